@@ -141,6 +141,8 @@ testScripts = [
     'abandonconflict.py',
     'p2p-versionbits-warning.py',
     'importprunedfunds.py',
+    'importmulti.py',
+    'sendqueue.py',
     'signmessages.py',
     'p2p-compactblocks.py',
 ]
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+
+class ImportMultiTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir)
+        connect_nodes_bi(self.nodes,0,1)
+        self.is_network_split=False
+        self.sync_all()
+
+    def run_test(self):
+        print("Mining blocks...")
+        self.nodes[0].generate(101)
+        timestamp = self.nodes[0].getblock(self.nodes[0].getbestblockhash())['mediantime']
+
+        # Fund a key, a watched address and a 2-of-2 multisig on node 0
+        address1 = self.nodes[0].getnewaddress()
+        address2 = self.nodes[0].getnewaddress()
+        address3 = self.nodes[0].getnewaddress()
+        address4 = self.nodes[0].getnewaddress()
+        multisig = self.nodes[0].createmultisig(2, [self.nodes[0].validateaddress(address3)['pubkey'],
+                                                    self.nodes[0].validateaddress(address4)['pubkey']])
+        self.nodes[0].sendtoaddress(address1, 1)
+        self.nodes[0].sendtoaddress(address2, 2)
+        self.nodes[0].sendtoaddress(multisig['address'], 4)
+        self.nodes[0].generate(1)
+        self.sync_all()
+
+        # Import everything at once, the rescan finds all three outputs
+        result = self.nodes[1].importmulti([
+            {
+                "scriptPubKey": {"address": address1},
+                "timestamp": timestamp,
+                "keys": [self.nodes[0].dumpprivkey(address1)],
+                "label": "key",
+            },
+            {
+                "scriptPubKey": self.nodes[0].validateaddress(address2)['scriptPubKey'],
+                "timestamp": timestamp,
+                "watchonly": True,
+            },
+            {
+                "scriptPubKey": {"address": multisig['address']},
+                "timestamp": timestamp,
+                "redeemscript": multisig['redeemScript'],
+                "keys": [self.nodes[0].dumpprivkey(address3), self.nodes[0].dumpprivkey(address4)],
+            },
+            {
+                "scriptPubKey": {"address": address2},
+                "timestamp": timestamp,
+            },
+            {
+                "scriptPubKey": {"address": address1},
+                "keys": [self.nodes[0].dumpprivkey(address1)],
+            },
+            {
+                "scriptPubKey": {"address": address2},
+                "timestamp": "now",
+                "keys": [self.nodes[0].dumpprivkey(address2)],
+                "watchonly": True,
+            },
+        ])
+        assert_equal([r['success'] for r in result], [True, True, True, False, False, False])
+        assert_equal(result[3]['error']['code'], -8)
+        assert_equal(result[4]['error']['code'], -3)
+        assert_equal(result[5]['error']['code'], -8)
+
+        assert_equal(self.nodes[1].validateaddress(address1)['ismine'], True)
+        assert_equal(self.nodes[1].validateaddress(address1)['account'], "key")
+        assert_equal(self.nodes[1].validateaddress(address2)['iswatchonly'], True)
+        assert_equal(self.nodes[1].validateaddress(multisig['address'])['ismine'], True)
+        assert_equal(self.nodes[1].getbalance("*", 1, False), Decimal('5'))
+        assert_equal(self.nodes[1].getbalance("*", 1, True), Decimal('7'))
+
+        # Keys already in the wallet can't be watched
+        result = self.nodes[1].importmulti([{
+            "scriptPubKey": {"address": address1},
+            "timestamp": "now",
+            "watchonly": True,
+        }], {"rescan": False})
+        assert_equal(result[0]['success'], False)
+        assert_equal(result[0]['error']['code'], -4)
+
+        # Malformed options are rejected before anything is written
+        address5 = self.nodes[0].getnewaddress()
+        try:
+            self.nodes[1].importmulti([{"scriptPubKey": {"address": address5}, "timestamp": 0, "watchonly": True}], {"rescan": "yes"})
+        except JSONRPCException as e:
+            assert_equal(e.error['code'], -1)
+        else:
+            assert(False)
+        assert_equal(self.nodes[1].validateaddress(address5)['iswatchonly'], False)
+
+if __name__ == '__main__':
+    ImportMultiTest().main()
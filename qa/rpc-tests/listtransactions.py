@@ -99,6 +99,7 @@ class ListTransactionsTest(BitcoinTestFramework):
                            {"txid":txid, "account" : "watchonly"} )
 
         self.run_rbf_opt_in_test()
+        self.run_paging_test()
 
     # Check that the opt-in-rbf flag works properly, for sent and received
     # transactions.
@@ -199,6 +200,48 @@ class ListTransactionsTest(BitcoinTestFramework):
         assert_equal(self.nodes[0].gettransaction(txid_4)["bip125-replaceable"], "unknown")
 
 
+    def run_paging_test(self):
+        # Pages from a cursor add up to the whole list
+        node = self.nodes[0]
+        full = node.listtransactions("*", 1000)
+        pages = []
+        cursor = ""
+        while True:
+            page = node.listtransactions("*", 7, 0, False, cursor)
+            assert(len(page["transactions"]) <= 7)
+            pages = page["transactions"] + pages
+            if "cursor" not in page:
+                break
+            cursor = page["cursor"]
+        assert_equal(pages, full)
+        assert_equal(node.listtransactions("*", 7, 0, False, "")["transactions"], node.listtransactions("*", 7))
+        assert_raises(JSONRPCException, node.listtransactions, "*", 7, 0, False, "00")
+
+        # listsinceblock pages list the same transactions as one call
+        blockhash = node.getblockhash(1)
+        full = node.listsinceblock(blockhash)
+        entries = []
+        cursor = ""
+        while True:
+            page = node.listsinceblock(blockhash, 1, False, 5, cursor)
+            assert(len(page["transactions"]) <= 5)
+            entries += page["transactions"]
+            if "cursor" not in page:
+                break
+            cursor = page["cursor"]
+        assert_equal(page["lastblock"], full["lastblock"])
+        key = lambda e: (e["txid"], e["category"], e.get("vout", -1))
+        assert_equal(sorted(entries, key=key), sorted(full["transactions"], key=key))
+
+        # Transactions confirmed after the given block are listed, earlier ones are not
+        txid = node.sendtoaddress(node.getnewaddress(), 0.1)
+        lastblock = node.getbestblockhash()
+        node.generate(1)
+        since = node.listsinceblock(lastblock)["transactions"]
+        assert_array_result(since, {"txid": txid, "category": "send"}, {"confirmations": 1})
+        since = node.listsinceblock(node.getbestblockhash())["transactions"]
+        assert_array_result(since, {"txid": txid}, {}, True)
+
 if __name__ == '__main__':
     ListTransactionsTest().main()
 
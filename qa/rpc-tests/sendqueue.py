@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import time
+
+
+class SendQueueTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+
+    def setup_network(self, split=False):
+        # Node 0 queues payments for an hour or until three are waiting
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir,
+                                 [["-sendqueueinterval=3600", "-sendqueuemaxoutputs=3"], []])
+        connect_nodes_bi(self.nodes,0,1)
+        self.is_network_split=False
+        self.sync_all()
+
+    def run_test(self):
+        print("Mining blocks...")
+        self.nodes[0].generate(101)
+        self.sync_all()
+
+        # Queued payments wait for the interval
+        address1 = self.nodes[1].getnewaddress()
+        address2 = self.nodes[1].getnewaddress()
+        id1 = self.nodes[0].queuesend(address1, 1)
+        id2 = self.nodes[0].queuesend(address2, 2)
+        assert_equal(self.nodes[0].getqueuedsend(id1), {"status": "queued"})
+        assert_equal(self.nodes[0].getqueuedsend(id2), {"status": "queued"})
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+
+        # and are sent in one transaction
+        self.nodes[0].flushsendqueue()
+        sent1 = self.nodes[0].getqueuedsend(id1)
+        sent2 = self.nodes[0].getqueuedsend(id2)
+        assert_equal(sent1["status"], "sent")
+        assert_equal(sent2["status"], "sent")
+        assert_equal(sent1["txid"], sent2["txid"])
+        assert_equal(self.nodes[0].getrawmempool(), [sent1["txid"]])
+        tx = self.nodes[0].getrawtransaction(sent1["txid"], 1)
+        assert_equal(tx["vout"][sent1["vout"]]["scriptPubKey"]["addresses"], [address1])
+        assert_equal(tx["vout"][sent1["vout"]]["value"], 1)
+        assert_equal(tx["vout"][sent2["vout"]]["scriptPubKey"]["addresses"], [address2])
+        assert_equal(tx["vout"][sent2["vout"]]["value"], 2)
+        self.nodes[0].generate(1)
+        self.sync_all()
+
+        # A full queue is sent without waiting
+        ids = [self.nodes[0].queuesend(self.nodes[1].getnewaddress(), 0.5) for i in range(3)]
+        for i in range(100):
+            if self.nodes[0].getqueuedsend(ids[0])["status"] != "queued":
+                break
+            time.sleep(0.1)
+        txids = set(self.nodes[0].getqueuedsend(id)["txid"] for id in ids)
+        assert_equal(len(txids), 1)
+        assert_equal(set(self.nodes[0].getrawmempool()), txids)
+        self.nodes[0].generate(1)
+        self.sync_all()
+
+        # Payments that can't be afforded yet stay queued
+        id1 = self.nodes[0].queuesend(self.nodes[1].getnewaddress(), 1)
+        id2 = self.nodes[0].queuesend(self.nodes[1].getnewaddress(), 100000)
+        assert_raises(JSONRPCException, self.nodes[0].flushsendqueue)
+        assert_equal(self.nodes[0].getqueuedsend(id1), {"status": "queued", "error": "Insufficient funds"})
+        assert_equal(self.nodes[0].getqueuedsend(id2), {"status": "queued", "error": "Insufficient funds"})
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+
+        assert_raises(JSONRPCException, self.nodes[0].getqueuedsend, "00" * 32)
+        assert_raises(JSONRPCException, self.nodes[1].queuesend, address1, 1)
+
+if __name__ == '__main__':
+    SendQueueTest().main()
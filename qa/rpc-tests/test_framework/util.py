@@ -268,7 +268,7 @@ def initialize_chain(test_dir, num_nodes, cachedir):
             os.remove(log_filename(cachedir, i, "debug.log"))
             os.remove(log_filename(cachedir, i, "db.log"))
             os.remove(log_filename(cachedir, i, "peers.dat"))
-            os.remove(log_filename(cachedir, i, "fee_estimates.dat"))
+            shutil.rmtree(log_filename(cachedir, i, "fee_estimates"))
 
     for i in range(num_nodes):
         from_dir = os.path.join(cachedir, "node"+str(i))
@@ -0,0 +1,93 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "blockindexmap.h"
+#include "chain.h"
+#include "random.h"
+
+#include <assert.h>
+#include <memory>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+static const int NUM_BLOCKS = 200000;
+
+struct CheapHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
+};
+
+static std::vector<uint256> MakeHashes()
+{
+    std::vector<uint256> vHashes(NUM_BLOCKS);
+    for (int i = 0; i < NUM_BLOCKS; i++)
+        vHashes[i] = GetRandHash();
+    return vHashes;
+}
+
+// Lookups of known hashes, as done for every inv, header and getdata
+static void BlockIndexLookup(benchmark::State& state)
+{
+    std::vector<uint256> vHashes = MakeHashes();
+    CBlockIndexArena arena;
+    CBlockIndexMap map;
+    for (int i = 0; i < NUM_BLOCKS; i++)
+        map.insert(std::make_pair(vHashes[i], arena.New()));
+
+    uint32_t n = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++) {
+            n = n * 1103515245 + 12345;
+            assert(map.find(vHashes[n % NUM_BLOCKS]) != map.end());
+        }
+    }
+}
+
+// The same with the node based map and heap allocated entries it replaced
+static void BlockIndexLookupUnorderedMap(benchmark::State& state)
+{
+    std::vector<uint256> vHashes = MakeHashes();
+    std::vector<std::unique_ptr<CBlockIndex> > vEntries;
+    boost::unordered_map<uint256, CBlockIndex*, CheapHasher> map;
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        vEntries.emplace_back(new CBlockIndex());
+        map.insert(std::make_pair(vHashes[i], vEntries.back().get()));
+    }
+
+    uint32_t n = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++) {
+            n = n * 1103515245 + 12345;
+            assert(map.find(vHashes[n % NUM_BLOCKS]) != map.end());
+        }
+    }
+}
+
+// Ancestor lookups over a chain built in the arena, as for locators and forks
+static void BlockIndexAncestor(benchmark::State& state)
+{
+    CBlockIndexArena arena;
+    CBlockIndex* pindexPrev = NULL;
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        CBlockIndex* pindex = arena.New();
+        pindex->nHeight = i;
+        pindex->pprev = pindexPrev;
+        pindex->BuildSkip();
+        pindexPrev = pindex;
+    }
+
+    uint32_t n = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++) {
+            n = n * 1103515245 + 12345;
+            assert(pindexPrev->GetAncestor(n % NUM_BLOCKS)->nHeight == (int)(n % NUM_BLOCKS));
+        }
+    }
+}
+
+BENCHMARK(BlockIndexLookup);
+BENCHMARK(BlockIndexLookupUnorderedMap);
+BENCHMARK(BlockIndexAncestor);
@@ -0,0 +1,158 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "coins.h"
+#include "dbwrapper.h"
+#include "hash.h"
+#include "kvstore.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "uint256.h"
+
+#include <boost/filesystem.hpp>
+
+static const int NUM_FLUSHES = 50;
+static const int COINS_PER_FLUSH = 2000;
+
+namespace {
+
+struct CoinOp
+{
+    bool fErase;
+    uint256 txid;
+    std::vector<unsigned char> vchCoins;
+};
+
+typedef std::vector<std::vector<CoinOp> > Workload;
+
+uint256 MakeTxid(uint32_t n)
+{
+    return Hash(BEGIN(n), END(n));
+}
+
+}
+
+// Chainstate flushes shaped like the ones during sync: every flush adds new
+// coins, rewrites partially spent ones from the previous flush and erases
+// most of those from the one before.  The same operations are replayed
+// against each store.
+static const Workload& GetWorkload()
+{
+    static Workload workload;
+    if (!workload.empty())
+        return workload;
+    uint32_t nRand = 1;
+    workload.resize(NUM_FLUSHES);
+    for (int nFlush = 0; nFlush < NUM_FLUSHES; nFlush++) {
+        std::vector<CoinOp>& vOps = workload[nFlush];
+        for (int i = 0; i < COINS_PER_FLUSH; i++) {
+            nRand = nRand * 1103515245 + 12345;
+            CoinOp op;
+            op.fErase = false;
+            op.txid = MakeTxid(nFlush * COINS_PER_FLUSH + i);
+            op.vchCoins.assign(30 + (nRand >> 16) % 60, (unsigned char)nRand);
+            vOps.push_back(op);
+        }
+        for (int i = 0; nFlush >= 1 && i < COINS_PER_FLUSH / 5; i++) {
+            CoinOp op;
+            op.fErase = false;
+            op.txid = MakeTxid((nFlush - 1) * COINS_PER_FLUSH + i);
+            op.vchCoins.assign(25, (unsigned char)i);
+            vOps.push_back(op);
+        }
+        for (int i = COINS_PER_FLUSH * 3 / 10; nFlush >= 2 && i < COINS_PER_FLUSH; i++) {
+            CoinOp op;
+            op.fErase = true;
+            op.txid = MakeTxid((nFlush - 2) * COINS_PER_FLUSH + i);
+            vOps.push_back(op);
+        }
+    }
+    return workload;
+}
+
+static void ReplayWorkload(benchmark::State& state, CDBWrapper& db)
+{
+    const Workload& workload = GetWorkload();
+    size_t nFlush = 0;
+    while (state.KeepRunning()) {
+        const std::vector<CoinOp>& vOps = workload[nFlush];
+        CDBBatch batch(db);
+        for (std::vector<CoinOp>::const_iterator it = vOps.begin(); it != vOps.end(); it++) {
+            if (it->fErase)
+                batch.Erase(std::make_pair('c', it->txid));
+            else
+                batch.Write(std::make_pair('c', it->txid), it->vchCoins);
+        }
+        batch.Write('B', MakeTxid(nFlush));
+        db.WriteBatch(batch);
+        nFlush = (nFlush + 1) % workload.size();
+    }
+}
+
+static void ChainstateReplayLevelDB(benchmark::State& state)
+{
+    CDBWrapper db(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path(), CDBOptions(8 << 20), true, false, true);
+    ReplayWorkload(state, db);
+}
+
+static void ChainstateReplayMemory(benchmark::State& state)
+{
+    CDBWrapper db(std::unique_ptr<CKVStore>(new CMemoryKVStore()), true);
+    ReplayWorkload(state, db);
+}
+
+static std::vector<CCoins> MakeCoins()
+{
+    std::vector<CCoins> vCoins(COINS_PER_FLUSH);
+    for (int i = 0; i < COINS_PER_FLUSH; i++) {
+        vCoins[i].nVersion = 1;
+        vCoins[i].nHeight = 400000 + i;
+        vCoins[i].vout.resize(1 + i % 3);
+        for (size_t n = 0; n < vCoins[i].vout.size(); n++) {
+            vCoins[i].vout[n].nValue = 1000 + i * 7 + n;
+            vCoins[i].vout[n].scriptPubKey = GetScriptForDestination(CKeyID(uint160(std::vector<unsigned char>(20, (unsigned char)(i + n)))));
+        }
+    }
+    return vCoins;
+}
+
+// Serializing and obfuscating the coins of a flush into a batch, without the
+// storage engine's own cost
+static void ChainstateFlushBatch(benchmark::State& state)
+{
+    std::vector<CCoins> vCoins = MakeCoins();
+    CDBWrapper db(std::unique_ptr<CKVStore>(new CMemoryKVStore()), true);
+    while (state.KeepRunning()) {
+        CDBBatch batch(db);
+        for (int i = 0; i < COINS_PER_FLUSH; i++)
+            batch.Write(std::make_pair('c', MakeTxid(i)), vCoins[i]);
+    }
+}
+
+// Reading the coins back in order, as for gettxoutsetinfo
+static void ChainstateIterate(benchmark::State& state)
+{
+    std::vector<CCoins> vCoins = MakeCoins();
+    CDBWrapper db(std::unique_ptr<CKVStore>(new CMemoryKVStore()), true);
+    CDBBatch batch(db);
+    for (int i = 0; i < COINS_PER_FLUSH; i++)
+        batch.Write(std::make_pair('c', MakeTxid(i)), vCoins[i]);
+    db.WriteBatch(batch);
+
+    while (state.KeepRunning()) {
+        std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+        std::pair<char, uint256> key;
+        CCoins coins;
+        for (pcursor->Seek('c'); pcursor->Valid(); pcursor->Next()) {
+            if (!pcursor->GetKey(key) || !pcursor->GetValue(coins))
+                break;
+        }
+    }
+}
+
+BENCHMARK(ChainstateReplayLevelDB);
+BENCHMARK(ChainstateReplayMemory);
+BENCHMARK(ChainstateFlushBatch);
+BENCHMARK(ChainstateIterate);
@@ -0,0 +1,43 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "wallet/wallet.h"
+
+static const unsigned int KEYS_PER_ITERATION = 100;
+
+static void SetupHDWallet(CWallet& wallet)
+{
+    CPubKey masterPubKey = wallet.GenerateNewHDMasterKey();
+    wallet.SetHDMasterKey(masterPubKey);
+}
+
+// Derive keys one by one, the way the keypool used to be topped up.
+static void KeyPoolGenerateNewKey(benchmark::State& state)
+{
+    CWallet wallet;
+    SetupHDWallet(wallet);
+
+    while (state.KeepRunning()) {
+        LOCK(wallet.cs_wallet);
+        for (unsigned int i = 0; i < KEYS_PER_ITERATION; i++)
+            wallet.GenerateNewKey();
+    }
+}
+
+// Grow the keypool by the same number of keys, derived as one batch.
+static void KeyPoolTopUp(benchmark::State& state)
+{
+    CWallet wallet;
+    SetupHDWallet(wallet);
+    unsigned int nSize = 0;
+
+    while (state.KeepRunning()) {
+        nSize += KEYS_PER_ITERATION;
+        wallet.TopUpKeyPool(nSize);
+    }
+}
+
+BENCHMARK(KeyPoolGenerateNewKey);
+BENCHMARK(KeyPoolTopUp);
@@ -0,0 +1,96 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+#include "txmempool.h"
+#include "txrelayorder.h"
+
+#include <algorithm>
+#include <list>
+
+static const int NUM_PEERS = 500;
+static const int NUM_QUEUED_TXS = 500;
+
+// Fill the pool with transactions, every fourth one spending its predecessor,
+// and queue all of them for announcement to each peer.
+static void SetupRelay(CTxMemPool& pool, std::vector<std::set<uint256> >& vQueues)
+{
+    LockPoints lp;
+    uint256 hashPrev;
+    for (int i = 0; i < NUM_QUEUED_TXS; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        if (i % 4 != 0) {
+            tx.vin[0].prevout = COutPoint(hashPrev, 0);
+        } else {
+            tx.vin[0].prevout.n = i;
+        }
+        tx.vout.resize(1);
+        tx.vout[0].nValue = COIN;
+        CTransaction t(tx);
+        hashPrev = t.GetHash();
+        pool.addUnchecked(hashPrev, CTxMemPoolEntry(t, 1000 + (i * 7919) % 5000, 0, 0, 1, true, 0, false, 4, lp));
+    }
+
+    std::set<uint256> setQueued;
+    std::vector<TxMempoolInfo> vInfo = pool.infoAll();
+    for (std::vector<TxMempoolInfo>::const_iterator it = vInfo.begin(); it != vInfo.end(); it++)
+        setQueued.insert((*it).tx->GetHash());
+    vQueues.assign(NUM_PEERS, setQueued);
+}
+
+// One round of trickles to all peers, each ordering its queue with the shared keys.
+static void TxRelayOrder500Peers(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<std::set<uint256> > vQueues;
+    SetupRelay(pool, vQueues);
+    CTxRelayOrder relayOrder(pool, TX_RELAY_ORDER_INTERVAL);
+    uint256 hashTip;
+    int64_t nNow = 0;
+
+    while (state.KeepRunning()) {
+        nNow += 100000;
+        for (int i = 0; i < NUM_PEERS; i++) {
+            relayOrder.Update(hashTip, nNow);
+            std::vector<CTxRelayOrder::Entry> vInvTx;
+            relayOrder.GetOrdered(vQueues[i], vInvTx);
+            CTxRelayOrder::Compare compareRelayOrder;
+            std::make_heap(vInvTx.begin(), vInvTx.end(), compareRelayOrder);
+            for (unsigned int n = 0; n < INVENTORY_BROADCAST_MAX && !vInvTx.empty(); n++) {
+                std::pop_heap(vInvTx.begin(), vInvTx.end(), compareRelayOrder);
+                vInvTx.pop_back();
+            }
+        }
+    }
+}
+
+// The same round with every peer sorting its queue against the mempool.
+static void TxRelayOrderMempool500Peers(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<std::set<uint256> > vQueues;
+    SetupRelay(pool, vQueues);
+
+    while (state.KeepRunning()) {
+        for (int i = 0; i < NUM_PEERS; i++) {
+            std::vector<std::set<uint256>::iterator> vInvTx;
+            vInvTx.reserve(vQueues[i].size());
+            for (std::set<uint256>::iterator it = vQueues[i].begin(); it != vQueues[i].end(); it++)
+                vInvTx.push_back(it);
+            auto compare = [&pool](std::set<uint256>::iterator a, std::set<uint256>::iterator b) {
+                return pool.CompareDepthAndScore(*b, *a);
+            };
+            std::make_heap(vInvTx.begin(), vInvTx.end(), compare);
+            for (unsigned int n = 0; n < INVENTORY_BROADCAST_MAX && !vInvTx.empty(); n++) {
+                std::pop_heap(vInvTx.begin(), vInvTx.end(), compare);
+                vInvTx.pop_back();
+            }
+        }
+    }
+}
+
+BENCHMARK(TxRelayOrder500Peers);
+BENCHMARK(TxRelayOrderMempool500Peers);
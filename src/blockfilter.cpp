@@ -0,0 +1,197 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "script/standard.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+//! SipHash key of the element hashes, fixed so filters don't depend on the node that built them
+static const uint64_t BLOCK_FILTER_K0 = 0x626c6f636b66696cULL;
+static const uint64_t BLOCK_FILTER_K1 = 0x746572696e646578ULL;
+
+uint64_t GetBlockFilterHash(const CScript& script)
+{
+    return CSipHasher(BLOCK_FILTER_K0, BLOCK_FILTER_K1).Write(begin_ptr(script), script.size()).Finalize() >> (64 - BLOCK_FILTER_HASH_BITS);
+}
+
+uint64_t GetBlockFilterHash(const COutPoint& outpoint)
+{
+    unsigned char buf[36];
+    memcpy(buf, outpoint.hash.begin(), 32);
+    WriteLE32(buf + 32, outpoint.n);
+    return CSipHasher(BLOCK_FILTER_K0, BLOCK_FILTER_K1).Write(buf, sizeof(buf)).Finalize() >> (64 - BLOCK_FILTER_HASH_BITS);
+}
+
+namespace {
+
+/** Appends values of up to BLOCK_FILTER_HASH_BITS bits to a byte vector, most significant bit first */
+class CBitWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+    uint64_t nBuf;
+    int nBits;
+
+public:
+    CBitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), nBuf(0), nBits(0) {}
+
+    void Write(uint64_t nValue, int n)
+    {
+        // Bits that were already written out are shifted off the top
+        nBuf = (nBuf << n) | (nValue & (((uint64_t)1 << n) - 1));
+        nBits += n;
+        while (nBits >= 8) {
+            vch.push_back((unsigned char)(nBuf >> (nBits - 8)));
+            nBits -= 8;
+        }
+    }
+
+    void WriteUnary(uint64_t nValue)
+    {
+        while (nValue > 32) {
+            Write(~(uint64_t)0, 32);
+            nValue -= 32;
+        }
+        Write(~(uint64_t)0, nValue);
+        Write(0, 1);
+    }
+
+    void Flush()
+    {
+        if (nBits > 0)
+            vch.push_back((unsigned char)(nBuf << (8 - nBits)));
+        nBits = 0;
+    }
+};
+
+class CBitReader
+{
+private:
+    const std::vector<unsigned char>& vch;
+    size_t nPos;
+    uint64_t nBuf;
+    int nBits;
+
+public:
+    CBitReader(const std::vector<unsigned char>& vchIn) : vch(vchIn), nPos(0), nBuf(0), nBits(0) {}
+
+    bool Read(int n, uint64_t& nValue)
+    {
+        while (nBits < n) {
+            if (nPos >= vch.size())
+                return false;
+            nBuf = (nBuf << 8) | vch[nPos++];
+            nBits += 8;
+        }
+        nValue = n == 0 ? 0 : (nBuf >> (nBits - n)) & (((uint64_t)1 << n) - 1);
+        nBits -= n;
+        return true;
+    }
+
+    bool ReadUnary(uint64_t& nValue)
+    {
+        nValue = 0;
+        uint64_t nBit;
+        while (true) {
+            if (!Read(1, nBit))
+                return false;
+            if (!nBit)
+                return true;
+            // More ones than the range can hold only come from a damaged filter
+            if (++nValue > ((uint64_t)1 << BLOCK_FILTER_HASH_BITS))
+                return false;
+        }
+    }
+};
+
+} // anon namespace
+
+CBlockFilter::CBlockFilter(const CBlock& block) : nElements(0), nP(0)
+{
+    std::vector<uint64_t> vHashes;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            if (txout.scriptPubKey.empty() || txout.scriptPubKey.IsUnspendable())
+                continue;
+            vHashes.push_back(GetBlockFilterHash(txout.scriptPubKey));
+
+            // A wallet can't list the bare multisig scripts of its keys, so
+            // they are also added as pay-to-pubkey scripts of each key
+            std::vector<std::vector<unsigned char> > vSolutions;
+            txnouttype whichType;
+            if (Solver(txout.scriptPubKey, whichType, vSolutions) && whichType == TX_MULTISIG)
+                for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                    vHashes.push_back(GetBlockFilterHash(CScript() << vSolutions[i] << OP_CHECKSIG));
+        }
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                vHashes.push_back(GetBlockFilterHash(txin.prevout));
+        }
+    }
+    Build(vHashes);
+}
+
+CBlockFilter::CBlockFilter(std::vector<uint64_t> vHashes) : nElements(0), nP(0)
+{
+    Build(vHashes);
+}
+
+void CBlockFilter::Build(std::vector<uint64_t>& vHashes)
+{
+    std::sort(vHashes.begin(), vHashes.end());
+    vHashes.erase(std::unique(vHashes.begin(), vHashes.end()), vHashes.end());
+    nElements = vHashes.size();
+
+    // With P about log2(range / N) the quotients of the differences are small
+    int nLogN = 0;
+    while (nLogN < BLOCK_FILTER_HASH_BITS && ((uint64_t)1 << nLogN) < nElements)
+        nLogN++;
+    nP = BLOCK_FILTER_HASH_BITS - nLogN;
+
+    vData.clear();
+    CBitWriter writer(vData);
+    uint64_t nLast = 0;
+    BOOST_FOREACH(uint64_t nHash, vHashes)
+    {
+        uint64_t nDelta = nHash - nLast;
+        writer.WriteUnary(nDelta >> nP);
+        writer.Write(nDelta, nP);
+        nLast = nHash;
+    }
+    writer.Flush();
+}
+
+bool CBlockFilter::MatchAny(const std::set<uint64_t>& setHashes) const
+{
+    if (setHashes.empty() || nElements == 0)
+        return false;
+    if (nP > BLOCK_FILTER_HASH_BITS)
+        return true;
+
+    const uint64_t nMax = *setHashes.rbegin();
+    CBitReader reader(vData);
+    uint64_t nValue = 0;
+    for (unsigned int i = 0; i < nElements; i++)
+    {
+        uint64_t nQuotient, nRemainder;
+        if (!reader.ReadUnary(nQuotient) || !reader.Read(nP, nRemainder))
+            return true;
+        nValue += (nQuotient << nP) | nRemainder;
+        if (nValue > nMax)
+            return false;
+        if (setHashes.count(nValue))
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+class COutPoint;
+class CScript;
+
+/**
+ * Bits of the element hashes kept in a block filter.  A wallet of E elements
+ * falsely matches a block of N elements with a chance of about N * E / 2^40,
+ * which keeps false matches rare up to about 100000 wallet elements.
+ */
+static const int BLOCK_FILTER_HASH_BITS = 40;
+/** Version of what block filters hold, stored filters of another version are rebuilt */
+static const int BLOCK_FILTER_VERSION = 1;
+
+/** Hash an output script for a block filter */
+uint64_t GetBlockFilterHash(const CScript& script);
+/** Hash a spent outpoint for a block filter */
+uint64_t GetBlockFilterHash(const COutPoint& outpoint);
+
+/**
+ * A Golomb-coded set of the output scripts a block pays to and the outpoints
+ * it spends, to tell without reading the block whether it may involve a
+ * wallet.  Unspendable outputs are left out.  The keys of bare multisig
+ * outputs are added as pay-to-pubkey scripts as well.
+ *
+ * Elements are hashed with SipHash under a fixed key into the same range for
+ * every block, so a wallet hashes its elements once for a whole rescan.  The
+ * sorted hashes are stored as Golomb-Rice coded differences, with the Rice
+ * parameter chosen by the number of elements.  A filter never misses an
+ * element of its block, but may match elements that are not in it.
+ */
+class CBlockFilter
+{
+public:
+    CBlockFilter() : nElements(0), nP(0) {}
+    explicit CBlockFilter(const CBlock& block);
+    explicit CBlockFilter(std::vector<uint64_t> vHashes);
+
+    unsigned int GetElementCount() const { return nElements; }
+    size_t GetEncodedSize() const { return vData.size(); }
+
+    /** Whether the filter may hold any of the hashes; a damaged filter matches everything */
+    bool MatchAny(const std::set<uint64_t>& setHashes) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(VARINT(nElements));
+        READWRITE(nP);
+        READWRITE(vData);
+    }
+
+private:
+    unsigned int nElements;
+    unsigned char nP;
+    std::vector<unsigned char> vData;
+
+    void Build(std::vector<uint64_t>& vHashes);
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
@@ -0,0 +1,170 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilterindex.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/thread.hpp>
+
+static const char DB_BLOCK_FILTER = 'f';
+static const char DB_BEST_BLOCK = 'B';
+static const char DB_VERSION = 'V';
+
+CBlockFilterIndex* pblockfilterindex = NULL;
+
+CBlockFilterIndex::CBlockFilterIndex(size_t nCacheSize, bool fMemory, bool fWipe) :
+    db(GetDataDir() / "blockfilters", nCacheSize, fMemory, fWipe), pindexBest(NULL), fSynced(false), fTipChanged(false)
+{
+    int nVersion = 0;
+    if (!db.Read(DB_VERSION, nVersion) || nVersion != BLOCK_FILTER_VERSION) {
+        // Filters of earlier versions may lack elements a wallet looks for
+        if (!db.IsEmpty())
+            LogPrintf("Rebuilding the block filter index, its filters are outdated\n");
+        Clear();
+        return;
+    }
+
+    uint256 hashBest;
+    if (db.Read(DB_BEST_BLOCK, hashBest)) {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hashBest);
+        if (it != mapBlockIndex.end())
+            pindexBest = it->second;
+    }
+}
+
+void CBlockFilterIndex::Clear()
+{
+    std::vector<uint256> vHashes;
+    std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (pcursor->Seek(DB_BLOCK_FILTER); pcursor->Valid(); pcursor->Next()) {
+        std::pair<char, uint256> key;
+        if (!pcursor->GetKey(key) || key.first != DB_BLOCK_FILTER)
+            break;
+        vHashes.push_back(key.second);
+    }
+    pcursor.reset();
+
+    for (size_t nStart = 0; nStart < vHashes.size(); nStart += BLOCK_FILTER_BATCH_SIZE) {
+        CDBBatch batch(db);
+        for (size_t i = nStart; i < std::min(vHashes.size(), nStart + BLOCK_FILTER_BATCH_SIZE); i++)
+            batch.Erase(std::make_pair(DB_BLOCK_FILTER, vHashes[i]));
+        db.WriteBatch(batch);
+    }
+    CDBBatch batch(db);
+    batch.Erase(DB_BEST_BLOCK);
+    batch.Write(DB_VERSION, BLOCK_FILTER_VERSION);
+    db.WriteBatch(batch, true);
+}
+
+bool CBlockFilterIndex::GetFilter(const CBlockIndex* pindex, CBlockFilter& filter) const
+{
+    return db.Read(std::make_pair(DB_BLOCK_FILTER, pindex->GetBlockHash()), filter);
+}
+
+void CBlockFilterIndex::WriteFilters(std::vector<std::pair<uint256, CBlockFilter> >& vFilters)
+{
+    CDBBatch batch(db);
+    for (unsigned int i = 0; i < vFilters.size(); i++)
+        batch.Write(std::make_pair(DB_BLOCK_FILTER, vFilters[i].first), vFilters[i].second);
+    if (pindexBest)
+        batch.Write(DB_BEST_BLOCK, pindexBest->GetBlockHash());
+    db.WriteBatch(batch);
+    vFilters.clear();
+}
+
+void CBlockFilterIndex::Sync()
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    std::vector<std::pair<uint256, CBlockFilter> > vFilters;
+    int nBlocks = 0;
+    while (!boost::this_thread::interruption_requested())
+    {
+        const CBlockIndex* pindexNext;
+        bool fHaveData;
+        CDiskBlockPos pos;
+        {
+            LOCK(cs_main);
+            // After a reorganization go on from the fork, the filters of the old branch are kept
+            pindexNext = pindexBest ? chainActive.Next(chainActive.FindFork(pindexBest)) : chainActive.Genesis();
+            if (!pindexNext) {
+                fSynced = true;
+                break;
+            }
+            fHaveData = pindexNext->nStatus & BLOCK_HAVE_DATA;
+            pos = pindexNext->GetBlockPos();
+        }
+        fSynced = false;
+
+        const uint256 hash = pindexNext->GetBlockHash();
+        if (fHaveData && !db.Exists(std::make_pair(DB_BLOCK_FILTER, hash))) {
+            CBlock block;
+            if (ReadBlockFromDisk(block, pos, params))
+                vFilters.push_back(std::make_pair(hash, CBlockFilter(block)));
+            else
+                LogPrintf("%s: failed to read block %s, it gets no filter\n", __func__, hash.ToString());
+        }
+        pindexBest = pindexNext;
+
+        if (++nBlocks % BLOCK_FILTER_BATCH_SIZE == 0) {
+            WriteFilters(vFilters);
+            LogPrintf("%s: block filters built up to height %d\n", __func__, pindexBest->nHeight);
+        }
+    }
+    if (nBlocks % BLOCK_FILTER_BATCH_SIZE != 0)
+        WriteFilters(vFilters);
+}
+
+void CBlockFilterIndex::ThreadSync()
+{
+    RenameThread("bitcoin-blockfilter");
+    while (true)
+    {
+        Sync();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fTipChanged)
+            condTip.wait(lock);
+        fTipChanged = false;
+    }
+}
+
+void CBlockFilterIndex::UpdatedBlockTip(const CBlockIndex* pindex)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fTipChanged = true;
+    }
+    condTip.notify_one();
+}
+
+bool StartBlockFilterIndex(boost::thread_group& threadGroup)
+{
+    if (!GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX))
+        return true;
+    try {
+        pblockfilterindex = new CBlockFilterIndex(nBlockFilterDBCache << 20);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+        return false;
+    }
+    RegisterValidationInterface(pblockfilterindex);
+    threadGroup.create_thread(boost::bind(&CBlockFilterIndex::ThreadSync, pblockfilterindex));
+    return true;
+}
+
+void StopBlockFilterIndex()
+{
+    if (!pblockfilterindex)
+        return;
+    UnregisterValidationInterface(pblockfilterindex);
+    delete pblockfilterindex;
+    pblockfilterindex = NULL;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTERINDEX_H
+#define BITCOIN_BLOCKFILTERINDEX_H
+
+#include "blockfilter.h"
+#include "dbwrapper.h"
+#include "uint256.h"
+#include "validationinterface.h"
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CBlockIndex;
+
+namespace boost {
+class thread_group;
+} // namespace boost
+
+//! -blockfilterindex default
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
+//! Cache of the block filter database (MiB)
+static const int64_t nBlockFilterDBCache = 8;
+//! Number of filters written to the database at once while catching up
+static const int BLOCK_FILTER_BATCH_SIZE = 1000;
+
+/**
+ * Block filters of the active chain, kept in their own database and built
+ * on a background thread that follows the tip.  Filters are stored by block
+ * hash, so those of blocks that were disconnected stay valid; blocks whose
+ * data was pruned before their filter was built are left without one.
+ */
+class CBlockFilterIndex : public CValidationInterface
+{
+public:
+    CBlockFilterIndex(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    virtual ~CBlockFilterIndex() {}
+
+    /** Read the filter of a block, false if it has none (yet) */
+    bool GetFilter(const CBlockIndex* pindex, CBlockFilter& filter) const;
+    /** Whether filters were built up to the tip the last time the index caught up */
+    bool IsSynced() const { return fSynced; }
+
+    /** Build the missing filters of the active chain, until caught up with the tip or interrupted */
+    void Sync();
+    /** Keeps the index in sync with the tip, until interrupted */
+    void ThreadSync();
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindex);
+
+private:
+    CDBWrapper db;
+    //! Last block of the active chain the index is built up to, only used by the syncing thread
+    const CBlockIndex* pindexBest;
+    std::atomic<bool> fSynced;
+
+    boost::mutex mutex;
+    boost::condition_variable condTip;
+    bool fTipChanged;
+
+    /** Erase all filters, to rebuild them with the current BLOCK_FILTER_VERSION */
+    void Clear();
+    /** Write the filters along with pindexBest, and clear them */
+    void WriteFilters(std::vector<std::pair<uint256, CBlockFilter> >& vFilters);
+};
+
+extern CBlockFilterIndex* pblockfilterindex;
+
+/** Open the block filter index and start building it, if -blockfilterindex is set */
+bool StartBlockFilterIndex(boost::thread_group& threadGroup);
+/** Free the index, after its thread has been interrupted and joined */
+void StopBlockFilterIndex();
+
+#endif // BITCOIN_BLOCKFILTERINDEX_H
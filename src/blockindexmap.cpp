@@ -0,0 +1,130 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockindexmap.h"
+
+#include "chain.h"
+#include "memusage.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <new>
+
+void* CBlockIndexArena::Allocate()
+{
+    if (nUsed == vChunks.size() * CHUNK_SIZE)
+        vChunks.push_back(static_cast<CBlockIndex*>(::operator new(CHUNK_SIZE * sizeof(CBlockIndex))));
+    void* p = &vChunks[nUsed / CHUNK_SIZE][nUsed % CHUNK_SIZE];
+    nUsed++;
+    return p;
+}
+
+CBlockIndex* CBlockIndexArena::New()
+{
+    void* p = Allocate();
+    return new (p) CBlockIndex();
+}
+
+CBlockIndex* CBlockIndexArena::New(const CBlockHeader& block)
+{
+    void* p = Allocate();
+    return new (p) CBlockIndex(block);
+}
+
+void CBlockIndexArena::Clear()
+{
+    for (size_t i = 0; i < nUsed; i++)
+        vChunks[i / CHUNK_SIZE][i % CHUNK_SIZE].~CBlockIndex();
+    for (size_t i = 0; i < vChunks.size(); i++)
+        ::operator delete(vChunks[i]);
+    vChunks.clear();
+    nUsed = 0;
+}
+
+size_t CBlockIndexArena::DynamicMemoryUsage() const
+{
+    return memusage::MallocUsage(CHUNK_SIZE * sizeof(CBlockIndex)) * vChunks.size() + memusage::DynamicUsage(vChunks);
+}
+
+size_t CBlockIndexMap::Find(const uint256& hash) const
+{
+    if (vSlots.empty())
+        return nSize;
+    const uint64_t nCheapHash = hash.GetCheapHash();
+    const uint32_t nTag = nCheapHash >> 32;
+    for (size_t nSlot = nCheapHash & nMask; vSlots[nSlot].nEntry != 0; nSlot = (nSlot + 1) & nMask) {
+        const Slot& slot = vSlots[nSlot];
+        if (slot.nTag == nTag && GetEntry(slot.nEntry - 1).first == hash)
+            return slot.nEntry - 1;
+    }
+    return nSize;
+}
+
+std::pair<CBlockIndexMap::iterator, bool> CBlockIndexMap::insert(const value_type& value)
+{
+    size_t nPos = Find(value.first);
+    if (nPos != nSize)
+        return std::make_pair(iterator(this, nPos), false);
+
+    // Keep the table at most three quarters full, probes stay short
+    if ((nSize + 1) * 4 > vSlots.size() * 3)
+        Rehash(std::max<size_t>(vSlots.size() * 2, 1024));
+
+    if (nSize == vChunks.size() * CHUNK_SIZE)
+        vChunks.push_back(static_cast<value_type*>(::operator new(CHUNK_SIZE * sizeof(value_type))));
+    new (&GetEntry(nSize)) value_type(value);
+
+    const uint64_t nCheapHash = value.first.GetCheapHash();
+    size_t nSlot = nCheapHash & nMask;
+    while (vSlots[nSlot].nEntry != 0)
+        nSlot = (nSlot + 1) & nMask;
+    vSlots[nSlot].nTag = nCheapHash >> 32;
+    vSlots[nSlot].nEntry = nSize + 1;
+    nSize++;
+    return std::make_pair(iterator(this, nSize - 1), true);
+}
+
+void CBlockIndexMap::Rehash(size_t nSlots)
+{
+    assert((nSlots & (nSlots - 1)) == 0);
+    std::vector<Slot> vOld;
+    vOld.swap(vSlots);
+    vSlots.assign(nSlots, Slot());
+    nMask = nSlots - 1;
+    for (size_t i = 0; i < vOld.size(); i++) {
+        if (vOld[i].nEntry == 0)
+            continue;
+        // Only the position bits are needed again, so rehash from the pair
+        size_t nSlot = GetEntry(vOld[i].nEntry - 1).first.GetCheapHash() & nMask;
+        while (vSlots[nSlot].nEntry != 0)
+            nSlot = (nSlot + 1) & nMask;
+        vSlots[nSlot] = vOld[i];
+    }
+}
+
+void CBlockIndexMap::reserve(size_t nEntries)
+{
+    size_t nSlots = 1024;
+    while (nSlots * 3 < nEntries * 4)
+        nSlots *= 2;
+    if (nSlots > vSlots.size())
+        Rehash(nSlots);
+}
+
+void CBlockIndexMap::clear()
+{
+    for (size_t i = 0; i < nSize; i++)
+        GetEntry(i).~value_type();
+    for (size_t i = 0; i < vChunks.size(); i++)
+        ::operator delete(vChunks[i]);
+    vChunks.clear();
+    std::vector<Slot>().swap(vSlots);
+    nSize = 0;
+    nMask = 0;
+}
+
+size_t CBlockIndexMap::DynamicMemoryUsage() const
+{
+    return memusage::MallocUsage(CHUNK_SIZE * sizeof(value_type)) * vChunks.size() + memusage::DynamicUsage(vChunks) + memusage::DynamicUsage(vSlots);
+}
@@ -0,0 +1,151 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKINDEXMAP_H
+#define BITCOIN_BLOCKINDEXMAP_H
+
+#include "uint256.h"
+
+#include <cstddef>
+#include <iterator>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class CBlockHeader;
+class CBlockIndex;
+
+/**
+ * Allocates CBlockIndex entries in large slabs.  Entries made one after
+ * another, like the headers of a chain, end up next to each other, which
+ * keeps walks over pprev and pskip in cache and saves the per allocation
+ * overhead of the heap.  Entries are only freed all at once, by Clear.
+ */
+class CBlockIndexArena
+{
+public:
+    CBlockIndexArena() : nUsed(0) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* New();
+    CBlockIndex* New(const CBlockHeader& block);
+
+    /** Destroy all entries, invalidating every pointer handed out */
+    void Clear();
+
+    size_t size() const { return nUsed; }
+    size_t DynamicMemoryUsage() const;
+
+private:
+    static const size_t CHUNK_SIZE = 4096;
+
+    std::vector<CBlockIndex*> vChunks;
+    size_t nUsed;
+
+    void* Allocate();
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+};
+
+/**
+ * Map from block hash to block index entry, replacing a node based hash map.
+ *
+ * The (hash, pointer) pairs are stored in slabs and never move, so
+ * CBlockIndex::phashBlock can point into them.  The pairs are found
+ * through an open addressing table with linear probing.  Each slot holds
+ * only 32 bits of the hash as a tag and the position of the pair, so
+ * lookups seldom touch a pair whose hash does not match.  Iteration
+ * follows insertion order.  Entries cannot be erased one by one.
+ */
+class CBlockIndexMap
+{
+public:
+    typedef uint256 key_type;
+    typedef CBlockIndex* mapped_type;
+    typedef std::pair<const uint256, CBlockIndex*> value_type;
+    typedef size_t size_type;
+
+    template<typename V>
+    class iter
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef V value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+        iter() : pmap(NULL), nPos(0) {}
+        iter(const CBlockIndexMap* pmapIn, size_t nPosIn) : pmap(pmapIn), nPos(nPosIn) {}
+        template<typename W>
+        iter(const iter<W>& other) : pmap(other.pmap), nPos(other.nPos) {}
+
+        V& operator*() const { return pmap->GetEntry(nPos); }
+        V* operator->() const { return &pmap->GetEntry(nPos); }
+        iter& operator++() { nPos++; return *this; }
+        iter operator++(int) { iter copy(*this); nPos++; return copy; }
+        template<typename W>
+        bool operator==(const iter<W>& other) const { return nPos == other.nPos; }
+        template<typename W>
+        bool operator!=(const iter<W>& other) const { return nPos != other.nPos; }
+
+    private:
+        template<typename W> friend class iter;
+        const CBlockIndexMap* pmap;
+        size_t nPos;
+    };
+    typedef iter<value_type> iterator;
+    typedef iter<const value_type> const_iterator;
+
+    CBlockIndexMap() : nSize(0), nMask(0) {}
+    ~CBlockIndexMap() { clear(); }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, nSize); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, nSize); }
+
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& hash) { return iterator(this, Find(hash)); }
+    const_iterator find(const uint256& hash) const { return const_iterator(this, Find(hash)); }
+    size_type count(const uint256& hash) const { return Find(hash) != nSize ? 1 : 0; }
+
+    std::pair<iterator, bool> insert(const value_type& value);
+    CBlockIndex*& operator[](const uint256& hash) { return insert(value_type(hash, NULL)).first->second; }
+
+    void clear();
+
+    /** Reserve table space for nEntries without growing */
+    void reserve(size_t nEntries);
+
+    size_t DynamicMemoryUsage() const;
+
+private:
+    static const size_t CHUNK_BITS = 12;
+    static const size_t CHUNK_SIZE = 1 << CHUNK_BITS;
+
+    struct Slot {
+        //! Upper half of the cheap hash, the lower half giving the position
+        uint32_t nTag;
+        //! Position of the pair plus one, or 0 if the slot is empty
+        uint32_t nEntry;
+    };
+
+    std::vector<value_type*> vChunks;
+    std::vector<Slot> vSlots;
+    size_t nSize;
+    size_t nMask;
+
+    value_type& GetEntry(size_t nPos) const { return vChunks[nPos >> CHUNK_BITS][nPos & (CHUNK_SIZE - 1)]; }
+    size_t Find(const uint256& hash) const;
+    void Rehash(size_t nSlots);
+
+    CBlockIndexMap(const CBlockIndexMap&);
+    CBlockIndexMap& operator=(const CBlockIndexMap&);
+};
+
+#endif // BITCOIN_BLOCKINDEXMAP_H
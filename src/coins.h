@@ -403,6 +403,10 @@ protected:
     /* Cached dynamic memory usage for the inner CCoins objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Lookups answered by this cache and passed on to the base view. */
+    mutable uint64_t nCacheHits;
+    mutable uint64_t nCacheMisses;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
     ~CCoinsViewCache();
@@ -462,6 +466,11 @@ public:
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Number of lookups answered from the cache
+    uint64_t GetCacheHits() const { return nCacheHits; }
+    //! Number of lookups passed on to the base view
+    uint64_t GetCacheMisses() const { return nCacheMisses; }
+
     //! Calculate the size of the cache (in bytes)
     size_t DynamicMemoryUsage() const;
 
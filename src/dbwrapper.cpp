@@ -8,54 +8,241 @@
 #include "random.h"
 
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 
 #include <leveldb/cache.h>
+#include <leveldb/db.h>
 #include <leveldb/env.h>
 #include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+CDBOptions::CDBOptions(size_t nCacheSize)
 {
-    leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
-    if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
-        // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
-        // on corruption in later versions.
-        options.paranoid_checks = true;
+    nBlockCacheSize = nCacheSize / 2;
+    nWriteBufferSize = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    nBlockSize = 4096;
+    nBloomBits = 10;
+    nMaxOpenFiles = 64;
+}
+
+CDBOptions GetDBOptions(const std::string& strName, size_t nCacheSize)
+{
+    CDBOptions options(nCacheSize);
+    BOOST_FOREACH(const std::string& strOption, mapMultiArgs["-dboption"]) {
+        size_t nDot = strOption.find('.');
+        size_t nEquals = strOption.find('=');
+        if (nDot == std::string::npos || nEquals == std::string::npos || nDot > nEquals)
+            throw dbwrapper_error(strprintf("Malformed -dboption '%s', expecting <db>.<option>=<value>", strOption));
+        std::string strDBName = strOption.substr(0, nDot);
+        if (strDBName != "chainstate" && strDBName != "blockindex")
+            throw dbwrapper_error(strprintf("Unknown database in -dboption '%s', expecting chainstate or blockindex", strOption));
+        std::string strOptionName = strOption.substr(nDot + 1, nEquals - nDot - 1);
+        std::string strValue = strOption.substr(nEquals + 1);
+        int64_t nValue;
+        if (!ParseInt64(strValue, &nValue) || nValue < 0)
+            throw dbwrapper_error(strprintf("Invalid value in -dboption '%s'", strOption));
+
+        bool fApply = strDBName == strName;
+        if (strOptionName == "block_cache") {
+            if (fApply) options.nBlockCacheSize = nValue;
+        } else if (strOptionName == "write_buffer") {
+            if (fApply) options.nWriteBufferSize = nValue;
+        } else if (strOptionName == "block_size") {
+            if (fApply) options.nBlockSize = nValue;
+        } else if (strOptionName == "bloom_bits") {
+            if (fApply) options.nBloomBits = nValue;
+        } else if (strOptionName == "max_open_files") {
+            if (fApply) options.nMaxOpenFiles = nValue;
+        } else {
+            throw dbwrapper_error(strprintf("Unknown option in -dboption '%s'", strOption));
+        }
     }
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+namespace {
+
+/** Handle database error by throwing dbwrapper_error exception.
+ */
+void HandleError(const leveldb::Status& status)
+{
+    if (status.ok())
+        return;
+    LogPrintf("%s\n", status.ToString());
+    if (status.IsCorruption())
+        throw dbwrapper_error("Database corrupted");
+    if (status.IsIOError())
+        throw dbwrapper_error("Database I/O error");
+    if (status.IsNotFound())
+        throw dbwrapper_error("Database entry missing");
+    throw dbwrapper_error("Unknown database error");
+}
+
+leveldb::Slice ToSlice(const CKVSlice& slice)
 {
-    penv = NULL;
-    readoptions.verify_checksums = true;
-    iteroptions.verify_checksums = true;
-    iteroptions.fill_cache = false;
-    syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
-    options.create_if_missing = true;
-    if (fMemory) {
-        penv = leveldb::NewMemEnv(leveldb::Env::Default());
-        options.env = penv;
-    } else {
-        if (fWipe) {
-            LogPrintf("Wiping LevelDB in %s\n", path.string());
-            leveldb::Status result = leveldb::DestroyDB(path.string(), options);
-            dbwrapper_private::HandleError(result);
+    return leveldb::Slice(slice.data, slice.size);
+}
+
+CKVSlice FromSlice(const leveldb::Slice& slice)
+{
+    return CKVSlice(slice.data(), slice.size());
+}
+
+class CLevelDBBatch : public CKVBatch
+{
+public:
+    leveldb::WriteBatch batch;
+
+    void Put(const CKVSlice& key, const CKVSlice& value) { batch.Put(ToSlice(key), ToSlice(value)); }
+    void Delete(const CKVSlice& key) { batch.Delete(ToSlice(key)); }
+    void Clear() { batch.Clear(); }
+};
+
+class CLevelDBIterator : public CKVIterator
+{
+private:
+    leveldb::Iterator* piter;
+
+public:
+    CLevelDBIterator(leveldb::Iterator* piterIn) : piter(piterIn) {}
+    ~CLevelDBIterator() { delete piter; }
+
+    bool Valid() const { return piter->Valid(); }
+    void SeekToFirst() { piter->SeekToFirst(); }
+    void Seek(const CKVSlice& key) { piter->Seek(ToSlice(key)); }
+    void Next() { piter->Next(); }
+    CKVSlice Key() const { return FromSlice(piter->key()); }
+    CKVSlice Value() const { return FromSlice(piter->value()); }
+};
+
+class CLevelDBStore : public CKVStore
+{
+private:
+    //! custom environment this database is using (may be NULL in case of default environment)
+    leveldb::Env* penv;
+
+    //! database options used
+    leveldb::Options options;
+
+    //! options used when reading from the database
+    leveldb::ReadOptions readoptions;
+
+    //! options used when iterating over values of the database
+    leveldb::ReadOptions iteroptions;
+
+    //! options used when writing to the database
+    leveldb::WriteOptions writeoptions;
+
+    //! options used when sync writing to the database
+    leveldb::WriteOptions syncoptions;
+
+    //! the database itself
+    leveldb::DB* pdb;
+
+public:
+    CLevelDBStore(const boost::filesystem::path& path, const CDBOptions& dboptions, bool fMemory, bool fWipe)
+    {
+        penv = NULL;
+        readoptions.verify_checksums = true;
+        iteroptions.verify_checksums = true;
+        iteroptions.fill_cache = false;
+        syncoptions.sync = true;
+        options.block_cache = leveldb::NewLRUCache(dboptions.nBlockCacheSize);
+        options.write_buffer_size = dboptions.nWriteBufferSize;
+        options.block_size = dboptions.nBlockSize;
+        options.filter_policy = dboptions.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(dboptions.nBloomBits) : NULL;
+        options.compression = leveldb::kNoCompression;
+        options.max_open_files = dboptions.nMaxOpenFiles;
+        if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
+            // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
+            // on corruption in later versions.
+            options.paranoid_checks = true;
+        }
+        options.create_if_missing = true;
+        if (fMemory) {
+            penv = leveldb::NewMemEnv(leveldb::Env::Default());
+            options.env = penv;
+        } else {
+            if (fWipe) {
+                LogPrintf("Wiping LevelDB in %s\n", path.string());
+                leveldb::Status result = leveldb::DestroyDB(path.string(), options);
+                HandleError(result);
+            }
+            TryCreateDirectory(path);
+            LogPrintf("Opening LevelDB in %s\n", path.string());
+            LogPrintf("Using a %u byte block cache, %u byte write buffer, %u byte blocks, %d bloom filter bits, %d open files\n",
+                dboptions.nBlockCacheSize, dboptions.nWriteBufferSize, dboptions.nBlockSize, dboptions.nBloomBits, dboptions.nMaxOpenFiles);
         }
-        TryCreateDirectory(path);
-        LogPrintf("Opening LevelDB in %s\n", path.string());
+        leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
+        HandleError(status);
+        LogPrintf("Opened LevelDB successfully\n");
+    }
+
+    ~CLevelDBStore()
+    {
+        delete pdb;
+        pdb = NULL;
+        delete options.filter_policy;
+        options.filter_policy = NULL;
+        delete options.block_cache;
+        options.block_cache = NULL;
+        delete penv;
+        options.env = NULL;
+    }
+
+    bool Get(const CKVSlice& key, std::string& strValue) const
+    {
+        leveldb::Status status = pdb->Get(readoptions, ToSlice(key), &strValue);
+        if (!status.ok()) {
+            if (status.IsNotFound())
+                return false;
+            LogPrintf("LevelDB read failure: %s\n", status.ToString());
+            HandleError(status);
+        }
+        return true;
+    }
+
+    void Write(CKVBatch& batch, bool fSync)
+    {
+        leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &static_cast<CLevelDBBatch&>(batch).batch);
+        HandleError(status);
+    }
+
+    CKVBatch* NewBatch() const
+    {
+        return new CLevelDBBatch();
     }
-    leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
-    dbwrapper_private::HandleError(status);
-    LogPrintf("Opened LevelDB successfully\n");
 
+    CKVIterator* NewIterator() const
+    {
+        return new CLevelDBIterator(pdb->NewIterator(iteroptions));
+    }
+};
+
+}
+
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+    : pstore(new CLevelDBStore(path, CDBOptions(nCacheSize), fMemory, fWipe))
+{
+    InitObfuscateKey(path.string(), obfuscate);
+}
+
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, const CDBOptions& options, bool fMemory, bool fWipe, bool obfuscate)
+    : pstore(new CLevelDBStore(path, options, fMemory, fWipe))
+{
+    InitObfuscateKey(path.string(), obfuscate);
+}
+
+CDBWrapper::CDBWrapper(std::unique_ptr<CKVStore> pstoreIn, bool obfuscate)
+    : pstore(std::move(pstoreIn))
+{
+    InitObfuscateKey("custom store", obfuscate);
+}
+
+void CDBWrapper::InitObfuscateKey(const std::string& strName, bool obfuscate)
+{
     // The base-case obfuscation key, which is a noop.
     obfuscate_key = std::vector<unsigned char>(OBFUSCATE_KEY_NUM_BYTES, '\000');
 
@@ -70,31 +257,27 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
         Write(OBFUSCATE_KEY_KEY, new_key);
         obfuscate_key = new_key;
 
-        LogPrintf("Wrote new obfuscate key for %s: %s\n", path.string(), HexStr(obfuscate_key));
+        LogPrintf("Wrote new obfuscate key for %s: %s\n", strName, HexStr(obfuscate_key));
     }
 
-    LogPrintf("Using obfuscation key for %s: %s\n", path.string(), HexStr(obfuscate_key));
+    LogPrintf("Using obfuscation key for %s: %s\n", strName, HexStr(obfuscate_key));
 }
 
 CDBWrapper::~CDBWrapper()
 {
-    delete pdb;
-    pdb = NULL;
-    delete options.filter_policy;
-    options.filter_policy = NULL;
-    delete options.block_cache;
-    options.block_cache = NULL;
-    delete penv;
-    options.env = NULL;
 }
 
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
 {
-    leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
-    dbwrapper_private::HandleError(status);
+    pstore->Write(*batch.pbatch, fSync);
     return true;
 }
 
+CDBBatch::CDBBatch(const CDBWrapper &_parent) :
+    parent(_parent), pbatch(_parent.pstore->NewBatch()), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION)
+{
+}
+
 // Prefixed with null character to avoid collisions with other keys
 //
 // We must use a string constructor which specifies length so that we copy
@@ -129,20 +312,6 @@ void CDBIterator::Next() { piter->Next(); }
 
 namespace dbwrapper_private {
 
-void HandleError(const leveldb::Status& status)
-{
-    if (status.ok())
-        return;
-    LogPrintf("%s\n", status.ToString());
-    if (status.IsCorruption())
-        throw dbwrapper_error("Database corrupted");
-    if (status.IsIOError())
-        throw dbwrapper_error("Database I/O error");
-    if (status.IsNotFound())
-        throw dbwrapper_error("Database entry missing");
-    throw dbwrapper_error("Unknown database error");
-}
-
 const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w)
 {
     return w.obfuscate_key;
@@ -6,16 +6,16 @@
 #define BITCOIN_DBWRAPPER_H
 
 #include "clientversion.h"
+#include "kvstore.h"
 #include "serialize.h"
 #include "streams.h"
 #include "util.h"
 #include "utilstrencodings.h"
 #include "version.h"
 
-#include <boost/filesystem/path.hpp>
+#include <memory>
 
-#include <leveldb/db.h>
-#include <leveldb/write_batch.h>
+#include <boost/filesystem/path.hpp>
 
 class dbwrapper_error : public std::runtime_error
 {
@@ -25,13 +25,33 @@ public:
 
 class CDBWrapper;
 
-/** These should be considered an implementation detail of the specific database.
+/** LevelDB settings of one database */
+struct CDBOptions
+{
+    //! size of the LRU cache of uncompressed blocks
+    size_t nBlockCacheSize;
+    //! amount of writes buffered in memory before being sorted into a table
+    size_t nWriteBufferSize;
+    //! approximate size of the blocks keys and values are packed into
+    size_t nBlockSize;
+    //! bits per key of the bloom filter in each table, 0 for none
+    int nBloomBits;
+    int nMaxOpenFiles;
+
+    //! Defaults, dividing nCacheSize between the block cache and write buffers
+    explicit CDBOptions(size_t nCacheSize);
+};
+
+/**
+ * The defaults for database strName with any -dboption=<name>.<option>=<value>
+ * overrides applied.  Throws dbwrapper_error on a malformed override or one
+ * for a database other than chainstate and blockindex.
  */
-namespace dbwrapper_private {
+CDBOptions GetDBOptions(const std::string& strName, size_t nCacheSize);
 
-/** Handle database error by throwing dbwrapper_error exception.
+/** These should be considered an implementation detail of the specific database.
  */
-void HandleError(const leveldb::Status& status);
+namespace dbwrapper_private {
 
 /** Work around circular dependency, as well as for testing in dbwrapper_tests.
  * Database obfuscation should be considered an implementation detail of the
@@ -48,40 +68,41 @@ class CDBBatch
 
 private:
     const CDBWrapper &parent;
-    leveldb::WriteBatch batch;
+    std::unique_ptr<CKVBatch> pbatch;
+
+    //! reused for every entry, so a flush does not allocate per coin
+    CDataStream ssKey;
+    CDataStream ssValue;
 
 public:
     /**
      * @param[in] _parent   CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &_parent) : parent(_parent) { };
+    CDBBatch(const CDBWrapper &_parent);
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey.clear();
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+        CKVSlice slKey(&ssKey[0], ssKey.size());
 
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.reserve(ssValue.GetSerializeSize(value));
+        ssValue.clear();
         ssValue << value;
         ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
-        leveldb::Slice slValue(&ssValue[0], ssValue.size());
+        CKVSlice slValue(&ssValue[0], ssValue.size());
 
-        batch.Put(slKey, slValue);
+        pbatch->Put(slKey, slValue);
     }
 
     template <typename K>
     void Erase(const K& key)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey.clear();
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+        CKVSlice slKey(&ssKey[0], ssKey.size());
 
-        batch.Delete(slKey);
+        pbatch->Delete(slKey);
     }
 };
 
@@ -89,16 +110,20 @@ class CDBIterator
 {
 private:
     const CDBWrapper &parent;
-    leveldb::Iterator *piter;
+    CKVIterator *piter;
+
+    //! reused for every key and value read
+    CDataStream ssKey;
+    CDataStream ssValue;
 
 public:
 
     /**
      * @param[in] _parent          Parent CDBWrapper instance.
-     * @param[in] _piter           The original leveldb iterator.
+     * @param[in] _piter           The iterator of the parent's store, owned from now on.
      */
-    CDBIterator(const CDBWrapper &_parent, leveldb::Iterator *_piter) :
-        parent(_parent), piter(_piter) { };
+    CDBIterator(const CDBWrapper &_parent, CKVIterator *_piter) :
+        parent(_parent), piter(_piter), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION) { };
     ~CDBIterator();
 
     bool Valid();
@@ -106,19 +131,19 @@ public:
     void SeekToFirst();
 
     template<typename K> void Seek(const K& key) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey.clear();
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+        CKVSlice slKey(&ssKey[0], ssKey.size());
         piter->Seek(slKey);
     }
 
     void Next();
 
     template<typename K> bool GetKey(K& key) {
-        leveldb::Slice slKey = piter->key();
+        CKVSlice slKey = piter->Key();
         try {
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            ssKey.clear();
+            ssKey.write(slKey.data, slKey.size);
             ssKey >> key;
         } catch (const std::exception&) {
             return false;
@@ -127,13 +152,14 @@ public:
     }
 
     unsigned int GetKeySize() {
-        return piter->key().size();
+        return piter->Key().size;
     }
 
     template<typename V> bool GetValue(V& value) {
-        leveldb::Slice slValue = piter->value();
+        CKVSlice slValue = piter->Value();
         try {
-            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue.clear();
+            ssValue.write(slValue.data, slValue.size);
             ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
             ssValue >> value;
         } catch (const std::exception&) {
@@ -143,35 +169,18 @@ public:
     }
 
     unsigned int GetValueSize() {
-        return piter->value().size();
+        return piter->Value().size;
     }
 
 };
 
 class CDBWrapper
 {
+    friend class CDBBatch;
     friend const std::vector<unsigned char>& dbwrapper_private::GetObfuscateKey(const CDBWrapper &w);
 private:
-    //! custom environment this database is using (may be NULL in case of default environment)
-    leveldb::Env* penv;
-
-    //! database options used
-    leveldb::Options options;
-
-    //! options used when reading from the database
-    leveldb::ReadOptions readoptions;
-
-    //! options used when iterating over values of the database
-    leveldb::ReadOptions iteroptions;
-
-    //! options used when writing to the database
-    leveldb::WriteOptions writeoptions;
-
-    //! options used when sync writing to the database
-    leveldb::WriteOptions syncoptions;
-
-    //! the database itself
-    leveldb::DB* pdb;
+    //! the storage engine, LevelDB unless one was passed in
+    std::unique_ptr<CKVStore> pstore;
 
     //! a key used for optional XOR-obfuscation of the database
     std::vector<unsigned char> obfuscate_key;
@@ -184,6 +193,9 @@ private:
 
     std::vector<unsigned char> CreateObfuscateKey() const;
 
+    //! Load or create the obfuscation key, strName is only used for logging
+    void InitObfuscateKey(const std::string& strName, bool obfuscate);
+
 public:
     /**
      * @param[in] path        Location in the filesystem where leveldb data will be stored.
@@ -194,6 +206,15 @@ public:
      *                        with a zero'd byte array.
      */
     CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    /**
+     * @param[in] options     LevelDB settings, see GetDBOptions.
+     */
+    CDBWrapper(const boost::filesystem::path& path, const CDBOptions& options, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    /**
+     * Use another storage engine.
+     * @param[in] pstoreIn    The store, owned from now on.
+     */
+    CDBWrapper(std::unique_ptr<CKVStore> pstoreIn, bool obfuscate = false);
     ~CDBWrapper();
 
     template <typename K, typename V>
@@ -202,16 +223,11 @@ public:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+        CKVSlice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
-        if (!status.ok()) {
-            if (status.IsNotFound())
-                return false;
-            LogPrintf("LevelDB read failure: %s\n", status.ToString());
-            dbwrapper_private::HandleError(status);
-        }
+        if (!pstore->Get(slKey, strValue))
+            return false;
         try {
             CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
             ssValue.Xor(obfuscate_key);
@@ -236,17 +252,10 @@ public:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+        CKVSlice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
-        if (!status.ok()) {
-            if (status.IsNotFound())
-                return false;
-            LogPrintf("LevelDB read failure: %s\n", status.ToString());
-            dbwrapper_private::HandleError(status);
-        }
-        return true;
+        return pstore->Get(slKey, strValue);
     }
 
     template <typename K>
@@ -273,7 +282,7 @@ public:
 
     CDBIterator *NewIterator()
     {
-        return new CDBIterator(*this, pdb->NewIterator(iteroptions));
+        return new CDBIterator(*this, pstore->NewIterator());
     }
 
     /**
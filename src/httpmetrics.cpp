@@ -0,0 +1,83 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "httprpc.h"
+
+#include "httpserver.h"
+#include "main.h"
+#include "metrics.h"
+#include "net.h"
+#include "rpc/protocol.h"
+#include "sync.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+static void WritePeerMetrics(std::string& strOut)
+{
+    std::vector<CNodeStats> vstats;
+    {
+        LOCK(cs_vNodes);
+        vstats.reserve(vNodes.size());
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            CNodeStats stats;
+            pnode->copyStats(stats);
+            vstats.push_back(stats);
+        }
+    }
+
+    WriteMetricHeader(strOut, "bitcoin_peers", "gauge", "Connected peers");
+    WriteMetricValue(strOut, "bitcoin_peers", "", vstats.size());
+    WriteMetricHeader(strOut, "bitcoin_peer_processing_seconds_total", "counter", "Time the message handler spent on a peer");
+    BOOST_FOREACH(const CNodeStats& stats, vstats)
+        WriteMetricValue(strOut, "bitcoin_peer_processing_seconds_total", MetricLabel("peer", strprintf("%d", stats.nodeid)) + MetricLabel("addr", stats.addrName), stats.nProcessingTime * 0.000001);
+    WriteMetricHeader(strOut, "bitcoin_peer_sent_bytes_total", "counter", "Bytes sent to a peer");
+    BOOST_FOREACH(const CNodeStats& stats, vstats)
+        WriteMetricValue(strOut, "bitcoin_peer_sent_bytes_total", MetricLabel("peer", strprintf("%d", stats.nodeid)) + MetricLabel("addr", stats.addrName), stats.nSendBytes);
+    WriteMetricHeader(strOut, "bitcoin_peer_received_bytes_total", "counter", "Bytes received from a peer");
+    BOOST_FOREACH(const CNodeStats& stats, vstats)
+        WriteMetricValue(strOut, "bitcoin_peer_received_bytes_total", MetricLabel("peer", strprintf("%d", stats.nodeid)) + MetricLabel("addr", stats.addrName), stats.nRecvBytes);
+}
+
+static bool HTTPReq_Metrics(HTTPRequest* req, const std::string&)
+{
+    if (req->GetRequestMethod() != HTTPRequest::GET) {
+        req->WriteReply(HTTP_BAD_METHOD, "Only GET requests are supported");
+        return false;
+    }
+
+    // Everything is gathered here, recording the metrics does no formatting
+    std::string strOut;
+    WriteValidationMetrics(strOut);
+    WriteLockMetrics(strOut);
+    WritePeerMetrics(strOut);
+
+    req->WriteHeader("Content-Type", "text/plain; version=0.0.4");
+    req->WriteReply(HTTP_OK, strOut);
+    return true;
+}
+
+bool StartHTTPMetrics()
+{
+    LogPrint("http", "Starting HTTP metrics\n");
+    std::vector<std::pair<std::string, void*> > vLocks;
+    vLocks.push_back(std::make_pair("cs_main", (void*)&cs_main));
+    vLocks.push_back(std::make_pair("mempool.cs", (void*)&mempool.cs));
+    vLocks.push_back(std::make_pair("cs_vNodes", (void*)&cs_vNodes));
+    InitLockMetrics(vLocks);
+    fMetrics = true;
+
+    RegisterHTTPHandler("/metrics", true, HTTPReq_Metrics);
+    return true;
+}
+
+void InterruptHTTPMetrics()
+{
+}
+
+void StopHTTPMetrics()
+{
+    UnregisterHTTPHandler("/metrics", true);
+}
@@ -34,4 +34,16 @@ void InterruptREST();
  */
 void StopREST();
 
+/** Start the HTTP metrics endpoint and the collection of timings.
+ * Precondition; HTTP has been started.
+ */
+bool StartHTTPMetrics();
+/** Interrupt the HTTP metrics endpoint.
+ */
+void InterruptHTTPMetrics();
+/** Stop the HTTP metrics endpoint.
+ * Precondition; HTTP has been stopped.
+ */
+void StopHTTPMetrics();
+
 #endif
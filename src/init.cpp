@@ -11,6 +11,7 @@
 
 #include "addrman.h"
 #include "amount.h"
+#include "blockfilterindex.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -20,6 +21,7 @@
 #include "httprpc.h"
 #include "key.h"
 #include "main.h"
+#include "metrics.h"
 #include "miner.h"
 #include "netbase.h"
 #include "net.h"
@@ -38,6 +40,7 @@
 #include "utilmoneystr.h"
 #include "validationinterface.h"
 #ifdef ENABLE_WALLET
+#include "wallet/sendqueue.h"
 #include "wallet/wallet.h"
 #endif
 #include <stdint.h>
@@ -92,7 +95,20 @@ enum BindFlags {
     BF_WHITELIST    = (1U << 2),
 };
 
-static const char* FEE_ESTIMATES_FILENAME="fee_estimates.dat";
+/** Interval in seconds between writes of changed fee estimates to disk */
+static const int64_t FEE_ESTIMATES_FLUSH_INTERVAL = 10 * 60;
+//! Cache of the fee estimates database (MiB)
+static const int64_t nFeeEstimatesDBCache = 1;
+
+static CDBWrapper* pfeeestimatesdb = NULL;
+
+/** Write the fee estimates changed since the last write, unless fForce is false and no block came in */
+static void FlushFeeEstimates(bool fForce)
+{
+    if (!pfeeestimatesdb || (!fForce && !mempool.FeeEstimatesDirty()))
+        return;
+    mempool.WriteFeeEstimates(*pfeeestimatesdb);
+}
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -170,6 +186,7 @@ void Interrupt(boost::thread_group& threadGroup)
     InterruptHTTPRPC();
     InterruptRPC();
     InterruptREST();
+    InterruptHTTPMetrics();
     InterruptTorControl();
     threadGroup.interrupt_all();
 }
@@ -191,6 +208,7 @@ void Shutdown()
 
     StopHTTPRPC();
     StopREST();
+    StopHTTPMetrics();
     StopRPC();
     StopHTTPServer();
 #ifdef ENABLE_WALLET
@@ -203,12 +221,9 @@ void Shutdown()
 
     if (fFeeEstimatesInitialized)
     {
-        boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
-        CAutoFile est_fileout(fopen(est_path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
-        if (!est_fileout.IsNull())
-            mempool.WriteFeeEstimates(est_fileout);
-        else
-            LogPrintf("%s: Failed to write fee estimates to %s\n", __func__, est_path.string());
+        FlushFeeEstimates(true);
+        delete pfeeestimatesdb;
+        pfeeestimatesdb = NULL;
         fFeeEstimatesInitialized = false;
     }
 
@@ -226,6 +241,7 @@ void Shutdown()
         delete pblocktree;
         pblocktree = NULL;
     }
+    StopBlockFilterIndex();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         pwalletMain->Flush(true);
@@ -248,6 +264,7 @@ void Shutdown()
 #endif
     UnregisterAllValidationInterfaces();
 #ifdef ENABLE_WALLET
+    StopSendQueue();
     delete pwalletMain;
     pwalletMain = NULL;
 #endif
@@ -306,6 +323,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-blockfilterindex", strprintf(_("Maintain an index of block filters, used to skip blocks that don't involve the wallet when rescanning (default: %u)"), DEFAULT_BLOCKFILTERINDEX));
+    strUsage += HelpMessageOpt("-blockindexsnapshot=<n>", strprintf(_("Write a snapshot of the block index for a faster start at shutdown and after <n> changed entries (0 to disable, default: %u)"), DEFAULT_BLOCK_INDEX_SNAPSHOT_INTERVAL));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
@@ -324,6 +343,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxorphanpeerkb=<n>", strprintf(_("Keep at most <n> kilobytes of unconnectable transactions in memory per peer (default: %u)"), DEFAULT_MAX_ORPHAN_PEER_KB));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
@@ -400,8 +420,10 @@ std::string HelpMessage(HelpMessageMode mode)
     if (showDebug)
     {
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
+        strUsage += HelpMessageOpt("-checkblockindexsweep=<n>", strprintf("Make -checkblockindex walk the whole block tree only every <n> times, checking the changed entries in between (1 for always, default: %u)", DEFAULT_CHECKBLOCKINDEX_SWEEP));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkpoints", strprintf("Disable expensive verification for known chain history (default: %u)", DEFAULT_CHECKPOINTS_ENABLED));
+        strUsage += HelpMessageOpt("-dboption=<db>.<option>=<n>", "Override a LevelDB setting of the chainstate or blockindex database: block_cache, write_buffer and block_size in bytes, bloom_bits or max_open_files");
         strUsage += HelpMessageOpt("-disablesafemode", strprintf("Disable safemode, override a real safe mode event (default: %u)", DEFAULT_DISABLE_SAFEMODE));
         strUsage += HelpMessageOpt("-testsafemode", strprintf("Force safe mode (default: %u)", DEFAULT_TESTSAFEMODE));
         strUsage += HelpMessageOpt("-dropmessagestest=<n>", "Randomly drop 1 of every <n> network messages");
@@ -412,6 +434,8 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_LIMIT));
         strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u).", DEFAULT_DESCENDANT_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-bip9params=deployment:start:end", "Use given start/end times for specified BIP9 deployment (regtest-only)");
+        strUsage += HelpMessageOpt("-lockprofile", strprintf("Count lock acquisitions and time their waits by call site, see getlockprofile (default: %u)", DEFAULT_LOCK_PROFILE));
+        strUsage += HelpMessageOpt("-lockprofilesamplerate=<n>", strprintf("With -lockprofile, time how long one in <n> acquisitions of each call site hold the lock (default: %u)", DEFAULT_LOCK_PROFILE_SAMPLE_RATE));
     }
     string debugCategories = "addrman, alert, bench, coindb, db, http, libevent, lock, mempool, mempoolrej, net, proxy, prune, rand, reindex, rpc, selectcoins, tor, zmq"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
@@ -463,6 +487,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("RPC server options:"));
     strUsage += HelpMessageOpt("-server", _("Accept command line and JSON-RPC commands"));
     strUsage += HelpMessageOpt("-rest", strprintf(_("Accept public REST requests (default: %u)"), DEFAULT_REST_ENABLE));
+    strUsage += HelpMessageOpt("-metrics", strprintf(_("Collect timings and serve them with other statistics in Prometheus format at /metrics, to the hosts allowed by -rpcallowip (default: %u)"), DEFAULT_METRICS));
     strUsage += HelpMessageOpt("-rpcbind=<addr>", _("Bind to given address to listen for JSON-RPC connections. Use [host]:port notation for IPv6. This option can be specified multiple times (default: bind to all interfaces)"));
     strUsage += HelpMessageOpt("-rpccookiefile=<loc>", _("Location of the auth cookie (default: data dir)"));
     strUsage += HelpMessageOpt("-rpcuser=<user>", _("Username for JSON-RPC connections"));
@@ -676,6 +701,8 @@ bool AppInitServers(boost::thread_group& threadGroup)
         return false;
     if (GetBoolArg("-rest", DEFAULT_REST_ENABLE) && !StartREST())
         return false;
+    if (GetBoolArg("-metrics", DEFAULT_METRICS) && !StartHTTPMetrics())
+        return false;
     if (!StartHTTPServer())
         return false;
     return true;
@@ -902,7 +929,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         mempool.setSanityCheck(1.0 / ratio);
     }
     fCheckBlockIndex = GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
+    nCheckBlockIndexSweep = std::max<int>(GetArg("-checkblockindexsweep", DEFAULT_CHECKBLOCKINDEX_SWEEP), 1);
     fCheckpointsEnabled = GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
+    nBlockIndexSnapshotInterval = std::max<int64_t>(GetArg("-blockindexsnapshot", DEFAULT_BLOCK_INDEX_SNAPSHOT_INTERVAL), 0);
+    try {
+        GetDBOptions("chainstate", 0);
+    } catch (const dbwrapper_error& e) {
+        return InitError(e.what());
+    }
+    if (GetBoolArg("-lockprofile", DEFAULT_LOCK_PROFILE))
+        StartLockProfile(GetArg("-lockprofilesamplerate", DEFAULT_LOCK_PROFILE_SAMPLE_RATE));
 
     // mempool limits
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
@@ -1070,8 +1106,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadHeaderCheck);
+        }
     }
 
     // Start the lightweight task scheduler thread
@@ -1300,6 +1338,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                pblocktree->SetSnapshotEnabled(nBlockIndexSnapshotInterval > 0);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
@@ -1409,12 +1448,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
-    boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
-    CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
-    // Allowed to fail as this file IS missing on first startup.
-    if (!est_filein.IsNull())
-        mempool.ReadFeeEstimates(est_filein);
+    // The estimates are written every few minutes, only the buckets that changed since the last write
+    try {
+        pfeeestimatesdb = new CDBWrapper(GetDataDir() / "fee_estimates", nFeeEstimatesDBCache << 20);
+        // Allowed to fail as there are no estimates on first startup
+        mempool.ReadFeeEstimates(*pfeeestimatesdb);
+    } catch (const dbwrapper_error& e) {
+        LogPrintf("Unable to open the fee estimates database, estimates won't be kept: %s\n", e.what());
+    }
     fFeeEstimatesInitialized = true;
+    scheduler.scheduleEvery(boost::bind(&FlushFeeEstimates, false), FEE_ESTIMATES_FLUSH_INTERVAL);
+
+    // Built in the background, rescans of the wallet loaded next use the filters there are
+    if (!StartBlockFilterIndex(threadGroup))
+        return InitError(_("Error opening block filter database"));
 
     // ********************************************************* Step 8: load wallet
 #ifdef ENABLE_WALLET
@@ -1492,7 +1539,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     // ********************************************************* Step 11: start node
 
     //// debug print
-    LogPrintf("mapBlockIndex.size() = %u\n",   mapBlockIndex.size());
+    LogPrintf("mapBlockIndex.size() = %u (%.1f MiB)\n", mapBlockIndex.size(), BlockIndexDynamicMemoryUsage() * (1.0 / (1 << 20)));
     LogPrintf("nBestHeight = %d\n",                   chainActive.Height());
     if (GetBoolArg("-listenonion", DEFAULT_LISTEN_ONION))
         StartTorControl(threadGroup, scheduler);
@@ -1508,6 +1555,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (pwalletMain) {
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+        StartSendQueue(threadGroup, pwalletMain);
     }
 #endif
 
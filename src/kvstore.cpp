@@ -0,0 +1,88 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kvstore.h"
+
+namespace {
+
+class CMemoryKVBatch : public CKVBatch
+{
+public:
+    struct Op
+    {
+        bool fErase;
+        std::string strKey;
+        std::string strValue;
+    };
+    std::vector<Op> vOps;
+
+    void Put(const CKVSlice& key, const CKVSlice& value)
+    {
+        vOps.push_back(Op());
+        vOps.back().fErase = false;
+        vOps.back().strKey.assign(key.data, key.size);
+        vOps.back().strValue.assign(value.data, value.size);
+    }
+
+    void Delete(const CKVSlice& key)
+    {
+        vOps.push_back(Op());
+        vOps.back().fErase = true;
+        vOps.back().strKey.assign(key.data, key.size);
+    }
+
+    void Clear()
+    {
+        vOps.clear();
+    }
+};
+
+class CMemoryKVIterator : public CKVIterator
+{
+private:
+    const std::map<std::string, std::string>& mapData;
+    std::map<std::string, std::string>::const_iterator it;
+
+public:
+    CMemoryKVIterator(const std::map<std::string, std::string>& mapDataIn) : mapData(mapDataIn), it(mapDataIn.end()) {}
+
+    bool Valid() const { return it != mapData.end(); }
+    void SeekToFirst() { it = mapData.begin(); }
+    void Seek(const CKVSlice& key) { it = mapData.lower_bound(std::string(key.data, key.size)); }
+    void Next() { ++it; }
+    CKVSlice Key() const { return CKVSlice(it->first); }
+    CKVSlice Value() const { return CKVSlice(it->second); }
+};
+
+}
+
+bool CMemoryKVStore::Get(const CKVSlice& key, std::string& strValue) const
+{
+    std::map<std::string, std::string>::const_iterator it = mapData.find(std::string(key.data, key.size));
+    if (it == mapData.end())
+        return false;
+    strValue = it->second;
+    return true;
+}
+
+void CMemoryKVStore::Write(CKVBatch& batch, bool fSync)
+{
+    const CMemoryKVBatch& memBatch = static_cast<const CMemoryKVBatch&>(batch);
+    for (std::vector<CMemoryKVBatch::Op>::const_iterator it = memBatch.vOps.begin(); it != memBatch.vOps.end(); it++) {
+        if (it->fErase)
+            mapData.erase(it->strKey);
+        else
+            mapData[it->strKey] = it->strValue;
+    }
+}
+
+CKVBatch* CMemoryKVStore::NewBatch() const
+{
+    return new CMemoryKVBatch();
+}
+
+CKVIterator* CMemoryKVStore::NewIterator() const
+{
+    return new CMemoryKVIterator(mapData);
+}
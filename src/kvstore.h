@@ -0,0 +1,80 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_KVSTORE_H
+#define BITCOIN_KVSTORE_H
+
+#include <map>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/** A key or value passed to or from a CKVStore, not owning its data */
+struct CKVSlice
+{
+    const char* data;
+    size_t size;
+
+    CKVSlice(const char* dataIn, size_t sizeIn) : data(dataIn), size(sizeIn) {}
+    explicit CKVSlice(const std::string& str) : data(str.data()), size(str.size()) {}
+};
+
+/** Changes queued to be applied to a CKVStore at once */
+class CKVBatch
+{
+public:
+    virtual ~CKVBatch() {}
+    virtual void Put(const CKVSlice& key, const CKVSlice& value) = 0;
+    virtual void Delete(const CKVSlice& key) = 0;
+    virtual void Clear() = 0;
+};
+
+/** Iterator over a CKVStore in key order, bytewise */
+class CKVIterator
+{
+public:
+    virtual ~CKVIterator() {}
+    virtual bool Valid() const = 0;
+    virtual void SeekToFirst() = 0;
+    /** Move to the first key at or after key */
+    virtual void Seek(const CKVSlice& key) = 0;
+    virtual void Next() = 0;
+    /** Only valid until the iterator moves */
+    virtual CKVSlice Key() const = 0;
+    virtual CKVSlice Value() const = 0;
+};
+
+/**
+ * Ordered key-value storage engine behind CDBWrapper.  Implementations
+ * throw dbwrapper_error on failure.
+ */
+class CKVStore
+{
+public:
+    virtual ~CKVStore() {}
+    /** Returns false if key is not present */
+    virtual bool Get(const CKVSlice& key, std::string& strValue) const = 0;
+    virtual void Write(CKVBatch& batch, bool fSync) = 0;
+    virtual CKVBatch* NewBatch() const = 0;
+    virtual CKVIterator* NewIterator() const = 0;
+};
+
+/**
+ * Store keeping everything in a std::map, for tests and for comparison in
+ * benchmarks.  Iterators do not see a snapshot; erasing the entry one points
+ * to invalidates it.
+ */
+class CMemoryKVStore : public CKVStore
+{
+public:
+    bool Get(const CKVSlice& key, std::string& strValue) const;
+    void Write(CKVBatch& batch, bool fSync);
+    CKVBatch* NewBatch() const;
+    CKVIterator* NewIterator() const;
+
+private:
+    std::map<std::string, std::string> mapData;
+};
+
+#endif // BITCOIN_KVSTORE_H
@@ -17,6 +17,7 @@
 #include "hash.h"
 #include "init.h"
 #include "merkleblock.h"
+#include "metrics.h"
 #include "net.h"
 #include "policy/fees.h"
 #include "policy/policy.h"
@@ -30,6 +31,7 @@
 #include "tinyformat.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txrelayorder.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
@@ -61,6 +63,8 @@ using namespace std;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+/** Owns the entries of mapBlockIndex, cleared along with it */
+static CBlockIndexArena blockIndexArena;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
@@ -75,7 +79,11 @@ bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
+int nCheckBlockIndexSweep = DEFAULT_CHECKBLOCKINDEX_SWEEP;
+/** Number of times CheckBlockIndex ran since the block index was loaded */
+static int64_t nBlockIndexChecks = 0;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
+int64_t nBlockIndexSnapshotInterval = 0;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
@@ -101,9 +109,25 @@ struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
     int64_t nTimeExpire;
+    size_t nUsage;
 };
 map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
 map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
+
+/** Orphans announced by one peer, oldest first, and their total memory usage. */
+struct COrphanPeerUsage {
+    size_t nUsage;
+    set<pair<int64_t, uint256>> setByExpiry;
+};
+map<NodeId, COrphanPeerUsage> mapOrphanPeerUsage GUARDED_BY(cs_main);
+
+/**
+ * Expiration time wheel: slot (nTimeExpire / ORPHAN_TX_EXPIRE_INTERVAL) % size
+ * holds the orphans that expire within that interval, so a sweep only looks at
+ * the slots that became due since the previous one.
+ */
+vector<set<uint256>> vOrphanExpiryWheel GUARDED_BY(cs_main)(ORPHAN_TX_EXPIRE_TIME / ORPHAN_TX_EXPIRE_INTERVAL + 1);
+int64_t nOrphanExpirySlot GUARDED_BY(cs_main) = 0;
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 static void CheckBlockIndex(const Consensus::Params& consensusParams);
@@ -217,6 +241,23 @@ namespace {
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
+    /** Block index entries changed since the last CheckBlockIndex, only kept with -checkblockindex. */
+    set<CBlockIndex*> setBlockIndexChanged;
+
+    /** Have CheckBlockIndex look at an entry that changed without being written. */
+    void MarkBlockIndexChanged(CBlockIndex* pindex)
+    {
+        if (fCheckBlockIndex)
+            setBlockIndexChanged.insert(pindex);
+    }
+
+    /** Have an entry written at the next flush, and checked at the next CheckBlockIndex. */
+    void MarkBlockIndexDirty(CBlockIndex* pindex)
+    {
+        setDirtyBlockIndex.insert(pindex);
+        MarkBlockIndexChanged(pindex);
+    }
+
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
 
@@ -228,6 +269,45 @@ namespace {
     MapRelay mapRelay;
     /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+
+    /** Announcement order of mempool transactions, shared by the trickle queues of all peers. */
+    CTxRelayOrder txRelayOrder(mempool, TX_RELAY_ORDER_INTERVAL);
+
+    /** Block and compact block messages recently sent, protected by cs_main. */
+    CNetMsgCache blockMsgCache(BLOCK_MSG_CACHE_SIZE);
+    /** Transaction messages recently sent, protected by cs_main. */
+    CNetMsgCache txMsgCache(TX_MSG_CACHE_SIZE);
+
+    /** Stages of connecting a block to the tip, as in the "bench" log */
+    enum ConnectStage {
+        CONNECT_READ,
+        CONNECT_CHECK,
+        CONNECT_FORKS,
+        CONNECT_TRANSACTIONS,
+        CONNECT_VERIFY,
+        CONNECT_INDEX,
+        CONNECT_CALLBACKS,
+        CONNECT_FLUSH,
+        CONNECT_CHAINSTATE,
+        CONNECT_POSTPROCESS,
+        CONNECT_TOTAL,
+    };
+    const char* pszConnectStages[] = {"read", "check", "forks", "transactions", "verify", "index", "callbacks", "flush", "chainstate", "postprocess", "total"};
+    CMetricHistogramSet metricsConnectBlock("bitcoin_block_connect_seconds", "Time spent connecting blocks, by stage", "stage",
+        std::vector<std::string>(pszConnectStages, pszConnectStages + ARRAYLEN(pszConnectStages)));
+
+    void ObserveConnectStage(ConnectStage stage, int64_t nMicros)
+    {
+        if (fMetrics)
+            metricsConnectBlock.Get(stage).Observe(nMicros);
+    }
+
+    /** Time spent in ProcessMessage, by command; built on first use as it needs the list of commands */
+    CMetricHistogramSet& GetMessageMetrics()
+    {
+        static CMetricHistogramSet metrics("bitcoin_message_processing_seconds", "Time spent processing received messages, by command", "command", getAllNetMessageTypes());
+        return metrics;
+    }
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -635,6 +715,40 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     return true;
 }
 
+void WriteValidationMetrics(std::string& strOut)
+{
+    GetMessageMetrics().Write(strOut);
+    metricsConnectBlock.Write(strOut);
+
+    std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t> > > vCaches;
+    uint64_t nSigHits, nSigMisses;
+    GetSignatureCacheStats(nSigHits, nSigMisses);
+    vCaches.push_back(std::make_pair("signatures", std::make_pair(nSigHits, nSigMisses)));
+    size_t nCoinsUsage = 0;
+    {
+        LOCK(cs_main);
+        if (pcoinsTip) {
+            vCaches.push_back(std::make_pair("coins", std::make_pair(pcoinsTip->GetCacheHits(), pcoinsTip->GetCacheMisses())));
+            nCoinsUsage = pcoinsTip->DynamicMemoryUsage();
+        }
+        vCaches.push_back(std::make_pair("block_messages", std::make_pair(blockMsgCache.GetHits(), blockMsgCache.GetMisses())));
+        vCaches.push_back(std::make_pair("tx_messages", std::make_pair(txMsgCache.GetHits(), txMsgCache.GetMisses())));
+    }
+
+    WriteMetricHeader(strOut, "bitcoin_cache_hits_total", "counter", "Lookups answered by a cache");
+    for (size_t i = 0; i < vCaches.size(); i++)
+        WriteMetricValue(strOut, "bitcoin_cache_hits_total", MetricLabel("cache", vCaches[i].first), vCaches[i].second.first);
+    WriteMetricHeader(strOut, "bitcoin_cache_misses_total", "counter", "Lookups a cache could not answer");
+    for (size_t i = 0; i < vCaches.size(); i++)
+        WriteMetricValue(strOut, "bitcoin_cache_misses_total", MetricLabel("cache", vCaches[i].first), vCaches[i].second.second);
+    WriteMetricHeader(strOut, "bitcoin_coins_cache_bytes", "gauge", "Memory used by the coins cache");
+    WriteMetricValue(strOut, "bitcoin_coins_cache_bytes", "", nCoinsUsage);
+    WriteMetricHeader(strOut, "bitcoin_mempool_transactions", "gauge", "Transactions in the memory pool");
+    WriteMetricValue(strOut, "bitcoin_mempool_transactions", "", mempool.size());
+    WriteMetricHeader(strOut, "bitcoin_mempool_bytes", "gauge", "Memory used by the memory pool");
+    WriteMetricValue(strOut, "bitcoin_mempool_bytes", "", mempool.DynamicMemoryUsage());
+}
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
@@ -679,6 +793,11 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
+static set<uint256>& OrphanExpirySlot(int64_t nTimeExpire) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    return vOrphanExpiryWheel[(nTimeExpire / ORPHAN_TX_EXPIRE_INTERVAL) % vOrphanExpiryWheel.size()];
+}
+
 bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     uint256 hash = tx.GetHash();
@@ -699,11 +818,17 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         return false;
     }
 
-    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME});
+    int64_t nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    size_t nUsage = RecursiveDynamicUsage(tx);
+    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, nTimeExpire, nUsage});
     assert(ret.second);
     BOOST_FOREACH(const CTxIn& txin, tx.vin) {
         mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
     }
+    COrphanPeerUsage& peerUsage = mapOrphanPeerUsage[peer];
+    peerUsage.nUsage += nUsage;
+    peerUsage.setByExpiry.emplace(nTimeExpire, hash);
+    OrphanExpirySlot(nTimeExpire).insert(hash);
 
     LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
              mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
@@ -724,57 +849,81 @@ int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    auto itPeer = mapOrphanPeerUsage.find(it->second.fromPeer);
+    assert(itPeer != mapOrphanPeerUsage.end());
+    itPeer->second.nUsage -= it->second.nUsage;
+    itPeer->second.setByExpiry.erase(make_pair(it->second.nTimeExpire, hash));
+    if (itPeer->second.setByExpiry.empty())
+        mapOrphanPeerUsage.erase(itPeer);
+    OrphanExpirySlot(it->second.nTimeExpire).erase(hash);
     mapOrphanTransactions.erase(it);
     return 1;
 }
 
 void EraseOrphansFor(NodeId peer)
 {
+    auto itPeer = mapOrphanPeerUsage.find(peer);
+    if (itPeer == mapOrphanPeerUsage.end())
+        return;
+    // Copy the hashes out, the peer entry goes away together with its last orphan
+    vector<uint256> vErase;
+    vErase.reserve(itPeer->second.setByExpiry.size());
+    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& entry, itPeer->second.setByExpiry)
+        vErase.push_back(entry.second);
     int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            nErased += EraseOrphanTx(maybeErase->second.tx.GetHash());
-        }
-    }
+    BOOST_FOREACH(const uint256& hash, vErase)
+        nErased += EraseOrphanTx(hash);
     if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxPeerUsage) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     unsigned int nEvicted = 0;
-    static int64_t nNextSweep;
     int64_t nNow = GetTime();
-    if (nNextSweep <= nNow) {
-        // Sweep out expired orphan pool entries:
+    int64_t nSlotNow = nNow / ORPHAN_TX_EXPIRE_INTERVAL;
+    {
+        // Sweep out expired orphan pool entries, visiting each wheel slot that
+        // became due since the last sweep (at most one full turn of the wheel):
         int nErased = 0;
-        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
-        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-        while (iter != mapOrphanTransactions.end())
-        {
-            map<uint256, COrphanTx>::iterator maybeErase = iter++;
-            if (maybeErase->second.nTimeExpire <= nNow) {
-                nErased += EraseOrphanTx(maybeErase->second.tx.GetHash());
-            } else {
-                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+        int64_t nSlot = std::max(std::min(nOrphanExpirySlot, nSlotNow), nSlotNow - (int64_t)vOrphanExpiryWheel.size() + 1);
+        for (; nSlot <= nSlotNow; nSlot++) {
+            set<uint256>& slot = vOrphanExpiryWheel[nSlot % vOrphanExpiryWheel.size()];
+            set<uint256>::iterator iter = slot.begin();
+            while (iter != slot.end())
+            {
+                const uint256 hash = *iter++; // increment to avoid iterator becoming invalid
+                map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+                assert(it != mapOrphanTransactions.end());
+                if (it->second.nTimeExpire <= nNow)
+                    nErased += EraseOrphanTx(hash);
             }
         }
-        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
-        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        nOrphanExpirySlot = nSlotNow;
         if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
     }
+    // Keep every peer within its memory quota, dropping its oldest orphans first:
+    for (auto itPeer = mapOrphanPeerUsage.begin(); itPeer != mapOrphanPeerUsage.end(); ) {
+        COrphanPeerUsage& peerUsage = (itPeer++)->second; // increment to avoid iterator becoming invalid
+        while (peerUsage.nUsage > nMaxPeerUsage) {
+            // Erasing the peer's last orphan also erases peerUsage
+            bool fLast = peerUsage.setByExpiry.size() == 1;
+            EraseOrphanTx(peerUsage.setByExpiry.begin()->second);
+            ++nEvicted;
+            if (fLast)
+                break;
+        }
+    }
     while (mapOrphanTransactions.size() > nMaxOrphans)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        // Evict the oldest orphan of the peer using the most orphan memory, so
+        // that one peer flooding us cannot push out everyone else's orphans:
+        auto itHeaviest = mapOrphanPeerUsage.begin();
+        for (auto itPeer = mapOrphanPeerUsage.begin(); itPeer != mapOrphanPeerUsage.end(); ++itPeer) {
+            if (itPeer->second.nUsage > itHeaviest->second.nUsage)
+                itHeaviest = itPeer;
+        }
+        EraseOrphanTx(itHeaviest->second.setByExpiry.begin()->second);
         ++nEvicted;
     }
     return nEvicted;
@@ -1546,6 +1695,9 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         }
     }
 
+    if (&pool == &mempool)
+        txRelayOrder.Add(hash);
+
     SyncWithWallets(tx, NULL);
 
     return true;
@@ -1874,7 +2026,7 @@ void static InvalidBlockFound(CBlockIndex *pindex, const CValidationState &state
     }
     if (!state.CorruptionPossible()) {
         pindex->nStatus |= BLOCK_FAILED_VALID;
-        setDirtyBlockIndex.insert(pindex);
+        MarkBlockIndexDirty(pindex);
         setBlockIndexCandidates.erase(pindex);
         InvalidChainFound(pindex);
     }
@@ -2243,6 +2395,78 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+/**
+ * Closure hashing a run of block headers and checking their proof of work,
+ * so a headers message needs neither once it is accepted under cs_main.
+ */
+class CBlockHeaderCheck
+{
+private:
+    const CBlockHeader* pheaders;
+    uint256* phashes;
+    unsigned char* pfValidPoW;
+    size_t nCount;
+    const Consensus::Params* pparams;
+
+public:
+    CBlockHeaderCheck() : pheaders(NULL), phashes(NULL), pfValidPoW(NULL), nCount(0), pparams(NULL) {}
+    CBlockHeaderCheck(const CBlockHeader* pheadersIn, uint256* phashesIn, unsigned char* pfValidPoWIn, size_t nCountIn, const Consensus::Params& params) :
+        pheaders(pheadersIn), phashes(phashesIn), pfValidPoW(pfValidPoWIn), nCount(nCountIn), pparams(&params) {}
+
+    bool operator()()
+    {
+        for (size_t i = 0; i < nCount; i++) {
+            phashes[i] = pheaders[i].GetHash();
+            pfValidPoW[i] = CheckProofOfWork(phashes[i], pheaders[i].nBits, *pparams);
+        }
+        return true;
+    }
+
+    void swap(CBlockHeaderCheck& check)
+    {
+        std::swap(pheaders, check.pheaders);
+        std::swap(phashes, check.phashes);
+        std::swap(pfValidPoW, check.pfValidPoW);
+        std::swap(nCount, check.nCount);
+        std::swap(pparams, check.pparams);
+    }
+};
+
+//! Headers hashed by one CBlockHeaderCheck
+static const size_t HEADER_CHECK_BATCH = 100;
+
+static CCheckQueue<CBlockHeaderCheck> headercheckqueue(1);
+
+void ThreadHeaderCheck() {
+    RenameThread("bitcoin-headerch");
+    headercheckqueue.Thread();
+}
+
+/**
+ * Hash a batch of headers and check their proof of work, without cs_main and
+ * on the script check threads if there are any.  vfValidPoW tells which
+ * headers passed.  Only to be called from the message handler thread.
+ */
+static void PreCheckBlockHeaders(const std::vector<CBlockHeader>& headers, std::vector<uint256>& vHashes, std::vector<unsigned char>& vfValidPoW, const Consensus::Params& params)
+{
+    vHashes.resize(headers.size());
+    vfValidPoW.resize(headers.size());
+    std::vector<CBlockHeaderCheck> vChecks;
+    for (size_t nStart = 0; nStart < headers.size(); nStart += HEADER_CHECK_BATCH) {
+        size_t nCount = std::min(HEADER_CHECK_BATCH, headers.size() - nStart);
+        vChecks.push_back(CBlockHeaderCheck(&headers[nStart], &vHashes[nStart], &vfValidPoW[nStart], nCount, params));
+    }
+
+    if (nScriptCheckThreads == 0 || vChecks.size() <= 1) {
+        BOOST_FOREACH(CBlockHeaderCheck& check, vChecks)
+            check();
+        return;
+    }
+    CCheckQueueControl<CBlockHeaderCheck> control(&headercheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -2329,6 +2553,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     }
 
     int64_t nTime1 = GetTimeMicros(); nTimeCheck += nTime1 - nTimeStart;
+    ObserveConnectStage(CONNECT_CHECK, nTime1 - nTimeStart);
     LogPrint("bench", "    - Sanity checks: %.2fms [%.2fs]\n", 0.001 * (nTime1 - nTimeStart), nTimeCheck * 0.000001);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
@@ -2395,6 +2620,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     }
 
     int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
+    ObserveConnectStage(CONNECT_FORKS, nTime2 - nTime1);
     LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), nTimeForks * 0.000001);
 
     CBlockUndo blockundo;
@@ -2481,6 +2707,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
+    ObserveConnectStage(CONNECT_TRANSACTIONS, nTime3 - nTime2);
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTime2), 0.001 * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * 0.000001);
 
     CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, chainparams.GetConsensus());
@@ -2493,6 +2720,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (!control.Wait())
         return state.DoS(100, false);
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
+    ObserveConnectStage(CONNECT_VERIFY, nTime4 - nTime2);
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
 
     if (fJustCheck)
@@ -2514,7 +2742,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
 
         pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
-        setDirtyBlockIndex.insert(pindex);
+        MarkBlockIndexDirty(pindex);
     }
 
     if (fTxIndex)
@@ -2525,6 +2753,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     view.SetBestBlock(pindex->GetBlockHash());
 
     int64_t nTime5 = GetTimeMicros(); nTimeIndex += nTime5 - nTime4;
+    ObserveConnectStage(CONNECT_INDEX, nTime5 - nTime4);
     LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime5 - nTime4), nTimeIndex * 0.000001);
 
     // Watch for changes to the previous coinbase transaction.
@@ -2542,6 +2771,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     }
 
     int64_t nTime6 = GetTimeMicros(); nTimeCallbacks += nTime6 - nTime5;
+    ObserveConnectStage(CONNECT_CALLBACKS, nTime6 - nTime5);
     LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime6 - nTime5), nTimeCallbacks * 0.000001);
 
     return true;
@@ -2554,6 +2784,23 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+/** Block index entries written since the last snapshot, counting an entry once per write */
+static int64_t nBlockIndexChanges = 0;
+
+/** Write a snapshot of the whole block index, which must have been flushed */
+static void WriteBlockIndexSnapshot()
+{
+    int64_t nStart = GetTimeMillis();
+    std::vector<const CBlockIndex*> vIndex;
+    vIndex.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+        vIndex.push_back(item.second);
+    if (pblocktree->WriteBlockIndexSnapshot(vIndex))
+        LogPrintf("Wrote block index snapshot of %u entries (%dms)\n", vIndex.size(), GetTimeMillis() - nStart);
+    // On failure too, so it is not retried on every flush
+    nBlockIndexChanges = 0;
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed depending on the mode we're called with
@@ -2626,6 +2873,12 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
             if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
                 return AbortNode(state, "Files to write to block index database");
             }
+            nBlockIndexChanges += vBlocks.size();
+        }
+        // Renew the block index snapshot now and then, and at shutdown for a fast restart
+        if (nBlockIndexSnapshotInterval > 0 && nBlockIndexChanges > 0 &&
+            (nBlockIndexChanges >= nBlockIndexSnapshotInterval || (mode == FLUSH_STATE_ALWAYS && ShutdownRequested()))) {
+            WriteBlockIndexSnapshot();
         }
         // Finally remove any pruned files
         if (fFlushForPrune)
@@ -2806,6 +3059,7 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
+    ObserveConnectStage(CONNECT_READ, nTime2 - nTime1);
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
@@ -2823,11 +3077,13 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         assert(view.Flush());
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
+    ObserveConnectStage(CONNECT_FLUSH, nTime4 - nTime3);
     LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     int64_t nTime5 = GetTimeMicros(); nTimeChainState += nTime5 - nTime4;
+    ObserveConnectStage(CONNECT_CHAINSTATE, nTime5 - nTime4);
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
     // Remove conflicting transactions from the mempool.;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
@@ -2838,6 +3094,8 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         txChanged.push_back(std::make_tuple(pblock->vtx[i], pindexNew, i));
 
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
+    ObserveConnectStage(CONNECT_POSTPROCESS, nTime6 - nTime5);
+    ObserveConnectStage(CONNECT_TOTAL, nTime6 - nTime1);
     LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, nTimePostConnect * 0.000001);
     LogPrint("bench", "- Connect block: %.2fms [%.2fs]\n", (nTime6 - nTime1) * 0.001, nTimeTotal * 0.000001);
     return true;
@@ -2879,6 +3137,7 @@ static CBlockIndex* FindMostWorkChain() {
                 CBlockIndex *pindexFailed = pindexNew;
                 // Remove the entire chain from the set.
                 while (pindexTest != pindexFailed) {
+                    MarkBlockIndexChanged(pindexFailed);
                     if (fFailedChain) {
                         pindexFailed->nStatus |= BLOCK_FAILED_CHILD;
                     } else if (fMissingData) {
@@ -3121,13 +3380,13 @@ bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, C
 
     // Mark the block itself as invalid.
     pindex->nStatus |= BLOCK_FAILED_VALID;
-    setDirtyBlockIndex.insert(pindex);
+    MarkBlockIndexDirty(pindex);
     setBlockIndexCandidates.erase(pindex);
 
     while (chainActive.Contains(pindex)) {
         CBlockIndex *pindexWalk = chainActive.Tip();
         pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
-        setDirtyBlockIndex.insert(pindexWalk);
+        MarkBlockIndexDirty(pindexWalk);
         setBlockIndexCandidates.erase(pindexWalk);
         // ActivateBestChain considers blocks already in chainActive
         // unconditionally valid already, so force disconnect away from it.
@@ -3164,7 +3423,7 @@ bool ResetBlockFailureFlags(CBlockIndex *pindex) {
     while (it != mapBlockIndex.end()) {
         if (!it->second->IsValid() && it->second->GetAncestor(nHeight) == pindex) {
             it->second->nStatus &= ~BLOCK_FAILED_MASK;
-            setDirtyBlockIndex.insert(it->second);
+            MarkBlockIndexDirty(it->second);
             if (it->second->IsValid(BLOCK_VALID_TRANSACTIONS) && it->second->nChainTx && setBlockIndexCandidates.value_comp()(chainActive.Tip(), it->second)) {
                 setBlockIndexCandidates.insert(it->second);
             }
@@ -3180,24 +3439,22 @@ bool ResetBlockFailureFlags(CBlockIndex *pindex) {
     while (pindex != NULL) {
         if (pindex->nStatus & BLOCK_FAILED_MASK) {
             pindex->nStatus &= ~BLOCK_FAILED_MASK;
-            setDirtyBlockIndex.insert(pindex);
+            MarkBlockIndexDirty(pindex);
         }
         pindex = pindex->pprev;
     }
     return true;
 }
 
-CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block, const uint256& hash)
 {
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator it = mapBlockIndex.find(hash);
     if (it != mapBlockIndex.end())
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.New(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -3216,7 +3473,7 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
         pindexBestHeader = pindexNew;
 
-    setDirtyBlockIndex.insert(pindexNew);
+    MarkBlockIndexDirty(pindexNew);
 
     return pindexNew;
 }
@@ -3234,7 +3491,7 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
         pindexNew->nStatus |= BLOCK_OPT_WITNESS;
     }
     pindexNew->RaiseValidity(BLOCK_VALID_TRANSACTIONS);
-    setDirtyBlockIndex.insert(pindexNew);
+    MarkBlockIndexDirty(pindexNew);
 
     if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
         // If pindexNew is the genesis block or all parents are BLOCK_VALID_TRANSACTIONS.
@@ -3246,6 +3503,7 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
             CBlockIndex *pindex = queue.front();
             queue.pop_front();
             pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            MarkBlockIndexChanged(pindex);
             {
                 LOCK(cs_nBlockSequenceId);
                 pindex->nSequenceId = nBlockSequenceId++;
@@ -3616,11 +3874,11 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, const Co
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+/** Accept a header whose hash is known, and whose proof of work was checked already unless fCheckPOW */
+static bool AcceptBlockHeader(const CBlockHeader& block, const uint256& hash, bool fCheckPOW, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = NULL;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
@@ -3635,7 +3893,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), fCheckPOW))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3655,7 +3913,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
     }
     if (pindex == NULL)
-        pindex = AddToBlockIndex(block);
+        pindex = AddToBlockIndex(block, hash);
 
     if (ppindex)
         *ppindex = pindex;
@@ -3663,6 +3921,11 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
     return true;
 }
 
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+{
+    return AcceptBlockHeader(block, block.GetHash(), true, state, chainparams, ppindex);
+}
+
 /** Store block on disk. If dbp is non-NULL, the file is known to already reside on disk */
 static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
 {
@@ -3701,7 +3964,7 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
         !ContextualCheckBlock(block, state, chainparams.GetConsensus(), pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
-            setDirtyBlockIndex.insert(pindex);
+            MarkBlockIndexDirty(pindex);
         }
         return error("%s: %s", __func__, FormatStateMessage(state));
     }
@@ -3810,7 +4073,7 @@ void PruneOneBlockFile(const int fileNumber)
             pindex->nFile = 0;
             pindex->nDataPos = 0;
             pindex->nUndoPos = 0;
-            setDirtyBlockIndex.insert(pindex);
+            MarkBlockIndexDirty(pindex);
 
             // Prune from mapBlocksUnlinked -- any block we prune would have
             // to be downloaded again in order to consider its chain, at which
@@ -3948,9 +4211,7 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error(std::string(__func__) + ": new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.New();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -3960,8 +4221,18 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
-        return false;
+    int64_t nStart = GetTimeMillis();
+    size_t nChanged = 0;
+    if (pblocktree->LoadBlockIndexSnapshot(InsertBlockIndex, nChanged)) {
+        LogPrintf("%s: loaded block index snapshot and %u entries written since (%dms)\n", __func__, nChanged, GetTimeMillis() - nStart);
+        nBlockIndexChanges = nChanged;
+    } else {
+        if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+            return false;
+        LogPrintf("%s: loaded block index database (%dms)\n", __func__, GetTimeMillis() - nStart);
+        // Everything counts toward the first snapshot
+        nBlockIndexChanges = mapBlockIndex.size();
+    }
 
     boost::this_thread::interruption_point();
 
@@ -4227,7 +4498,7 @@ bool RewindBlockIndex(const CChainParams& params)
             pindexIter->nChainTx = 0;
             pindexIter->nSequenceId = 0;
             // Make sure it gets written.
-            setDirtyBlockIndex.insert(pindexIter);
+            MarkBlockIndexDirty(pindexIter);
             // Update indexes
             setBlockIndexCandidates.erase(pindexIter);
             std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> ret = mapBlocksUnlinked.equal_range(pindexIter->pprev);
@@ -4264,6 +4535,10 @@ void UnloadBlockIndex()
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
+    mapOrphanPeerUsage.clear();
+    BOOST_FOREACH(set<uint256>& slot, vOrphanExpiryWheel)
+        slot.clear();
+    nOrphanExpirySlot = 0;
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -4273,6 +4548,8 @@ void UnloadBlockIndex()
     mapBlocksInFlight.clear();
     nPreferredDownload = 0;
     setDirtyBlockIndex.clear();
+    setBlockIndexChanged.clear();
+    nBlockIndexChecks = 0;
     setDirtyFileInfo.clear();
     mapNodeState.clear();
     recentRejects.reset(NULL);
@@ -4281,13 +4558,18 @@ void UnloadBlockIndex()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
+    nBlockIndexChanges = 0;
     fHavePruned = false;
 }
 
+size_t BlockIndexDynamicMemoryUsage()
+{
+    LOCK(cs_main);
+    return mapBlockIndex.DynamicMemoryUsage() + blockIndexArena.DynamicMemoryUsage();
+}
+
 bool LoadBlockIndex()
 {
     // Load block index from databases
@@ -4324,7 +4606,7 @@ bool InitBlockIndex(const CChainParams& chainparams)
                 return error("LoadBlockIndex(): FindBlockPos failed");
             if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart()))
                 return error("LoadBlockIndex(): writing genesis block to disk failed");
-            CBlockIndex *pindex = AddToBlockIndex(block);
+            CBlockIndex *pindex = AddToBlockIndex(block, block.GetHash());
             if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
                 return error("LoadBlockIndex(): genesis block not accepted");
             // Force a chainstate write so that when we VerifyDB in a moment, it doesn't check stale data
@@ -4452,22 +4734,89 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     return nLoaded > 0;
 }
 
-void static CheckBlockIndex(const Consensus::Params& consensusParams)
+/** Whether pindex or one of its parents off the active chain failed validation */
+static bool HasInvalidAncestor(const CBlockIndex* pindex)
 {
-    if (!fCheckBlockIndex) {
-        return;
+    for (; pindex != NULL && !chainActive.Contains(pindex); pindex = pindex->pprev) {
+        if (pindex->nStatus & BLOCK_FAILED_VALID)
+            return true;
     }
+    return false;
+}
 
-    LOCK(cs_main);
+/**
+ * The checks of CheckBlockIndexTree on the entries in setBlockIndexChanged,
+ * in a form relating each entry only to its parent, or walking back no
+ * further than the active chain.  Entries that depend on a changed parent
+ * without having changed themselves are left to the next full walk, as are
+ * the checks that need the whole ancestry of pruned entries.
+ */
+static void CheckBlockIndexChanged(const Consensus::Params& consensusParams)
+{
+    setBlockIndexChanged.insert(chainActive.Tip());
+    BOOST_FOREACH(CBlockIndex* pindex, setBlockIndexChanged) {
+        const CBlockIndex* pprev = pindex->pprev;
+        BlockMap::const_iterator it = mapBlockIndex.find(pindex->GetBlockHash());
+        assert(it != mapBlockIndex.end() && it->second == pindex);
+        if (pprev == NULL) {
+            assert(pindex->GetBlockHash() == consensusParams.hashGenesisBlock);
+            assert(pindex == chainActive.Genesis());
+            assert(pindex->nHeight == 0);
+        } else {
+            assert(pindex->nHeight == pprev->nHeight + 1);
+            assert(pindex->nChainWork >= pprev->nChainWork);
+            assert((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TREE);
+            // CHAIN and SCRIPTS valid imply the same of all parents but the genesis block
+            if (pprev->pprev != NULL && (pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_CHAIN) assert((pprev->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_CHAIN);
+            if (pprev->pprev != NULL && (pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_SCRIPTS) assert((pprev->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_SCRIPTS);
+        }
+        assert(pindex->nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < pindex->nHeight)));
+        if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0);
+        if (!fHavePruned) {
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+        } else {
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
+        assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
+        // nChainTx is set once this block and all its parents have been processed.
+        assert((pindex->nChainTx != 0) == (pindex->nTx > 0 && (pprev == NULL || pprev->nChainTx != 0)));
+        if (pindex->nStatus & BLOCK_FAILED_MASK) assert(HasInvalidAncestor(pindex));
+
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindex->nChainTx != 0) {
+            // Without pruning, having processed all parents means having all their data.
+            if ((!fHavePruned || pindex == chainActive.Tip()) && !HasInvalidAncestor(pindex)) {
+                assert(setBlockIndexCandidates.count(pindex));
+            }
+        } else {
+            assert(setBlockIndexCandidates.count(pindex) == 0);
+        }
 
-    // During a reindex, we read the genesis block and call CheckBlockIndex before ActivateBestChain,
-    // so we have the genesis block in mapBlockIndex but no active chain.  (A few of the tests when
-    // iterating the block tree require that chainActive has been initialized.)
-    if (chainActive.Height() < 0) {
-        assert(mapBlockIndex.size() <= 1);
-        return;
+        bool foundInUnlinked = false;
+        std::pair<std::multimap<CBlockIndex*,CBlockIndex*>::iterator,std::multimap<CBlockIndex*,CBlockIndex*>::iterator> rangeUnlinked = mapBlocksUnlinked.equal_range(pindex->pprev);
+        for (; rangeUnlinked.first != rangeUnlinked.second; rangeUnlinked.first++) {
+            if (rangeUnlinked.first->second == pindex) {
+                foundInUnlinked = true;
+                break;
+            }
+        }
+        if (pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindex->nChainTx == 0 && !HasInvalidAncestor(pindex)) {
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) assert(!foundInUnlinked);
+        if (!fHavePruned && pindex->nChainTx != 0) assert(!foundInUnlinked);
+    }
+
+    // The tip moving on can leave candidates behind it, whether they changed or not.
+    BOOST_FOREACH(CBlockIndex* pindex, setBlockIndexCandidates) {
+        assert(!CBlockIndexWorkComparator()(pindex, chainActive.Tip()));
+        assert(pindex->nChainTx != 0);
     }
+}
 
+/** Walk the whole block tree, checking every entry against its ancestry */
+static void CheckBlockIndexTree(const Consensus::Params& consensusParams)
+{
     // Build forward-pointing map of the entire block tree.
     std::multimap<CBlockIndex*,CBlockIndex*> forward;
     for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); it++) {
@@ -4636,6 +4985,32 @@ void static CheckBlockIndex(const Consensus::Params& consensusParams)
     assert(nNodes == forward.size());
 }
 
+void static CheckBlockIndex(const Consensus::Params& consensusParams)
+{
+    if (!fCheckBlockIndex) {
+        return;
+    }
+
+    LOCK(cs_main);
+
+    // During a reindex, we read the genesis block and call CheckBlockIndex before ActivateBestChain,
+    // so we have the genesis block in mapBlockIndex but no active chain.  (A few of the tests when
+    // iterating the block tree require that chainActive has been initialized.)
+    if (chainActive.Height() < 0) {
+        assert(mapBlockIndex.size() <= 1);
+        return;
+    }
+
+    // Walking the whole tree after every block makes long chains quadratic, so
+    // only do it every nCheckBlockIndexSweep checks, starting with the first.
+    if (nBlockIndexChecks++ % nCheckBlockIndexSweep == 0) {
+        CheckBlockIndexTree(consensusParams);
+    } else {
+        CheckBlockIndexChanged(consensusParams);
+    }
+    setBlockIndexChanged.clear();
+}
+
 std::string GetWarnings(const std::string& strFor)
 {
     string strStatusBar;
@@ -4779,45 +5154,56 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_FILTERED_BLOCK)
+                    // If a peer is asking for old blocks, we're almost guaranteed
+                    // they wont have a useful mempool to match against a compact block,
+                    // and we don't feel like constructing the object for them, so
+                    // instead we respond with the full, non-compact block.
+                    bool fCompact = inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight >= chainActive.Height() - 10;
+                    const char* pszCommand = fCompact ? NetMsgType::CMPCTBLOCK : NetMsgType::BLOCK;
+                    int nSendVersion = pfrom->GetSendVersion() | (inv.type == MSG_WITNESS_BLOCK ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS);
+
+                    // Full and compact blocks are sent as they were serialized
+                    // for the last peer that asked for the same, if they were
+                    CSerializedNetMsgRef msg;
+                    if (inv.type != MSG_FILTERED_BLOCK)
+                        msg = blockMsgCache.Get(inv.hash, pszCommand, nSendVersion);
+                    if (msg)
+                        pfrom->PushSerializedMessage(msg);
+                    else
                     {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter)
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                            assert(!"cannot load block from disk");
+                        if (inv.type == MSG_FILTERED_BLOCK)
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
+                            LOCK(pfrom->cs_filter);
+                            if (pfrom->pfilter)
+                            {
+                                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                                pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
+                                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                                // This avoids hurting performance by pointlessly requiring a round-trip
+                                // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                                // they must either disconnect and retry or request the full block.
+                                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                                // however we MUST always provide at least what the remote peer needs
+                                typedef std::pair<unsigned int, uint256> PairType;
+                                BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+                                    pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
+                            }
+                            // else
+                                // no response
+                        }
+                        else
+                        {
+                            if (fCompact)
+                                msg = CNode::MakeMessage(nSendVersion, pszCommand, CBlockHeaderAndShortTxIDs(block));
+                            else
+                                msg = CNode::MakeMessage(nSendVersion, pszCommand, block);
+                            blockMsgCache.Add(inv.hash, nSendVersion, msg);
+                            pfrom->PushSerializedMessage(msg);
                         }
-                        // else
-                            // no response
-                    }
-                    else if (inv.type == MSG_CMPCT_BLOCK)
-                    {
-                        // If a peer is asking for old blocks, we're almost guaranteed
-                        // they wont have a useful mempool to match against a compact block,
-                        // and we don't feel like constructing the object for them, so
-                        // instead we respond with the full, non-compact block.
-                        if (mi->second->nHeight >= chainActive.Height() - 10) {
-                            CBlockHeaderAndShortTxIDs cmpctblock(block);
-                            pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
-                        } else
-                            pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
                     }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
@@ -4837,18 +5223,27 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             {
                 // Send stream from relay memory
                 bool push = false;
+                int nSendVersion = pfrom->GetSendVersion() | (inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0);
+                std::shared_ptr<const CTransaction> tx;
                 auto mi = mapRelay.find(inv.hash);
                 if (mi != mapRelay.end()) {
-                    pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *mi->second);
-                    push = true;
+                    tx = mi->second;
                 } else if (pfrom->timeLastMempoolReq) {
                     auto txinfo = mempool.info(inv.hash);
                     // To protect privacy, do not answer getdata using the mempool when
                     // that TX couldn't have been INVed in reply to a MEMPOOL request.
-                    if (txinfo.tx && txinfo.nTime <= pfrom->timeLastMempoolReq) {
-                        pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *txinfo.tx);
-                        push = true;
+                    if (txinfo.tx && txinfo.nTime <= pfrom->timeLastMempoolReq)
+                        tx = txinfo.tx;
+                }
+                if (tx) {
+                    // A relayed transaction is asked for by most peers, serialize it once
+                    CSerializedNetMsgRef msg = txMsgCache.Get(inv.hash, NetMsgType::TX, nSendVersion, tx.get());
+                    if (!msg) {
+                        msg = CNode::MakeMessage(nSendVersion, NetMsgType::TX, *tx);
+                        txMsgCache.Add(inv.hash, nSendVersion, msg, tx);
                     }
+                    pfrom->PushSerializedMessage(msg);
+                    push = true;
                 }
                 if (!push) {
                     vNotFound.push_back(inv);
@@ -4877,6 +5272,76 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+/** Queue the orphans spending outputs of tx for reconsideration in pnode's message handler turns. */
+void static QueueOrphanWork(CNode* pnode, const CTransaction& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    const uint256& hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        auto itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi)
+            pnode->setOrphanWork.insert((*mi)->first);
+    }
+}
+
+/**
+ * Reconsider at most MAX_ORPHAN_WORK_BATCH queued orphans of pfrom. Accepting an
+ * orphan queues its own children, so long chains are resolved over several
+ * message handler iterations instead of in one go while holding cs_main.
+ */
+void static ProcessOrphanWork(CNode* pfrom) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    set<NodeId> setMisbehaving;
+    unsigned int nProcessed = 0;
+    while (!pfrom->setOrphanWork.empty() && nProcessed < MAX_ORPHAN_WORK_BATCH) {
+        const uint256 orphanHash = *pfrom->setOrphanWork.begin();
+        pfrom->setOrphanWork.erase(pfrom->setOrphanWork.begin());
+
+        auto itOrphan = mapOrphanTransactions.find(orphanHash);
+        if (itOrphan == mapOrphanTransactions.end())
+            continue;
+        ++nProcessed;
+
+        const CTransaction& orphanTx = itOrphan->second.tx;
+        NodeId fromPeer = itOrphan->second.fromPeer;
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (setMisbehaving.count(fromPeer))
+            continue;
+        if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx);
+            QueueOrphanWork(pfrom, orphanTx);
+            EraseOrphanTx(orphanHash);
+        }
+        else if (!fMissingInputs2)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0 && (!stateDummy.CorruptionPossible() || State(fromPeer)->fHaveWitness))
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                setMisbehaving.insert(fromPeer);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            if (!stateDummy.CorruptionPossible()) {
+                assert(recentRejects);
+                recentRejects->insert(orphanHash);
+            }
+            EraseOrphanTx(orphanHash);
+        }
+        mempool.check(pcoinsTip);
+    }
+}
+
 uint32_t GetFetchFlags(CNode* pfrom, CBlockIndex* pprev, const Consensus::Params& chainparams) {
     uint32_t nFetchFlags = 0;
     if (IsWitnessEnabled(pprev, chainparams) && State(pfrom->GetId())->fHaveWitness) {
@@ -5429,8 +5894,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
-        deque<COutPoint> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
@@ -5448,9 +5911,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                vWorkQueue.emplace_back(inv.hash, i);
-            }
 
             pfrom->nLastTXTime = GetTime();
 
@@ -5459,62 +5919,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 tx.GetHash().ToString(),
                 mempool.size(), mempool.DynamicMemoryUsage() / 1000);
 
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
-                        }
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0 && (!state.CorruptionPossible() || State(fromPeer)->fHaveWitness))
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        if (!stateDummy.CorruptionPossible()) {
-                            assert(recentRejects);
-                            recentRejects->insert(orphanHash);
-                        }
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            // Orphans that depended on this one are reconsidered in bounded
+            // batches by ProcessOrphanWork, see ProcessMessages
+            QueueOrphanWork(pfrom, tx);
         }
         else if (fMissingInputs)
         {
@@ -5535,7 +5942,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
                 // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
                 unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+                size_t nMaxOrphanPeerUsage = std::max((int64_t)0, GetArg("-maxorphanpeerkb", DEFAULT_MAX_ORPHAN_PEER_KB)) * 1000;
+                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanPeerUsage);
                 if (nEvicted > 0)
                     LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
             } else {
@@ -5769,6 +6177,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Hash the headers and check their proof of work before taking cs_main
+        std::vector<uint256> vHashes;
+        std::vector<unsigned char> vfValidPoW;
+        PreCheckBlockHeaders(headers, vHashes, vfValidPoW, chainparams.GetConsensus());
+
         {
         LOCK(cs_main);
 
@@ -5791,14 +6204,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             nodestate->nUnconnectingHeaders++;
             pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256());
             LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
-                    headers[0].GetHash().ToString(),
+                    vHashes[0].ToString(),
                     headers[0].hashPrevBlock.ToString(),
                     pindexBestHeader->nHeight,
                     pfrom->id, nodestate->nUnconnectingHeaders);
             // Set hashLastUnknownBlock for this peer, so that if we
             // eventually get the headers - even from a different peer -
             // we can use this peer to download.
-            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+            UpdateBlockAvailability(pfrom->GetId(), vHashes.back());
 
             if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0) {
                 Misbehaving(pfrom->GetId(), 20);
@@ -5807,13 +6220,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
+        for (unsigned int n = 0; n < nCount; n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
+            // Headers failing the proof of work check go through it again, for the error
+            if (!AcceptBlockHeader(header, vHashes[n], !vfValidPoW[n], state, chainparams, &pindexLast)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -6179,6 +6594,14 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    if (!pfrom->setOrphanWork.empty()) {
+        LOCK(cs_main);
+        ProcessOrphanWork(pfrom);
+    }
+
+    // finish resolving orphans before handling the peer's next message
+    if (!pfrom->setOrphanWork.empty()) return fOk;
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom, chainparams.GetConsensus());
 
@@ -6225,19 +6648,18 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, hashed as the data arrived
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
-        if (nChecksum != hdr.nChecksum)
+        if (msg.nDataChecksum != hdr.nChecksum)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
-               SanitizeString(strCommand), nMessageSize, nChecksum, hdr.nChecksum);
+               SanitizeString(strCommand), nMessageSize, msg.nDataChecksum, hdr.nChecksum);
             continue;
         }
 
         // Process message
         bool fRet = false;
+        int64_t nStart = fMetrics ? GetTimeMicros() : 0;
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams);
@@ -6274,6 +6696,8 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        if (fMetrics)
+            GetMessageMetrics().Get(strCommand).Observe(GetTimeMicros() - nStart);
 
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -6282,29 +6706,15 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        for (std::deque<CNetMessage>::iterator itDone = pfrom->vRecvMsg.begin(); itDone != it; ++itDone)
+            itDone->ReleaseBuffer();
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
 
-class CompareInvMempoolOrder
-{
-    CTxMemPool *mp;
-public:
-    CompareInvMempoolOrder(CTxMemPool *mempool)
-    {
-        mp = mempool;
-    }
-
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
-    {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
-    }
-};
-
 bool SendMessages(CNode* pto)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -6507,11 +6917,17 @@ bool SendMessages(CNode* pto)
                     // probably means we're doing an initial-ish-sync or they're slow
                     LogPrint("net", "%s sending header-and-ids %s to peer %d\n", __func__,
                             vHeaders.front().GetHash().ToString(), pto->id);
-                    //TODO: Shouldn't need to reload block from disk, but requires refactor
-                    CBlock block;
-                    assert(ReadBlockFromDisk(block, pBestIndex, consensusParams));
-                    CBlockHeaderAndShortTxIDs cmpctblock(block);
-                    pto->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
+                    // The same compact block goes to every peer announced to this way
+                    int nSendVersion = pto->GetSendVersion() | SERIALIZE_TRANSACTION_NO_WITNESS;
+                    CSerializedNetMsgRef msg = blockMsgCache.Get(pBestIndex->GetBlockHash(), NetMsgType::CMPCTBLOCK, nSendVersion);
+                    if (!msg) {
+                        //TODO: Shouldn't need to reload block from disk, but requires refactor
+                        CBlock block;
+                        assert(ReadBlockFromDisk(block, pBestIndex, consensusParams));
+                        msg = CNode::MakeMessage(nSendVersion, NetMsgType::CMPCTBLOCK, CBlockHeaderAndShortTxIDs(block));
+                        blockMsgCache.Add(pBestIndex->GetBlockHash(), nSendVersion, msg);
+                    }
+                    pto->PushSerializedMessage(msg);
                     state.pindexBestHeaderSent = pBestIndex;
                 } else if (state.fPreferHeaders) {
                     if (vHeaders.size() > 1) {
@@ -6624,29 +7040,28 @@ bool SendMessages(CNode* pto)
 
             // Determine transactions to relay
             if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
-                }
+                // Produce a vector with all candidates for sending.
+                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons,
+                // using the order shared by all peers so the mempool isn't consulted for every peer.
+                txRelayOrder.Update(chainActive.Tip()->GetBlockHash(), nNow);
+                vector<CTxRelayOrder::Entry> vInvTx;
+                txRelayOrder.GetOrdered(pto->setInventoryTxToSend, vInvTx);
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
-                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
                 // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                CTxRelayOrder::Compare compareRelayOrder;
+                std::make_heap(vInvTx.begin(), vInvTx.end(), compareRelayOrder);
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
                 unsigned int nRelayedTransactions = 0;
                 LOCK(pto->cs_filter);
                 while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
                     // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
+                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareRelayOrder);
+                    std::set<uint256>::iterator it = vInvTx.back().second;
                     vInvTx.pop_back();
                     uint256 hash = *it;
                     // Remove it from the to-be-sent set
@@ -6805,10 +7220,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
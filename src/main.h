@@ -11,6 +11,7 @@
 #endif
 
 #include "amount.h"
+#include "blockindexmap.h"
 #include "chain.h"
 #include "coins.h"
 #include "net.h"
@@ -27,8 +28,6 @@
 #include <utility>
 #include <vector>
 
-#include <boost/unordered_map.hpp>
-
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
@@ -57,10 +56,14 @@ static const CAmount HIGH_TX_FEE_PER_KB = 0.01 * COIN;
 static const CAmount HIGH_MAX_TX_FEE = 100 * HIGH_TX_FEE_PER_KB;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphanpeerkb, maximum memory usage of the orphan transactions announced by a single peer */
+static const unsigned int DEFAULT_MAX_ORPHAN_PEER_KB = 1000;
 /** Expiration time for orphan transactions in seconds */
 static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
-/** Minimum time between orphan transactions expire time checks in seconds */
-static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Width in seconds of one slot of the orphan transaction expiration time wheel */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 60;
+/** Maximum number of orphan transactions reconsidered for one peer per message handler iteration */
+static const unsigned int MAX_ORPHAN_WORK_BATCH = 10;
 /** Default for -limitancestorcount, max number of in-mempool ancestors */
 static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
 /** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
@@ -110,6 +113,13 @@ static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
 /** Maximum number of inventory items to send per transmission.
  *  Limits the impact of low-fee transaction floods. */
 static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
+/** Minimum delay in microseconds between rankings of new transactions for the shared
+ *  inventory order. Transactions a peer needs earlier are ranked when it trickles. */
+static const int64_t TX_RELAY_ORDER_INTERVAL = 500000;
+/** Number of block and compact block messages kept for other peers asking for the same block */
+static const unsigned int BLOCK_MSG_CACHE_SIZE = 4;
+/** Number of transaction messages kept for other peers asking for the same transaction */
+static const unsigned int TX_MSG_CACHE_SIZE = 128;
 /** Average delay between feefilter broadcasts in seconds. */
 static const unsigned int AVG_FEEFILTER_BROADCAST_INTERVAL = 10 * 60;
 /** Maximum feefilter broadcast delay after significant change. */
@@ -126,6 +136,10 @@ static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
 /** Default for -permitbaremultisig */
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
+/** Default for -checkblockindexsweep, how often -checkblockindex walks the whole block tree */
+static const int DEFAULT_CHECKBLOCKINDEX_SWEEP = 100;
+/** Default for -blockindexsnapshot, block index entries written before the snapshot is renewed */
+static const int64_t DEFAULT_BLOCK_INDEX_SNAPSHOT_INTERVAL = 50000;
 static const bool DEFAULT_TXINDEX = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 
@@ -143,15 +157,10 @@ static const int MAX_UNCONNECTING_HEADERS = 10;
 
 static const bool DEFAULT_PEERBLOOMFILTERS = true;
 
-struct BlockHasher
-{
-    size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
-};
-
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+typedef CBlockIndexMap BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
@@ -166,7 +175,11 @@ extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
+/** CheckBlockIndex walks the whole tree every this many times, checking changed entries in between */
+extern int nCheckBlockIndexSweep;
 extern bool fCheckpointsEnabled;
+/** Renew the block index snapshot after this many entries were written, 0 if there is none */
+extern int64_t nBlockIndexSnapshotInterval;
 extern size_t nCoinCacheUsage;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
@@ -239,6 +252,8 @@ bool InitBlockIndex(const CChainParams& chainparams);
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/** Memory used by mapBlockIndex and its entries */
+size_t BlockIndexDynamicMemoryUsage();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /**
@@ -249,6 +264,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread hashing received headers, one per script checking thread */
+void ThreadHeaderCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -291,6 +308,8 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune);
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
+/** Append the message processing, block connection and cache metrics in Prometheus text format */
+void WriteValidationMetrics(std::string& strOut);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
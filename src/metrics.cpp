@@ -0,0 +1,104 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "metrics.h"
+
+#include "tinyformat.h"
+
+#include <algorithm>
+
+std::atomic<bool> fMetrics(DEFAULT_METRICS);
+
+//! Upper bounds of the histogram buckets in microseconds
+static const int64_t vBucketBounds[CMetricHistogram::BUCKETS] = {
+    10, 25, 50, 100, 250, 500,
+    1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000,
+    10000000
+};
+
+CMetricHistogram::CMetricHistogram() : nCount(0), nSumMicros(0)
+{
+    for (int i = 0; i < BUCKETS; i++)
+        vBuckets[i] = 0;
+}
+
+void CMetricHistogram::Observe(int64_t nMicros)
+{
+    if (nMicros < 0)
+        nMicros = 0;
+    // Buckets only count their own range, Write adds them up
+    int nBucket = 0;
+    while (nBucket < BUCKETS && nMicros > vBucketBounds[nBucket])
+        nBucket++;
+    if (nBucket < BUCKETS)
+        vBuckets[nBucket].fetch_add(1, std::memory_order_relaxed);
+    nSumMicros.fetch_add(nMicros, std::memory_order_relaxed);
+    nCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CMetricHistogram::Write(std::string& strOut, const std::string& strName, const std::string& strLabels) const
+{
+    uint64_t nCumulative = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        nCumulative += vBuckets[i].load(std::memory_order_relaxed);
+        WriteMetricValue(strOut, strName + "_bucket", strLabels + MetricLabel("le", strprintf("%g", vBucketBounds[i] * 0.000001)), nCumulative);
+    }
+    // Samples recorded while reading may make the total lag the buckets
+    const uint64_t nTotal = std::max(nCumulative, GetCount());
+    WriteMetricValue(strOut, strName + "_bucket", strLabels + MetricLabel("le", "+Inf"), nTotal);
+    WriteMetricValue(strOut, strName + "_sum", strLabels, nSumMicros.load(std::memory_order_relaxed) * 0.000001);
+    WriteMetricValue(strOut, strName + "_count", strLabels, nTotal);
+}
+
+CMetricHistogramSet::CMetricHistogramSet(const std::string& strNameIn, const std::string& strHelpIn, const std::string& strLabelIn, const std::vector<std::string>& vValuesIn) :
+    strName(strNameIn), strHelp(strHelpIn), strLabel(strLabelIn), vValues(vValuesIn)
+{
+    vValues.push_back("other");
+    for (size_t i = 0; i < vValues.size(); i++)
+        mapIndex.insert(std::make_pair(vValues[i], i));
+    vHistograms.reset(new CMetricHistogram[vValues.size()]);
+}
+
+CMetricHistogram& CMetricHistogramSet::Get(const std::string& strValue)
+{
+    std::map<std::string, size_t>::const_iterator it = mapIndex.find(strValue);
+    return vHistograms[it != mapIndex.end() ? it->second : vValues.size() - 1];
+}
+
+void CMetricHistogramSet::Write(std::string& strOut) const
+{
+    WriteMetricHeader(strOut, strName, "histogram", strHelp);
+    for (size_t i = 0; i < vValues.size(); i++)
+        if (vHistograms[i].GetCount() > 0)
+            vHistograms[i].Write(strOut, strName, MetricLabel(strLabel, vValues[i]));
+}
+
+void WriteMetricHeader(std::string& strOut, const std::string& strName, const std::string& strType, const std::string& strHelp)
+{
+    strOut += "# HELP " + strName + " " + strHelp + "\n";
+    strOut += "# TYPE " + strName + " " + strType + "\n";
+}
+
+void WriteMetricValue(std::string& strOut, const std::string& strName, const std::string& strLabels, double dValue)
+{
+    strOut += strName;
+    if (!strLabels.empty())
+        strOut += "{" + strLabels.substr(0, strLabels.size() - 1) + "}";
+    strOut += strprintf(" %.15g\n", dValue);
+}
+
+std::string MetricLabel(const std::string& strName, const std::string& strValue)
+{
+    std::string strEscaped;
+    for (size_t i = 0; i < strValue.size(); i++) {
+        if (strValue[i] == '\\' || strValue[i] == '"')
+            strEscaped += '\\';
+        if (strValue[i] == '\n')
+            strEscaped += "\\n";
+        else
+            strEscaped += strValue[i];
+    }
+    return strName + "=\"" + strEscaped + "\",";
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_METRICS_H
+#define BITCOIN_METRICS_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//! -metrics default
+static const bool DEFAULT_METRICS = false;
+
+/** Whether timings are collected, set once at startup */
+extern std::atomic<bool> fMetrics;
+
+/**
+ * Distribution of durations over fixed buckets, from 10us to 10s.  Recording
+ * is a couple of relaxed atomic increments, so it can be done from any thread
+ * without a lock; a reader may see a sample in one field before the others.
+ */
+class CMetricHistogram
+{
+public:
+    static const int BUCKETS = 19;
+
+    CMetricHistogram();
+
+    void Observe(int64_t nMicros);
+
+    uint64_t GetCount() const { return nCount.load(std::memory_order_relaxed); }
+
+    /** Append the histogram in Prometheus text format, strLabels being "" or a list like `a="b",` */
+    void Write(std::string& strOut, const std::string& strName, const std::string& strLabels) const;
+
+private:
+    std::atomic<uint64_t> vBuckets[BUCKETS];
+    std::atomic<uint64_t> nCount;
+    std::atomic<uint64_t> nSumMicros;
+};
+
+/**
+ * Histograms of one metric, told apart by the value of one label.  The values
+ * are fixed at construction, along with "other" for anything else, so
+ * lookups need no lock.
+ */
+class CMetricHistogramSet
+{
+public:
+    CMetricHistogramSet(const std::string& strNameIn, const std::string& strHelpIn, const std::string& strLabelIn, const std::vector<std::string>& vValuesIn);
+
+    CMetricHistogram& Get(size_t nIndex) { return vHistograms[nIndex]; }
+    CMetricHistogram& Get(const std::string& strValue);
+
+    /** Append the histograms that have samples in Prometheus text format */
+    void Write(std::string& strOut) const;
+
+private:
+    const std::string strName;
+    const std::string strHelp;
+    const std::string strLabel;
+    std::vector<std::string> vValues;
+    std::map<std::string, size_t> mapIndex;
+    std::unique_ptr<CMetricHistogram[]> vHistograms;
+};
+
+/** Append the HELP and TYPE lines of a metric */
+void WriteMetricHeader(std::string& strOut, const std::string& strName, const std::string& strType, const std::string& strHelp);
+/** Append a sample, strLabels being "" or a list like `a="b",` */
+void WriteMetricValue(std::string& strOut, const std::string& strName, const std::string& strLabels, double dValue);
+/** Format a label for WriteMetricValue, escaping its value */
+std::string MetricLabel(const std::string& strName, const std::string& strValue);
+
+#endif // BITCOIN_METRICS_H
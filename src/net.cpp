@@ -16,6 +16,7 @@
 #include "crypto/common.h"
 #include "crypto/sha256.h"
 #include "hash.h"
+#include "metrics.h"
 #include "primitives/transaction.h"
 #include "netbase.h"
 #include "scheduler.h"
@@ -700,6 +701,7 @@ void CNode::copyStats(CNodeStats &stats)
     X(nRecvBytes);
     X(mapRecvBytesPerMsgCmd);
     X(fWhitelisted);
+    X(nProcessingTime);
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -770,6 +772,53 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+static CRecvBufferPool recvBufferPool(MAX_RECV_BUFFER_POOL);
+
+void CRecvBufferPool::Get(size_t nCapacity, CSerializeData& data)
+{
+    // Small buffers are not pooled; allocate exactly what is asked for, so
+    // tiny and empty messages cost no more than their size
+    if (nCapacity < ((size_t)1 << MIN_CLASS)) {
+        CSerializeData().swap(data);
+        data.reserve(nCapacity);
+        return;
+    }
+    int nClass = MIN_CLASS;
+    while (((size_t)1 << nClass) < nCapacity)
+        nClass++;
+    {
+        LOCK(cs);
+        std::map<int, std::vector<CSerializeData> >::iterator it = mapFree.find(nClass);
+        if (it != mapFree.end() && !it->second.empty()) {
+            data.swap(it->second.back());
+            it->second.pop_back();
+            nSize -= data.capacity();
+            return;
+        }
+    }
+    CSerializeData().swap(data);
+    data.reserve((size_t)1 << nClass);
+}
+
+void CRecvBufferPool::Put(CSerializeData& data)
+{
+    size_t nCapacity = data.capacity();
+    if (nCapacity < ((size_t)1 << MIN_CLASS))
+        return;
+    int nClass = MIN_CLASS;
+    while (((size_t)1 << (nClass + 1)) <= nCapacity)
+        nClass++;
+    data.clear();
+
+    LOCK(cs);
+    if (nSize + nCapacity > nMaxSize)
+        return;
+    std::vector<CSerializeData>& vFree = mapFree[nClass];
+    vFree.push_back(CSerializeData());
+    vFree.back().swap(data);
+    nSize += nCapacity;
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -798,6 +847,17 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // Size the buffer for the whole message if it is small; larger ones
+    // grow as their data arrives, so a header alone can't make us reserve
+    // megabytes
+    if (hdr.nMessageSize <= MAX_PROTOCOL_MESSAGE_LENGTH) {
+        CSerializeData data;
+        recvBufferPool.Get(std::min(hdr.nMessageSize, MAX_RECV_PREALLOC), data);
+        vRecv.SwapBuffer(data);
+    }
+    if (hdr.nMessageSize == 0)
+        FinishData();
+
     return nCopy;
 }
 
@@ -806,45 +866,81 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+    if (vRecv.capacity() < nDataPos + nCopy) {
+        // Move to a buffer twice as large, up to the total message size
+        CSerializeData data;
+        recvBufferPool.Get(std::min((size_t)hdr.nMessageSize, std::max((size_t)nDataPos + nCopy, 2 * vRecv.capacity())), data);
+        data.insert(data.end(), vRecv.begin(), vRecv.end());
+        vRecv.SwapBuffer(data);
+        recvBufferPool.Put(data);
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // Appending doesn't zero the buffer first, unlike resizing it would
+    vRecv.write(pch, nCopy);
+    hasher.Write((const unsigned char*)pch, nCopy);
     nDataPos += nCopy;
+    if (nDataPos == hdr.nMessageSize)
+        FinishData();
 
     return nCopy;
 }
 
+void CNetMessage::FinishData()
+{
+    uint256 hash;
+    hasher.Finalize(hash.begin());
+    nDataChecksum = ReadLE32(hash.begin());
+}
 
-
-
-
-
-
-
+void CNetMessage::ReleaseBuffer()
+{
+    CSerializeData data;
+    vRecv.SwapBuffer(data);
+    recvBufferPool.Put(data);
+}
 
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedNetMsgRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->data.size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = (*it)->data;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand the socket as many queued messages as it takes in one call,
+        // straight from the (possibly shared) message buffers
+        struct iovec iov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        for (std::deque<CSerializedNetMsgRef>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++itIov, ++nIov) {
+            const CSerializeData &data = (*itIov)->data;
+            size_t nOffset = nIov == 0 ? pnode->nSendOffset : 0;
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Step over the messages that were sent completely
+            size_t nSent = nBytes;
+            while (it != pnode->vSendMsg.end() && nSent >= (*it)->data.size() - pnode->nSendOffset) {
+                nSent -= (*it)->data.size() - pnode->nSendOffset;
+                pnode->nSendSize -= (*it)->data.size();
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
                 it++;
-            } else {
+            }
+            if (nSent > 0) {
                 // could not send full message; stop sending more
+                pnode->nSendOffset += nSent;
                 break;
             }
         } else {
@@ -1870,6 +1966,7 @@ void ThreadMessageHandler()
         {
             if (pnode->fDisconnect)
                 continue;
+            int64_t nStart = fMetrics ? GetTimeMicros() : 0;
 
             // Receive messages
             {
@@ -1881,7 +1978,7 @@ void ThreadMessageHandler()
 
                     if (pnode->nSendSize < SendBufferSize())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        if (!pnode->vRecvGetData.empty() || !pnode->setOrphanWork.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
                             fSleep = false;
                         }
@@ -1896,6 +1993,8 @@ void ThreadMessageHandler()
                 if (lockSend)
                     GetNodeSignals().SendMessages(pnode);
             }
+            if (fMetrics)
+                pnode->nProcessingTime += GetTimeMicros() - nStart;
             boost::this_thread::interruption_point();
         }
 
@@ -2512,6 +2611,7 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     timeLastMempoolReq = 0;
     nLastBlockTime = 0;
     nLastTXTime = 0;
+    nProcessingTime = 0;
     nPingNonceSent = 0;
     nPingUsecStart = 0;
     nPingUsecTime = 0;
@@ -2590,7 +2690,7 @@ void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSen
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
-    ssSend << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+    WriteMessageHeader(ssSend, pszCommand);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
 
@@ -2622,31 +2722,77 @@ void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
 
-    //log total amount of bytes per command
-    mapSendBytesPerMsgCmd[std::string(pszCommand)] += nSize + CMessageHeader::HEADER_SIZE;
+    CSerializedNetMsgRef msg = FinishMessage(ssSend, pszCommand);
+    LogPrint("net", "(%d bytes) peer=%d\n", msg->data.size() - CMessageHeader::HEADER_SIZE, id);
+    QueueMessage(msg);
+
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+void CNode::PushSerializedMessage(const CSerializedNetMsgRef& msg)
+{
+    LOCK(cs_vSend);
+    LogPrint("net", "sending: %s (%d bytes) peer=%d\n", SanitizeString(msg->command), msg->data.size() - CMessageHeader::HEADER_SIZE, id);
+    QueueMessage(msg);
+}
+
+void CNode::WriteMessageHeader(CDataStream& ss, const char* pszCommand)
+{
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+}
+
+CSerializedNetMsgRef CNode::FinishMessage(CDataStream& ss, const char* pszCommand)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
 
     // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
     unsigned int nChecksum = 0;
     memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    std::shared_ptr<CSerializedNetMsg> msg = std::make_shared<CSerializedNetMsg>();
+    msg->command = pszCommand;
+    ss.GetAndClear(msg->data);
+    return msg;
+}
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+// requires LOCK(cs_vSend)
+void CNode::QueueMessage(const CSerializedNetMsgRef& msg)
+{
+    //log total amount of bytes per command
+    mapSendBytesPerMsgCmd[msg->command] += msg->data.size();
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    std::deque<CSerializedNetMsgRef>::iterator it = vSendMsg.insert(vSendMsg.end(), msg);
+    nSendSize += msg->data.size();
 
     // If write queue empty, attempt "optimistic write"
     if (it == vSendMsg.begin())
         SocketSendData(this);
+}
 
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+CSerializedNetMsgRef CNetMsgCache::Get(const uint256& hash, const char* pszCommand, int nVersion, const void* pObject) const
+{
+    for (std::deque<Entry>::const_reverse_iterator it = vEntries.rbegin(); it != vEntries.rend(); ++it) {
+        if (it->hash == hash && it->nVersion == nVersion && it->pObject.get() == pObject && it->msg->command == pszCommand) {
+            nHits++;
+            return it->msg;
+        }
+    }
+    nMisses++;
+    return CSerializedNetMsgRef();
+}
+
+void CNetMsgCache::Add(const uint256& hash, int nVersion, const CSerializedNetMsgRef& msg, const std::shared_ptr<const void>& pObject)
+{
+    Entry entry = { hash, nVersion, msg, pObject };
+    vEntries.push_back(entry);
+    while (vEntries.size() > nMaxEntries)
+        vEntries.pop_front();
 }
 
 //
@@ -9,6 +9,7 @@
 #include "amount.h"
 #include "bloom.h"
 #include "compat.h"
+#include "hash.h"
 #include "limitedmap.h"
 #include "netaddress.h"
 #include "protocol.h"
@@ -19,7 +20,10 @@
 
 #include <atomic>
 #include <deque>
+#include <map>
+#include <memory>
 #include <stdint.h>
+#include <vector>
 
 #ifndef WIN32
 #include <arpa/inet.h>
@@ -49,6 +53,10 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 4 MB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 4 * 1000 * 1000;
+/** Messages up to this size get a receive buffer for all of their data once their header arrives */
+static const unsigned int MAX_RECV_PREALLOC = 256 * 1024;
+/** The most bytes of receive buffers kept for reuse */
+static const size_t MAX_RECV_BUFFER_POOL = 16 * 1024 * 1024;
 /** Maximum length of strSubVer in `version` message */
 static const unsigned int MAX_SUBVERSION_LENGTH = 256;
 /** -listen default */
@@ -69,6 +77,8 @@ static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
 /** Default for blocks only*/
 static const bool DEFAULT_BLOCKSONLY = false;
+/** The maximum number of queued messages handed to the socket in one call */
+static const int MAX_SEND_IOVECS = 64;
 
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
@@ -208,6 +218,7 @@ public:
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
     bool fWhitelisted;
+    int64_t nProcessingTime;
     double dPingTime;
     double dPingWait;
     double dPingMin;
@@ -217,6 +228,33 @@ public:
 
 
 
+/**
+ * Receive buffers kept for reuse, by size class, so large messages don't
+ * allocate a fresh buffer (and wipe it when freed) each time.  Buffers are
+ * handed out empty, with a capacity of at least the size asked for, and of
+ * exactly that size below the smallest class.
+ */
+class CRecvBufferPool
+{
+public:
+    CRecvBufferPool(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn), nSize(0) {}
+
+    void Get(size_t nCapacity, CSerializeData& data);
+    /** Take back a buffer, or let it be freed when the pool is full */
+    void Put(CSerializeData& data);
+    size_t GetSize() const { LOCK(cs); return nSize; }
+
+private:
+    //! Buffers smaller than 2^MIN_CLASS bytes are not worth keeping
+    static const int MIN_CLASS = 12;
+
+    mutable CCriticalSection cs;
+    const size_t nMaxSize;
+    size_t nSize;
+    //! Buffers with a capacity of at least 2^n bytes, by n
+    std::map<int, std::vector<CSerializeData> > mapFree;
+};
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
@@ -227,6 +265,8 @@ public:
 
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
+    CHash256 hasher;                // hashes the data as it arrives
+    unsigned int nDataChecksum;     // checksum of the data, once complete
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
@@ -235,6 +275,7 @@ public:
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        nDataChecksum = 0;
         nTime = 0;
     }
 
@@ -253,6 +294,12 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Hand the data buffer back to the pool, once the message was processed */
+    void ReleaseBuffer();
+
+private:
+    void FinishData();
 };
 
 
@@ -317,6 +364,53 @@ public:
 
 typedef std::map<CSubNet, CBanEntry> banmap_t;
 
+/**
+ * A message serialized with its header and checksum.  It is immutable once
+ * made, so the send queues of any number of peers can hold it by reference.
+ */
+struct CSerializedNetMsg
+{
+    std::string command;
+    CSerializeData data;
+};
+
+typedef std::shared_ptr<const CSerializedNetMsg> CSerializedNetMsgRef;
+
+/**
+ * The last few messages made for some objects, by the hash of the object and
+ * the serialization version, so the next peer asking for the same object in
+ * the same way is sent the same bytes.  Objects whose hash doesn't commit to
+ * all of their serialization, like transactions and their witnesses, are
+ * also told apart by the object the message was made from.  Not thread safe.
+ */
+class CNetMsgCache
+{
+public:
+    CNetMsgCache(size_t nMaxEntriesIn) : nMaxEntries(nMaxEntriesIn), nHits(0), nMisses(0) {}
+
+    CSerializedNetMsgRef Get(const uint256& hash, const char* pszCommand, int nVersion, const void* pObject = NULL) const;
+    void Add(const uint256& hash, int nVersion, const CSerializedNetMsgRef& msg, const std::shared_ptr<const void>& pObject = std::shared_ptr<const void>());
+
+    uint64_t GetHits() const { return nHits; }
+    uint64_t GetMisses() const { return nMisses; }
+
+private:
+    struct Entry
+    {
+        uint256 hash;
+        int nVersion;
+        CSerializedNetMsgRef msg;
+        //! Held so another object can't take its address while the entry is kept
+        std::shared_ptr<const void> pObject;
+    };
+
+    const size_t nMaxEntries;
+    //! Most recently added last
+    std::deque<Entry> vEntries;
+    mutable uint64_t nHits;
+    mutable uint64_t nMisses;
+};
+
 /** Information about a peer */
 class CNode
 {
@@ -329,10 +423,13 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedNetMsgRef> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
+    // Orphan transactions whose parents arrived from this peer and that still
+    // have to be reconsidered. Only used by the message handler thread, under cs_main.
+    std::set<uint256> setOrphanWork;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
@@ -429,6 +526,9 @@ public:
     std::atomic<int64_t> nLastBlockTime;
     std::atomic<int64_t> nLastTXTime;
 
+    // Microseconds the message handler spent on this peer, counted with -metrics
+    std::atomic<int64_t> nProcessingTime;
+
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
     uint64_t nPingNonceSent;
@@ -480,11 +580,12 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
+    // Counts the buffers' capacity, which may exceed the data received so far
     unsigned int GetTotalRecvSize()
     {
         unsigned int total = 0;
         BOOST_FOREACH(const CNetMessage &msg, vRecvMsg)
-            total += msg.vRecv.size() + 24;
+            total += msg.vRecv.capacity() + 24;
         return total;
     }
 
@@ -569,6 +670,25 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend);
 
+    /**
+     * Serialize a message for any number of peers whose send version is
+     * nVersion, to push with PushSerializedMessage().
+     */
+    template<typename T1>
+    static CSerializedNetMsgRef MakeMessage(int nVersion, const char* pszCommand, const T1& a1)
+    {
+        CDataStream ss(SER_NETWORK, nVersion);
+        WriteMessageHeader(ss, pszCommand);
+        ss << a1;
+        return FinishMessage(ss, pszCommand);
+    }
+
+    /** Queue a message made by MakeMessage(), without copying it */
+    void PushSerializedMessage(const CSerializedNetMsgRef& msg);
+
+    /** The version messages to this peer are serialized with */
+    int GetSendVersion() { return ssSend.GetVersion(); }
+
     void PushVersion();
 
 
@@ -749,6 +869,14 @@ public:
 
     void CloseSocketDisconnect();
 
+private:
+    static void WriteMessageHeader(CDataStream& ss, const char* pszCommand);
+    /** Set the size and checksum in the header of the message in ss, and take it out of ss */
+    static CSerializedNetMsgRef FinishMessage(CDataStream& ss, const char* pszCommand);
+    // requires LOCK(cs_vSend)
+    void QueueMessage(const CSerializedNetMsgRef& msg);
+
+public:
     // Denial-of-service detection/prevention
     // The idea is to detect peers that are behaving
     // badly and disconnect/ban them, but do it in a
@@ -7,150 +7,177 @@
 #include "policy/policy.h"
 
 #include "amount.h"
+#include "dbwrapper.h"
 #include "primitives/transaction.h"
 #include "random.h"
-#include "streams.h"
+#include "serialize.h"
 #include "txmempool.h"
 #include "util.h"
 
-void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
-                                unsigned int maxConfirms, double _decay, std::string _dataTypeString)
+#include <algorithm>
+#include <math.h>
+
+/** The moving averages are normalized once their weight exceeds this */
+static const double MAX_STATS_MULTIPLIER = 1e100;
+
+/** Version of the estimates database, estimates of other versions are ignored */
+static const int FEE_ESTIMATES_DB_VERSION = 1;
+
+static const char DB_VERSION = 'V';
+static const char DB_BEST_HEIGHT = 'H';
+static const char DB_BUCKETS = 'b';
+static const char DB_HORIZON = 'h';
+static const char DB_HORIZON_BUCKET = 'c';
+
+namespace {
+
+/** The settings and weight of a time horizon in the estimates database */
+struct CStatsHeader
 {
-    decay = _decay;
-    dataTypeString = _dataTypeString;
-    for (unsigned int i = 0; i < defaultBuckets.size(); i++) {
-        buckets.push_back(defaultBuckets[i]);
-        bucketMap[defaultBuckets[i]] = i;
+    double decay;
+    unsigned int scale;
+    unsigned int maxPeriods;
+    double multiplier;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(decay);
+        READWRITE(scale);
+        READWRITE(maxPeriods);
+        READWRITE(multiplier);
     }
-    confAvg.resize(maxConfirms);
-    curBlockConf.resize(maxConfirms);
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        confAvg[i].resize(buckets.size());
-        curBlockConf[i].resize(buckets.size());
-        unconfTxs[i].resize(buckets.size());
+};
+
+/** The moving averages of one bucket of a time horizon, stored multiplied by its weight */
+struct CStatsBucket
+{
+    double avg;
+    double txCtAvg;
+    std::vector<double> confAvg;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(avg);
+        READWRITE(txCtAvg);
+        READWRITE(confAvg);
     }
+};
 
-    oldUnconfTxs.resize(buckets.size());
-    curBlockTxCt.resize(buckets.size());
-    txCtAvg.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-    avg.resize(buckets.size());
 }
 
-// Zero out the data for the current block
-void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
+TxConfirmStats::TxConfirmStats(unsigned int numBuckets, unsigned int maxPeriods,
+                               double _decay, unsigned int _scale)
+    : multiplier(1), decay(_decay), scale(_scale)
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
-        for (unsigned int i = 0; i < curBlockConf.size(); i++)
-            curBlockConf[i][j] = 0;
-        curBlockTxCt[j] = 0;
-        curBlockVal[j] = 0;
+    confAvg.resize(maxPeriods);
+    for (unsigned int i = 0; i < maxPeriods; i++) {
+        confAvg[i].resize(numBuckets);
     }
+    txCtAvg.resize(numBuckets);
+    avg.resize(numBuckets);
+    bucketDirty.assign(numBuckets, true);
 }
 
-
-void TxConfirmStats::Record(int blocksToConfirm, double val)
+void TxConfirmStats::Record(int blocksToConfirm, unsigned int bucketindex, double val)
 {
     // blocksToConfirm is 1-based
     if (blocksToConfirm < 1)
         return;
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
-    }
-    curBlockTxCt[bucketindex]++;
-    curBlockVal[bucketindex] += val;
+    unsigned int periodsToConfirm = (blocksToConfirm + scale - 1) / scale;
+    if (periodsToConfirm <= confAvg.size())
+        confAvg[periodsToConfirm - 1][bucketindex] += multiplier;
+    txCtAvg[bucketindex] += multiplier;
+    avg[bucketindex] += val * multiplier;
+    bucketDirty[bucketindex] = true;
 }
 
 void TxConfirmStats::UpdateMovingAverages()
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
+    // Instead of decaying every stored average, give the data points of the
+    // new block more weight than all the older ones
+    multiplier /= decay;
+    if (multiplier > MAX_STATS_MULTIPLIER)
+        Normalize();
+}
+
+void TxConfirmStats::Normalize()
+{
+    for (unsigned int j = 0; j < txCtAvg.size(); j++) {
         for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
-        avg[j] = avg[j] * decay + curBlockVal[j];
-        txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
+            confAvg[i][j] /= multiplier;
+        avg[j] /= multiplier;
+        txCtAvg[j] /= multiplier;
     }
+    multiplier = 1;
+    bucketDirty.assign(txCtAvg.size(), true);
 }
 
 // returns -1 on error conditions
 double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
-                                         double successBreakPoint, bool requireGreater,
-                                         unsigned int nBlockHeight)
+                                         double successBreakPoint, const std::vector<double>& buckets,
+                                         const std::vector<int>& unconfTxs) const
 {
     // Counters for a bucket (or range of buckets)
     double nConf = 0; // Number of tx's confirmed within the confTarget
     double totalNum = 0; // Total number of tx's that were ever confirmed
     int extraNum = 0;  // Number of tx's still in mempool for confTarget or longer
 
-    int maxbucketindex = buckets.size() - 1;
-
-    // requireGreater means we are looking for the lowest fee/priority such that all higher
-    // values pass, so we start at maxbucketindex (highest fee) and look at successively
-    // smaller buckets until we reach failure.  Otherwise, we are looking for the highest
-    // fee/priority such that all lower values fail, and we go in the opposite direction.
-    unsigned int startbucket = requireGreater ? maxbucketindex : 0;
-    int step = requireGreater ? -1 : 1;
-
-    // We'll combine buckets until we have enough samples.
-    // The near and far variables will define the range we've combined
-    // The best variables are the last range we saw which still had a high
-    // enough confirmation rate to count as success.
-    // The cur variables are the current range we're counting.
-    unsigned int curNearBucket = startbucket;
-    unsigned int bestNearBucket = startbucket;
-    unsigned int curFarBucket = startbucket;
-    unsigned int bestFarBucket = startbucket;
+    int maxbucketindex = txCtAvg.size() - 1;
+    unsigned int periodTarget = (confTarget + scale - 1) / scale;
+
+    // We are looking for the lowest feerate such that all higher values pass,
+    // so we start at maxbucketindex (highest feerate) and look at successively
+    // smaller buckets until we reach failure.
+    unsigned int curNearBucket = maxbucketindex;
+    unsigned int bestNearBucket = maxbucketindex;
+    unsigned int curFarBucket = maxbucketindex;
+    unsigned int bestFarBucket = maxbucketindex;
 
     bool foundAnswer = false;
-    unsigned int bins = unconfTxs.size();
 
-    // Start counting from highest(default) or lowest fee/pri transactions
-    for (int bucket = startbucket; bucket >= 0 && bucket <= maxbucketindex; bucket += step) {
+    // Start counting from highest feerate transactions
+    for (int bucket = maxbucketindex; bucket >= 0; bucket--) {
         curFarBucket = bucket;
-        nConf += confAvg[confTarget - 1][bucket];
+        for (unsigned int period = 0; period < periodTarget; period++)
+            nConf += confAvg[period][bucket];
         totalNum += txCtAvg[bucket];
-        for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
-            extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
-        extraNum += oldUnconfTxs[bucket];
+        extraNum += unconfTxs[bucket];
         // If we have enough transaction data points in this range of buckets,
         // we can test for success
         // (Only count the confirmed data points, so that each confirmation count
         // will be looking at the same amount of data and same bucket breaks)
-        if (totalNum >= sufficientTxVal / (1 - decay)) {
-            double curPct = nConf / (totalNum + extraNum);
+        if (totalNum >= sufficientTxVal / (1 - decay) * multiplier) {
+            double curPct = nConf / (totalNum + extraNum * multiplier);
 
             // Check to see if we are no longer getting confirmed at the success rate
-            if (requireGreater && curPct < successBreakPoint)
-                break;
-            if (!requireGreater && curPct > successBreakPoint)
+            if (curPct < successBreakPoint)
                 break;
 
             // Otherwise update the cumulative stats, and the bucket variables
             // and reset the counters
-            else {
-                foundAnswer = true;
-                nConf = 0;
-                totalNum = 0;
-                extraNum = 0;
-                bestNearBucket = curNearBucket;
-                bestFarBucket = curFarBucket;
-                curNearBucket = bucket + step;
-            }
+            foundAnswer = true;
+            nConf = 0;
+            totalNum = 0;
+            extraNum = 0;
+            bestNearBucket = curNearBucket;
+            bestFarBucket = curFarBucket;
+            curNearBucket = bucket - 1;
         }
     }
 
     double median = -1;
     double txSum = 0;
 
-    // Calculate the "average" fee of the best bucket range that met success conditions
-    // Find the bucket with the median transaction and then report the average fee from that bucket
+    // Calculate the "average" feerate of the best bucket range that met success conditions
+    // Find the bucket with the median transaction and then report the average feerate from that bucket
     // This is a compromise between finding the median which we can't since we don't save all tx's
     // and reporting the average which is less accurate
-    unsigned int minBucket = bestNearBucket < bestFarBucket ? bestNearBucket : bestFarBucket;
-    unsigned int maxBucket = bestNearBucket > bestFarBucket ? bestNearBucket : bestFarBucket;
+    unsigned int minBucket = std::min(bestNearBucket, bestFarBucket);
+    unsigned int maxBucket = std::max(bestNearBucket, bestFarBucket);
     for (unsigned int j = minBucket; j <= maxBucket; j++) {
         txSum += txCtAvg[j];
     }
@@ -166,191 +193,223 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
         }
     }
 
-    LogPrint("estimatefee", "%3d: For conf success %s %4.2f need %s %s: %12.5g from buckets %8g - %8g  Cur Bucket stats %6.2f%%  %8.1f/(%.1f+%d mempool)\n",
-             confTarget, requireGreater ? ">" : "<", successBreakPoint, dataTypeString,
-             requireGreater ? ">" : "<", median, buckets[minBucket], buckets[maxBucket],
-             100 * nConf / (totalNum + extraNum), nConf, totalNum, extraNum);
+    LogPrint("estimatefee", "%3d: For conf success > %4.2f need feerate (decay %.5f): %12.5g from buckets %8g - %8g  Cur Bucket stats %6.2f%%  %8.1f/(%.1f+%d mempool)\n",
+             confTarget, successBreakPoint, decay, median, buckets[minBucket], buckets[maxBucket],
+             100 * nConf / (totalNum + extraNum * multiplier), nConf / multiplier, totalNum / multiplier, extraNum);
 
     return median;
 }
 
-void TxConfirmStats::Write(CAutoFile& fileout)
+void TxConfirmStats::Write(CDBBatch& batch, unsigned char horizon) const
 {
-    fileout << decay;
-    fileout << buckets;
-    fileout << avg;
-    fileout << txCtAvg;
-    fileout << confAvg;
+    CStatsHeader header;
+    header.decay = decay;
+    header.scale = scale;
+    header.maxPeriods = confAvg.size();
+    header.multiplier = multiplier;
+    batch.Write(std::make_pair(DB_HORIZON, horizon), header);
+
+    for (unsigned int j = 0; j < txCtAvg.size(); j++) {
+        if (!bucketDirty[j])
+            continue;
+        CStatsBucket bucket;
+        bucket.avg = avg[j];
+        bucket.txCtAvg = txCtAvg[j];
+        for (unsigned int i = 0; i < confAvg.size(); i++)
+            bucket.confAvg.push_back(confAvg[i][j]);
+        batch.Write(std::make_pair(DB_HORIZON_BUCKET, std::make_pair(horizon, j)), bucket);
+    }
 }
 
-void TxConfirmStats::Read(CAutoFile& filein)
+void TxConfirmStats::SetClean()
 {
-    // Read data file into temporary variables and do some very basic sanity checking
-    std::vector<double> fileBuckets;
-    std::vector<double> fileAvg;
-    std::vector<std::vector<double> > fileConfAvg;
-    std::vector<double> fileTxCtAvg;
-    double fileDecay;
-    size_t maxConfirms;
-    size_t numBuckets;
+    bucketDirty.assign(txCtAvg.size(), false);
+}
 
-    filein >> fileDecay;
-    if (fileDecay <= 0 || fileDecay >= 1)
-        throw std::runtime_error("Corrupt estimates file. Decay must be between 0 and 1 (non-inclusive)");
-    filein >> fileBuckets;
-    numBuckets = fileBuckets.size();
-    if (numBuckets <= 1 || numBuckets > 1000)
-        throw std::runtime_error("Corrupt estimates file. Must have between 2 and 1000 fee/pri buckets");
-    filein >> fileAvg;
-    if (fileAvg.size() != numBuckets)
-        throw std::runtime_error("Corrupt estimates file. Mismatch in fee/pri average bucket count");
-    filein >> fileTxCtAvg;
-    if (fileTxCtAvg.size() != numBuckets)
-        throw std::runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
-    filein >> fileConfAvg;
-    maxConfirms = fileConfAvg.size();
-    if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) // one week
-        throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        if (fileConfAvg[i].size() != numBuckets)
-            throw std::runtime_error("Corrupt estimates file. Mismatch in fee/pri conf average bucket count");
-    }
-    // Now that we've processed the entire fee estimate data file and not
+void TxConfirmStats::Read(const CDBWrapper& db, unsigned char horizon, unsigned int numBuckets)
+{
+    // Read the database into temporary variables and do some very basic sanity checking
+    CStatsHeader header;
+    if (!db.Read(std::make_pair(DB_HORIZON, horizon), header))
+        throw std::runtime_error("Corrupt estimates database. Missing time horizon");
+    if (header.decay <= 0 || header.decay >= 1)
+        throw std::runtime_error("Corrupt estimates database. Decay must be between 0 and 1 (non-inclusive)");
+    if (header.scale == 0)
+        throw std::runtime_error("Corrupt estimates database. Scale must be non-zero");
+    if (header.maxPeriods <= 0 || header.maxPeriods * header.scale > 6 * 24 * 7) // one week
+        throw std::runtime_error("Corrupt estimates database.  Must maintain estimates for between 1 and 1008 (one week) confirms");
+    if (!(header.multiplier >= 1 && header.multiplier <= MAX_STATS_MULTIPLIER))
+        throw std::runtime_error("Corrupt estimates database. Weight out of range");
+
+    std::vector<double> dbAvg(numBuckets);
+    std::vector<std::vector<double> > dbConfAvg(header.maxPeriods, std::vector<double>(numBuckets));
+    std::vector<double> dbTxCtAvg(numBuckets);
+    for (unsigned int j = 0; j < numBuckets; j++) {
+        CStatsBucket bucket;
+        if (!db.Read(std::make_pair(DB_HORIZON_BUCKET, std::make_pair(horizon, j)), bucket))
+            throw std::runtime_error("Corrupt estimates database. Missing feerate bucket");
+        if (bucket.confAvg.size() != header.maxPeriods)
+            throw std::runtime_error("Corrupt estimates database. Mismatch in feerate conf average period count");
+        dbAvg[j] = bucket.avg;
+        dbTxCtAvg[j] = bucket.txCtAvg;
+        for (unsigned int i = 0; i < header.maxPeriods; i++)
+            dbConfAvg[i][j] = bucket.confAvg[i];
+    }
+    // Now that we've processed the entire feerate estimate data and not
     // thrown any errors, we can copy it to our data structures
-    decay = fileDecay;
-    buckets = fileBuckets;
-    avg = fileAvg;
-    confAvg = fileConfAvg;
-    txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
-
-    // Resize the current block variables which aren't stored in the data file
-    // to match the number of confirms and buckets
-    curBlockConf.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        curBlockConf[i].resize(buckets.size());
-    }
-    curBlockTxCt.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
+    decay = header.decay;
+    scale = header.scale;
+    avg = dbAvg;
+    confAvg = dbConfAvg;
+    txCtAvg = dbTxCtAvg;
+    multiplier = header.multiplier;
+    SetClean();
+
+    LogPrint("estimatefee", "Reading estimates: %u buckets counting confirms up to %u blocks\n",
+             numBuckets, GetMaxConfirms());
+}
 
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        unconfTxs[i].resize(buckets.size());
-    }
-    oldUnconfTxs.resize(buckets.size());
+CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
+    : minTrackedFee(_minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee),
+      nBestSeenHeight(0), nLastWrittenHeight(0),
+      buckets(1, minTrackedFee.GetFeePerK()),
+      shortStats(0, SHORT_BLOCK_PERIODS, SHORT_DECAY, SHORT_SCALE),
+      feeStats(0, MED_BLOCK_PERIODS, MED_DECAY, MED_SCALE),
+      longStats(0, LONG_BLOCK_PERIODS, LONG_DECAY, LONG_SCALE)
+{
+    for (double bucketBoundary = buckets.back() * FEE_SPACING; bucketBoundary <= MAX_FEERATE; bucketBoundary *= FEE_SPACING) {
+        buckets.push_back(bucketBoundary);
+    }
+    buckets.push_back(INF_FEERATE);
+    shortStats = TxConfirmStats(buckets.size(), SHORT_BLOCK_PERIODS, SHORT_DECAY, SHORT_SCALE);
+    feeStats = TxConfirmStats(buckets.size(), MED_BLOCK_PERIODS, MED_DECAY, MED_SCALE);
+    longStats = TxConfirmStats(buckets.size(), LONG_BLOCK_PERIODS, LONG_DECAY, LONG_SCALE);
+    ResetUnconfirmed();
+}
 
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
+void CBlockPolicyEstimator::ResetUnconfirmed()
+{
+    unsigned int maxConfirms = std::max(shortStats.GetMaxConfirms(), std::max(feeStats.GetMaxConfirms(), longStats.GetMaxConfirms()));
+    mapMemPoolTxs.clear();
+    unconfTxs.assign(maxConfirms, std::vector<int>(buckets.size()));
+    unconfTxsTree.assign(buckets.size(), std::vector<int>(maxConfirms));
+    oldUnconfTxs.assign(buckets.size(), 0);
+}
 
-    LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
-             numBuckets, dataTypeString, maxConfirms);
+unsigned int CBlockPolicyEstimator::BucketIndex(double val) const
+{
+    // The buckets are exponentially spaced, so the index of the bucket can be
+    // computed from the logarithm of val.  Rounding may put that off by one,
+    // and buckets read from disk may use a different spacing, in which case
+    // fall back to a binary search.
+    if (!(val > buckets.front()))
+        return 0;
+    double fIndex = ceil(log(val / buckets.front()) / log(FEE_SPACING));
+    if (fIndex < buckets.size()) {
+        unsigned int index = fIndex;
+        if (buckets[index] >= val && buckets[index - 1] < val)
+            return index;
+    }
+    unsigned int index = std::lower_bound(buckets.begin(), buckets.end(), val) - buckets.begin();
+    return std::min<unsigned int>(index, buckets.size() - 1);
 }
 
-unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
+void CBlockPolicyEstimator::AddUnconfirmed(unsigned int slot, unsigned int bucket, int n)
 {
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    unsigned int blockIndex = nBlockHeight % unconfTxs.size();
-    unconfTxs[blockIndex][bucketindex]++;
-    LogPrint("estimatefee", "adding to %s", dataTypeString);
-    return bucketindex;
+    unconfTxs[slot][bucket] += n;
+    std::vector<int>& tree = unconfTxsTree[bucket];
+    for (int i = slot + 1; i <= (int)tree.size(); i += i & -i)
+        tree[i - 1] += n;
 }
 
-void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight, unsigned int bucketindex)
+int CBlockPolicyEstimator::SumUnconfirmed(unsigned int bucket, unsigned int slotEnd) const
 {
-    //nBestSeenHeight is not updated yet for the new block
-    int blocksAgo = nBestSeenHeight - entryHeight;
-    if (nBestSeenHeight == 0)  // the BlockPolicyEstimator hasn't seen any blocks yet
-        blocksAgo = 0;
-    if (blocksAgo < 0) {
-        LogPrint("estimatefee", "Blockpolicy error, blocks ago is negative for mempool tx\n");
-        return;  //This can't happen because we call this with our best seen height, no entries can have higher
-    }
+    const std::vector<int>& tree = unconfTxsTree[bucket];
+    int sum = 0;
+    for (int i = slotEnd; i > 0; i -= i & -i)
+        sum += tree[i - 1];
+    return sum;
+}
 
-    if (blocksAgo >= (int)unconfTxs.size()) {
-        if (oldUnconfTxs[bucketindex] > 0)
-            oldUnconfTxs[bucketindex]--;
-        else
-            LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from >25 blocks,bucketIndex=%u already\n",
-                     bucketindex);
+void CBlockPolicyEstimator::ClearCurrent(unsigned int nBlockHeight)
+{
+    unsigned int slot = nBlockHeight % unconfTxs.size();
+    for (unsigned int j = 0; j < buckets.size(); j++) {
+        int n = unconfTxs[slot][j];
+        if (n == 0)
+            continue;
+        oldUnconfTxs[j] += n;
+        AddUnconfirmed(slot, j, -n);
     }
-    else {
-        unsigned int blockIndex = entryHeight % unconfTxs.size();
-        if (unconfTxs[blockIndex][bucketindex] > 0)
-            unconfTxs[blockIndex][bucketindex]--;
+}
+
+std::vector<int> CBlockPolicyEstimator::UnconfirmedSince(int nBlocks) const
+{
+    std::vector<int> result(oldUnconfTxs);
+    // The blocks from nBlocks to maxAge blocks ago use count consecutive
+    // slots starting at first, possibly wrapping around
+    unsigned int bins = unconfTxs.size();
+    unsigned int maxAge = std::min(bins - 1, nBestSeenHeight);
+    if (nBlocks < 0 || (unsigned int)nBlocks > maxAge)
+        return result;
+    unsigned int first = (nBestSeenHeight - maxAge) % bins;
+    unsigned int count = maxAge - nBlocks + 1;
+    for (unsigned int j = 0; j < buckets.size(); j++) {
+        if (first + count <= bins)
+            result[j] += SumUnconfirmed(j, first + count) - SumUnconfirmed(j, first);
         else
-            LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
-                     blockIndex, bucketindex);
+            result[j] += SumUnconfirmed(j, bins) - SumUnconfirmed(j, first) + SumUnconfirmed(j, first + count - bins);
     }
+    return result;
 }
 
 void CBlockPolicyEstimator::removeTx(uint256 hash)
 {
+    LOCK(cs);
     std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
     if (pos == mapMemPoolTxs.end()) {
-        LogPrint("estimatefee", "Blockpolicy error mempool tx %s not found for removeTx\n",
-                 hash.ToString().c_str());
+        // Not every mempool transaction is tracked
         return;
     }
-    TxConfirmStats *stats = pos->second.stats;
     unsigned int entryHeight = pos->second.blockHeight;
     unsigned int bucketIndex = pos->second.bucketIndex;
+    mapMemPoolTxs.erase(pos);
 
-    if (stats != NULL)
-        stats->removeTx(entryHeight, nBestSeenHeight, bucketIndex);
-    mapMemPoolTxs.erase(hash);
-}
-
-CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
-    : nBestSeenHeight(0)
-{
-    minTrackedFee = _minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee;
-    std::vector<double> vfeelist;
-    for (double bucketBoundary = minTrackedFee.GetFeePerK(); bucketBoundary <= MAX_FEERATE; bucketBoundary *= FEE_SPACING) {
-        vfeelist.push_back(bucketBoundary);
-    }
-    vfeelist.push_back(INF_FEERATE);
-    feeStats.Initialize(vfeelist, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY, "FeeRate");
-
-    minTrackedPriority = AllowFreeThreshold() < MIN_PRIORITY ? MIN_PRIORITY : AllowFreeThreshold();
-    std::vector<double> vprilist;
-    for (double bucketBoundary = minTrackedPriority; bucketBoundary <= MAX_PRIORITY; bucketBoundary *= PRI_SPACING) {
-        vprilist.push_back(bucketBoundary);
+    //nBestSeenHeight is not updated yet for the new block
+    int blocksAgo = nBestSeenHeight - entryHeight;
+    if (nBestSeenHeight == 0)  // the BlockPolicyEstimator hasn't seen any blocks yet
+        blocksAgo = 0;
+    if (blocksAgo < 0) {
+        LogPrint("estimatefee", "Blockpolicy error, blocks ago is negative for mempool tx\n");
+        return;  //This can't happen because we call this with our best seen height, no entries can have higher
     }
-    vprilist.push_back(INF_PRIORITY);
-    priStats.Initialize(vprilist, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY, "Priority");
 
-    feeUnlikely = CFeeRate(0);
-    feeLikely = CFeeRate(INF_FEERATE);
-    priUnlikely = 0;
-    priLikely = INF_PRIORITY;
-}
-
-bool CBlockPolicyEstimator::isFeeDataPoint(const CFeeRate &fee, double pri)
-{
-    if ((pri < minTrackedPriority && fee >= minTrackedFee) ||
-        (pri < priUnlikely && fee > feeLikely)) {
-        return true;
+    if (blocksAgo >= (int)unconfTxs.size()) {
+        if (oldUnconfTxs[bucketIndex] > 0)
+            oldUnconfTxs[bucketIndex]--;
+        else
+            LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from >%u blocks,bucketIndex=%u already\n",
+                     unconfTxs.size(), bucketIndex);
     }
-    return false;
-}
-
-bool CBlockPolicyEstimator::isPriDataPoint(const CFeeRate &fee, double pri)
-{
-    if ((fee < minTrackedFee && pri >= minTrackedPriority) ||
-        (fee < feeUnlikely && pri > priLikely)) {
-        return true;
+    else {
+        unsigned int blockIndex = entryHeight % unconfTxs.size();
+        if (unconfTxs[blockIndex][bucketIndex] > 0)
+            AddUnconfirmed(blockIndex, bucketIndex, -1);
+        else
+            LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
+                     blockIndex, bucketIndex);
     }
-    return false;
 }
 
 void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate)
 {
+    LOCK(cs);
     unsigned int txHeight = entry.GetHeight();
     uint256 hash = entry.GetTx().GetHash();
-    if (mapMemPoolTxs[hash].stats != NULL) {
+    if (mapMemPoolTxs.count(hash)) {
         LogPrint("estimatefee", "Blockpolicy error mempool tx %s already being tracked\n",
                  hash.ToString().c_str());
-	return;
+        return;
     }
 
     if (txHeight < nBestSeenHeight) {
@@ -371,30 +430,17 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
         return;
     }
 
-    // Fees are stored and reported as BTC-per-kb:
+    // Zero fee transactions can only be mined because of their priority
+    if (entry.GetFee() == 0)
+        return;
+
+    // Feerates are stored and reported as BTC-per-kb:
     CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
 
-    // Want the priority of the tx at confirmation. However we don't know
-    // what that will be and its too hard to continue updating it
-    // so use starting priority as a proxy
-    double curPri = entry.GetPriority(txHeight);
-    mapMemPoolTxs[hash].blockHeight = txHeight;
-
-    LogPrint("estimatefee", "Blockpolicy mempool tx %s ", hash.ToString().substr(0,10));
-    // Record this as a priority estimate
-    if (entry.GetFee() == 0 || isPriDataPoint(feeRate, curPri)) {
-        mapMemPoolTxs[hash].stats = &priStats;
-        mapMemPoolTxs[hash].bucketIndex =  priStats.NewTx(txHeight, curPri);
-    }
-    // Record this as a fee estimate
-    else if (isFeeDataPoint(feeRate, curPri)) {
-        mapMemPoolTxs[hash].stats = &feeStats;
-        mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
-    }
-    else {
-        LogPrint("estimatefee", "not adding");
-    }
-    LogPrint("estimatefee", "\n");
+    TxStatsInfo& info = mapMemPoolTxs[hash];
+    info.blockHeight = txHeight;
+    info.bucketIndex = BucketIndex(feeRate.GetFeePerK());
+    AddUnconfirmed(txHeight % unconfTxs.size(), info.bucketIndex, 1);
 }
 
 void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry)
@@ -406,6 +452,9 @@ void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
         return;
     }
 
+    if (entry.GetFee() == 0)
+        return;
+
     // How many blocks did it take for miners to include this transaction?
     // blocksToConfirm is 1-based, so a transaction included in the earliest
     // possible block has confirmation count of 1
@@ -417,26 +466,20 @@ void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
         return;
     }
 
-    // Fees are stored and reported as BTC-per-kb:
+    // Feerates are stored and reported as BTC-per-kb:
     CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
+    double val = feeRate.GetFeePerK();
+    unsigned int bucketIndex = BucketIndex(val);
 
-    // Want the priority of the tx at confirmation.  The priority when it
-    // entered the mempool could easily be very small and change quickly
-    double curPri = entry.GetPriority(nBlockHeight);
-
-    // Record this as a priority estimate
-    if (entry.GetFee() == 0 || isPriDataPoint(feeRate, curPri)) {
-        priStats.Record(blocksToConfirm, curPri);
-    }
-    // Record this as a fee estimate
-    else if (isFeeDataPoint(feeRate, curPri)) {
-        feeStats.Record(blocksToConfirm, (double)feeRate.GetFeePerK());
-    }
+    shortStats.Record(blocksToConfirm, bucketIndex, val);
+    feeStats.Record(blocksToConfirm, bucketIndex, val);
+    longStats.Record(blocksToConfirm, bucketIndex, val);
 }
 
 void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
                                          std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate)
 {
+    LOCK(cs);
     if (nBlockHeight <= nBestSeenHeight) {
         // Ignore side chains and re-orgs; assuming they are random
         // they don't affect the estimate.
@@ -452,53 +495,52 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     if (!fCurrentEstimate)
         return;
 
-    // Update the dynamic cutoffs
-    // a fee/priority is "likely" the reason your tx was included in a block if >85% of such tx's
-    // were confirmed in 2 blocks and is "unlikely" if <50% were confirmed in 10 blocks
-    LogPrint("estimatefee", "Blockpolicy recalculating dynamic cutoffs:\n");
-    priLikely = priStats.EstimateMedianVal(2, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBlockHeight);
-    if (priLikely == -1)
-        priLikely = INF_PRIORITY;
-
-    double feeLikelyEst = feeStats.EstimateMedianVal(2, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBlockHeight);
-    if (feeLikelyEst == -1)
-        feeLikely = CFeeRate(INF_FEERATE);
-    else
-        feeLikely = CFeeRate(feeLikelyEst);
-
-    priUnlikely = priStats.EstimateMedianVal(10, SUFFICIENT_PRITXS, UNLIKELY_PCT, false, nBlockHeight);
-    if (priUnlikely == -1)
-        priUnlikely = 0;
-
-    double feeUnlikelyEst = feeStats.EstimateMedianVal(10, SUFFICIENT_FEETXS, UNLIKELY_PCT, false, nBlockHeight);
-    if (feeUnlikelyEst == -1)
-        feeUnlikely = CFeeRate(0);
-    else
-        feeUnlikely = CFeeRate(feeUnlikelyEst);
-
-    // Clear the current block states
-    feeStats.ClearCurrent(nBlockHeight);
-    priStats.ClearCurrent(nBlockHeight);
-
-    // Repopulate the current block states
-    for (unsigned int i = 0; i < entries.size(); i++)
-        processBlockTx(nBlockHeight, entries[i]);
+    // Clear the current block state
+    ClearCurrent(nBlockHeight);
 
-    // Update all exponential averages with the current block states
+    // Decay the exponential averages so the new block's data outweighs the history
+    shortStats.UpdateMovingAverages();
     feeStats.UpdateMovingAverages();
-    priStats.UpdateMovingAverages();
+    longStats.UpdateMovingAverages();
+
+    // Record the confirmed entries
+    for (unsigned int i = 0; i < entries.size(); i++)
+        processBlockTx(nBlockHeight, entries[i]);
 
     LogPrint("estimatefee", "Blockpolicy after updating estimates for %u confirmed entries, new mempool map size %u\n",
              entries.size(), mapMemPoolTxs.size());
 }
 
-CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
+const TxConfirmStats& CBlockPolicyEstimator::GetStats(FeeEstimateHorizon horizon) const
+{
+    switch (horizon) {
+    case SHORT_HALFLIFE: return shortStats;
+    case MED_HALFLIFE: return feeStats;
+    case LONG_HALFLIFE: return longStats;
+    }
+    throw std::out_of_range("CBlockPolicyEstimator::GetStats: unknown horizon");
+}
+
+double CBlockPolicyEstimator::EstimateMedianVal(const TxConfirmStats& stats, int confTarget) const
+{
+    return stats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, buckets, UnconfirmedSince(confTarget));
+}
+
+unsigned int CBlockPolicyEstimator::HighestTargetTracked(FeeEstimateHorizon horizon)
+{
+    LOCK(cs);
+    return GetStats(horizon).GetMaxConfirms();
+}
+
+CFeeRate CBlockPolicyEstimator::estimateRawFee(int confTarget, FeeEstimateHorizon horizon)
 {
+    LOCK(cs);
+    const TxConfirmStats& stats = GetStats(horizon);
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > stats.GetMaxConfirms())
         return CFeeRate(0);
 
-    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    double median = EstimateMedianVal(stats, confTarget);
 
     if (median < 0)
         return CFeeRate(0);
@@ -506,26 +548,45 @@ CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
     return CFeeRate(median);
 }
 
-CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
+CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
+{
+    // Targets the medium horizon can't answer are estimated from the long one
+    if (confTarget > 0 && (unsigned int)confTarget > HighestTargetTracked(MED_HALFLIFE))
+        return estimateRawFee(confTarget, LONG_HALFLIFE);
+    return estimateRawFee(confTarget, MED_HALFLIFE);
+}
+
+CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CFeeRate& minPoolFee)
 {
+    LOCK(cs);
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > longStats.GetMaxConfirms())
         return CFeeRate(0);
 
+    // Walk the targets of the medium horizon one block at a time, then
+    // continue with the periods of the long horizon.
     double median = -1;
-    while (median < 0 && (unsigned int)confTarget <= feeStats.GetMaxConfirms()) {
-        median = feeStats.EstimateMedianVal(confTarget++, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    while (median < 0 && (unsigned int)confTarget <= longStats.GetMaxConfirms()) {
+        if ((unsigned int)confTarget <= feeStats.GetMaxConfirms()) {
+            median = EstimateMedianVal(feeStats, confTarget);
+        } else {
+            unsigned int scale = longStats.GetScale();
+            confTarget = (confTarget + scale - 1) / scale * scale;
+            median = EstimateMedianVal(longStats, confTarget);
+        }
+        if (median < 0)
+            confTarget++;
     }
 
     if (answerFoundAtTarget)
-        *answerFoundAtTarget = confTarget - 1;
+        *answerFoundAtTarget = std::min<unsigned int>(confTarget, longStats.GetMaxConfirms());
 
     // If mempool is limiting txs , return at least the min fee from the mempool
-    CAmount minPoolFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFeePerK();
-    if (minPoolFee > 0 && minPoolFee > median)
-        return CFeeRate(minPoolFee);
+    CAmount minPoolFeePerK = minPoolFee.GetFeePerK();
+    if (minPoolFeePerK > 0 && minPoolFeePerK > median)
+        return CFeeRate(minPoolFeePerK);
 
     if (median < 0)
         return CFeeRate(0);
@@ -535,51 +596,83 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoun
 
 double CBlockPolicyEstimator::estimatePriority(int confTarget)
 {
-    // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
-        return -1;
-
-    return priStats.EstimateMedianVal(confTarget, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    return -1;
 }
 
-double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
+double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerFoundAtTarget, const CFeeRate& minPoolFee)
 {
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
-    // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
-        return -1;
 
     // If mempool is limiting txs, no priority txs are allowed
-    CAmount minPoolFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFeePerK();
-    if (minPoolFee > 0)
+    if (minPoolFee.GetFeePerK() > 0)
         return INF_PRIORITY;
 
-    double median = -1;
-    while (median < 0 && (unsigned int)confTarget <= priStats.GetMaxConfirms()) {
-        median = priStats.EstimateMedianVal(confTarget++, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
-    }
-
-    if (answerFoundAtTarget)
-        *answerFoundAtTarget = confTarget - 1;
+    return -1;
+}
 
-    return median;
+bool CBlockPolicyEstimator::IsDirty()
+{
+    LOCK(cs);
+    return nBestSeenHeight != nLastWrittenHeight;
 }
 
-void CBlockPolicyEstimator::Write(CAutoFile& fileout)
+void CBlockPolicyEstimator::Write(CDBWrapper& db)
 {
-    fileout << nBestSeenHeight;
-    feeStats.Write(fileout);
-    priStats.Write(fileout);
+    LOCK(cs);
+    CDBBatch batch(db);
+    batch.Write(DB_VERSION, FEE_ESTIMATES_DB_VERSION);
+    batch.Write(DB_BEST_HEIGHT, nBestSeenHeight);
+    batch.Write(DB_BUCKETS, buckets);
+    shortStats.Write(batch, SHORT_HALFLIFE);
+    feeStats.Write(batch, MED_HALFLIFE);
+    longStats.Write(batch, LONG_HALFLIFE);
+    db.WriteBatch(batch, true);
+
+    shortStats.SetClean();
+    feeStats.SetClean();
+    longStats.SetClean();
+    nLastWrittenHeight = nBestSeenHeight;
 }
 
-void CBlockPolicyEstimator::Read(CAutoFile& filein)
+bool CBlockPolicyEstimator::Read(const CDBWrapper& db)
 {
-    int nFileBestSeenHeight;
-    filein >> nFileBestSeenHeight;
-    feeStats.Read(filein);
-    priStats.Read(filein);
-    nBestSeenHeight = nFileBestSeenHeight;
+    LOCK(cs);
+    int nVersion;
+    if (!db.Read(DB_VERSION, nVersion))
+        return false;
+    if (nVersion != FEE_ESTIMATES_DB_VERSION)
+        throw std::runtime_error(strprintf("Estimates database has unsupported version %d", nVersion));
+    unsigned int nDBBestSeenHeight;
+    if (!db.Read(DB_BEST_HEIGHT, nDBBestSeenHeight))
+        throw std::runtime_error("Corrupt estimates database. Missing best height");
+    std::vector<double> dbBuckets;
+    if (!db.Read(DB_BUCKETS, dbBuckets))
+        throw std::runtime_error("Corrupt estimates database. Missing feerate buckets");
+    unsigned int numBuckets = dbBuckets.size();
+    if (numBuckets <= 1 || numBuckets > 1000)
+        throw std::runtime_error("Corrupt estimates database. Must have between 2 and 1000 feerate buckets");
+    for (unsigned int i = 1; i < numBuckets; i++) {
+        if (!(dbBuckets[i] > dbBuckets[i - 1]))
+            throw std::runtime_error("Corrupt estimates database. Feerate buckets must be increasing");
+    }
+
+    TxConfirmStats dbShortStats(shortStats), dbFeeStats(feeStats), dbLongStats(longStats);
+    dbShortStats.Read(db, SHORT_HALFLIFE, numBuckets);
+    dbFeeStats.Read(db, MED_HALFLIFE, numBuckets);
+    dbLongStats.Read(db, LONG_HALFLIFE, numBuckets);
+
+    // Only replace our state once the whole database was read successfully. The
+    // mempool transactions being tracked refer to the old buckets, so start
+    // tracking them afresh.
+    buckets = dbBuckets;
+    shortStats = dbShortStats;
+    feeStats = dbFeeStats;
+    longStats = dbLongStats;
+    nBestSeenHeight = nDBBestSeenHeight;
+    nLastWrittenHeight = nDBBestSeenHeight;
+    ResetUnconfirmed();
+    return true;
 }
 
 FeeFilterRounder::FeeFilterRounder(const CFeeRate& minIncrementalFee)
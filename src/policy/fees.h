@@ -6,212 +6,209 @@
 #define BITCOIN_POLICYESTIMATOR_H
 
 #include "amount.h"
+#include "sync.h"
 #include "uint256.h"
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
-class CAutoFile;
+class CDBBatch;
+class CDBWrapper;
 class CFeeRate;
 class CTxMemPoolEntry;
 class CTxMemPool;
 
 /** \class CBlockPolicyEstimator
- * The BlockPolicyEstimator is used for estimating the fee or priority needed
+ * The BlockPolicyEstimator is used for estimating the feerate needed
  * for a transaction to be included in a block within a certain number of
  * blocks.
  *
  * At a high level the algorithm works by grouping transactions into buckets
- * based on having similar priorities or fees and then tracking how long it
+ * based on having similar feerates and then tracking how long it
  * takes transactions in the various buckets to be mined.  It operates under
- * the assumption that in general transactions of higher fee/priority will be
- * included in blocks before transactions of lower fee/priority.   So for
- * example if you wanted to know what fee you should put on a transaction to
+ * the assumption that in general transactions of higher feerate will be
+ * included in blocks before transactions of lower feerate.   So for
+ * example if you wanted to know what feerate you should put on a transaction to
  * be included in a block within the next 5 blocks, you would start by looking
- * at the bucket with the highest fee transactions and verifying that a
+ * at the bucket with the highest feerate transactions and verifying that a
  * sufficiently high percentage of them were confirmed within 5 blocks and
- * then you would look at the next highest fee bucket, and so on, stopping at
- * the last bucket to pass the test.   The average fee of transactions in this
- * bucket will give you an indication of the lowest fee you can put on a
+ * then you would look at the next highest feerate bucket, and so on, stopping at
+ * the last bucket to pass the test.   The average feerate of transactions in this
+ * bucket will give you an indication of the lowest feerate you can put on a
  * transaction and still have a sufficiently high chance of being confirmed
  * within your desired 5 blocks.
  *
- * When a transaction enters the mempool or is included within a block we
- * decide whether it can be used as a data point for fee estimation, priority
- * estimation or neither.  If the value of exactly one of those properties was
- * below the required minimum it can be used to estimate the other.  In
- * addition, if a priori our estimation code would indicate that the
- * transaction would be much more quickly included in a block because of one
- * of the properties compared to the other, we can also decide to use it as
- * an estimate for that property.
- *
- * Here is a brief description of the implementation for fee estimation.
- * When a transaction that counts for fee estimation enters the mempool, we
- * track the height of the block chain at entry.  Whenever a block comes in,
- * we count the number of transactions in each bucket and the total amount of fee
- * paid in each bucket. Then we calculate how many blocks Y it took each
- * transaction to be mined and we track an array of counters in each bucket
- * for how long it to took transactions to get confirmed from 1 to a max of 25
- * and we increment all the counters from Y up to 25. This is because for any
- * number Z>=Y the transaction was successfully mined within Z blocks.  We
- * want to save a history of this information, so at any time we have a
- * counter of the total number of transactions that happened in a given fee
- * bucket and the total number that were confirmed in each number 1-25 blocks
- * or less for any bucket.   We save this history by keeping an exponentially
- * decaying moving average of each one of these stats.  Furthermore we also
+ * Here is a brief description of the implementation.
+ * When a transaction paying a fee enters the mempool, we track the height of
+ * the block chain at entry.  Whenever a block comes in, we count the number
+ * of transactions in each bucket and the total amount of feerate paid in
+ * each bucket. Then we calculate how many blocks Y it took each transaction
+ * to be mined.  We convert from a number of blocks to a number of periods
+ * Y' each encompassing "scale" blocks.  This is tracked in 3 different data
+ * sets, each up to a maximum number of periods and each with its own decay,
+ * which gives a short, a medium and a long time horizon.  Within each data
+ * set we keep one counter per period and bucket and only increment the
+ * counter for Y'; the number of transactions confirmed within Z periods is
+ * summed up from these counters when an estimate is requested, so recording
+ * a confirmed transaction costs the same regardless of how many targets are
+ * tracked.  We save a history of this information by keeping an
+ * exponentially decaying moving average of each one of these stats.  Rather
+ * than multiplying every counter by the decay on each block, every data set
+ * keeps a single weight that grows by 1/decay per block and new data points
+ * are added with that weight; the counters are only normalized when the
+ * weight becomes large.  The counters are stored per bucket in a database
+ * along with the weight, so writing the estimates only writes the buckets
+ * that changed since the last write.  Furthermore we also
  * keep track of the number unmined (in mempool) transactions in each bucket
  * and for how many blocks they have been outstanding and use that to increase
- * the number of transactions we've seen in that fee bucket when calculating
- * an estimate for any number of confirmations below the number of blocks
- * they've been outstanding.
+ * the number of transactions we've seen in that feerate bucket when
+ * calculating an estimate for any number of confirmations below the number
+ * of blocks they've been outstanding.
+ *
+ * Priority is no longer tracked: zero fee transactions are ignored and
+ * the priority estimates always report failure.
  */
 
+/** Identifies the time horizon a raw fee estimate is requested for */
+enum FeeEstimateHorizon {
+    SHORT_HALFLIFE = 0,
+    MED_HALFLIFE = 1,
+    LONG_HALFLIFE = 2
+};
+
 /**
- * We will instantiate two instances of this class, one to track transactions
- * that were included in a block due to fee, and one for tx's included due to
- * priority.  We will lump transactions into a bucket according to their approximate
- * fee or priority and then track how long it took for those txs to be included in a block
+ * We will instantiate an instance of this class for each time horizon.  We will
+ * lump transactions into a bucket according to their approximate feerate and then
+ * track how long it took for those txs to be included in a block.
  *
- * The tracking of unconfirmed (mempool) transactions is completely independent of the
- * historical tracking of transactions that have been confirmed in a block.
+ * The bucket boundaries and the tracking of unconfirmed (mempool) transactions
+ * are shared between the time horizons and live in CBlockPolicyEstimator.
  */
 class TxConfirmStats
 {
 private:
-    //Define the buckets we will group transactions into (both fee buckets and priority buckets)
-    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
-
     // For each bucket X:
     // Count the total # of txs in each bucket
     // Track the historical moving average of this total over blocks
     std::vector<double> txCtAvg;
-    // and calculate the total for the current block to update the moving average
-    std::vector<int> curBlockTxCt;
 
-    // Count the total # of txs confirmed within Y blocks in each bucket
-    // Track the historical moving average of theses totals over blocks
+    // Count the total # of txs confirmed in period Y (not within Y periods) in each bucket
+    // Track the historical moving average of these counts over blocks
     std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
-    // and calculate the totals for the current block to update the moving averages
-    std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
 
-    // Sum the total priority/fee of all tx's in each bucket
+    // Sum the total feerate of all tx's in each bucket
     // Track the historical moving average of this total over blocks
     std::vector<double> avg;
-    // and calculate the total for the current block to update the moving average
-    std::vector<double> curBlockVal;
 
-    // Combine the conf counts with tx counts to calculate the confirmation % for each Y,X
-    // Combine the total value with the tx counts to calculate the avg fee/priority per bucket
+    // The moving averages above are stored multiplied by this weight, which
+    // new data points are added with and which grows by 1/decay every block
+    double multiplier;
 
-    std::string dataTypeString;
     double decay;
 
-    // Mempool counts of outstanding transactions
-    // For each bucket X, track the number of transactions in the mempool
-    // that are unconfirmed for each possible confirmation value Y
-    std::vector<std::vector<int> > unconfTxs;  //unconfTxs[Y][X]
-    // transactions still unconfirmed after MAX_CONFIRMS for each bucket
-    std::vector<int> oldUnconfTxs;
+    // Resolution (# of blocks) with which confirmations are tracked
+    unsigned int scale;
+
+    // Buckets whose moving averages changed since they were last written
+    std::vector<bool> bucketDirty;
+
+    /** Divide all moving averages by the current weight and reset it to 1 */
+    void Normalize();
 
 public:
     /**
-     * Initialize the data structures.  This is called by BlockPolicyEstimator's
-     * constructor with default values.
-     * @param defaultBuckets contains the upper limits for the bucket boundaries
-     * @param maxConfirms max number of confirms to track
+     * Create new TxConfirmStats.
+     * @param numBuckets number of feerate buckets
+     * @param maxPeriods max number of periods to track
      * @param decay how much to decay the historical moving average per block
-     * @param dataTypeString for logging purposes
+     * @param scale number of blocks per period
      */
-    void Initialize(std::vector<double>& defaultBuckets, unsigned int maxConfirms, double decay, std::string dataTypeString);
-
-    /** Clear the state of the curBlock variables to start counting for the new block */
-    void ClearCurrent(unsigned int nBlockHeight);
+    TxConfirmStats(unsigned int numBuckets, unsigned int maxPeriods, double decay, unsigned int scale);
 
     /**
-     * Record a new transaction data point in the current block stats
+     * Record a new transaction data point
      * @param blocksToConfirm the number of blocks it took this transaction to confirm
-     * @param val either the fee or the priority when entered of the transaction
+     * @param bucketindex the feerate bucket of the transaction
+     * @param val the feerate of the transaction
      * @warning blocksToConfirm is 1-based and has to be >= 1
      */
-    void Record(int blocksToConfirm, double val);
-
-    /** Record a new transaction entering the mempool*/
-    unsigned int NewTx(unsigned int nBlockHeight, double val);
-
-    /** Remove a transaction from mempool tracking stats*/
-    void removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight,
-                  unsigned int bucketIndex);
+    void Record(int blocksToConfirm, unsigned int bucketindex, double val);
 
-    /** Update our estimates by decaying our historical moving average and updating
-        with the data gathered from the current block */
+    /** Decay the historical moving averages before the data of a new block is recorded */
     void UpdateMovingAverages();
 
     /**
-     * Calculate a fee or priority estimate.  Find the lowest value bucket (or range of buckets
+     * Calculate a feerate estimate.  Find the lowest value bucket (or range of buckets
      * to make sure we have enough data points) whose transactions still have sufficient likelihood
      * of being confirmed within the target number of confirmations
      * @param confTarget target number of confirmations
      * @param sufficientTxVal required average number of transactions per block in a bucket range
      * @param minSuccess the success probability we require
-     * @param requireGreater return the lowest fee/pri such that all higher values pass minSuccess OR
-     *        return the highest fee/pri such that all lower values fail minSuccess
-     * @param nBlockHeight the current block height
+     * @param buckets the upper bounds of the feerate buckets, for logging
+     * @param unconfTxs number of mempool transactions per bucket outstanding for at least confTarget blocks
      */
-    double EstimateMedianVal(int confTarget, double sufficientTxVal,
-                             double minSuccess, bool requireGreater, unsigned int nBlockHeight);
+    double EstimateMedianVal(int confTarget, double sufficientTxVal, double minSuccess,
+                             const std::vector<double>& buckets, const std::vector<int>& unconfTxs) const;
 
     /** Return the max number of confirms we're tracking */
-    unsigned int GetMaxConfirms() { return confAvg.size(); }
+    unsigned int GetMaxConfirms() const { return scale * confAvg.size(); }
 
-    /** Write state of estimation data to a file*/
-    void Write(CAutoFile& fileout);
+    double GetDecay() const { return decay; }
+    unsigned int GetScale() const { return scale; }
+
+    /** Queue the buckets changed since the last write, and the weight, to be written under horizon */
+    void Write(CDBBatch& batch, unsigned char horizon) const;
+    /** Mark all buckets as written */
+    void SetClean();
 
     /**
-     * Read saved state of estimation data from a file and replace all internal data structures and
+     * Read saved state of estimation data from a database and replace all internal data structures and
      * variables with this state.
      */
-    void Read(CAutoFile& filein);
+    void Read(const CDBWrapper& db, unsigned char horizon, unsigned int numBuckets);
 };
 
 
 
-/** Track confirm delays up to 25 blocks, can't estimate beyond that */
-static const unsigned int MAX_BLOCK_CONFIRMS = 25;
+/** Track confirm delays up to 12 blocks for the short horizon */
+static const unsigned int SHORT_BLOCK_PERIODS = 12;
+static const unsigned int SHORT_SCALE = 1;
+/** Track confirm delays up to 25 blocks for the medium horizon */
+static const unsigned int MED_BLOCK_PERIODS = 25;
+static const unsigned int MED_SCALE = 1;
+/** Track confirm delays up to 1008 blocks (one week) for the long horizon, in periods of 24 blocks */
+static const unsigned int LONG_BLOCK_PERIODS = 42;
+static const unsigned int LONG_SCALE = 24;
 
+/** Decay of .962 is a half-life of 18 blocks or about 3 hours */
+static const double SHORT_DECAY = .962;
 /** Decay of .998 is a half-life of 346 blocks or about 2.4 days */
-static const double DEFAULT_DECAY = .998;
+static const double MED_DECAY = .998;
+/** Decay of .9995 is a half-life of 1386 blocks or about 9.6 days */
+static const double LONG_DECAY = .9995;
 
-/** Require greater than 95% of X fee transactions to be confirmed within Y blocks for X to be big enough */
+/** Require greater than 95% of X feerate transactions to be confirmed within Y blocks for X to be big enough */
 static const double MIN_SUCCESS_PCT = .95;
-static const double UNLIKELY_PCT = .5;
 
-/** Require an avg of 1 tx in the combined fee bucket per block to have stat significance */
+/** Require an avg of 1 tx in the combined feerate bucket per block to have stat significance */
 static const double SUFFICIENT_FEETXS = 1;
 
-/** Require only an avg of 1 tx every 5 blocks in the combined pri bucket (way less pri txs) */
-static const double SUFFICIENT_PRITXS = .2;
-
-// Minimum and Maximum values for tracking fees and priorities
+// Minimum and Maximum values for tracking feerates
 static const double MIN_FEERATE = 10;
 static const double MAX_FEERATE = 1e7;
 static const double INF_FEERATE = MAX_MONEY;
-static const double MIN_PRIORITY = 10;
-static const double MAX_PRIORITY = 1e16;
 static const double INF_PRIORITY = 1e9 * MAX_MONEY;
 
-// We have to lump transactions into buckets based on fee or priority, but we want to be able
-// to give accurate estimates over a large range of potential fees and priorities
+// We have to lump transactions into buckets based on feerate, but we want to be able
+// to give accurate estimates over a large range of potential feerates
 // Therefore it makes sense to exponentially space the buckets
 /** Spacing of FeeRate buckets */
 static const double FEE_SPACING = 1.1;
 
-/** Spacing of Priority buckets */
-static const double PRI_SPACING = 2;
-
 /**
- *  We want to be able to estimate fees or priorities that are needed on tx's to be included in
+ *  We want to be able to estimate feerates that are needed on tx's to be included in
  * a certain number of blocks.  Every time a block is added to the best chain, this class records
  * stats on the transactions included in that block
  */
@@ -225,66 +222,104 @@ public:
     void processBlock(unsigned int nBlockHeight,
                       std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate);
 
-    /** Process a transaction confirmed in a block*/
-    void processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry);
-
     /** Process a transaction accepted to the mempool*/
     void processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate);
 
     /** Remove a transaction from the mempool tracking stats*/
     void removeTx(uint256 hash);
 
-    /** Is this transaction likely included in a block because of its fee?*/
-    bool isFeeDataPoint(const CFeeRate &fee, double pri);
-
-    /** Is this transaction likely included in a block because of its priority?*/
-    bool isPriDataPoint(const CFeeRate &fee, double pri);
-
-    /** Return a fee estimate */
+    /** Return a feerate estimate */
     CFeeRate estimateFee(int confTarget);
 
-    /** Estimate fee rate needed to get be included in a block within
+    /** Return a feerate estimate using only the data of the given time horizon */
+    CFeeRate estimateRawFee(int confTarget, FeeEstimateHorizon horizon);
+
+    /** Estimate feerate needed to get be included in a block within
      *  confTarget blocks. If no answer can be given at confTarget, return an
      *  estimate at the lowest target where one can be given.
+     *  The estimate is never below minPoolFee.
      */
-    CFeeRate estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool);
+    CFeeRate estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CFeeRate& minPoolFee);
 
-    /** Return a priority estimate */
+    /** Return a priority estimate; priority is no longer tracked so this always fails */
     double estimatePriority(int confTarget);
 
-    /** Estimate priority needed to get be included in a block within
-     *  confTarget blocks. If no answer can be given at confTarget, return an
-     *  estimate at the lowest target where one can be given.
+    /** Priority is no longer tracked: return INF_PRIORITY if the mempool is
+     *  limiting transactions (minPoolFee is set) and failure otherwise.
      */
-    double estimateSmartPriority(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool);
+    double estimateSmartPriority(int confTarget, int *answerFoundAtTarget, const CFeeRate& minPoolFee);
 
-    /** Write estimation data to a file */
-    void Write(CAutoFile& fileout);
+    /** Return the highest confirmation target the given time horizon can estimate */
+    unsigned int HighestTargetTracked(FeeEstimateHorizon horizon);
 
-    /** Read estimation data from a file */
-    void Read(CAutoFile& filein);
+    /** Has any block been processed since the estimates were last written? */
+    bool IsDirty();
+
+    /** Write the estimation data changed since the last write to a database */
+    void Write(CDBWrapper& db);
+
+    /**
+     * Read estimation data from a database, throwing if it is corrupt
+     * @return false if the database holds no estimates
+     */
+    bool Read(const CDBWrapper& db);
 
 private:
+    CCriticalSection cs;
     CFeeRate minTrackedFee;    //!< Passed to constructor to avoid dependency on main
-    double minTrackedPriority; //!< Set to AllowFreeThreshold
     unsigned int nBestSeenHeight;
+    unsigned int nLastWrittenHeight;
     struct TxStatsInfo
     {
-        TxConfirmStats *stats;
         unsigned int blockHeight;
         unsigned int bucketIndex;
-        TxStatsInfo() : stats(NULL), blockHeight(0), bucketIndex(0) {}
+        TxStatsInfo() : blockHeight(0), bucketIndex(0) {}
     };
 
     // map of txids to information about that transaction
     std::map<uint256, TxStatsInfo> mapMemPoolTxs;
 
+    //Define the buckets we will group transactions into
+    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
+
     /** Classes to track historical data on transaction confirmations */
-    TxConfirmStats feeStats, priStats;
+    TxConfirmStats shortStats, feeStats, longStats;
+
+    // Mempool counts of outstanding transactions
+    // For each bucket X, track the number of transactions in the mempool
+    // that are unconfirmed for each possible confirmation value Y
+    std::vector<std::vector<int> > unconfTxs;  //unconfTxs[Y][X]
+    // For each bucket X, a Fenwick tree over the slots Y of unconfTxs, to
+    // sum the transactions outstanding for a range of blocks in log time
+    std::vector<std::vector<int> > unconfTxsTree;  //unconfTxsTree[X][Y]
+    // transactions still unconfirmed after the longest tracked target for each bucket
+    std::vector<int> oldUnconfTxs;
+
+    /** Return the index of the bucket val falls into */
+    unsigned int BucketIndex(double val) const;
+
+    /** Process a transaction confirmed in a block*/
+    void processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry);
+
+    /** Clear the unconfirmed counts of the slot nBlockHeight reuses */
+    void ClearCurrent(unsigned int nBlockHeight);
+
+    /** Add n to the unconfirmed count of slot and bucket */
+    void AddUnconfirmed(unsigned int slot, unsigned int bucket, int n);
+
+    /** Sum the unconfirmed counts of bucket in the slots before slotEnd */
+    int SumUnconfirmed(unsigned int bucket, unsigned int slotEnd) const;
+
+    /** Count the mempool transactions per bucket that have been outstanding for at least nBlocks */
+    std::vector<int> UnconfirmedSince(int nBlocks) const;
+
+    /** Calculate a feerate estimate from one horizon, -1 on failure */
+    double EstimateMedianVal(const TxConfirmStats& stats, int confTarget) const;
+
+    const TxConfirmStats& GetStats(FeeEstimateHorizon horizon) const;
 
-    /** Breakpoints to help determine whether a transaction was confirmed by priority or Fee */
-    CFeeRate feeLikely, feeUnlikely;
-    double priLikely, priUnlikely;
+    /** Reset the mempool tracking to the current number of buckets and longest target */
+    void ResetUnconfirmed();
 };
 
 class FeeFilterRounder
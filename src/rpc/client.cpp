@@ -26,6 +26,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
 {
     { "stop", 0 },
     { "setmocktime", 0 },
+    { "getlockprofile", 0 },
     { "generate", 0 },
     { "generate", 1 },
     { "generatetoaddress", 0 },
@@ -34,6 +35,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getnetworkhashps", 1 },
     { "sendtoaddress", 1 },
     { "sendtoaddress", 4 },
+    { "queuesend", 1 },
+    { "queuesend", 2 },
     { "settxfee", 0 },
     { "getreceivedbyaddress", 1 },
     { "getreceivedbyaccount", 1 },
@@ -59,6 +62,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getblocktemplate", 0 },
     { "listsinceblock", 1 },
     { "listsinceblock", 2 },
+    { "listsinceblock", 3 },
     { "sendmany", 1 },
     { "sendmany", 2 },
     { "sendmany", 4 },
@@ -89,6 +93,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "importaddress", 2 },
     { "importaddress", 3 },
     { "importpubkey", 2 },
+    { "importmulti", 0 },
+    { "importmulti", 1 },
     { "verifychain", 0 },
     { "verifychain", 1 },
     { "keypoolrefill", 0 },
@@ -97,6 +103,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "estimatepriority", 0 },
     { "estimatesmartfee", 0 },
     { "estimatesmartpriority", 0 },
+    { "estimaterawfee", 0 },
+    { "estimaterawfee", 1 },
     { "prioritisetransaction", 1 },
     { "prioritisetransaction", 2 },
     { "setban", 2 },
@@ -15,6 +15,7 @@
 #include "main.h"
 #include "miner.h"
 #include "net.h"
+#include "policy/fees.h"
 #include "pow.h"
 #include "rpc/server.h"
 #include "txmempool.h"
@@ -779,7 +780,7 @@ UniValue estimatefee(const UniValue& params, bool fHelp)
             "\nEstimates the approximate fee per kilobyte needed for a transaction to begin\n"
             "confirmation within nblocks blocks.\n"
             "\nArguments:\n"
-            "1. nblocks     (numeric)\n"
+            "1. nblocks     (numeric) up to 1008, targets above 25 are estimated in steps of 24 blocks\n"
             "\nResult:\n"
             "n              (numeric) estimated fee-per-kilobyte\n"
             "\n"
@@ -807,15 +808,12 @@ UniValue estimatepriority(const UniValue& params, bool fHelp)
     if (fHelp || params.size() != 1)
         throw runtime_error(
             "estimatepriority nblocks\n"
-            "\nEstimates the approximate priority a zero-fee transaction needs to begin\n"
-            "confirmation within nblocks blocks.\n"
+            "\nDEPRECATED. Priority is no longer tracked by fee estimation, so this\n"
+            "always returns a negative value.\n"
             "\nArguments:\n"
             "1. nblocks     (numeric)\n"
             "\nResult:\n"
             "n              (numeric) estimated priority\n"
-            "\n"
-            "A negative value is returned if not enough transactions and blocks\n"
-            "have been observed to make an estimate.\n"
             "\nExample:\n"
             + HelpExampleCli("estimatepriority", "6")
             );
@@ -871,9 +869,7 @@ UniValue estimatesmartpriority(const UniValue& params, bool fHelp)
         throw runtime_error(
             "estimatesmartpriority nblocks\n"
             "\nWARNING: This interface is unstable and may disappear or change!\n"
-            "\nEstimates the approximate priority a zero-fee transaction needs to begin\n"
-            "confirmation within nblocks blocks if possible and return the number of blocks\n"
-            "for which the estimate is valid.\n"
+            "\nDEPRECATED. Priority is no longer tracked by fee estimation.\n"
             "\nArguments:\n"
             "1. nblocks     (numeric)\n"
             "\nResult:\n"
@@ -882,9 +878,8 @@ UniValue estimatesmartpriority(const UniValue& params, bool fHelp)
             "  \"blocks\" : n         (numeric) block number where estimate was found\n"
             "}\n"
             "\n"
-            "A negative value is returned if not enough transactions and blocks\n"
-            "have been observed to make an estimate for any number of blocks.\n"
-            "However if the mempool reject fee is set it will return 1e9 * MAX_MONEY.\n"
+            "A negative value is returned, unless the mempool reject fee is set,\n"
+            "in which case it will return 1e9 * MAX_MONEY.\n"
             "\nExample:\n"
             + HelpExampleCli("estimatesmartpriority", "6")
             );
@@ -901,6 +896,52 @@ UniValue estimatesmartpriority(const UniValue& params, bool fHelp)
     return result;
 }
 
+UniValue estimaterawfee(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "estimaterawfee nblocks ( horizon )\n"
+            "\nWARNING: This interface is unstable and may disappear or change!\n"
+            "\nEstimates the approximate fee per kilobyte needed for a transaction to begin\n"
+            "confirmation within nblocks blocks, using only the data of one time horizon.\n"
+            "\nArguments:\n"
+            "1. nblocks     (numeric)\n"
+            "2. horizon     (numeric, optional, default=1) 0 for the short, 1 for the medium\n"
+            "               and 2 for the long time horizon\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"feerate\" : x.x,     (numeric) estimate fee-per-kilobyte (in BTC)\n"
+            "  \"decay\" : x.x,       (numeric) exponential decay (per block) of the horizon's data\n"
+            "  \"scale\" : n,         (numeric) resolution of confirmation targets of the horizon\n"
+            "  \"maxtarget\" : n      (numeric) highest number of blocks the horizon can estimate for\n"
+            "}\n"
+            "\n"
+            "A negative feerate is returned if not enough transactions and blocks\n"
+            "have been observed to make an estimate.\n"
+            "\nExample:\n"
+            + HelpExampleCli("estimaterawfee", "6 0")
+            );
+
+    RPCTypeCheck(params, boost::assign::list_of(UniValue::VNUM)(UniValue::VNUM), true);
+
+    int nBlocks = params[0].get_int();
+    int nHorizon = params.size() > 1 ? params[1].get_int() : MED_HALFLIFE;
+    if (nHorizon < SHORT_HALFLIFE || nHorizon > LONG_HALFLIFE)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid horizon");
+    FeeEstimateHorizon horizon = (FeeEstimateHorizon)nHorizon;
+
+    static const double decays[] = {SHORT_DECAY, MED_DECAY, LONG_DECAY};
+    static const unsigned int scales[] = {SHORT_SCALE, MED_SCALE, LONG_SCALE};
+
+    UniValue result(UniValue::VOBJ);
+    CFeeRate feeRate = mempool.estimateRawFee(nBlocks, horizon);
+    result.push_back(Pair("feerate", feeRate == CFeeRate(0) ? -1.0 : ValueFromAmount(feeRate.GetFeePerK())));
+    result.push_back(Pair("decay", decays[horizon]));
+    result.push_back(Pair("scale", (int)scales[horizon]));
+    result.push_back(Pair("maxtarget", (int)mempool.HighestFeeEstimateTarget(horizon)));
+    return result;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         okSafeMode
   //  --------------------- ------------------------  -----------------------  ----------
@@ -917,6 +958,7 @@ static const CRPCCommand commands[] =
     { "util",               "estimatepriority",       &estimatepriority,       true  },
     { "util",               "estimatesmartfee",       &estimatesmartfee,       true  },
     { "util",               "estimatesmartpriority",  &estimatesmartpriority,  true  },
+    { "util",               "estimaterawfee",         &estimaterawfee,         true  },
 };
 
 void RegisterMiningRPCCommands(CRPCTable &t)
@@ -10,6 +10,7 @@
 #include "net.h"
 #include "netbase.h"
 #include "rpc/server.h"
+#include "sync.h"
 #include "timedata.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -18,6 +19,7 @@
 #include "wallet/walletdb.h"
 #endif
 
+#include <algorithm>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
@@ -484,10 +486,72 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+static bool CompareLockWaitTime(const CLockSiteStats& a, const CLockSiteStats& b)
+{
+    if (a.nWaitTime != b.nWaitTime)
+        return a.nWaitTime > b.nWaitTime;
+    return a.nHoldTime > b.nHoldTime;
+}
+
+UniValue getlockprofile(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getlockprofile ( reset )\n"
+            "\nReturns the lock acquisitions recorded since startup or the last reset, by the place in the source\n"
+            "they were made, most waited for first. Needs -lockprofile.\n"
+            "\nArguments:\n"
+            "1. reset      (boolean, optional, default=false) Clear the profile after returning it\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"lock\": \"name\",         (string) The lock, as named where it is taken\n"
+            "    \"site\": \"file:line\",    (string) Where the lock is taken\n"
+            "    \"count\": n,              (numeric) Number of acquisitions\n"
+            "    \"contended\": n,          (numeric) Number of acquisitions that had to wait\n"
+            "    \"waittime\": n,           (numeric) Total time waited in seconds\n"
+            "    \"maxwait\": n,            (numeric) Longest wait in seconds\n"
+            "    \"holdsamples\": n,        (numeric) Number of acquisitions whose hold time was measured\n"
+            "    \"holdtime\": n,           (numeric) Total hold time of the sampled acquisitions in seconds\n"
+            "    \"maxhold\": n             (numeric) Longest sampled hold in seconds\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getlockprofile", "")
+            + HelpExampleRpc("getlockprofile", "true")
+        );
+
+    if (!fLockProfile)
+        throw JSONRPCError(RPC_MISC_ERROR, "Lock profiling is disabled, start with -lockprofile");
+
+    std::vector<CLockSiteStats> vStats = GetLockProfile(params.size() > 0 && params[0].get_bool());
+    std::sort(vStats.begin(), vStats.end(), CompareLockWaitTime);
+
+    UniValue ret(UniValue::VARR);
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats) {
+        if (stats.nCount == 0)
+            continue;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("lock", stats.strName));
+        obj.push_back(Pair("site", strprintf("%s:%d", stats.strFile, stats.nLine)));
+        obj.push_back(Pair("count", stats.nCount));
+        obj.push_back(Pair("contended", stats.nContended));
+        obj.push_back(Pair("waittime", stats.nWaitTime * 0.000001));
+        obj.push_back(Pair("maxwait", stats.nMaxWaitTime * 0.000001));
+        obj.push_back(Pair("holdsamples", stats.nHoldSamples));
+        obj.push_back(Pair("holdtime", stats.nHoldTime * 0.000001));
+        obj.push_back(Pair("maxhold", stats.nMaxHoldTime * 0.000001));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         okSafeMode
   //  --------------------- ------------------------  -----------------------  ----------
     { "control",            "getinfo",                &getinfo,                true  }, /* uses wallet if enabled */
+    { "control",            "getlockprofile",         &getlockprofile,         true  },
     { "util",               "validateaddress",        &validateaddress,        true  }, /* uses wallet if enabled */
     { "util",               "createmultisig",         &createmultisig,         true  },
     { "util",               "createwitnessaddress",   &createwitnessaddress,   true  },
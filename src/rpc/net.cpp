@@ -7,6 +7,7 @@
 #include "chainparams.h"
 #include "clientversion.h"
 #include "main.h"
+#include "metrics.h"
 #include "net.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -97,6 +98,7 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"bytesrecv\": n,            (numeric) The total bytes received\n"
             "    \"conntime\": ttt,           (numeric) The connection time in seconds since epoch (Jan 1 1970 GMT)\n"
             "    \"timeoffset\": ttt,         (numeric) The time offset in seconds\n"
+            "    \"processingtime\": n,       (numeric) Seconds spent processing messages of the peer (with -metrics)\n"
             "    \"pingtime\": n,             (numeric) ping time (if available)\n"
             "    \"minping\": n,              (numeric) minimum observed ping time (if any at all)\n"
             "    \"pingwait\": n,             (numeric) ping wait (if non-zero)\n"
@@ -150,6 +152,8 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         obj.push_back(Pair("bytesrecv", stats.nRecvBytes));
         obj.push_back(Pair("conntime", stats.nTimeConnected));
         obj.push_back(Pair("timeoffset", stats.nTimeOffset));
+        if (fMetrics)
+            obj.push_back(Pair("processingtime", stats.nProcessingTime * 0.000001));
         if (stats.dPingTime > 0.0)
             obj.push_back(Pair("pingtime", stats.dPingTime));
         if (stats.dPingMin < std::numeric_limits<int64_t>::max()/1e6)
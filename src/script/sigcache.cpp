@@ -11,6 +11,8 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <atomic>
+
 #include <boost/thread.hpp>
 #include <boost/unordered_set.hpp>
 
@@ -87,6 +89,16 @@ public:
     }
 };
 
+//! Signatures found in the cache and verified, for the metrics
+std::atomic<uint64_t> nSignatureCacheHits(0);
+std::atomic<uint64_t> nSignatureCacheMisses(0);
+
+}
+
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses)
+{
+    nHits = nSignatureCacheHits.load(std::memory_order_relaxed);
+    nMisses = nSignatureCacheMisses.load(std::memory_order_relaxed);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
@@ -97,11 +109,13 @@ bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsig
     signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
     if (signatureCache.Get(entry)) {
+        nSignatureCacheHits.fetch_add(1, std::memory_order_relaxed);
         if (!store) {
             signatureCache.Erase(entry);
         }
         return true;
     }
+    nSignatureCacheMisses.fetch_add(1, std::memory_order_relaxed);
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
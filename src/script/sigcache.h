@@ -16,6 +16,9 @@ static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 40;
 
 class CPubKey;
 
+/** Number of signature checks answered by the cache and verified since startup */
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses);
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -332,6 +332,14 @@ public:
         clear();
     }
 
+    /** Exchange the whole underlying buffer with data, and read from its start */
+    void SwapBuffer(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
+
+    size_type capacity() const { return vch.capacity(); }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
@@ -343,7 +351,22 @@ public:
             return;
         }
 
-        for (size_type i = 0, j = 0; i != size(); i++) {
+        size_type i = 0;
+        if (key.size() == 8) {
+            // Database obfuscation keys are 8 bytes: do whole words, which
+            // the compiler can vectorize, and leave only the tail to the loop
+            // below.  memcpy keeps this safe for unaligned data.
+            uint64_t nKey;
+            memcpy(&nKey, &key[0], 8);
+            for (; i + 8 <= size(); i += 8) {
+                uint64_t nWord;
+                memcpy(&nWord, &vch[i], 8);
+                nWord ^= nKey;
+                memcpy(&vch[i], &nWord, 8);
+            }
+        }
+
+        for (size_type j = 0; i != size(); i++) {
             vch[i] ^= key[j++];
 
             // This potentially acts on very many bytes of data, so it's
@@ -7,6 +7,7 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
+#include <algorithm>
 #include <stdio.h>
 
 #include <boost/foreach.hpp>
@@ -20,6 +21,158 @@ void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 }
 #endif /* DEBUG_LOCKCONTENTION */
 
+static std::unique_ptr<CMetricHistogramSet> pmetricsLockWait;
+//! Locks with their own histogram, in the order of their names in pmetricsLockWait
+static std::vector<void*> vMetricLocks;
+
+void InitLockMetrics(const std::vector<std::pair<std::string, void*> >& vLocks)
+{
+    std::vector<std::string> vNames;
+    vMetricLocks.clear();
+    for (size_t i = 0; i < vLocks.size(); i++) {
+        vNames.push_back(vLocks[i].first);
+        vMetricLocks.push_back(vLocks[i].second);
+    }
+    pmetricsLockWait.reset(new CMetricHistogramSet("bitcoin_lock_wait_seconds", "Time spent waiting for contended locks", "lock", vNames));
+}
+
+void LockWaited(void* cs, int64_t nMicros)
+{
+    if (!fMetrics || !pmetricsLockWait)
+        return;
+    size_t i = 0;
+    while (i < vMetricLocks.size() && vMetricLocks[i] != cs)
+        i++;
+    // Past the registered locks is the histogram of all others
+    pmetricsLockWait->Get(i).Observe(nMicros);
+}
+
+void WriteLockMetrics(std::string& strOut)
+{
+    if (pmetricsLockWait)
+        pmetricsLockWait->Write(strOut);
+}
+
+//
+// Lock profiling.
+// Every LOCK and TRY_LOCK call site gets a slot in a fixed open addressing
+// table the first time it acquires a lock, keyed by the address of its
+// __FILE__ string and its line.  Slots are never freed, so acquisitions find
+// theirs and update its counters without taking a lock of their own.
+//
+
+std::atomic<bool> fLockProfile(false);
+
+//! Number of call sites that can be profiled, a power of two
+static const size_t LOCK_PROFILE_SITES = 4096;
+
+struct CLockProfileSite
+{
+    enum {
+        EMPTY = 0,
+        CLAIMED,
+        READY,
+    };
+    std::atomic<int> nState;
+    const char* pszName;
+    const char* pszFile;
+    int nLine;
+
+    std::atomic<uint64_t> nCount;
+    std::atomic<uint64_t> nContended;
+    std::atomic<int64_t> nWaitTime;
+    std::atomic<int64_t> nMaxWaitTime;
+    std::atomic<uint64_t> nHoldSamples;
+    std::atomic<int64_t> nHoldTime;
+    std::atomic<int64_t> nMaxHoldTime;
+};
+
+//! Zero initialized as it has static storage, so usable before any constructor ran
+static CLockProfileSite vLockProfileSites[LOCK_PROFILE_SITES];
+static std::atomic<int> nLockProfileSampleRate(DEFAULT_LOCK_PROFILE_SAMPLE_RATE);
+
+void StartLockProfile(int nSampleRate)
+{
+    nLockProfileSampleRate = std::max(nSampleRate, 1);
+    fLockProfile = true;
+}
+
+static CLockProfileSite* FindLockProfileSite(const char* pszName, const char* pszFile, int nLine)
+{
+    const size_t nHash = ((size_t)pszFile >> 2) * 0x9e3779b1 + nLine;
+    for (size_t i = 0; i < LOCK_PROFILE_SITES; i++) {
+        CLockProfileSite& site = vLockProfileSites[(nHash + i) & (LOCK_PROFILE_SITES - 1)];
+        int nState = site.nState.load(std::memory_order_acquire);
+        if (nState == CLockProfileSite::EMPTY) {
+            if (site.nState.compare_exchange_strong(nState, CLockProfileSite::CLAIMED)) {
+                site.pszName = pszName;
+                site.pszFile = pszFile;
+                site.nLine = nLine;
+                site.nState.store(CLockProfileSite::READY, std::memory_order_release);
+                return &site;
+            }
+        }
+        // Another thread is filling in the slot
+        while (nState != CLockProfileSite::READY)
+            nState = site.nState.load(std::memory_order_acquire);
+        if (site.pszFile == pszFile && site.nLine == nLine)
+            return &site;
+    }
+    // Full, the site goes unprofiled
+    return NULL;
+}
+
+static void UpdateMax(std::atomic<int64_t>& nMax, int64_t nValue)
+{
+    int64_t nOld = nMax.load(std::memory_order_relaxed);
+    while (nValue > nOld && !nMax.compare_exchange_weak(nOld, nValue, std::memory_order_relaxed)) {}
+}
+
+CLockProfileSite* ProfileLockAcquired(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros)
+{
+    CLockProfileSite* psite = FindLockProfileSite(pszName, pszFile, nLine);
+    if (!psite)
+        return NULL;
+    uint64_t nCount = psite->nCount.fetch_add(1, std::memory_order_relaxed);
+    if (nWaitMicros >= 0) {
+        psite->nContended.fetch_add(1, std::memory_order_relaxed);
+        psite->nWaitTime.fetch_add(nWaitMicros, std::memory_order_relaxed);
+        UpdateMax(psite->nMaxWaitTime, nWaitMicros);
+    }
+    return nCount % nLockProfileSampleRate.load(std::memory_order_relaxed) == 0 ? psite : NULL;
+}
+
+void ProfileLockReleased(CLockProfileSite* psite, int64_t nHoldMicros)
+{
+    psite->nHoldSamples.fetch_add(1, std::memory_order_relaxed);
+    psite->nHoldTime.fetch_add(nHoldMicros, std::memory_order_relaxed);
+    UpdateMax(psite->nMaxHoldTime, nHoldMicros);
+}
+
+std::vector<CLockSiteStats> GetLockProfile(bool fReset)
+{
+    std::vector<CLockSiteStats> vStats;
+    for (size_t i = 0; i < LOCK_PROFILE_SITES; i++) {
+        CLockProfileSite& site = vLockProfileSites[i];
+        if (site.nState.load(std::memory_order_acquire) != CLockProfileSite::READY)
+            continue;
+        CLockSiteStats stats;
+        stats.strName = site.pszName;
+        stats.strFile = site.pszFile;
+        stats.nLine = site.nLine;
+        // Samples taken while resetting may be lost, which is fine for a profile
+        stats.nCount = fReset ? site.nCount.exchange(0) : site.nCount.load();
+        stats.nContended = fReset ? site.nContended.exchange(0) : site.nContended.load();
+        stats.nWaitTime = fReset ? site.nWaitTime.exchange(0) : site.nWaitTime.load();
+        stats.nMaxWaitTime = fReset ? site.nMaxWaitTime.exchange(0) : site.nMaxWaitTime.load();
+        stats.nHoldSamples = fReset ? site.nHoldSamples.exchange(0) : site.nHoldSamples.load();
+        stats.nHoldTime = fReset ? site.nHoldTime.exchange(0) : site.nHoldTime.load();
+        stats.nMaxHoldTime = fReset ? site.nMaxHoldTime.exchange(0) : site.nMaxHoldTime.load();
+        vStats.push_back(stats);
+    }
+    return vStats;
+}
+
 #ifdef DEBUG_LOCKORDER
 //
 // Early deadlock detection.
@@ -6,7 +6,13 @@
 #ifndef BITCOIN_SYNC_H
 #define BITCOIN_SYNC_H
 
+#include "metrics.h"
 #include "threadsafety.h"
+#include "utiltime.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
 
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
@@ -108,24 +114,90 @@ typedef boost::condition_variable CConditionVariable;
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/**
+ * Collect the wait times of the given locks for the metrics, each under its
+ * name and the others together.  Call before fMetrics is set.
+ */
+void InitLockMetrics(const std::vector<std::pair<std::string, void*> >& vLocks);
+/** Record how long a contended lock was waited for */
+void LockWaited(void* cs, int64_t nMicros);
+/** Append the lock wait times in Prometheus text format */
+void WriteLockMetrics(std::string& strOut);
+
+/** Whether lock acquisitions are profiled by call site, set once at startup */
+extern std::atomic<bool> fLockProfile;
+//! Default for -lockprofile
+static const bool DEFAULT_LOCK_PROFILE = false;
+//! Default for -lockprofilesamplerate
+static const int DEFAULT_LOCK_PROFILE_SAMPLE_RATE = 16;
+
+struct CLockProfileSite;
+
+/** Acquisitions, waits and sampled hold times of the locks taken at one place */
+struct CLockSiteStats
+{
+    std::string strName;
+    std::string strFile;
+    int nLine;
+    uint64_t nCount;
+    uint64_t nContended;
+    int64_t nWaitTime;
+    int64_t nMaxWaitTime;
+    uint64_t nHoldSamples;
+    int64_t nHoldTime;
+    int64_t nMaxHoldTime;
+};
+
+/** Start profiling locks, timing the hold of one in nSampleRate acquisitions of each call site */
+void StartLockProfile(int nSampleRate);
+/**
+ * Record an acquisition, nWaitMicros being negative if the lock was free.
+ * Returns the site when the hold time of this acquisition is to be sampled.
+ */
+CLockProfileSite* ProfileLockAcquired(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros);
+/** Record the hold time of a sampled acquisition */
+void ProfileLockReleased(CLockProfileSite* psite, int64_t nHoldMicros);
+/** Statistics of every call site seen, times in microseconds; fReset starts over afterwards */
+std::vector<CLockSiteStats> GetLockProfile(bool fReset = false);
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template <typename Mutex>
 class SCOPED_LOCKABLE CMutexLock
 {
 private:
     boost::unique_lock<Mutex> lock;
+    //! Call site of a sampled acquisition, and when it was made
+    CLockProfileSite* pprofileSite;
+    int64_t nProfileStart;
+
+    void Acquired(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros)
+    {
+        pprofileSite = ProfileLockAcquired(pszName, pszFile, nLine, nWaitMicros);
+        if (pprofileSite)
+            nProfileStart = GetTimeMicros();
+    }
 
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
-#ifdef DEBUG_LOCKCONTENTION
+#ifndef DEBUG_LOCKCONTENTION
+        if (!fMetrics && !fLockProfile) {
+            lock.lock();
+            return;
+        }
+#endif
+        int64_t nWaitMicros = -1;
         if (!lock.try_lock()) {
+#ifdef DEBUG_LOCKCONTENTION
             PrintLockContention(pszName, pszFile, nLine);
 #endif
+            int64_t nStart = GetTimeMicros();
             lock.lock();
-#ifdef DEBUG_LOCKCONTENTION
+            nWaitMicros = GetTimeMicros() - nStart;
+            LockWaited((void*)(lock.mutex()), nWaitMicros);
         }
-#endif
+        if (fLockProfile)
+            Acquired(pszName, pszFile, nLine, nWaitMicros);
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
@@ -134,11 +206,13 @@ private:
         lock.try_lock();
         if (!lock.owns_lock())
             LeaveCritical();
+        else if (fLockProfile)
+            Acquired(pszName, pszFile, nLine, -1);
         return lock.owns_lock();
     }
 
 public:
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(mutexIn) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(mutexIn) : lock(mutexIn, boost::defer_lock), pprofileSite(NULL), nProfileStart(0)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -146,7 +220,7 @@ public:
             Enter(pszName, pszFile, nLine);
     }
 
-    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(pmutexIn)
+    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(pmutexIn) : pprofileSite(NULL), nProfileStart(0)
     {
         if (!pmutexIn) return;
 
@@ -161,6 +235,8 @@ public:
     {
         if (lock.owns_lock())
             LeaveCritical();
+        if (pprofileSite)
+            ProfileLockReleased(pprofileSite, GetTimeMicros() - nProfileStart);
     }
 
     operator bool()
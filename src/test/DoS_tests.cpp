@@ -25,10 +25,12 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxPeerUsage);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nUsage;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
@@ -186,13 +188,76 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
 }
 
+static CTransaction SimpleOrphan()
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansQuotaAndExpiry)
+{
+    const size_t nNoLimit = std::numeric_limits<size_t>::max();
+    int64_t nStartTime = GetTime();
+
+    // Ten orphans from peer 1, a minute apart, and two from peer 2:
+    std::vector<CTransaction> vPeer1;
+    for (int i = 0; i < 10; i++)
+    {
+        SetMockTime(nStartTime + i * 60);
+        vPeer1.push_back(SimpleOrphan());
+        BOOST_CHECK(AddOrphanTx(vPeer1.back(), 1));
+    }
+    std::vector<CTransaction> vPeer2;
+    for (int i = 0; i < 2; i++)
+    {
+        vPeer2.push_back(SimpleOrphan());
+        BOOST_CHECK(AddOrphanTx(vPeer2.back(), 2));
+    }
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 12U);
+
+    // A per-peer quota of five orphans drops the oldest five of peer 1 only:
+    size_t nUsage = mapOrphanTransactions[vPeer1[0].GetHash()].nUsage;
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(100, 5 * nUsage), 5U);
+    for (int i = 0; i < 10; i++)
+        BOOST_CHECK_EQUAL(mapOrphanTransactions.count(vPeer1[i].GetHash()), i < 5 ? 0U : 1U);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 7U);
+
+    // The global limit evicts from the peer using the most memory, oldest first:
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(6, nNoLimit), 1U);
+    BOOST_CHECK(!mapOrphanTransactions.count(vPeer1[5].GetHash()));
+    BOOST_CHECK(mapOrphanTransactions.count(vPeer2[0].GetHash()));
+    BOOST_CHECK(mapOrphanTransactions.count(vPeer2[1].GetHash()));
+
+    // Orphans expire once ORPHAN_TX_EXPIRE_TIME has passed since they arrived:
+    SetMockTime(nStartTime + 7 * 60 + ORPHAN_TX_EXPIRE_TIME);
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(100, nNoLimit), 0U);
+    BOOST_CHECK(!mapOrphanTransactions.count(vPeer1[6].GetHash()));
+    BOOST_CHECK(!mapOrphanTransactions.count(vPeer1[7].GetHash()));
+    BOOST_CHECK(mapOrphanTransactions.count(vPeer1[8].GetHash()));
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 4U);
+
+    SetMockTime(nStartTime + 10 * 60 + ORPHAN_TX_EXPIRE_TIME);
+    LimitOrphanTxSize(100, nNoLimit);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,128 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+#include "blockfilterindex.h"
+
+#include "clientversion.h"
+#include "key.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+static uint64_t RandomFilterHash()
+{
+    return (((uint64_t)insecure_rand() << 32) | insecure_rand()) >> (64 - BLOCK_FILTER_HASH_BITS);
+}
+
+static std::set<uint64_t> HashSet(uint64_t nHash)
+{
+    return std::set<uint64_t>(&nHash, &nHash + 1);
+}
+
+BOOST_FIXTURE_TEST_SUITE(blockfilter_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockfilter_match)
+{
+    BOOST_CHECK(!CBlockFilter().MatchAny(HashSet(0)));
+
+    std::vector<uint64_t> vHashes;
+    for (int i = 0; i < 1000; i++)
+        vHashes.push_back(RandomFilterHash());
+    vHashes.push_back(vHashes[0]);
+    vHashes.push_back(0);
+    vHashes.push_back(((uint64_t)1 << BLOCK_FILTER_HASH_BITS) - 1);
+    CBlockFilter filter(vHashes);
+    BOOST_CHECK_EQUAL(filter.GetElementCount(), 1002U);
+
+    // Round trip through serialization
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << filter;
+    CBlockFilter filter2;
+    ss >> filter2;
+    BOOST_CHECK_EQUAL(filter2.GetEncodedSize(), filter.GetEncodedSize());
+
+    BOOST_FOREACH(uint64_t nHash, vHashes)
+        BOOST_CHECK(filter2.MatchAny(HashSet(nHash)));
+
+    // With 1000 elements in a 40 bit range, unrelated hashes should not match
+    std::set<uint64_t> setOther;
+    for (int i = 0; i < 1000; i++)
+        setOther.insert(RandomFilterHash());
+    BOOST_CHECK(!filter2.MatchAny(setOther));
+    setOther.insert(vHashes[500]);
+    BOOST_CHECK(filter2.MatchAny(setOther));
+
+    // About 30 bits per element
+    BOOST_CHECK(filter.GetEncodedSize() < 1002 * 32 / 8);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_block)
+{
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(2);
+    coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    coinbase.vout[1].scriptPubKey = CScript() << OP_RETURN << std::vector<unsigned char>(32, 1);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 3);
+    tx.vout.resize(2);
+    tx.vout[0].scriptPubKey = GetScriptForDestination(CKeyID(uint160(std::vector<unsigned char>(20, 2))));
+    std::vector<CPubKey> vKeys(2);
+    for (unsigned int i = 0; i < vKeys.size(); i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        vKeys[i] = key.GetPubKey();
+    }
+    tx.vout[1].scriptPubKey = GetScriptForMultisig(1, vKeys);
+
+    CBlock block;
+    block.vtx.push_back(coinbase);
+    block.vtx.push_back(tx);
+    CBlockFilter filter(block);
+    BOOST_CHECK_EQUAL(filter.GetElementCount(), 6U);
+
+    BOOST_CHECK(filter.MatchAny(HashSet(GetBlockFilterHash(coinbase.vout[0].scriptPubKey))));
+    BOOST_CHECK(filter.MatchAny(HashSet(GetBlockFilterHash(tx.vout[0].scriptPubKey))));
+    BOOST_CHECK(filter.MatchAny(HashSet(GetBlockFilterHash(tx.vin[0].prevout))));
+    BOOST_CHECK(!filter.MatchAny(HashSet(GetBlockFilterHash(COutPoint(tx.vin[0].prevout.hash, 2)))));
+    BOOST_CHECK(!filter.MatchAny(HashSet(GetBlockFilterHash(coinbase.vout[1].scriptPubKey))));
+
+    // The keys of bare multisig are there as pay-to-pubkey, which is how a wallet looks for its keys
+    BOOST_CHECK(filter.MatchAny(HashSet(GetBlockFilterHash(tx.vout[1].scriptPubKey))));
+    BOOST_CHECK(filter.MatchAny(HashSet(GetBlockFilterHash(GetScriptForRawPubKey(vKeys[0])))));
+    BOOST_CHECK(filter.MatchAny(HashSet(GetBlockFilterHash(GetScriptForRawPubKey(vKeys[1])))));
+}
+
+BOOST_FIXTURE_TEST_CASE(blockfilter_index, TestChain100Setup)
+{
+    CScript scriptCoinbase = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CBlockFilterIndex index(1 << 20, true);
+    BOOST_CHECK(!index.IsSynced());
+    index.Sync();
+    BOOST_CHECK(index.IsSynced());
+
+    CBlockFilter filter;
+    BOOST_CHECK(index.GetFilter(chainActive.Tip(), filter));
+    BOOST_CHECK(filter.MatchAny(HashSet(GetBlockFilterHash(scriptCoinbase))));
+    BOOST_CHECK(index.GetFilter(chainActive[1], filter));
+
+    // New blocks get their filter on the next sync
+    CBlock block = CreateAndProcessBlock(std::vector<CMutableTransaction>(), CScript() << OP_TRUE);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    BOOST_CHECK(!index.GetFilter(chainActive.Tip(), filter));
+    index.Sync();
+    BOOST_CHECK(index.GetFilter(chainActive.Tip(), filter));
+    BOOST_CHECK(filter.MatchAny(HashSet(GetBlockFilterHash(CScript() << OP_TRUE))));
+    BOOST_CHECK(!filter.MatchAny(HashSet(GetBlockFilterHash(scriptCoinbase))));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
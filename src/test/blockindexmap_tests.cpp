@@ -0,0 +1,102 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockindexmap.h"
+#include "chain.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <set>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockindexmap_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockindexmap_insert_find)
+{
+    CBlockIndexArena arena;
+    CBlockIndexMap map;
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.find(uint256()) == map.end());
+
+    // Enough entries to grow the table and the slabs several times
+    std::vector<uint256> vHashes;
+    std::vector<const uint256*> vKeys;
+    for (int i = 0; i < 20000; i++) {
+        vHashes.push_back(GetRandHash());
+        CBlockIndex* pindex = arena.New();
+        pindex->nHeight = i;
+        std::pair<CBlockIndexMap::iterator, bool> ret = map.insert(std::make_pair(vHashes.back(), pindex));
+        BOOST_CHECK(ret.second);
+        BOOST_CHECK(ret.first->second == pindex);
+        pindex->phashBlock = &ret.first->first;
+        vKeys.push_back(pindex->phashBlock);
+    }
+    BOOST_CHECK_EQUAL(map.size(), 20000U);
+    BOOST_CHECK_EQUAL(arena.size(), 20000U);
+
+    for (int i = 0; i < 20000; i++) {
+        CBlockIndexMap::iterator it = map.find(vHashes[i]);
+        BOOST_CHECK(it != map.end());
+        BOOST_CHECK_EQUAL(it->second->nHeight, i);
+        // Keys stay where they were inserted
+        BOOST_CHECK(&it->first == vKeys[i]);
+        BOOST_CHECK(*it->second->phashBlock == vHashes[i]);
+        BOOST_CHECK_EQUAL(map.count(vHashes[i]), 1U);
+    }
+    BOOST_CHECK_EQUAL(map.count(GetRandHash()), 0U);
+
+    // Inserting again leaves the existing entry alone
+    std::pair<CBlockIndexMap::iterator, bool> ret = map.insert(std::make_pair(vHashes[7], (CBlockIndex*)NULL));
+    BOOST_CHECK(!ret.second);
+    BOOST_CHECK_EQUAL(ret.first->second->nHeight, 7);
+    BOOST_CHECK_EQUAL(map.size(), 20000U);
+
+    // operator[] adds a null entry for an unknown hash
+    uint256 hashNew = GetRandHash();
+    BOOST_CHECK(map[hashNew] == NULL);
+    BOOST_CHECK_EQUAL(map.size(), 20001U);
+    BOOST_CHECK_EQUAL(map[vHashes[3]]->nHeight, 3);
+
+    map.clear();
+    arena.Clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.find(vHashes[0]) == map.end());
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockindexmap_iterate)
+{
+    CBlockIndexArena arena;
+    CBlockIndexMap map;
+    map.reserve(5000);
+    std::set<uint256> setHashes;
+    for (int i = 0; i < 5000; i++) {
+        uint256 hash = GetRandHash();
+        setHashes.insert(hash);
+        map.insert(std::make_pair(hash, arena.New()));
+    }
+
+    // Every entry is visited once, in insertion order
+    std::set<uint256> setSeen;
+    const CBlockIndexMap& mapConst = map;
+    BOOST_FOREACH(const CBlockIndexMap::value_type& item, mapConst) {
+        BOOST_CHECK(setSeen.insert(item.first).second);
+    }
+    BOOST_CHECK(setSeen == setHashes);
+
+    CBlockIndex* pindexPrev = NULL;
+    BOOST_FOREACH(CBlockIndexMap::value_type& item, map) {
+        item.second->pprev = pindexPrev;
+        pindexPrev = item.second;
+    }
+    BOOST_CHECK(map.begin()->second->pprev == NULL);
+    CBlockIndexMap::const_iterator it = map.begin();
+    ++it;
+    BOOST_CHECK(it->second->pprev == map.begin()->second);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
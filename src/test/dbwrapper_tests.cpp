@@ -323,5 +323,86 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
 }
 
 
+// The same wrapper over another store, as used to compare storage engines
+BOOST_AUTO_TEST_CASE(dbwrapper_memory_store)
+{
+    for (int i = 0; i < 2; i++) {
+        bool obfuscate = (bool)i;
+        CDBWrapper dbw(std::unique_ptr<CKVStore>(new CMemoryKVStore()), obfuscate);
+        BOOST_CHECK(obfuscate != is_null_key(dbwrapper_private::GetObfuscateKey(dbw)));
+
+        uint256 in = GetRandHash();
+        uint256 in2 = GetRandHash();
+        uint256 res;
+        CDBBatch batch(dbw);
+        batch.Write('j', in);
+        batch.Write('k', in2);
+        batch.Write('l', in2);
+        batch.Erase('l');
+        dbw.WriteBatch(batch);
+
+        BOOST_CHECK(dbw.Read('j', res));
+        BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
+        BOOST_CHECK(dbw.Exists('k'));
+        BOOST_CHECK(!dbw.Exists('l'));
+
+        std::unique_ptr<CDBIterator> it(dbw.NewIterator());
+        it->Seek('j');
+        char key_res;
+        BOOST_CHECK(it->Valid());
+        BOOST_CHECK(it->GetKey(key_res));
+        BOOST_CHECK(it->GetValue(res));
+        BOOST_CHECK_EQUAL(key_res, 'j');
+        BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
+        it->Next();
+        BOOST_CHECK(it->GetKey(key_res));
+        BOOST_CHECK(it->GetValue(res));
+        BOOST_CHECK_EQUAL(key_res, 'k');
+        BOOST_CHECK_EQUAL(res.ToString(), in2.ToString());
+        it->Next();
+        BOOST_CHECK(!it->Valid());
+
+        BOOST_CHECK(dbw.Erase('j'));
+        BOOST_CHECK(!dbw.Read('j', res));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_options)
+{
+    CDBOptions options = GetDBOptions("chainstate", 1 << 20);
+    BOOST_CHECK_EQUAL(options.nBlockCacheSize, 1U << 19);
+    BOOST_CHECK_EQUAL(options.nWriteBufferSize, 1U << 18);
+    BOOST_CHECK_EQUAL(options.nBloomBits, 10);
+
+    mapMultiArgs["-dboption"].push_back("chainstate.bloom_bits=16");
+    mapMultiArgs["-dboption"].push_back("blockindex.max_open_files=100");
+    options = GetDBOptions("chainstate", 1 << 20);
+    BOOST_CHECK_EQUAL(options.nBloomBits, 16);
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, 64);
+    options = GetDBOptions("blockindex", 1 << 20);
+    BOOST_CHECK_EQUAL(options.nBloomBits, 10);
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, 100);
+
+    // Overridden settings still open a working database
+    path ph = temp_directory_path() / unique_path();
+    CDBWrapper dbw(ph, GetDBOptions("chainstate", 1 << 20), true, false, false);
+    uint256 in = GetRandHash();
+    uint256 res;
+    BOOST_CHECK(dbw.Write('k', in));
+    BOOST_CHECK(dbw.Read('k', res));
+    BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
+
+    mapMultiArgs["-dboption"].push_back("chainstate.bloom_bitz=16");
+    BOOST_CHECK_THROW(GetDBOptions("chainstate", 1 << 20), dbwrapper_error);
+    mapMultiArgs["-dboption"].back() = "chainstate.bloom_bits";
+    BOOST_CHECK_THROW(GetDBOptions("blockindex", 1 << 20), dbwrapper_error);
+    mapMultiArgs["-dboption"].back() = "chainstate.bloom_bits=-1";
+    BOOST_CHECK_THROW(GetDBOptions("chainstate", 1 << 20), dbwrapper_error);
+    mapMultiArgs["-dboption"].back() = "chainstate.compression=1";
+    BOOST_CHECK_THROW(GetDBOptions("chainstate", 1 << 20), dbwrapper_error);
+    mapMultiArgs["-dboption"].back() = "chainstat.bloom_bits=16";
+    BOOST_CHECK_THROW(GetDBOptions("chainstate", 1 << 20), dbwrapper_error);
+    mapMultiArgs.erase("-dboption");
+}
 
 BOOST_AUTO_TEST_SUITE_END()
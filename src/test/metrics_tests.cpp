@@ -0,0 +1,111 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "metrics.h"
+#include "sync.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(metrics_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(metrics_histogram)
+{
+    CMetricHistogram histogram;
+    histogram.Observe(5);
+    histogram.Observe(10);
+    histogram.Observe(700);
+    histogram.Observe(20000000);
+    BOOST_CHECK_EQUAL(histogram.GetCount(), 4U);
+
+    std::string strOut;
+    histogram.Write(strOut, "test_seconds", MetricLabel("a", "b"));
+    BOOST_CHECK(strOut.find("test_seconds_bucket{a=\"b\",le=\"1e-05\"} 2\n") != std::string::npos);
+    BOOST_CHECK(strOut.find("test_seconds_bucket{a=\"b\",le=\"0.0005\"} 2\n") != std::string::npos);
+    BOOST_CHECK(strOut.find("test_seconds_bucket{a=\"b\",le=\"0.001\"} 3\n") != std::string::npos);
+    BOOST_CHECK(strOut.find("test_seconds_bucket{a=\"b\",le=\"10\"} 3\n") != std::string::npos);
+    BOOST_CHECK(strOut.find("test_seconds_bucket{a=\"b\",le=\"+Inf\"} 4\n") != std::string::npos);
+    BOOST_CHECK(strOut.find("test_seconds_sum{a=\"b\"} 20.000715\n") != std::string::npos);
+    BOOST_CHECK(strOut.find("test_seconds_count{a=\"b\"} 4\n") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(metrics_histogram_set)
+{
+    std::vector<std::string> vValues;
+    vValues.push_back("x");
+    vValues.push_back("y");
+    CMetricHistogramSet set("test_seconds", "Test", "kind", vValues);
+    set.Get("y").Observe(1);
+    set.Get("z").Observe(1);
+    set.Get(2).Observe(1);
+
+    // Unknown values share the last histogram, unused histograms are left out
+    std::string strOut;
+    set.Write(strOut);
+    BOOST_CHECK(strOut.find("# HELP test_seconds Test\n# TYPE test_seconds histogram\n") == 0);
+    BOOST_CHECK(strOut.find("kind=\"x\"") == std::string::npos);
+    BOOST_CHECK(strOut.find("test_seconds_count{kind=\"y\"} 1\n") != std::string::npos);
+    BOOST_CHECK(strOut.find("test_seconds_count{kind=\"other\"} 2\n") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(metrics_format)
+{
+    BOOST_CHECK_EQUAL(MetricLabel("addr", "a\"b\\c\nd"), "addr=\"a\\\"b\\\\c\\nd\",");
+    std::string strOut;
+    WriteMetricValue(strOut, "test_total", "", 12345678901LL);
+    WriteMetricValue(strOut, "test_total", MetricLabel("a", "1") + MetricLabel("b", "2"), 0.25);
+    BOOST_CHECK_EQUAL(strOut, "test_total 12345678901\ntest_total{a=\"1\",b=\"2\"} 0.25\n");
+}
+
+static void HoldLock(CCriticalSection* cs, boost::mutex* mutexStarted, boost::condition_variable* condStarted, bool* fStarted)
+{
+    LOCK(*cs);
+    {
+        boost::unique_lock<boost::mutex> lock(*mutexStarted);
+        *fStarted = true;
+    }
+    condStarted->notify_one();
+    MilliSleep(50);
+}
+
+BOOST_AUTO_TEST_CASE(metrics_lock_wait)
+{
+    CCriticalSection cs;
+    std::vector<std::pair<std::string, void*> > vLocks;
+    vLocks.push_back(std::make_pair("cs", (void*)&cs));
+    InitLockMetrics(vLocks);
+    fMetrics = true;
+
+    // Uncontended locks aren't recorded
+    {
+        LOCK(cs);
+    }
+    std::string strOut;
+    WriteLockMetrics(strOut);
+    BOOST_CHECK(strOut.find("lock=\"cs\"") == std::string::npos);
+
+    boost::mutex mutexStarted;
+    boost::condition_variable condStarted;
+    bool fStarted = false;
+    boost::thread thread(HoldLock, &cs, &mutexStarted, &condStarted, &fStarted);
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStarted);
+        while (!fStarted)
+            condStarted.wait(lock);
+    }
+    {
+        LOCK(cs);
+    }
+    thread.join();
+    fMetrics = false;
+
+    strOut.clear();
+    WriteLockMetrics(strOut);
+    BOOST_CHECK(strOut.find("bitcoin_lock_wait_seconds_count{lock=\"cs\"} 1\n") != std::string::npos);
+    BOOST_CHECK(strOut.find("bitcoin_lock_wait_seconds_bucket{lock=\"cs\",le=\"0.001\"} 0\n") != std::string::npos);
+    BOOST_CHECK(strOut.find("lock=\"other\"") == std::string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -11,6 +11,7 @@
 #include "net.h"
 #include "netbase.h"
 #include "chainparams.h"
+#include "crypto/common.h"
 
 using namespace std;
 
@@ -172,4 +173,162 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(serialized_message)
+{
+    std::vector<unsigned char> vPayload(1000, 0x42);
+    CSerializedNetMsgRef msg = CNode::MakeMessage(PROTOCOL_VERSION, "test", vPayload);
+    BOOST_CHECK_EQUAL(msg->command, "test");
+
+    CDataStream ss(msg->data.begin(), msg->data.end(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(Params().MessageStart());
+    ss >> hdr;
+    BOOST_CHECK(hdr.IsValid(Params().MessageStart()));
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "test");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ss.size());
+    uint256 hash = Hash(ss.begin(), ss.end());
+    BOOST_CHECK(memcmp(hash.begin(), &hdr.nChecksum, CMessageHeader::CHECKSUM_SIZE) == 0);
+    std::vector<unsigned char> vRead;
+    ss >> vRead;
+    BOOST_CHECK(vRead == vPayload);
+
+    // Cached messages are told apart by hash, version, command and object
+    CNetMsgCache cache(2);
+    uint256 hashObject = GetRandHash();
+    std::shared_ptr<const void> pObject = std::make_shared<int>(0);
+    cache.Add(hashObject, PROTOCOL_VERSION, msg, pObject);
+    BOOST_CHECK(cache.Get(hashObject, "test", PROTOCOL_VERSION, pObject.get()) == msg);
+    BOOST_CHECK(!cache.Get(hashObject, "test", PROTOCOL_VERSION));
+    BOOST_CHECK(!cache.Get(hashObject, "tx", PROTOCOL_VERSION, pObject.get()));
+    BOOST_CHECK(!cache.Get(hashObject, "test", PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS, pObject.get()));
+    cache.Add(GetRandHash(), PROTOCOL_VERSION, msg);
+    cache.Add(GetRandHash(), PROTOCOL_VERSION, msg);
+    BOOST_CHECK(!cache.Get(hashObject, "test", PROTOCOL_VERSION, pObject.get()));
+}
+
+static bool ReceiveMessage(CNetMessage& msg, const CSerializeData& data, size_t nChunk)
+{
+    const char* pch = &data[0];
+    unsigned int nBytes = data.size();
+    while (nBytes > 0) {
+        int handled = msg.in_data ? msg.readData(pch, std::min((unsigned int)nChunk, nBytes)) : msg.readHeader(pch, std::min((unsigned int)nChunk, nBytes));
+        if (handled < 0)
+            return false;
+        pch += handled;
+        nBytes -= handled;
+    }
+    return msg.complete();
+}
+
+BOOST_AUTO_TEST_CASE(receive_message)
+{
+    // Larger than what is allocated up front, so the buffer has to grow
+    std::vector<unsigned char> vPayload(MAX_RECV_PREALLOC * 3);
+    for (unsigned int i = 0; i < vPayload.size(); i++)
+        vPayload[i] = i * 7;
+    CSerializedNetMsgRef msg = CNode::MakeMessage(PROTOCOL_VERSION, "test", vPayload);
+
+    CNetMessage msgRecv(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(ReceiveMessage(msgRecv, msg->data, 1000));
+    BOOST_CHECK_EQUAL(msgRecv.nDataChecksum, msgRecv.hdr.nChecksum);
+    std::vector<unsigned char> vRead;
+    msgRecv.vRecv >> vRead;
+    BOOST_CHECK(vRead == vPayload);
+    msgRecv.ReleaseBuffer();
+
+    // A corrupted byte shows in the checksum
+    CSerializeData data(msg->data);
+    data[data.size() / 2] ^= 1;
+    CNetMessage msgBad(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(ReceiveMessage(msgBad, data, 65536));
+    BOOST_CHECK(msgBad.nDataChecksum != msgBad.hdr.nChecksum);
+
+    // Messages without data are complete with their header
+    CSerializedNetMsgRef msgEmpty = CNode::MakeMessage(PROTOCOL_VERSION, "verack", std::vector<unsigned char>());
+    CSerializeData dataEmpty(msgEmpty->data.begin(), msgEmpty->data.begin() + CMessageHeader::HEADER_SIZE);
+    WriteLE32((unsigned char*)&dataEmpty[CMessageHeader::MESSAGE_SIZE_OFFSET], 0);
+    uint256 hash = Hash(dataEmpty.end(), dataEmpty.end());
+    memcpy(&dataEmpty[CMessageHeader::CHECKSUM_OFFSET], hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CNetMessage msgEmptyRecv(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(ReceiveMessage(msgEmptyRecv, dataEmpty, 5));
+    BOOST_CHECK_EQUAL(msgEmptyRecv.nDataChecksum, msgEmptyRecv.hdr.nChecksum);
+    BOOST_CHECK_EQUAL(msgEmptyRecv.vRecv.capacity(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(recv_buffer_pool)
+{
+    CRecvBufferPool pool(3 * 8192);
+    CSerializeData data;
+    pool.Get(5000, data);
+    BOOST_CHECK(data.empty());
+    BOOST_CHECK(data.capacity() >= 8192);
+    data.resize(5000);
+    const char* pBuffer = &data[0];
+    pool.Put(data);
+    BOOST_CHECK_EQUAL(pool.GetSize(), 8192U);
+
+    // The buffer comes back for anything of the same size class
+    CSerializeData data2;
+    pool.Get(8000, data2);
+    BOOST_CHECK(data2.empty());
+    data2.resize(1);
+    BOOST_CHECK(&data2[0] == pBuffer);
+    BOOST_CHECK_EQUAL(pool.GetSize(), 0U);
+
+    // Small buffers aren't kept, nor anything past the pool size
+    CSerializeData dataSmall(100);
+    pool.Put(dataSmall);
+    BOOST_CHECK_EQUAL(pool.GetSize(), 0U);
+    CSerializeData dataLarge;
+    pool.Get(20000, dataLarge);
+    pool.Put(dataLarge);
+    BOOST_CHECK_EQUAL(pool.GetSize(), 0U);
+    pool.Put(data2);
+    BOOST_CHECK_EQUAL(pool.GetSize(), 8192U);
+
+    // Small requests get exactly what they ask for, empty ones nothing
+    CSerializeData dataTiny;
+    pool.Get(100, dataTiny);
+    BOOST_CHECK_EQUAL(dataTiny.capacity(), 100U);
+    pool.Get(0, dataTiny);
+    BOOST_CHECK_EQUAL(dataTiny.capacity(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetSize(), 8192U);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(send_shared_messages)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CNode* pnode = new CNode(fds[0], CAddress(CService(ipv4Addr, 7777), NODE_NETWORK), "", true);
+
+    // The same message queued twice, around one serialized for this peer only
+    CSerializedNetMsgRef msg = CNode::MakeMessage(PROTOCOL_VERSION, "test", std::vector<unsigned char>(100, 1));
+    pnode->PushSerializedMessage(msg);
+    pnode->PushMessage("ping", (uint64_t)7);
+    pnode->PushSerializedMessage(msg);
+    BOOST_CHECK(pnode->vSendMsg.empty());
+    BOOST_CHECK_EQUAL(pnode->nSendSize, 0U);
+    BOOST_CHECK_EQUAL(pnode->nSendBytes, 2 * msg->data.size() + CMessageHeader::HEADER_SIZE + 8);
+
+    std::vector<char> vExpected(msg->data.begin(), msg->data.end());
+    CSerializedNetMsgRef msgPing = CNode::MakeMessage(pnode->GetSendVersion(), "ping", (uint64_t)7);
+    vExpected.insert(vExpected.end(), msgPing->data.begin(), msgPing->data.end());
+    vExpected.insert(vExpected.end(), msg->data.begin(), msg->data.end());
+    std::vector<char> vRead(vExpected.size() + 1);
+    size_t nRead = 0;
+    while (nRead < vExpected.size()) {
+        ssize_t n = recv(fds[1], &vRead[nRead], vRead.size() - nRead, 0);
+        BOOST_REQUIRE(n > 0);
+        nRead += n;
+    }
+    vRead.resize(nRead);
+    BOOST_CHECK(vRead == vExpected);
+
+    delete pnode;
+    close(fds[1]);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
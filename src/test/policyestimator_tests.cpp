@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "dbwrapper.h"
 #include "policy/policy.h"
 #include "policy/fees.h"
 #include "txmempool.h"
@@ -21,7 +22,6 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     CAmount basefee(2000);
     double basepri = 1e6;
     CAmount deltaFee(100);
-    double deltaPri=5e5;
     std::vector<CAmount> feeV[2];
     std::vector<double> priV[2];
 
@@ -101,7 +101,6 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 
     std::vector<CAmount> origFeeEst;
-    std::vector<double> origPriEst;
     // Highest feerate is 10*baseRate and gets in all blocks,
     // second highest feerate is 9*baseRate and gets in 9/10 blocks = 90%,
     // third highest feerate is 8*base rate, and gets in 8/10 blocks = 80%,
@@ -110,16 +109,14 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     // so estimateFee(2) should return 9*baseRate etc...
     for (int i = 1; i < 10;i++) {
         origFeeEst.push_back(mpool.estimateFee(i).GetFeePerK());
-        origPriEst.push_back(mpool.estimatePriority(i));
         if (i > 1) { // Fee estimates should be monotonically decreasing
             BOOST_CHECK(origFeeEst[i-1] <= origFeeEst[i-2]);
-            BOOST_CHECK(origPriEst[i-1] <= origPriEst[i-2]);
         }
         int mult = 11-i;
         BOOST_CHECK(origFeeEst[i-1] < mult*baseRate.GetFeePerK() + deltaFee);
         BOOST_CHECK(origFeeEst[i-1] > mult*baseRate.GetFeePerK() - deltaFee);
-        BOOST_CHECK(origPriEst[i-1] < pow(10,mult) * basepri + deltaPri);
-        BOOST_CHECK(origPriEst[i-1] > pow(10,mult) * basepri - deltaPri);
+        // Priority is no longer tracked
+        BOOST_CHECK(mpool.estimatePriority(i) == -1);
     }
 
     // Mine 50 more blocks with no transactions happening, estimates shouldn't change
@@ -130,8 +127,6 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     for (int i = 1; i < 10;i++) {
         BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() < origFeeEst[i-1] + deltaFee);
         BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() > origFeeEst[i-1] - deltaFee);
-        BOOST_CHECK(mpool.estimatePriority(i) < origPriEst[i-1] + deltaPri);
-        BOOST_CHECK(mpool.estimatePriority(i) > origPriEst[i-1] - deltaPri);
     }
 
 
@@ -153,8 +148,6 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     for (int i = 1; i < 10;i++) {
         BOOST_CHECK(mpool.estimateFee(i) == CFeeRate(0) || mpool.estimateFee(i).GetFeePerK() > origFeeEst[i-1] - deltaFee);
         BOOST_CHECK(mpool.estimateSmartFee(i, &answerFound).GetFeePerK() > origFeeEst[answerFound-1] - deltaFee);
-        BOOST_CHECK(mpool.estimatePriority(i) == -1 || mpool.estimatePriority(i) > origPriEst[i-1] - deltaPri);
-        BOOST_CHECK(mpool.estimateSmartPriority(i, &answerFound) > origPriEst[answerFound-1] - deltaPri);
     }
 
     // Mine all those transactions
@@ -171,7 +164,6 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     block.clear();
     for (int i = 1; i < 10;i++) {
         BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() > origFeeEst[i-1] - deltaFee);
-        BOOST_CHECK(mpool.estimatePriority(i) > origPriEst[i-1] - deltaPri);
     }
 
     // Mine 200 more blocks where everything is mined every block
@@ -192,7 +184,6 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
     for (int i = 1; i < 10; i++) {
         BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() < origFeeEst[i-1] - deltaFee);
-        BOOST_CHECK(mpool.estimatePriority(i) < origPriEst[i-1] - deltaPri);
     }
 
     // Test that if the mempool is limited, estimateSmartFee won't return a value below the mempool min fee
@@ -208,4 +199,77 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 }
 
+BOOST_AUTO_TEST_CASE(BlockPolicyHorizonsAndPersistence)
+{
+    CTxMemPool mpool(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+    std::list<CTransaction> dummyConflicted;
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+
+    // Every block confirms 40 transactions of 10 different feerates
+    std::vector<CTransaction> block;
+    int blocknum = 0;
+    while (blocknum < 100) {
+        for (int j = 0; j < 10; j++) {
+            for (int k = 0; k < 4; k++) {
+                tx.vin[0].prevout.n = 10000*blocknum+100*j+k;
+                uint256 hash = tx.GetHash();
+                mpool.addUnchecked(hash, entry.Fee(2000 * (j+1)).Time(GetTime()).Height(blocknum).FromTx(tx, &mpool));
+                block.push_back(*mpool.get(hash));
+            }
+        }
+        mpool.removeForBlock(block, ++blocknum, dummyConflicted);
+        block.clear();
+    }
+
+    // All horizons have seen enough transactions to answer
+    BOOST_CHECK(mpool.estimateRawFee(1, SHORT_HALFLIFE) > CFeeRate(0));
+    BOOST_CHECK(mpool.estimateRawFee(1, MED_HALFLIFE) == mpool.estimateFee(1));
+    BOOST_CHECK(mpool.estimateRawFee(24, LONG_HALFLIFE) > CFeeRate(0));
+    BOOST_CHECK(mpool.estimateRawFee(SHORT_BLOCK_PERIODS * SHORT_SCALE + 1, SHORT_HALFLIFE) == CFeeRate(0));
+    // Targets beyond the medium horizon are answered by the long one
+    BOOST_CHECK(mpool.HighestFeeEstimateTarget(LONG_HALFLIFE) == LONG_BLOCK_PERIODS * LONG_SCALE);
+    BOOST_CHECK(mpool.estimateFee(100) == mpool.estimateRawFee(100, LONG_HALFLIFE));
+    BOOST_CHECK(mpool.estimateFee(MED_BLOCK_PERIODS + 1) > CFeeRate(0));
+    int answerFound;
+    BOOST_CHECK(mpool.estimateSmartFee(30, &answerFound) == mpool.estimateRawFee(48, LONG_HALFLIFE) && answerFound == 48);
+
+    // Estimates survive a round trip through the database
+    CDBWrapper db(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path(), 1 << 20, true);
+    CTxMemPool mpool2(CFeeRate(1000));
+    BOOST_CHECK(!mpool2.ReadFeeEstimates(db));
+    BOOST_CHECK(mpool.FeeEstimatesDirty());
+    BOOST_CHECK(mpool.WriteFeeEstimates(db));
+    BOOST_CHECK(!mpool.FeeEstimatesDirty());
+    BOOST_CHECK(mpool2.ReadFeeEstimates(db));
+    for (int i = 1; i < 10; i++) {
+        BOOST_CHECK(mpool2.estimateFee(i) == mpool.estimateFee(i));
+        BOOST_CHECK(mpool2.estimateRawFee(i, SHORT_HALFLIFE) == mpool.estimateRawFee(i, SHORT_HALFLIFE));
+        BOOST_CHECK(mpool2.estimateRawFee(i * LONG_SCALE, LONG_HALFLIFE) == mpool.estimateRawFee(i * LONG_SCALE, LONG_HALFLIFE));
+    }
+
+    // A block confirming a single feerate only rewrites that bucket, and
+    // what is read back still matches
+    for (int k = 0; k < 4; k++) {
+        tx.vin[0].prevout.n = 10000*blocknum+k;
+        uint256 hash = tx.GetHash();
+        mpool.addUnchecked(hash, entry.Fee(50000).Time(GetTime()).Height(blocknum).FromTx(tx, &mpool));
+        block.push_back(*mpool.get(hash));
+    }
+    mpool.removeForBlock(block, ++blocknum, dummyConflicted);
+    BOOST_CHECK(mpool.FeeEstimatesDirty());
+    BOOST_CHECK(mpool.WriteFeeEstimates(db));
+    CTxMemPool mpool3(CFeeRate(1000));
+    BOOST_CHECK(mpool3.ReadFeeEstimates(db));
+    for (int i = 1; i < 10; i++) {
+        BOOST_CHECK(mpool3.estimateFee(i) == mpool.estimateFee(i));
+        BOOST_CHECK(mpool3.estimateRawFee(i, SHORT_HALFLIFE) == mpool.estimateRawFee(i, SHORT_HALFLIFE));
+        BOOST_CHECK(mpool3.estimateRawFee(i * LONG_SCALE, LONG_HALFLIFE) == mpool.estimateRawFee(i * LONG_SCALE, LONG_HALFLIFE));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -64,4 +64,26 @@ BOOST_AUTO_TEST_CASE(streams_serializedata_xor)
             std::string(ds.begin(), ds.end()));  
 }         
 
+BOOST_AUTO_TEST_CASE(streams_serializedata_xor_words)
+{
+    // Eight byte keys take the word at a time path, check it and the tail
+    // against xoring byte by byte for every length up to a few words
+    std::vector<unsigned char> key;
+    for (int i = 0; i < 8; i++)
+        key.push_back(0x11 * (i + 1));
+
+    for (unsigned int nLen = 0; nLen < 40; nLen++) {
+        std::vector<char> in, expected_xor;
+        for (unsigned int i = 0; i < nLen; i++) {
+            in.push_back((char)(i * 37));
+            expected_xor.push_back((char)(i * 37) ^ key[i % 8]);
+        }
+        CDataStream ds(in, 0, 0);
+        ds.Xor(key);
+        BOOST_CHECK_EQUAL(
+                std::string(expected_xor.begin(), expected_xor.end()),
+                std::string(ds.begin(), ds.end()));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,73 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sync.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(sync_tests, BasicTestingSetup)
+
+static void HoldLock(CCriticalSection* cs, CSemaphore* semLocked)
+{
+    LOCK(*cs);
+    semLocked->post();
+    MilliSleep(50);
+}
+
+static const CLockSiteStats* FindSite(const std::vector<CLockSiteStats>& vStats, int nLine)
+{
+    for (size_t i = 0; i < vStats.size(); i++)
+        if (vStats[i].strFile == __FILE__ && vStats[i].nLine == nLine)
+            return &vStats[i];
+    return NULL;
+}
+
+BOOST_AUTO_TEST_CASE(lock_profile)
+{
+    CCriticalSection cs;
+    StartLockProfile(2);
+
+    const int nLineFree = __LINE__ + 2;
+    for (int i = 0; i < 4; i++) {
+        LOCK(cs);
+    }
+
+    CSemaphore semLocked(0);
+    boost::thread thread(HoldLock, &cs, &semLocked);
+    semLocked.wait();
+    const int nLineContended = __LINE__ + 2;
+    {
+        LOCK(cs);
+    }
+    thread.join();
+    fLockProfile = false;
+
+    std::vector<CLockSiteStats> vStats = GetLockProfile(true);
+    const CLockSiteStats* pstats = FindSite(vStats, nLineFree);
+    BOOST_CHECK(pstats);
+    if (pstats) {
+        BOOST_CHECK_EQUAL(pstats->strName, "cs");
+        BOOST_CHECK_EQUAL(pstats->nCount, 4U);
+        BOOST_CHECK_EQUAL(pstats->nContended, 0U);
+        BOOST_CHECK_EQUAL(pstats->nWaitTime, 0);
+        BOOST_CHECK_EQUAL(pstats->nHoldSamples, 2U);
+    }
+    pstats = FindSite(vStats, nLineContended);
+    BOOST_CHECK(pstats);
+    if (pstats) {
+        BOOST_CHECK_EQUAL(pstats->nCount, 1U);
+        BOOST_CHECK_EQUAL(pstats->nContended, 1U);
+        BOOST_CHECK(pstats->nWaitTime > 0);
+        BOOST_CHECK_EQUAL(pstats->nMaxWaitTime, pstats->nWaitTime);
+    }
+
+    // The sites stay, with their counters cleared
+    vStats = GetLockProfile();
+    pstats = FindSite(vStats, nLineFree);
+    BOOST_CHECK(pstats && pstats->nCount == 0 && pstats->nHoldSamples == 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
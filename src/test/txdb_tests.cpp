@@ -0,0 +1,140 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "blockindexmap.h"
+#include "chain.h"
+#include "txdb.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txdb_tests, TestingSetup)
+
+static CBlockIndex* InsertIndex(CBlockIndexArena& arena, CBlockIndexMap& map, const uint256& hash)
+{
+    if (hash.IsNull())
+        return NULL;
+    CBlockIndexMap::iterator it = map.find(hash);
+    if (it != map.end())
+        return it->second;
+    CBlockIndex* pindex = arena.New();
+    it = map.insert(std::make_pair(hash, pindex)).first;
+    pindex->phashBlock = &it->first;
+    return pindex;
+}
+
+static void CheckLoaded(const CBlockIndexMap& map, const std::vector<const CBlockIndex*>& vIndex)
+{
+    BOOST_CHECK_EQUAL(map.size(), vIndex.size());
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        CBlockIndexMap::const_iterator it = map.find(vIndex[i]->GetBlockHash());
+        BOOST_CHECK(it != map.end());
+        const CBlockIndex* pindex = it->second;
+        BOOST_CHECK_EQUAL(pindex->nHeight, vIndex[i]->nHeight);
+        BOOST_CHECK_EQUAL(pindex->nStatus, vIndex[i]->nStatus);
+        BOOST_CHECK_EQUAL(pindex->nTx, vIndex[i]->nTx);
+        BOOST_CHECK_EQUAL(pindex->nTime, vIndex[i]->nTime);
+        BOOST_CHECK((pindex->pprev ? pindex->pprev->GetBlockHash() : uint256()) == (vIndex[i]->pprev ? vIndex[i]->pprev->GetBlockHash() : uint256()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_snapshot)
+{
+    // A chain with hashes that pass the proof of work check
+    std::vector<uint256> vHashes(200);
+    std::vector<CBlockIndex> vBlocks(vHashes.size());
+    std::vector<const CBlockIndex*> vIndex;
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        vHashes[i] = ArithToUint256(arith_uint256(i + 1));
+        vBlocks[i].phashBlock = &vHashes[i];
+        vBlocks[i].pprev = i > 0 ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].nHeight = i;
+        vBlocks[i].nBits = 0x1d00ffff;
+        vBlocks[i].nTime = 1000 + i;
+        vBlocks[i].nStatus = BLOCK_VALID_TREE;
+        vIndex.push_back(&vBlocks[i]);
+    }
+    std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
+
+    CBlockTreeDB db(1 << 20, false, true);
+    db.SetSnapshotEnabled(true);
+    std::vector<const CBlockIndex*> vFirst(vIndex.begin(), vIndex.begin() + 150);
+    BOOST_CHECK(db.WriteBatchSync(vFiles, 0, vFirst));
+
+    // Nothing to load before a snapshot is written
+    size_t nChanged = 0;
+    {
+        CBlockIndexArena arena;
+        CBlockIndexMap map;
+        BOOST_CHECK(!db.LoadBlockIndexSnapshot(boost::bind(InsertIndex, boost::ref(arena), boost::ref(map), _1), nChanged));
+    }
+
+    BOOST_CHECK(db.WriteBlockIndexSnapshot(vFirst));
+    {
+        CBlockIndexArena arena;
+        CBlockIndexMap map;
+        BOOST_CHECK(db.LoadBlockIndexSnapshot(boost::bind(InsertIndex, boost::ref(arena), boost::ref(map), _1), nChanged));
+        BOOST_CHECK_EQUAL(nChanged, 0U);
+        CheckLoaded(map, vFirst);
+    }
+
+    // Entries written after the snapshot, new and changed ones, come from the database
+    vBlocks[100].nStatus |= BLOCK_FAILED_VALID;
+    std::vector<const CBlockIndex*> vSecond(vIndex.begin() + 150, vIndex.end());
+    vSecond.push_back(&vBlocks[100]);
+    BOOST_CHECK(db.WriteBatchSync(vFiles, 0, vSecond));
+    {
+        CBlockIndexArena arena;
+        CBlockIndexMap map;
+        BOOST_CHECK(db.LoadBlockIndexSnapshot(boost::bind(InsertIndex, boost::ref(arena), boost::ref(map), _1), nChanged));
+        BOOST_CHECK_EQUAL(nChanged, 51U);
+        CheckLoaded(map, vIndex);
+    }
+
+    // A version that doesn't know about snapshots flushes without marking
+    // its entries as changed, which makes the snapshot unusable, also when
+    // the flush only changes the status of a block
+    {
+        vBlocks[10].nStatus |= BLOCK_FAILED_VALID;
+        CDBBatch batch(db);
+        batch.Write('l', 0);
+        batch.Write(std::make_pair('b', vHashes[10]), CDiskBlockIndex(&vBlocks[10]));
+        db.WriteBatch(batch, true);
+
+        CBlockIndexArena arena;
+        CBlockIndexMap map;
+        BOOST_CHECK(!db.LoadBlockIndexSnapshot(boost::bind(InsertIndex, boost::ref(arena), boost::ref(map), _1), nChanged));
+    }
+    // Flushes that mark their entries don't make it usable again
+    {
+        BOOST_CHECK(db.WriteBatchSync(vFiles, 0, std::vector<const CBlockIndex*>(1, &vBlocks[20])));
+        CBlockIndexArena arena;
+        CBlockIndexMap map;
+        BOOST_CHECK(!db.LoadBlockIndexSnapshot(boost::bind(InsertIndex, boost::ref(arena), boost::ref(map), _1), nChanged));
+    }
+    // until the next snapshot is written
+    BOOST_CHECK(db.WriteBlockIndexSnapshot(vIndex));
+    {
+        CBlockIndexArena arena;
+        CBlockIndexMap map;
+        BOOST_CHECK(db.LoadBlockIndexSnapshot(boost::bind(InsertIndex, boost::ref(arena), boost::ref(map), _1), nChanged));
+        BOOST_CHECK_EQUAL(nChanged, 0U);
+        CheckLoaded(map, vIndex);
+    }
+
+    // Disabling snapshots forgets the one written
+    db.SetSnapshotEnabled(false);
+    db.SetSnapshotEnabled(true);
+    {
+        CBlockIndexArena arena;
+        CBlockIndexMap map;
+        BOOST_CHECK(!db.LoadBlockIndexSnapshot(boost::bind(InsertIndex, boost::ref(arena), boost::ref(map), _1), nChanged));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
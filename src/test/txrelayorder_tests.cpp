@@ -0,0 +1,172 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txmempool.h"
+#include "txrelayorder.h"
+
+#include "test/test_bitcoin.h"
+
+#include <algorithm>
+#include <list>
+#include <set>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txrelayorder_tests, TestingSetup)
+
+static const int64_t INTERVAL = 1000000;
+
+static CTransaction MakeTx(const uint256& hashPrev, uint32_t n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, n);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = COIN;
+    return CTransaction(tx);
+}
+
+// The queued transactions in the order they are announced
+static std::vector<uint256> Announce(CTxRelayOrder& relayOrder, std::set<uint256>& setQueued)
+{
+    std::vector<CTxRelayOrder::Entry> vInvTx;
+    relayOrder.GetOrdered(setQueued, vInvTx);
+    BOOST_CHECK_EQUAL(vInvTx.size(), setQueued.size());
+    CTxRelayOrder::Compare compareRelayOrder;
+    std::make_heap(vInvTx.begin(), vInvTx.end(), compareRelayOrder);
+    std::vector<uint256> vOrder;
+    while (!vInvTx.empty()) {
+        std::pop_heap(vInvTx.begin(), vInvTx.end(), compareRelayOrder);
+        vOrder.push_back(*vInvTx.back().second);
+        vInvTx.pop_back();
+    }
+    return vOrder;
+}
+
+BOOST_AUTO_TEST_CASE(txrelayorder_order)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CTxRelayOrder relayOrder(pool, INTERVAL);
+    TestMemPoolEntryHelper entry;
+
+    // Three unrelated transactions of the same size and a child of the cheapest
+    CTransaction tx1 = MakeTx(uint256S("01"), 0);
+    CTransaction tx2 = MakeTx(uint256S("02"), 0);
+    CTransaction tx3 = MakeTx(uint256S("03"), 0);
+    CTransaction txChild = MakeTx(tx1.GetHash(), 0);
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(1000).FromTx(tx1));
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(3000).FromTx(tx2));
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(2000).FromTx(tx3));
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(10000).FromTx(txChild));
+
+    std::set<uint256> setQueued;
+    setQueued.insert(tx1.GetHash());
+    setQueued.insert(tx2.GetHash());
+    setQueued.insert(tx3.GetHash());
+    setQueued.insert(txChild.GetHash());
+    for (std::set<uint256>::const_iterator it = setQueued.begin(); it != setQueued.end(); it++)
+        relayOrder.Add(*it);
+
+    // The whole batch is ranked at once
+    uint256 hashTip = uint256S("aa");
+    relayOrder.Update(hashTip, 0);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 4U);
+
+    // Fewest ancestors first, then by descending feerate
+    std::vector<uint256> vOrder = Announce(relayOrder, setQueued);
+    BOOST_CHECK_EQUAL(vOrder.size(), 4U);
+    BOOST_CHECK(vOrder[0] == tx2.GetHash());
+    BOOST_CHECK(vOrder[1] == tx3.GetHash());
+    BOOST_CHECK(vOrder[2] == tx1.GetHash());
+    BOOST_CHECK(vOrder[3] == txChild.GetHash());
+
+    // A transaction that left the mempool is announced last
+    std::list<CTransaction> removed;
+    pool.removeRecursive(tx2, removed);
+    relayOrder.Update(uint256S("bb"), 1);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 0U);
+    vOrder = Announce(relayOrder, setQueued);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 4U);
+    BOOST_CHECK(vOrder[0] == tx3.GetHash());
+    BOOST_CHECK(vOrder[1] == tx1.GetHash());
+    BOOST_CHECK(vOrder[2] == txChild.GetHash());
+    BOOST_CHECK(vOrder[3] == tx2.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(txrelayorder_update)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CTxRelayOrder relayOrder(pool, INTERVAL);
+    TestMemPoolEntryHelper entry;
+    uint256 hashTip = uint256S("aa");
+
+    CTransaction tx1 = MakeTx(uint256S("01"), 0);
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(1000).FromTx(tx1));
+    relayOrder.Add(tx1.GetHash());
+    relayOrder.Update(hashTip, 0);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 1U);
+
+    // The next batch waits for the interval
+    CTransaction tx2 = MakeTx(uint256S("02"), 0);
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(2000).FromTx(tx2));
+    relayOrder.Add(tx2.GetHash());
+    relayOrder.Update(hashTip, INTERVAL - 1);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 1U);
+    relayOrder.Update(hashTip, INTERVAL);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 2U);
+
+    // but a peer that has it queued ranks it right away
+    CTransaction tx3 = MakeTx(uint256S("03"), 0);
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(3000).FromTx(tx3));
+    relayOrder.Add(tx3.GetHash());
+    relayOrder.Update(hashTip, INTERVAL + 1);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 2U);
+    std::set<uint256> setQueued;
+    setQueued.insert(tx1.GetHash());
+    setQueued.insert(tx3.GetHash());
+    std::vector<uint256> vOrder = Announce(relayOrder, setQueued);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 3U);
+    BOOST_CHECK(vOrder[0] == tx3.GetHash());
+    BOOST_CHECK(vOrder[1] == tx1.GetHash());
+
+    // A new tip forgets all keys
+    relayOrder.Update(uint256S("bb"), INTERVAL + 2);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(txrelayorder_prioritise)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CTxRelayOrder relayOrder(pool, INTERVAL);
+    TestMemPoolEntryHelper entry;
+    uint256 hashTip = uint256S("aa");
+
+    CTransaction tx1 = MakeTx(uint256S("01"), 0);
+    CTransaction tx2 = MakeTx(uint256S("02"), 0);
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(1000).FromTx(tx1));
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(2000).FromTx(tx2));
+    std::set<uint256> setQueued;
+    setQueued.insert(tx1.GetHash());
+    setQueued.insert(tx2.GetHash());
+    relayOrder.Add(tx1.GetHash());
+    relayOrder.Add(tx2.GetHash());
+    relayOrder.Update(hashTip, 0);
+    std::vector<uint256> vOrder = Announce(relayOrder, setQueued);
+    BOOST_CHECK(vOrder[0] == tx2.GetHash());
+    BOOST_CHECK(vOrder[1] == tx1.GetHash());
+
+    // Raising the fee of tx1 forgets its key, even before the interval passed
+    pool.PrioritiseTransaction(tx1.GetHash(), tx1.GetHash().ToString(), 0, 5000);
+    relayOrder.Update(hashTip, 1);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 1U);
+    vOrder = Announce(relayOrder, setQueued);
+    BOOST_CHECK_EQUAL(relayOrder.size(), 2U);
+    BOOST_CHECK(vOrder[0] == tx1.GetHash());
+    BOOST_CHECK(vOrder[1] == tx2.GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -12,6 +12,7 @@
 
 #include <stdint.h>
 
+#include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -20,14 +21,23 @@ static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_BLOCK_INDEX_CHANGED = 'd';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_BLOCK_INDEX_SNAPSHOT = 'S';
 
+//! Format version of the block index snapshot
+static const int BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+//! Stored after the last block file number by flushes that mark changed entries
+static const uint32_t BLOCK_INDEX_FLUSH_MARKER = 0x70616e73;
+//! Bytes serialized before they are written out to the snapshot
+static const size_t BLOCK_INDEX_SNAPSHOT_CHUNK = 1 << 20;
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", GetDBOptions("chainstate", nCacheSize), fMemory, fWipe, true) 
 {
 }
 
@@ -69,7 +79,9 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", GetDBOptions("blockindex", nCacheSize), fMemory, fWipe), fSnapshot(false) {
+    if (!fMemory)
+        pathSnapshot = GetDataDir() / "blocks" / "indexsnapshot.dat";
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -141,13 +153,24 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
         batch.Write(make_pair(DB_BLOCK_FILES, it->first), *it->second);
     }
-    batch.Write(DB_LAST_BLOCK, nLastFile);
+    if (fSnapshot)
+        batch.Write(DB_LAST_BLOCK, make_pair(nLastFile, BLOCK_INDEX_FLUSH_MARKER));
+    else
+        batch.Write(DB_LAST_BLOCK, nLastFile);
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
         batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
+        if (fSnapshot)
+            batch.Write(make_pair(DB_BLOCK_INDEX_CHANGED, (*it)->GetBlockHash()), '1');
     }
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::IsLastFlushMarked()
+{
+    std::pair<int, uint32_t> lastBlock;
+    return Read(DB_LAST_BLOCK, lastBlock) && lastBlock.second == BLOCK_INDEX_FLUSH_MARKER;
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair(DB_TXINDEX, txid), pos);
 }
@@ -171,6 +194,29 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+/** Fill in the block index entry for hash from its record */
+static bool LoadDiskBlockIndex(const uint256& hash, const CDiskBlockIndex& diskindex, boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+{
+    // Construct block index object
+    CBlockIndex* pindexNew = insertBlockIndex(hash);
+    pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
+    pindexNew->nHeight        = diskindex.nHeight;
+    pindexNew->nFile          = diskindex.nFile;
+    pindexNew->nDataPos       = diskindex.nDataPos;
+    pindexNew->nUndoPos       = diskindex.nUndoPos;
+    pindexNew->nVersion       = diskindex.nVersion;
+    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindexNew->nTime          = diskindex.nTime;
+    pindexNew->nBits          = diskindex.nBits;
+    pindexNew->nNonce         = diskindex.nNonce;
+    pindexNew->nStatus        = diskindex.nStatus;
+    pindexNew->nTx            = diskindex.nTx;
+
+    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
+        return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
 {
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
@@ -184,24 +230,8 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
         if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
             CDiskBlockIndex diskindex;
             if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
-
+                if (!LoadDiskBlockIndex(diskindex.GetBlockHash(), diskindex, insertBlockIndex))
+                    return false;
                 pcursor->Next();
             } else {
                 return error("LoadBlockIndex() : failed to read value");
@@ -213,3 +243,129 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
 
     return true;
 }
+
+void CBlockTreeDB::SetSnapshotEnabled(bool fEnabled)
+{
+    fSnapshot = fEnabled && !pathSnapshot.empty();
+    // Entries written while disabled are not tracked, so forget the snapshot
+    if (!fSnapshot && Exists(DB_BLOCK_INDEX_SNAPSHOT)) {
+        CDBBatch batch(*this);
+        batch.Erase(DB_BLOCK_INDEX_SNAPSHOT);
+        WriteBatch(batch, true);
+    }
+}
+
+bool CBlockTreeDB::WriteBlockIndexSnapshot(const std::vector<const CBlockIndex*>& vIndex)
+{
+    if (!fSnapshot)
+        return false;
+
+    // Write a new file next to the old one and hash it as it is written
+    boost::filesystem::path pathTmp = pathSnapshot;
+    pathTmp += ".new";
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    try {
+        CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s: failed to open %s", __func__, pathTmp.string());
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << BLOCK_INDEX_SNAPSHOT_VERSION << (uint64_t)vIndex.size();
+        for (size_t i = 0; i <= vIndex.size(); i++) {
+            if (i < vIndex.size())
+                ss << vIndex[i]->GetBlockHash() << CDiskBlockIndex(vIndex[i]);
+            if (ss.size() >= BLOCK_INDEX_SNAPSHOT_CHUNK || (i == vIndex.size() && !ss.empty())) {
+                hasher.write(&ss[0], ss.size());
+                fileout.write(&ss[0], ss.size());
+                ss.clear();
+            }
+        }
+        FileCommit(fileout.Get());
+    } catch (const std::exception& e) {
+        return error("%s: failed to write %s: %s", __func__, pathTmp.string(), e.what());
+    }
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("%s: failed to rename %s", __func__, pathTmp.string());
+
+    // Only now is the snapshot used, with the entries written from here on on top
+    CDBBatch batch(*this);
+    batch.Write(DB_BLOCK_INDEX_SNAPSHOT, hasher.GetHash());
+    int nLastFile;
+    if (ReadLastBlockFile(nLastFile))
+        batch.Write(DB_LAST_BLOCK, make_pair(nLastFile, BLOCK_INDEX_FLUSH_MARKER));
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+    for (pcursor->Seek(make_pair(DB_BLOCK_INDEX_CHANGED, uint256())); pcursor->Valid(); pcursor->Next()) {
+        std::pair<char, uint256> key;
+        if (!pcursor->GetKey(key) || key.first != DB_BLOCK_INDEX_CHANGED)
+            break;
+        batch.Erase(key);
+    }
+    return WriteBatch(batch, true);
+}
+
+bool CBlockTreeDB::LoadBlockIndexSnapshot(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, size_t& nChanged)
+{
+    uint256 hashSnapshot;
+    if (!fSnapshot || !Read(DB_BLOCK_INDEX_SNAPSHOT, hashSnapshot))
+        return false;
+
+    // Versions that don't know about snapshots write entries without marking
+    // them as changed.  Every flush of theirs, also one that only changes the
+    // status of blocks, writes the last block file number without the marker
+    // after it, which they ignore when reading it.  The snapshot is forgotten,
+    // so flushes from here on don't make it look current again.
+    if (!IsLastFlushMarked()) {
+        LogPrintf("%s: the block index was written without updating the snapshot, loading it in full\n", __func__);
+        Erase(DB_BLOCK_INDEX_SNAPSHOT, true);
+        return false;
+    }
+
+    // Read the whole file at once and check that it is the one last written
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    try {
+        CAutoFile filein(fopen(pathSnapshot.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: failed to open %s", __func__, pathSnapshot.string());
+        ss.resize(boost::filesystem::file_size(pathSnapshot));
+        if (ss.empty())
+            return error("%s: %s is empty", __func__, pathSnapshot.string());
+        filein.read(&ss[0], ss.size());
+    } catch (const std::exception& e) {
+        return error("%s: failed to read %s: %s", __func__, pathSnapshot.string(), e.what());
+    }
+    if (Hash(ss.begin(), ss.end()) != hashSnapshot)
+        return error("%s: %s does not match the block index", __func__, pathSnapshot.string());
+
+    try {
+        int nVersion;
+        uint64_t nEntries;
+        ss >> nVersion >> nEntries;
+        if (nVersion != BLOCK_INDEX_SNAPSHOT_VERSION)
+            return error("%s: unknown snapshot version %d", __func__, nVersion);
+        for (uint64_t i = 0; i < nEntries; i++) {
+            uint256 hash;
+            CDiskBlockIndex diskindex;
+            ss >> hash >> diskindex;
+            if (!LoadDiskBlockIndex(hash, diskindex, insertBlockIndex))
+                return false;
+        }
+    } catch (const std::exception& e) {
+        return error("%s: failed to deserialize %s: %s", __func__, pathSnapshot.string(), e.what());
+    }
+
+    // Then the entries written since, which replace those in the snapshot
+    nChanged = 0;
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+    for (pcursor->Seek(make_pair(DB_BLOCK_INDEX_CHANGED, uint256())); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, uint256> key;
+        if (!pcursor->GetKey(key) || key.first != DB_BLOCK_INDEX_CHANGED)
+            break;
+        CDiskBlockIndex diskindex;
+        if (!Read(make_pair(DB_BLOCK_INDEX, key.second), diskindex))
+            return error("%s: failed to read changed entry %s", __func__, key.second.ToString());
+        if (!LoadDiskBlockIndex(key.second, diskindex, insertBlockIndex))
+            return false;
+        nChanged++;
+    }
+    return true;
+}
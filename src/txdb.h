@@ -117,6 +117,24 @@ public:
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+
+    /** Start or stop keeping track of the entries written since the last snapshot */
+    void SetSnapshotEnabled(bool fEnabled);
+    /** Replace the block index snapshot by one of vIndex, which must be all of the flushed block index */
+    bool WriteBlockIndexSnapshot(const std::vector<const CBlockIndex*>& vIndex);
+    /**
+     * Load the block index from the snapshot and the entries written since.
+     * Returns false if there is no usable snapshot, LoadBlockIndexGuts then
+     * loads everything, overwriting any entry loaded so far.
+     */
+    bool LoadBlockIndexSnapshot(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, size_t& nChanged);
+
+private:
+    bool fSnapshot;
+    boost::filesystem::path pathSnapshot;
+
+    /** Whether the last block file number was last written by a flush that marks changed entries */
+    bool IsLastFlushMarked();
 };
 
 #endif // BITCOIN_TXDB_H
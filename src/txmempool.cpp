@@ -13,6 +13,7 @@
 #include "policy/fees.h"
 #include "streams.h"
 #include "timedata.h"
+#include "txrelayorder.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "utiltime.h"
@@ -359,6 +360,7 @@ CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee) :
     nCheckFrequency = 0;
 
     minerPolicyEstimator = new CBlockPolicyEstimator(_minReasonableRelayFee);
+    relayOrder = NULL;
     minReasonableRelayFee = _minReasonableRelayFee;
 }
 
@@ -633,6 +635,7 @@ void CTxMemPool::_clear()
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
+    nLastMinFeePerK = 0;
     ++nTransactionsUpdated;
 }
 
@@ -864,33 +867,34 @@ TxMempoolInfo CTxMemPool::info(const uint256& hash) const
 
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
-    LOCK(cs);
     return minerPolicyEstimator->estimateFee(nBlocks);
 }
+CFeeRate CTxMemPool::estimateRawFee(int nBlocks, FeeEstimateHorizon horizon) const
+{
+    return minerPolicyEstimator->estimateRawFee(nBlocks, horizon);
+}
+unsigned int CTxMemPool::HighestFeeEstimateTarget(FeeEstimateHorizon horizon) const
+{
+    return minerPolicyEstimator->HighestTargetTracked(horizon);
+}
 CFeeRate CTxMemPool::estimateSmartFee(int nBlocks, int *answerFoundAtBlocks) const
 {
-    LOCK(cs);
-    return minerPolicyEstimator->estimateSmartFee(nBlocks, answerFoundAtBlocks, *this);
+    return minerPolicyEstimator->estimateSmartFee(nBlocks, answerFoundAtBlocks, CFeeRate(nLastMinFeePerK));
 }
 double CTxMemPool::estimatePriority(int nBlocks) const
 {
-    LOCK(cs);
     return minerPolicyEstimator->estimatePriority(nBlocks);
 }
 double CTxMemPool::estimateSmartPriority(int nBlocks, int *answerFoundAtBlocks) const
 {
-    LOCK(cs);
-    return minerPolicyEstimator->estimateSmartPriority(nBlocks, answerFoundAtBlocks, *this);
+    return minerPolicyEstimator->estimateSmartPriority(nBlocks, answerFoundAtBlocks, CFeeRate(nLastMinFeePerK));
 }
 
 bool
-CTxMemPool::WriteFeeEstimates(CAutoFile& fileout) const
+CTxMemPool::WriteFeeEstimates(CDBWrapper& db) const
 {
     try {
-        LOCK(cs);
-        fileout << 109900; // version required to read: 0.10.99 or later
-        fileout << CLIENT_VERSION; // version that wrote the file
-        minerPolicyEstimator->Write(fileout);
+        minerPolicyEstimator->Write(db);
     }
     catch (const std::exception&) {
         LogPrintf("CTxMemPool::WriteFeeEstimates(): unable to write policy estimator data (non-fatal)\n");
@@ -900,24 +904,24 @@ CTxMemPool::WriteFeeEstimates(CAutoFile& fileout) const
 }
 
 bool
-CTxMemPool::ReadFeeEstimates(CAutoFile& filein)
+CTxMemPool::ReadFeeEstimates(const CDBWrapper& db)
 {
     try {
-        int nVersionRequired, nVersionThatWrote;
-        filein >> nVersionRequired >> nVersionThatWrote;
-        if (nVersionRequired > CLIENT_VERSION)
-            return error("CTxMemPool::ReadFeeEstimates(): up-version (%d) fee estimate file", nVersionRequired);
-
-        LOCK(cs);
-        minerPolicyEstimator->Read(filein);
+        if (!minerPolicyEstimator->Read(db))
+            return false;
     }
-    catch (const std::exception&) {
-        LogPrintf("CTxMemPool::ReadFeeEstimates(): unable to read policy estimator data (non-fatal)\n");
+    catch (const std::exception& e) {
+        LogPrintf("CTxMemPool::ReadFeeEstimates(): unable to read policy estimator data (non-fatal): %s\n", e.what());
         return false;
     }
     return true;
 }
 
+bool CTxMemPool::FeeEstimatesDirty() const
+{
+    return minerPolicyEstimator->IsDirty();
+}
+
 void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash, double dPriorityDelta, const CAmount& nFeeDelta)
 {
     {
@@ -937,6 +941,8 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
                 mapTx.modify(ancestorIt, update_descendant_state(0, nFeeDelta, 0));
             }
         }
+        if (relayOrder)
+            relayOrder->Invalidate(hash);
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -1062,8 +1068,10 @@ const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) cons
 
 CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
     LOCK(cs);
-    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0) {
+        nLastMinFeePerK = (CAmount)rollingMinimumFeeRate;
         return CFeeRate(rollingMinimumFeeRate);
+    }
 
     int64_t time = GetTime();
     if (time > lastRollingFeeUpdate + 10) {
@@ -1078,10 +1086,13 @@ CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
 
         if (rollingMinimumFeeRate < minReasonableRelayFee.GetFeePerK() / 2) {
             rollingMinimumFeeRate = 0;
+            nLastMinFeePerK = 0;
             return CFeeRate(0);
         }
     }
-    return std::max(CFeeRate(rollingMinimumFeeRate), minReasonableRelayFee);
+    CFeeRate minFee = std::max(CFeeRate(rollingMinimumFeeRate), minReasonableRelayFee);
+    nLastMinFeePerK = minFee.GetFeePerK();
+    return minFee;
 }
 
 void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
@@ -1089,6 +1100,7 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
     if (rate.GetFeePerK() > rollingMinimumFeeRate) {
         rollingMinimumFeeRate = rate.GetFeePerK();
         blockSinceLastRollingFeeBump = false;
+        nLastMinFeePerK = rate.GetFeePerK();
     }
 }
 
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <atomic>
 #include <list>
 #include <memory>
 #include <set>
@@ -13,6 +14,7 @@
 #include "amount.h"
 #include "coins.h"
 #include "indirectmap.h"
+#include "policy/fees.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
@@ -21,8 +23,8 @@
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
 
-class CAutoFile;
 class CBlockIndex;
+class CDBWrapper;
 
 inline double AllowFreeThreshold()
 {
@@ -311,6 +313,7 @@ struct mining_score {};
 struct ancestor_score {};
 
 class CBlockPolicyEstimator;
+class CTxRelayOrder;
 
 /**
  * Information about a mempool transaction.
@@ -410,6 +413,7 @@ private:
     uint32_t nCheckFrequency; //!< Value n means that n times in 2^32 we check.
     unsigned int nTransactionsUpdated;
     CBlockPolicyEstimator* minerPolicyEstimator;
+    CTxRelayOrder* relayOrder; //!< told about prioritised transactions, may be NULL
 
     uint64_t totalTxSize;      //!< sum of all mempool tx' byte sizes
     uint64_t cachedInnerUsage; //!< sum of dynamic memory usage of all the map elements (NOT the maps themselves)
@@ -419,6 +423,7 @@ private:
     mutable int64_t lastRollingFeeUpdate;
     mutable bool blockSinceLastRollingFeeBump;
     mutable double rollingMinimumFeeRate; //!< minimum fee to get into the pool, decreases exponentially
+    mutable std::atomic<CAmount> nLastMinFeePerK; //!< last result of GetMinFee, read by fee estimation without taking cs
 
     void trackPackageRemoved(const CFeeRate& rate);
 
@@ -509,6 +514,7 @@ public:
      */
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(double dFrequency = 1.0) { nCheckFrequency = dFrequency * 4294967295.0; }
+    void SetRelayOrder(CTxRelayOrder* relayOrderIn) { relayOrder = relayOrderIn; }
 
     // addUnchecked must updated state for all ancestors of a given transaction,
     // to track size/count of descendant transactions.  First version of
@@ -619,13 +625,20 @@ public:
 
     /** Estimate fee rate needed to get into the next nBlocks
      *  If no answer can be given at nBlocks, return an estimate
-     *  at the lowest number of blocks where one can be given
+     *  at the lowest number of blocks where one can be given.
+     *  Neither this nor the other estimates take cs.
      */
     CFeeRate estimateSmartFee(int nBlocks, int *answerFoundAtBlocks = NULL) const;
 
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 
+    /** Estimate fee rate needed to get into the next nBlocks using only one time horizon */
+    CFeeRate estimateRawFee(int nBlocks, FeeEstimateHorizon horizon) const;
+
+    /** Highest number of blocks the given time horizon can estimate for */
+    unsigned int HighestFeeEstimateTarget(FeeEstimateHorizon horizon) const;
+
     /** Estimate priority needed to get into the next nBlocks
      *  If no answer can be given at nBlocks, return an estimate
      *  at the lowest number of blocks where one can be given
@@ -635,9 +648,13 @@ public:
     /** Estimate priority needed to get into the next nBlocks */
     double estimatePriority(int nBlocks) const;
     
-    /** Write/Read estimates to disk */
-    bool WriteFeeEstimates(CAutoFile& fileout) const;
-    bool ReadFeeEstimates(CAutoFile& filein);
+    /** Write the estimates changed since the last write to db */
+    bool WriteFeeEstimates(CDBWrapper& db) const;
+    /** Read the estimates from db, false if there are none or they can't be read */
+    bool ReadFeeEstimates(const CDBWrapper& db);
+
+    /** Have the estimates changed since they were last written to disk? */
+    bool FeeEstimatesDirty() const;
 
     size_t DynamicMemoryUsage() const;
 
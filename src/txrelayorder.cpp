@@ -0,0 +1,131 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txrelayorder.h"
+
+#include "txmempool.h"
+
+#include <algorithm>
+#include <limits>
+
+/** Transactions beyond this many waiting for the next batch are left to be ranked by the peers */
+static const size_t MAX_PENDING_RANKS = 50000;
+/** Forget all keys when more than this many are cached, even if the tip didn't change */
+static const size_t MAX_CACHED_KEYS = 200000;
+
+bool CTxRelayOrder::Compare::operator()(const Entry& a, const Entry& b) const
+{
+    /* As std::make_heap produces a max-heap, we want the entries with the
+     * fewest ancestors/highest fee to sort later. This mirrors
+     * CTxMemPool::CompareDepthAndScore(*b, *a). */
+    if (a.first.nCountWithAncestors != b.first.nCountWithAncestors)
+        return b.first.nCountWithAncestors < a.first.nCountWithAncestors;
+    double f1 = (double)b.first.nModifiedFee * a.first.nTxSize;
+    double f2 = (double)a.first.nModifiedFee * b.first.nTxSize;
+    if (f1 == f2)
+        return *a.second < *b.second;
+    return f1 > f2;
+}
+
+CTxRelayOrder::CTxRelayOrder(CTxMemPool& poolIn, int64_t nIntervalIn) :
+    pool(poolIn), nInterval(nIntervalIn), nNextUpdate(0)
+{
+    pool.SetRelayOrder(this);
+}
+
+CTxRelayOrder::~CTxRelayOrder()
+{
+    pool.SetRelayOrder(NULL);
+}
+
+void CTxRelayOrder::Add(const uint256& hash)
+{
+    LOCK(cs_pending);
+    if (vPending.size() < MAX_PENDING_RANKS)
+        vPending.push_back(hash);
+}
+
+void CTxRelayOrder::Invalidate(const uint256& hash)
+{
+    LOCK(cs_pending);
+    vInvalidated.push_back(hash);
+}
+
+void CTxRelayOrder::Update(const uint256& hashTip, int64_t nNow)
+{
+    LOCK(cs);
+    if (hashTip != hashLastTip || mapKeys.size() > MAX_CACHED_KEYS) {
+        hashLastTip = hashTip;
+        mapKeys.clear();
+    }
+    std::vector<uint256> vForget;
+    {
+        LOCK(cs_pending);
+        vForget.swap(vInvalidated);
+    }
+    // Ranked again by the first peer that has them queued
+    for (std::vector<uint256>::const_iterator it = vForget.begin(); it != vForget.end(); it++)
+        mapKeys.erase(*it);
+    if (nNow < nNextUpdate)
+        return;
+    std::vector<uint256> vBatch;
+    {
+        LOCK(cs_pending);
+        vBatch.swap(vPending);
+    }
+    if (vBatch.empty())
+        return;
+    nNextUpdate = nNow + nInterval;
+    Rank(vBatch);
+}
+
+void CTxRelayOrder::Rank(const std::vector<uint256>& vHashes)
+{
+    AssertLockHeld(cs);
+    LOCK(pool.cs);
+    for (std::vector<uint256>::const_iterator it = vHashes.begin(); it != vHashes.end(); it++) {
+        CTxMemPool::indexed_transaction_set::const_iterator mi = pool.mapTx.find(*it);
+        Key& key = mapKeys[*it];
+        if (mi == pool.mapTx.end()) {
+            // Sort transactions that are gone last, they are dropped when their turn comes
+            key.nCountWithAncestors = std::numeric_limits<uint64_t>::max();
+            key.nModifiedFee = 0;
+            key.nTxSize = 1;
+        } else {
+            key.nCountWithAncestors = mi->GetCountWithAncestors();
+            key.nModifiedFee = mi->GetModifiedFee();
+            key.nTxSize = mi->GetTxSize();
+        }
+    }
+}
+
+void CTxRelayOrder::GetOrdered(std::set<uint256>& setQueued, std::vector<Entry>& vEntries)
+{
+    LOCK(cs);
+    size_t nFirst = vEntries.size();
+    std::vector<uint256> vMissing;
+    vEntries.reserve(nFirst + setQueued.size());
+    for (std::set<uint256>::iterator it = setQueued.begin(); it != setQueued.end(); it++) {
+        boost::unordered_map<uint256, Key, SaltedTxidHasher>::const_iterator mi = mapKeys.find(*it);
+        if (mi == mapKeys.end())
+            vMissing.push_back(*it);
+        else
+            vEntries.push_back(std::make_pair(mi->second, it));
+    }
+    if (vMissing.empty())
+        return;
+
+    // Rank what no other peer has needed yet, sharing the result with them
+    Rank(vMissing);
+    for (std::set<uint256>::iterator it = setQueued.begin(); it != setQueued.end() && nFirst + setQueued.size() != vEntries.size(); it++) {
+        if (std::binary_search(vMissing.begin(), vMissing.end(), *it))
+            vEntries.push_back(std::make_pair(mapKeys[*it], it));
+    }
+}
+
+size_t CTxRelayOrder::size()
+{
+    LOCK(cs);
+    return mapKeys.size();
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXRELAYORDER_H
+#define BITCOIN_TXRELAYORDER_H
+
+#include "amount.h"
+#include "coins.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+class CTxMemPool;
+
+/**
+ * Order in which queued transactions are announced to peers.
+ *
+ * Transactions are announced with the fewest in-mempool ancestors first and
+ * then by descending feerate, which is the same order for every peer.  Rather
+ * than sorting each peer's trickle queue against the mempool, taking the
+ * mempool lock for every comparison, the ordering key of each transaction is
+ * looked up once and shared by all peers.  New mempool transactions are ranked
+ * in one batch per interval; a peer that finds a transaction without a key
+ * ranks it right away, so no announcement is delayed.
+ *
+ * The number of ancestors of a mempool transaction can only shrink when a
+ * block is connected, so all keys are forgotten when the tip changes.  Within
+ * one tip the cached keys thus always order parents before their children.
+ * The key of a transaction whose fee is changed by PrioritiseTransaction is
+ * forgotten with the next Update().
+ */
+class CTxRelayOrder
+{
+public:
+    /** Ordering key of a transaction, taken from its mempool entry */
+    struct Key
+    {
+        uint64_t nCountWithAncestors;
+        CAmount nModifiedFee;
+        size_t nTxSize;
+    };
+
+    /** A queued transaction of a peer with its key */
+    typedef std::pair<Key, std::set<uint256>::iterator> Entry;
+
+    /** Comparator for a max-heap with the transaction to announce first at the top */
+    struct Compare
+    {
+        bool operator()(const Entry& a, const Entry& b) const;
+    };
+
+    /** Registers with poolIn to learn about prioritised transactions */
+    CTxRelayOrder(CTxMemPool& poolIn, int64_t nIntervalIn);
+    ~CTxRelayOrder();
+
+    /** Queue a transaction added to the mempool to be ranked with the next batch */
+    void Add(const uint256& hash);
+
+    /** Forget the key of a transaction with the next Update(), as its fee changed */
+    void Invalidate(const uint256& hash);
+
+    /**
+     * Forget all keys if hashTip differs from the last call, and rank the
+     * queued transactions if the interval since the last batch has passed.
+     * @param nNow current time in microseconds
+     */
+    void Update(const uint256& hashTip, int64_t nNow);
+
+    /** Append the queued transactions of a peer with their keys to vEntries */
+    void GetOrdered(std::set<uint256>& setQueued, std::vector<Entry>& vEntries);
+
+    /** Number of transactions with a known key */
+    size_t size();
+
+private:
+    CCriticalSection cs;
+    CTxMemPool& pool;
+    const int64_t nInterval;
+    int64_t nNextUpdate;
+    uint256 hashLastTip;
+    //! Protects only vPending and vInvalidated, so Add() and Invalidate() can be called with the mempool locked
+    CCriticalSection cs_pending;
+    std::vector<uint256> vPending;
+    std::vector<uint256> vInvalidated;
+    boost::unordered_map<uint256, Key, SaltedTxidHasher> mapKeys;
+
+    /** Look up the keys of vHashes under a single mempool lock */
+    void Rank(const std::vector<uint256>& vHashes);
+};
+
+#endif // BITCOIN_TXRELAYORDER_H
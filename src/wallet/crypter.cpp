@@ -162,6 +162,7 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        mapDecryptedKeys.clear();
     }
 
     NotifyStatusChanged(this);
@@ -175,11 +176,19 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         if (!SetCrypted())
             return false;
 
+        // The first unlock checks a sample of keys spread over the wallet,
+        // later ones just one; the others are checked as they are used.
+        size_t nCheck = fDecryptionThoroughlyChecked ? 1 : std::min(mapCryptedKeys.size(), (size_t)UNLOCK_CHECK_KEYS);
+        size_t nStep = nCheck > 0 ? mapCryptedKeys.size() / nCheck : 1;
+        size_t nChecked = 0;
         bool keyPass = false;
         bool keyFail = false;
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
-        for (; mi != mapCryptedKeys.end(); ++mi)
+        for (size_t i = 0; mi != mapCryptedKeys.end() && nChecked < nCheck; ++mi, ++i)
         {
+            if (i % nStep != 0)
+                continue;
+            nChecked++;
             const CPubKey &vchPubKey = (*mi).second.first;
             const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
             CKey key;
@@ -189,8 +198,6 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
                 break;
             }
             keyPass = true;
-            if (fDecryptionThoroughlyChecked)
-                break;
         }
         if (keyPass && keyFail)
         {
@@ -200,6 +207,7 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         if (keyFail || !keyPass)
             return false;
         vMasterKey = vMasterKeyIn;
+        mapDecryptedKeys.clear();
         fDecryptionThoroughlyChecked = true;
     }
     NotifyStatusChanged(this);
@@ -213,12 +221,8 @@ bool CCryptoKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
         if (!IsCrypted())
             return CBasicKeyStore::AddKeyPubKey(key, pubkey);
 
-        if (IsLocked())
-            return false;
-
         std::vector<unsigned char> vchCryptedSecret;
-        CKeyingMaterial vchSecret(key.begin(), key.end());
-        if (!EncryptSecret(vMasterKey, vchSecret, pubkey.GetHash(), vchCryptedSecret))
+        if (!EncryptKey(key, pubkey, vchCryptedSecret))
             return false;
 
         if (!AddCryptedKey(pubkey, vchCryptedSecret))
@@ -227,6 +231,16 @@ bool CCryptoKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
     return true;
 }
 
+bool CCryptoKeyStore::EncryptKey(const CKey& key, const CPubKey &pubkey, std::vector<unsigned char> &vchCryptedSecret) const
+{
+    LOCK(cs_KeyStore);
+    if (!IsCrypted() || IsLocked())
+        return false;
+
+    CKeyingMaterial vchSecret(key.begin(), key.end());
+    return EncryptSecret(vMasterKey, vchSecret, pubkey.GetHash(), vchCryptedSecret);
+}
+
 
 bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
@@ -236,6 +250,7 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
             return false;
 
         mapCryptedKeys[vchPubKey.GetID()] = make_pair(vchPubKey, vchCryptedSecret);
+        mapDecryptedKeys.erase(vchPubKey.GetID());
     }
     return true;
 }
@@ -247,12 +262,29 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
         if (!IsCrypted())
             return CBasicKeyStore::GetKey(address, keyOut);
 
+        std::map<CKeyID, CKey>::const_iterator ki = mapDecryptedKeys.find(address);
+        if (ki != mapDecryptedKeys.end())
+        {
+            keyOut = ki->second;
+            return true;
+        }
+
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
         {
             const CPubKey &vchPubKey = (*mi).second.first;
             const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            return DecryptKey(vMasterKey, vchCryptedSecret, vchPubKey, keyOut);
+            if (!DecryptKey(vMasterKey, vchCryptedSecret, vchPubKey, keyOut))
+            {
+                // Unlock() only checked a sample of the keys
+                if (!vMasterKey.empty())
+                    LogPrintf("%s: key %s does not decrypt, the wallet is probably corrupted\n", __func__, address.ToString());
+                return false;
+            }
+            if (mapDecryptedKeys.size() >= MAX_DECRYPTED_KEYS)
+                mapDecryptedKeys.erase(mapDecryptedKeys.begin());
+            mapDecryptedKeys.insert(std::make_pair(address, keyOut));
+            return true;
         }
     }
     return false;
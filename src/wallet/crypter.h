@@ -116,8 +116,18 @@ public:
     }
 };
 
+//! Number of keys, spread over the wallet, the first Unlock() decrypts and checks against their public keys
+static const unsigned int UNLOCK_CHECK_KEYS = 32;
+//! Maximum number of decrypted keys kept while the wallet is unlocked
+static const unsigned int MAX_DECRYPTED_KEYS = 4096;
+
 /** Keystore which keeps the private keys encrypted.
  * It derives from the basic key store, which is used if no encryption is active.
+ *
+ * Unlocking only decrypts a sample of the keys to check the master key;
+ * each key is decrypted and checked against its public key when it is
+ * first used, and kept in mapDecryptedKeys until the wallet is locked, so
+ * signing with it again doesn't repeat the work.
  */
 class CCryptoKeyStore : public CBasicKeyStore
 {
@@ -126,6 +136,9 @@ private:
 
     CKeyingMaterial vMasterKey;
 
+    //! Keys decrypted since the wallet was unlocked; CKey keeps the secrets in locked memory and wipes them when freed
+    mutable std::map<CKeyID, CKey> mapDecryptedKeys;
+
     //! if fUseCrypto is true, mapKeys must be empty
     //! if fUseCrypto is false, vMasterKey must be empty
     bool fUseCrypto;
@@ -141,6 +154,9 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    //! Encrypt key with the master key, for AddCryptedKey; fails if the store is locked
+    bool EncryptKey(const CKey& key, const CPubKey &pubkey, std::vector<unsigned char> &vchCryptedSecret) const;
+
 public:
     CCryptoKeyStore() : fUseCrypto(false), fDecryptionThoroughlyChecked(false)
     {
@@ -61,6 +61,9 @@ CDBEnv::CDBEnv() : dbenv(NULL)
 
 CDBEnv::~CDBEnv()
 {
+    for (std::map<std::string, CLogDB*>::iterator it = mapLogDb.begin(); it != mapLogDb.end(); it++)
+        delete it->second;
+    mapLogDb.clear();
     EnvShutdown();
     delete dbenv;
     dbenv = NULL;
@@ -234,13 +237,13 @@ bool CDBEnv::Salvage(const std::string& strFile, bool fAggressive, std::vector<C
 void CDBEnv::CheckpointLSN(const std::string& strFile)
 {
     dbenv->txn_checkpoint(0, 0, 0);
-    if (fMockDb)
+    if (fMockDb || IsLogDb(strFile))
         return;
     dbenv->lsn_reset(strFile.c_str(), 0);
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), plogdb(NULL), activeTxn(NULL), pactiveBatch(NULL)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -259,6 +262,24 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
             throw runtime_error("CDB: Failed to open database environment.");
 
         strFile = strFilename;
+        bool fNewLog = fCreate && !bitdb.IsMock() && GetArg("-walletbackend", DEFAULT_WALLET_BACKEND) == "log" &&
+                       !boost::filesystem::exists(GetDataDir() / strFile);
+        if (fNewLog || bitdb.IsLogDb(strFile)) {
+            plogdb = bitdb.OpenLogDb(strFile, fCreate);
+            if (!plogdb) {
+                strFile = "";
+                throw runtime_error(strprintf("CDB: Can't open log database %s", strFilename));
+            }
+            ++bitdb.mapFileUseCount[strFile];
+            if (fCreate && !Exists(string("version"))) {
+                bool fTmp = fReadOnly;
+                fReadOnly = false;
+                WriteVersion(CLIENT_VERSION);
+                fReadOnly = fTmp;
+            }
+            return;
+        }
+
         ++bitdb.mapFileUseCount[strFile];
         pdb = bitdb.mapDb[strFile];
         if (pdb == NULL) {
@@ -301,7 +322,8 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    // Commits to a log are synced as they are made
+    if (activeTxn || plogdb)
         return;
 
     // Flush database activity from memory pool to disk log
@@ -314,12 +336,15 @@ void CDB::Flush()
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pdb && !plogdb)
         return;
     if (activeTxn)
         activeTxn->abort();
     activeTxn = NULL;
+    delete pactiveBatch;
+    pactiveBatch = NULL;
     pdb = NULL;
+    plogdb = NULL;
 
     if (fFlushOnClose)
         Flush();
@@ -334,6 +359,11 @@ void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
+        std::map<std::string, CLogDB*>::iterator it = mapLogDb.find(strFile);
+        if (it != mapLogDb.end()) {
+            delete it->second;
+            mapLogDb.erase(it);
+        }
         if (mapDb[strFile] != NULL) {
             // Close the database handle
             Db* pdb = mapDb[strFile];
@@ -349,16 +379,127 @@ bool CDBEnv::RemoveDb(const string& strFile)
     this->CloseDb(strFile);
 
     LOCK(cs_db);
+    if (IsLogDb(strFile)) {
+        mapIsLogDb.erase(strFile);
+        return boost::filesystem::remove(boost::filesystem::path(strPath) / strFile);
+    }
     int rc = dbenv->dbremove(NULL, strFile.c_str(), NULL, DB_AUTO_COMMIT);
     return (rc == 0);
 }
 
+bool CDBEnv::IsLogDb(const std::string& strFile)
+{
+    LOCK(cs_db);
+    if (fMockDb)
+        return false;
+    if (mapLogDb.count(strFile))
+        return true;
+    std::map<std::string, bool>::const_iterator it = mapIsLogDb.find(strFile);
+    if (it != mapIsLogDb.end())
+        return it->second;
+    boost::filesystem::path pathFile = boost::filesystem::path(strPath) / strFile;
+    if (!boost::filesystem::exists(pathFile))
+        return false;
+    bool fLogDb = CLogDB::IsLogFile(pathFile);
+    mapIsLogDb[strFile] = fLogDb;
+    return fLogDb;
+}
+
+CLogDB* CDBEnv::OpenLogDb(const std::string& strFile, bool fCreate)
+{
+    LOCK(cs_db);
+    CLogDB*& plogdb = mapLogDb[strFile];
+    if (plogdb)
+        return plogdb;
+    plogdb = new CLogDB();
+    if (!plogdb->Open(boost::filesystem::path(strPath) / strFile, fCreate)) {
+        delete plogdb;
+        mapLogDb.erase(strFile);
+        return NULL;
+    }
+    mapIsLogDb[strFile] = true;
+    return plogdb;
+}
+
+bool CDB::ReadLog(const CDataStream& ssKey, CSerializeData& vchValue)
+{
+    CSerializeData vchKey(ssKey.begin(), ssKey.end());
+    if (pactiveBatch) {
+        bool fErased;
+        if (pactiveBatch->Find(vchKey, vchValue, fErased))
+            return !fErased;
+    }
+    return plogdb->Read(vchKey, vchValue);
+}
+
+bool CDB::WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite) {
+        CSerializeData vchValue;
+        if (ReadLog(ssKey, vchValue))
+            return false;
+    }
+    CSerializeData vchKey(ssKey.begin(), ssKey.end());
+    CSerializeData vchValue(ssValue.begin(), ssValue.end());
+    if (pactiveBatch) {
+        pactiveBatch->Write(vchKey, vchValue);
+        return true;
+    }
+    CLogDBBatch batch;
+    batch.Write(vchKey, vchValue);
+    return plogdb->Commit(batch);
+}
+
+bool CDB::EraseLog(const CDataStream& ssKey)
+{
+    CSerializeData vchKey(ssKey.begin(), ssKey.end());
+    if (pactiveBatch) {
+        pactiveBatch->Erase(vchKey);
+        return true;
+    }
+    CLogDBBatch batch;
+    batch.Erase(vchKey);
+    return plogdb->Commit(batch);
+}
+
+int CDB::ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool setRange)
+{
+    CSerializeData vchKey, vchValue;
+    bool fFound;
+    if (setRange)
+        fFound = plogdb->ReadNext(CSerializeData(ssKey.begin(), ssKey.end()), true, vchKey, vchValue);
+    else
+        fFound = plogdb->ReadNext(pcursor->vchKey, !pcursor->fStarted, vchKey, vchValue);
+    if (!fFound)
+        return DB_NOTFOUND;
+    pcursor->vchKey = vchKey;
+    pcursor->fStarted = true;
+
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write(vchKey.data(), vchKey.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write(vchValue.data(), vchValue.size());
+    return 0;
+}
+
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
     while (true) {
         {
             LOCK(bitdb.cs_db);
             if (!bitdb.mapFileUseCount.count(strFile) || bitdb.mapFileUseCount[strFile] == 0) {
+                if (bitdb.IsLogDb(strFile)) {
+                    // Compacting drops old copies of the records as well
+                    LogPrintf("CDB::Rewrite: Compacting %s...\n", strFile);
+                    CLogDB* plogdb = bitdb.OpenLogDb(strFile, false);
+                    bool fSuccess = plogdb && plogdb->Compact(pszSkip);
+                    if (!fSuccess)
+                        LogPrintf("CDB::Rewrite: Failed to compact log database file %s\n", strFile);
+                    return fSuccess;
+                }
+
                 // Flush log data to the dat file
                 bitdb.CloseDb(strFile);
                 bitdb.CheckpointLSN(strFile);
@@ -382,17 +523,17 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
                             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
                             int ret1 = db.ReadAtCursor(pcursor, ssKey, ssValue);
                             if (ret1 == DB_NOTFOUND) {
-                                pcursor->close();
+                                delete pcursor;
                                 break;
                             } else if (ret1 != 0) {
-                                pcursor->close();
+                                delete pcursor;
                                 fSuccess = false;
                                 break;
                             }
@@ -436,6 +577,74 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
     return false;
 }
 
+bool CDB::ConvertToLog(const string& strFile)
+{
+    LOCK(bitdb.cs_db);
+    if (bitdb.mapFileUseCount.count(strFile) && bitdb.mapFileUseCount[strFile] > 0)
+        return error("CDB::ConvertToLog: %s is in use", strFile);
+
+    LogPrintf("CDB::ConvertToLog: Converting %s...\n", strFile);
+    boost::filesystem::path pathFile = GetDataDir() / strFile;
+    boost::filesystem::path pathLog = GetDataDir() / (strFile + ".log");
+    boost::filesystem::remove(pathLog);
+
+    bool fSuccess = true;
+    unsigned int nRecords = 0;
+    {
+        CLogDB logdb;
+        if (!logdb.Open(pathLog, true))
+            return false;
+        CDB db(strFile.c_str(), "r");
+        CDBCursor* pcursor = db.GetCursor();
+        fSuccess = pcursor != NULL;
+        CLogDBBatch batch;
+        while (fSuccess) {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue);
+            if (ret == DB_NOTFOUND)
+                break;
+            if (ret != 0) {
+                fSuccess = false;
+                break;
+            }
+            batch.Write(CSerializeData(ssKey.begin(), ssKey.end()), CSerializeData(ssValue.begin(), ssValue.end()));
+            if (++nRecords % 1000 == 0) {
+                fSuccess = logdb.Commit(batch);
+                batch.Clear();
+            }
+        }
+        delete pcursor;
+        fSuccess = fSuccess && logdb.Commit(batch);
+    }
+    if (!fSuccess) {
+        boost::filesystem::remove(pathLog);
+        return error("CDB::ConvertToLog: Failed to copy %s", strFile);
+    }
+
+    // Make the BerkeleyDB file self contained before moving it away
+    bitdb.CloseDb(strFile);
+    bitdb.CheckpointLSN(strFile);
+    bitdb.mapFileUseCount.erase(strFile);
+    boost::filesystem::path pathBak = GetDataDir() / strprintf("%s.%d.bdb.bak", strFile, GetTime());
+    try {
+        boost::filesystem::rename(pathFile, pathBak);
+    } catch (const boost::filesystem::filesystem_error& e) {
+        return error("CDB::ConvertToLog: Failed to move %s away: %s", strFile, e.what());
+    }
+    try {
+        boost::filesystem::rename(pathLog, pathFile);
+    } catch (const boost::filesystem::filesystem_error& e) {
+        // Put the original back, it is still the wallet
+        boost::system::error_code ec;
+        boost::filesystem::rename(pathBak, pathFile, ec);
+        return error("CDB::ConvertToLog: Failed to replace %s: %s", strFile, e.what());
+    }
+    bitdb.mapIsLogDb.erase(strFile);
+    LogPrintf("CDB::ConvertToLog: Converted %u records, the BerkeleyDB file was kept as %s\n", nRecords, pathBak.string());
+    return true;
+}
+
 
 void CDBEnv::Flush(bool fShutdown)
 {
@@ -457,7 +666,7 @@ void CDBEnv::Flush(bool fShutdown)
                 LogPrint("db", "CDBEnv::Flush: %s checkpoint\n", strFile);
                 dbenv->txn_checkpoint(0, 0, 0);
                 LogPrint("db", "CDBEnv::Flush: %s detach\n", strFile);
-                if (!fMockDb)
+                if (!fMockDb && !IsLogDb(strFile))
                     dbenv->lsn_reset(strFile.c_str(), 0);
                 LogPrint("db", "CDBEnv::Flush: %s closed\n", strFile);
                 mapFileUseCount.erase(mi++);
@@ -11,6 +11,7 @@
 #include "streams.h"
 #include "sync.h"
 #include "version.h"
+#include "wallet/logdb.h"
 
 #include <map>
 #include <string>
@@ -22,6 +23,8 @@
 
 static const unsigned int DEFAULT_WALLET_DBLOGSIZE = 100;
 static const bool DEFAULT_WALLET_PRIVDB = true;
+//! -walletbackend default, "bdb" or "log"
+static const char DEFAULT_WALLET_BACKEND[] = "bdb";
 
 extern unsigned int nWalletDBUpdated;
 
@@ -41,6 +44,9 @@ public:
     DbEnv *dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    std::map<std::string, CLogDB*> mapLogDb;
+    //! Files found to be logs or not, see IsLogDb()
+    std::map<std::string, bool> mapIsLogDb;
 
     CDBEnv();
     ~CDBEnv();
@@ -77,6 +83,11 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    /** Whether strFile is an append-only log (see CLogDB) rather than a BerkeleyDB file */
+    bool IsLogDb(const std::string& strFile);
+    /** Get the open log strFile, opening it if needed; NULL on failure */
+    CLogDB* OpenLogDb(const std::string& strFile, bool fCreate);
+
     DbTxn* TxnBegin(int flags = DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -89,14 +100,44 @@ public:
 
 extern CDBEnv bitdb;
 
+/** Cursor over the records of a CDB, see CDB::GetCursor() */
+class CDBCursor
+{
+public:
+    explicit CDBCursor(Dbc* pdbcIn) : pdbc(pdbcIn), plogdb(NULL), fStarted(false) {}
+    explicit CDBCursor(CLogDB* plogdbIn) : pdbc(NULL), plogdb(plogdbIn), fStarted(false) {}
+    ~CDBCursor()
+    {
+        if (pdbc)
+            pdbc->close();
+    }
 
-/** RAII class that provides access to a Berkeley database */
+private:
+    friend class CDB;
+
+    Dbc* pdbc;
+    CLogDB* plogdb;
+    //! Last key read from plogdb
+    CSerializeData vchKey;
+    bool fStarted;
+
+    CDBCursor(const CDBCursor&);
+    void operator=(const CDBCursor&);
+};
+
+/**
+ * RAII class that provides access to a Berkeley database, or to an
+ * append-only log if the file is one (see -walletbackend)
+ */
 class CDB
 {
 protected:
     Db* pdb;
+    CLogDB* plogdb;
     std::string strFile;
     DbTxn* activeTxn;
+    //! Changes of the open transaction on plogdb, committed together
+    CLogDBBatch* pactiveBatch;
     bool fReadOnly;
     bool fFlushOnClose;
 
@@ -111,17 +152,36 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    bool ReadLog(const CDataStream& ssKey, CSerializeData& vchValue);
+    bool WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool EraseLog(const CDataStream& ssKey);
+    int ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool setRange);
+
 protected:
     template <typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plogdb) {
+            CSerializeData vchValue;
+            if (!ReadLog(ssKey, vchValue))
+                return false;
+            try {
+                CDataStream ssValue(vchValue.begin(), vchValue.end(), SER_DISK, CLIENT_VERSION);
+                ssValue >> value;
+            } catch (const std::exception&) {
+                return false;
+            }
+            return true;
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -149,7 +209,7 @@ protected:
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -158,12 +218,16 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+
+        if (plogdb)
+            return WriteLog(ssKey, ssValue, fOverwrite);
+
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -178,7 +242,7 @@ protected:
     template <typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -187,6 +251,10 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plogdb)
+            return EraseLog(ssKey);
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -200,13 +268,19 @@ protected:
     template <typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plogdb) {
+            CSerializeData vchValue;
+            return ReadLog(ssKey, vchValue);
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -217,19 +291,25 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
+    /** Create a cursor over all records, to be deleted by the caller */
+    CDBCursor* GetCursor()
     {
+        if (plogdb)
+            return new CDBCursor(plogdb);
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
             return NULL;
-        return pcursor;
+        return new CDBCursor(pcursor);
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool setRange = false)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool setRange = false)
     {
+        if (pcursor->plogdb)
+            return ReadAtLogCursor(pcursor, ssKey, ssValue, setRange);
+
         // Read at cursor
         Dbt datKey;
         unsigned int fFlags = DB_NEXT;
@@ -241,7 +321,7 @@ protected:
         Dbt datValue;
         datKey.set_flags(DB_DBT_MALLOC);
         datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        int ret = pcursor->pdbc->get(&datKey, &datValue, fFlags);
         if (ret != 0)
             return ret;
         else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
@@ -266,6 +346,12 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (plogdb) {
+            if (pactiveBatch)
+                return false;
+            pactiveBatch = new CLogDBBatch();
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -277,6 +363,14 @@ public:
 
     bool TxnCommit()
     {
+        if (plogdb) {
+            if (!pactiveBatch)
+                return false;
+            bool ret = plogdb->Commit(*pactiveBatch);
+            delete pactiveBatch;
+            pactiveBatch = NULL;
+            return ret;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -286,6 +380,13 @@ public:
 
     bool TxnAbort()
     {
+        if (plogdb) {
+            if (!pactiveBatch)
+                return false;
+            delete pactiveBatch;
+            pactiveBatch = NULL;
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -305,6 +406,12 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+    /**
+     * Copy the BerkeleyDB file strFile into an append-only log that takes its
+     * place, keeping the original as strFile.<time>.bdb.bak.  strFile must
+     * not be in use.
+     */
+    bool static ConvertToLog(const std::string& strFile);
 };
 
 #endif // BITCOIN_WALLET_DB_H
@@ -0,0 +1,447 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/logdb.h"
+
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "hash.h"
+#include "util.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+/** First bytes of a log file, chosen not to be mistaken for a BerkeleyDB file */
+static const unsigned char LOGDB_MAGIC[8] = {0x89, 'W', 'L', 'O', 'G', '\r', '\n', 0x1a};
+static const uint32_t LOGDB_VERSION = 1;
+static const unsigned int LOGDB_HEADER_SIZE = sizeof(LOGDB_MAGIC) + 4;
+//! Size and checksum in front of each commit
+static const unsigned int LOGDB_FRAME_HEADER_SIZE = 8;
+//! Approximate overhead of a record in the log, for deciding when to compact
+static const unsigned int LOGDB_RECORD_OVERHEAD = 8;
+//! Live records are written in frames of about this size when compacting
+static const size_t LOGDB_COMPACT_FRAME_SIZE = 1024 * 1024;
+
+static const unsigned char LOGDB_RECORD_WRITE = 1;
+static const unsigned char LOGDB_RECORD_ERASE = 2;
+
+void CLogDBBatch::Write(const CSerializeData& key, const CSerializeData& value)
+{
+    vRecords.push_back(Record());
+    vRecords.back().fErase = false;
+    vRecords.back().key = key;
+    vRecords.back().value = value;
+}
+
+void CLogDBBatch::Erase(const CSerializeData& key)
+{
+    vRecords.push_back(Record());
+    vRecords.back().fErase = true;
+    vRecords.back().key = key;
+}
+
+bool CLogDBBatch::Find(const CSerializeData& key, CSerializeData& value, bool& fErased) const
+{
+    for (std::vector<Record>::const_reverse_iterator it = vRecords.rbegin(); it != vRecords.rend(); it++) {
+        if (it->key == key) {
+            fErased = it->fErase;
+            if (!fErased)
+                value = it->value;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CLogDB::KeyCompare::operator()(const CSerializeData& a, const CSerializeData& b) const
+{
+    int c = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+    return c < 0 || (c == 0 && a.size() < b.size());
+}
+
+CLogDB::CLogDB() : file(NULL), fWriting(false), fError(false), nNextSeq(0), nCommittedSeq(0), nFileSize(0), nLiveSize(0)
+{
+}
+
+CLogDB::~CLogDB()
+{
+    Close();
+}
+
+bool CLogDB::IsLogFile(const boost::filesystem::path& path)
+{
+    FILE* f = fopen(path.string().c_str(), "rb");
+    if (!f)
+        return false;
+    unsigned char magic[sizeof(LOGDB_MAGIC)];
+    bool fLog = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, LOGDB_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+    return fLog;
+}
+
+bool CLogDB::Open(const boost::filesystem::path& pathIn, bool fCreate)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (file)
+        return true;
+    path = pathIn;
+
+    if (!boost::filesystem::exists(path)) {
+        if (!fCreate)
+            return false;
+        FILE* fileNew = fopen(path.string().c_str(), "wb");
+        if (!fileNew)
+            return error("%s: can't create %s", __func__, path.string());
+        unsigned char header[LOGDB_HEADER_SIZE];
+        memcpy(header, LOGDB_MAGIC, sizeof(LOGDB_MAGIC));
+        WriteLE32(header + sizeof(LOGDB_MAGIC), LOGDB_VERSION);
+        bool fOk = fwrite(header, 1, sizeof(header), fileNew) == sizeof(header) && fflush(fileNew) == 0;
+        FileCommit(fileNew);
+        fclose(fileNew);
+        if (!fOk)
+            return error("%s: can't write %s", __func__, path.string());
+    }
+
+    file = fopen(path.string().c_str(), "rb+");
+    if (!file)
+        return error("%s: can't open %s", __func__, path.string());
+    if (!ReadFrames()) {
+        fclose(file);
+        file = NULL;
+        mapRecords.clear();
+        return false;
+    }
+    fError = false;
+    return true;
+}
+
+bool CLogDB::ReadFrames()
+{
+    if (fseek(file, 0, SEEK_END) != 0)
+        return error("%s: can't read %s", __func__, path.string());
+    long nEnd = ftell(file);
+    rewind(file);
+
+    unsigned char header[LOGDB_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, LOGDB_MAGIC, sizeof(LOGDB_MAGIC)) != 0)
+        return error("%s: %s is not a wallet log", __func__, path.string());
+    if (ReadLE32(header + sizeof(LOGDB_MAGIC)) != LOGDB_VERSION)
+        return error("%s: %s has unsupported version %u", __func__, path.string(), ReadLE32(header + sizeof(LOGDB_MAGIC)));
+
+    mapRecords.clear();
+    nFileSize = LOGDB_HEADER_SIZE;
+    nLiveSize = 0;
+    bool fTorn = false;
+    CSerializeData vPayload;
+    while (nFileSize < (uint64_t)nEnd) {
+        unsigned char frameHeader[LOGDB_FRAME_HEADER_SIZE];
+        if (nEnd - nFileSize < LOGDB_FRAME_HEADER_SIZE || fread(frameHeader, 1, sizeof(frameHeader), file) != sizeof(frameHeader)) {
+            fTorn = true;
+            break;
+        }
+        uint32_t nSize = ReadLE32(frameHeader);
+        uint64_t nFrameEnd = nFileSize + LOGDB_FRAME_HEADER_SIZE + nSize;
+        if (nFrameEnd > (uint64_t)nEnd) {
+            fTorn = true;
+            break;
+        }
+        if (nSize > LOGDB_MAX_FRAME_SIZE)
+            return error("%s: %s has a damaged commit at offset %u", __func__, path.string(), nFileSize);
+        vPayload.resize(nSize);
+        if (nSize > 0 && fread(&vPayload[0], 1, nSize, file) != nSize)
+            return error("%s: can't read %s", __func__, path.string());
+        uint256 hash = Hash(vPayload.begin(), vPayload.end());
+        if (ReadLE32(hash.begin()) != ReadLE32(frameHeader + 4)) {
+            // A crash can leave the last commit with its length but without
+            // its data; any other mismatch is damage that isn't ours to drop
+            if (nFrameEnd == (uint64_t)nEnd && std::count(vPayload.begin(), vPayload.end(), 0) == (long)nSize) {
+                fTorn = true;
+                break;
+            }
+            return error("%s: %s has a damaged commit at offset %u", __func__, path.string(), nFileSize);
+        }
+
+        try {
+            CDataStream ss(vPayload.begin(), vPayload.end(), SER_DISK, CLIENT_VERSION);
+            while (!ss.empty()) {
+                CLogDBBatch::Record record;
+                unsigned char nType;
+                ss >> nType >> record.key;
+                record.fErase = nType == LOGDB_RECORD_ERASE;
+                if (nType == LOGDB_RECORD_WRITE)
+                    ss >> record.value;
+                else if (nType != LOGDB_RECORD_ERASE)
+                    return error("%s: %s has an unknown record type %u", __func__, path.string(), nType);
+                Apply(record);
+            }
+        } catch (const std::exception& e) {
+            return error("%s: %s has an unreadable commit at offset %u: %s", __func__, path.string(), nFileSize, e.what());
+        }
+        nFileSize = nFrameEnd;
+    }
+
+    if (fTorn) {
+        LogPrintf("%s: dropping %u bytes of an incomplete commit at the end of %s\n", __func__, nEnd - nFileSize, path.string());
+        if (!TruncateFile(file, nFileSize))
+            return error("%s: can't truncate %s", __func__, path.string());
+        FileCommit(file);
+    }
+    if (fseek(file, 0, SEEK_END) != 0)
+        return error("%s: can't seek in %s", __func__, path.string());
+    LogPrint("db", "%s: read %u records from %s (%u of %u bytes live)\n", __func__, mapRecords.size(), path.string(), nLiveSize, nFileSize);
+    return true;
+}
+
+void CLogDB::Close()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fWriting)
+        condCommitted.wait(lock);
+    if (file) {
+        fclose(file);
+        file = NULL;
+    }
+    mapRecords.clear();
+    nFileSize = 0;
+    nLiveSize = 0;
+}
+
+void CLogDB::Apply(const CLogDBBatch::Record& record)
+{
+    RecordMap::iterator it = mapRecords.find(record.key);
+    if (it != mapRecords.end()) {
+        nLiveSize -= it->first.size() + it->second.size() + LOGDB_RECORD_OVERHEAD;
+        if (record.fErase) {
+            mapRecords.erase(it);
+            return;
+        }
+        it->second = record.value;
+    } else {
+        if (record.fErase)
+            return;
+        mapRecords.insert(std::make_pair(record.key, record.value));
+    }
+    nLiveSize += record.key.size() + record.value.size() + LOGDB_RECORD_OVERHEAD;
+}
+
+bool CLogDB::Read(const CSerializeData& key, CSerializeData& value)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    RecordMap::const_iterator it = mapRecords.find(key);
+    if (it == mapRecords.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+bool CLogDB::Exists(const CSerializeData& key)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return mapRecords.count(key) > 0;
+}
+
+bool CLogDB::ReadNext(const CSerializeData& key, bool fInclusive, CSerializeData& keyOut, CSerializeData& valueOut)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    RecordMap::const_iterator it = fInclusive ? mapRecords.lower_bound(key) : mapRecords.upper_bound(key);
+    if (it == mapRecords.end())
+        return false;
+    keyOut = it->first;
+    valueOut = it->second;
+    return true;
+}
+
+void CLogDB::SerializeFrame(const CLogDBBatch& batch, CSerializeData& frame)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    BOOST_FOREACH(const CLogDBBatch::Record& record, batch.vRecords) {
+        if (record.fErase)
+            ss << LOGDB_RECORD_ERASE << record.key;
+        else
+            ss << LOGDB_RECORD_WRITE << record.key << record.value;
+    }
+    uint256 hash = Hash(ss.begin(), ss.end());
+    frame.resize(LOGDB_FRAME_HEADER_SIZE);
+    WriteLE32((unsigned char*)&frame[0], ss.size());
+    WriteLE32((unsigned char*)&frame[4], ReadLE32(hash.begin()));
+    frame.insert(frame.end(), ss.begin(), ss.end());
+}
+
+bool CLogDB::WriteFrames(const std::vector<Pending>& vFrames)
+{
+    size_t nWritten = 0;
+    BOOST_FOREACH(const Pending& pending, vFrames) {
+        if (fwrite(&pending.frame[0], 1, pending.frame.size(), file) != pending.frame.size())
+            return false;
+        nWritten += pending.frame.size();
+    }
+    if (fflush(file) != 0)
+        return false;
+    FileCommit(file);
+    nFileSize += nWritten;
+    return true;
+}
+
+bool CLogDB::Commit(const CLogDBBatch& batch)
+{
+    if (batch.IsEmpty())
+        return true;
+    Pending pending;
+    pending.pbatch = &batch;
+    SerializeFrame(batch, pending.frame);
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!file || fError)
+        return false;
+    pending.nSeq = ++nNextSeq;
+    uint64_t nSeq = pending.nSeq;
+    vPending.push_back(Pending());
+    std::swap(vPending.back(), pending);
+
+    while (nCommittedSeq < nSeq && !fError) {
+        if (fWriting) {
+            condCommitted.wait(lock);
+            continue;
+        }
+
+        // Write everything queued so far, including commits that arrived
+        // while the previous group was being synced
+        fWriting = true;
+        std::vector<Pending> vFrames;
+        vFrames.swap(vPending);
+        lock.unlock();
+        bool fOk = WriteFrames(vFrames);
+        lock.lock();
+        if (fOk) {
+            BOOST_FOREACH(const Pending& frame, vFrames)
+                BOOST_FOREACH(const CLogDBBatch::Record& record, frame.pbatch->vRecords)
+                    Apply(record);
+            nCommittedSeq = vFrames.back().nSeq;
+            if (NeedsCompaction())
+                CompactLocked(lock, NULL);
+        } else {
+            LogPrintf("%s: error writing to %s, no further changes are accepted\n", __func__, path.string());
+            fError = true;
+        }
+        fWriting = false;
+        condCommitted.notify_all();
+    }
+    return nCommittedSeq >= nSeq;
+}
+
+bool CLogDB::NeedsCompaction() const
+{
+    return nFileSize >= LOGDB_COMPACT_MIN_SIZE && nFileSize > nLiveSize * LOGDB_COMPACT_RATIO;
+}
+
+bool CLogDB::Compact(const char* pszSkip)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fWriting)
+        condCommitted.wait(lock);
+    if (!file || fError)
+        return false;
+    fWriting = true;
+    bool fOk = CompactLocked(lock, pszSkip);
+    fWriting = false;
+    condCommitted.notify_all();
+    return fOk;
+}
+
+bool CLogDB::CompactLocked(boost::unique_lock<boost::mutex>& lock, const char* pszSkip)
+{
+    assert(fWriting);
+    int64_t nStart = GetTimeMillis();
+    uint64_t nSizeBefore = nFileSize;
+    size_t nSkip = pszSkip ? strlen(pszSkip) : 0;
+    boost::filesystem::path pathTmp = path.string() + ".compact";
+
+    // Only the writing thread changes mapRecords, so it can be read without
+    // the lock while the new file is written
+    lock.unlock();
+    bool fOk = true;
+    uint64_t nNewSize = LOGDB_HEADER_SIZE;
+    std::vector<CSerializeData> vSkipped;
+    FILE* fileNew = fopen(pathTmp.string().c_str(), "wb");
+    if (!fileNew) {
+        fOk = false;
+    } else {
+        unsigned char header[LOGDB_HEADER_SIZE];
+        memcpy(header, LOGDB_MAGIC, sizeof(LOGDB_MAGIC));
+        WriteLE32(header + sizeof(LOGDB_MAGIC), LOGDB_VERSION);
+        fOk = fwrite(header, 1, sizeof(header), fileNew) == sizeof(header);
+
+        CLogDBBatch batch;
+        size_t nBatchSize = 0;
+        for (RecordMap::const_iterator it = mapRecords.begin(); fOk && it != mapRecords.end(); it++) {
+            if (nSkip && it->first.size() >= nSkip && memcmp(it->first.data(), pszSkip, nSkip) == 0) {
+                vSkipped.push_back(it->first);
+                continue;
+            }
+            batch.Write(it->first, it->second);
+            nBatchSize += it->first.size() + it->second.size();
+            if (nBatchSize >= LOGDB_COMPACT_FRAME_SIZE) {
+                CSerializeData frame;
+                SerializeFrame(batch, frame);
+                fOk = fwrite(&frame[0], 1, frame.size(), fileNew) == frame.size();
+                nNewSize += frame.size();
+                batch.Clear();
+                nBatchSize = 0;
+            }
+        }
+        if (fOk && !batch.IsEmpty()) {
+            CSerializeData frame;
+            SerializeFrame(batch, frame);
+            fOk = fwrite(&frame[0], 1, frame.size(), fileNew) == frame.size();
+            nNewSize += frame.size();
+        }
+        fOk = fOk && fflush(fileNew) == 0;
+        FileCommit(fileNew);
+        fclose(fileNew);
+    }
+    lock.lock();
+
+    if (!fOk) {
+        boost::filesystem::remove(pathTmp);
+        return error("%s: can't write %s", __func__, pathTmp.string());
+    }
+
+    fclose(file);
+    file = NULL;
+    if (!RenameOver(pathTmp, path)) {
+        LogPrintf("%s: can't replace %s with %s\n", __func__, path.string(), pathTmp.string());
+        fOk = false;
+    } else {
+        BOOST_FOREACH(const CSerializeData& key, vSkipped) {
+            RecordMap::iterator it = mapRecords.find(key);
+            nLiveSize -= it->first.size() + it->second.size() + LOGDB_RECORD_OVERHEAD;
+            mapRecords.erase(it);
+        }
+        nFileSize = nNewSize;
+    }
+    file = fopen(path.string().c_str(), "rb+");
+    if (!file || fseek(file, 0, SEEK_END) != 0) {
+        LogPrintf("%s: can't reopen %s, no further changes are accepted\n", __func__, path.string());
+        fError = true;
+        return false;
+    }
+    if (fOk)
+        LogPrint("db", "%s: compacted %s from %u to %u bytes in %dms\n", __func__, path.string(), nSizeBefore, nFileSize, GetTimeMillis() - nStart);
+    return fOk;
+}
+
+uint64_t CLogDB::GetFileSize()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nFileSize;
+}
+
+uint64_t CLogDB::GetLiveSize()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nLiveSize;
+}
@@ -0,0 +1,149 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_LOGDB_H
+#define BITCOIN_WALLET_LOGDB_H
+
+#include "streams.h"
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+//! Compact a log when it is this many times the size of its live records...
+static const unsigned int LOGDB_COMPACT_RATIO = 2;
+//! ...and at least this large, in bytes
+static const uint64_t LOGDB_COMPACT_MIN_SIZE = 4 * 1024 * 1024;
+//! Largest commit accepted when reading a log, anything bigger is treated as corruption
+static const uint32_t LOGDB_MAX_FRAME_SIZE = 0x10000000;
+
+/** Writes and erases that are committed to a CLogDB together */
+class CLogDBBatch
+{
+public:
+    void Write(const CSerializeData& key, const CSerializeData& value);
+    void Erase(const CSerializeData& key);
+
+    /**
+     * Look up the last change to key in this batch.
+     * @return false if the batch doesn't touch key, otherwise whether key is
+     *         written (with its value in value) or erased (fErased)
+     */
+    bool Find(const CSerializeData& key, CSerializeData& value, bool& fErased) const;
+
+    bool IsEmpty() const { return vRecords.empty(); }
+    void Clear() { vRecords.clear(); }
+
+private:
+    friend class CLogDB;
+
+    struct Record
+    {
+        bool fErase;
+        CSerializeData key;
+        CSerializeData value;
+    };
+    std::vector<Record> vRecords;
+};
+
+/**
+ * An append-only, log-structured key/value file, used as an alternative to
+ * BerkeleyDB for wallet files.
+ *
+ * The file starts with a header and holds a sequence of commits, each a
+ * checksummed frame of writes and erases that is applied entirely or not at
+ * all.  All live records are kept in memory, so reads never touch the disk.
+ * A commit is synced to disk before Commit() returns; commits from threads
+ * that arrive while another one is being written are appended and synced
+ * together by the next writer (group commit), so concurrent writers share
+ * the cost of fsync.  When the file grows to LOGDB_COMPACT_RATIO times the
+ * size of its live records it is rewritten with only those.
+ *
+ * A commit at the end of the file that was cut short by a crash is dropped
+ * when the file is next opened.  A damaged commit followed by others is not
+ * repaired: Open() fails rather than lose the later ones.
+ */
+class CLogDB
+{
+public:
+    CLogDB();
+    ~CLogDB();
+
+    /** Whether the file at path starts with a log header */
+    static bool IsLogFile(const boost::filesystem::path& path);
+
+    /** Open the file at path and read all records, creating it if fCreate is set */
+    bool Open(const boost::filesystem::path& pathIn, bool fCreate);
+    void Close();
+
+    bool Read(const CSerializeData& key, CSerializeData& value);
+    bool Exists(const CSerializeData& key);
+
+    /** Append batch to the log and sync it, returning once it is durable */
+    bool Commit(const CLogDBBatch& batch);
+
+    /**
+     * Read the first record after key, or at or after it if fInclusive is
+     * set, in key order.  Records written meanwhile may or may not be seen.
+     * @return false if there is none
+     */
+    bool ReadNext(const CSerializeData& key, bool fInclusive, CSerializeData& keyOut, CSerializeData& valueOut);
+
+    /**
+     * Rewrite the file with only the live records, dropping those whose key
+     * starts with pszSkip.
+     */
+    bool Compact(const char* pszSkip = NULL);
+
+    /** Size of the file and of the live records it holds, in bytes */
+    uint64_t GetFileSize();
+    uint64_t GetLiveSize();
+
+private:
+    /** Orders keys as unsigned bytes, like BerkeleyDB's btree */
+    struct KeyCompare
+    {
+        bool operator()(const CSerializeData& a, const CSerializeData& b) const;
+    };
+    typedef std::map<CSerializeData, CSerializeData, KeyCompare> RecordMap;
+
+    /** A commit waiting to be written by the group */
+    struct Pending
+    {
+        uint64_t nSeq;
+        const CLogDBBatch* pbatch;
+        CSerializeData frame;
+    };
+
+    boost::filesystem::path path;
+    FILE* file;
+
+    boost::mutex mutex;
+    boost::condition_variable condCommitted;
+    RecordMap mapRecords;
+    std::vector<Pending> vPending;
+    //! Whether a thread is writing to the file
+    bool fWriting;
+    //! Set when a write failed; the log accepts no further commits
+    bool fError;
+    uint64_t nNextSeq;
+    uint64_t nCommittedSeq;
+    uint64_t nFileSize;
+    uint64_t nLiveSize;
+
+    static void SerializeFrame(const CLogDBBatch& batch, CSerializeData& frame);
+    bool ReadFrames();
+    void Apply(const CLogDBBatch::Record& record);
+    bool WriteFrames(const std::vector<Pending>& vFrames);
+    bool CompactLocked(boost::unique_lock<boost::mutex>& lock, const char* pszSkip);
+    bool NeedsCompaction() const;
+};
+
+#endif // BITCOIN_WALLET_LOGDB_H
@@ -0,0 +1,241 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/rescan.h"
+
+#include "blockfilterindex.h"
+#include "crypto/ripemd160.h"
+#include "crypto/sha256.h"
+#include "main.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+void CWalletScanFilter::AddFilterHash(uint64_t nHash)
+{
+    boost::unique_lock<boost::mutex> lock(csFilterHashes);
+    setFilterHashes.insert(nHash);
+    nFilterHashes = setFilterHashes.size();
+}
+
+void CWalletScanFilter::AddKey(const CPubKey& pubkey)
+{
+    setIds.insert(pubkey.GetID());
+    // Block filters hold the keys of bare multisig outputs this way too
+    AddFilterHash(GetBlockFilterHash(GetScriptForRawPubKey(pubkey)));
+    AddFilterHash(GetBlockFilterHash(GetScriptForDestination(pubkey.GetID())));
+    AddFilterHash(GetBlockFilterHash(CScript() << OP_0 << ToByteVector(pubkey.GetID())));
+}
+
+void CWalletScanFilter::AddRedeemScript(const CScript& script)
+{
+    setIds.insert(CScriptID(script));
+    uint256 hash;
+    CSHA256().Write(begin_ptr(script), script.size()).Finalize(hash.begin());
+    AddFilterHash(GetBlockFilterHash(GetScriptForDestination(CScriptID(script))));
+    AddFilterHash(GetBlockFilterHash(CScript() << OP_0 << ToByteVector(hash)));
+    AddFilterHash(GetBlockFilterHash(script));
+}
+
+void CWalletScanFilter::AddScript(const CScript& script)
+{
+    setScripts.insert(script);
+    AddFilterHash(GetBlockFilterHash(script));
+}
+
+void CWalletScanFilter::AddTx(const CTransaction& tx)
+{
+    const uint256& hash = tx.GetHash();
+    setTxids.insert(hash);
+    // Spends of the outputs that aren't ours are matched too, which only costs false matches
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+        AddFilterHash(GetBlockFilterHash(COutPoint(hash, i)));
+    if (tx.IsCoinBase())
+        return;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        setSpent.insert(txin.prevout);
+        AddFilterHash(GetBlockFilterHash(txin.prevout));
+    }
+}
+
+bool CWalletScanFilter::MatchScript(const CScript& script) const
+{
+    if (setScripts.count(script))
+        return true;
+
+    std::vector<std::vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(script, whichType, vSolutions))
+        return false;
+
+    switch (whichType)
+    {
+    case TX_PUBKEY:
+        return setIds.count(CPubKey(vSolutions[0]).GetID()) > 0;
+    case TX_PUBKEYHASH:
+    case TX_WITNESS_V0_KEYHASH:
+    case TX_SCRIPTHASH:
+        return setIds.count(uint160(vSolutions[0])) > 0;
+    case TX_WITNESS_V0_SCRIPTHASH:
+    {
+        uint160 hash;
+        CRIPEMD160().Write(&vSolutions[0][0], vSolutions[0].size()).Finalize(hash.begin());
+        return setIds.count(hash) > 0;
+    }
+    case TX_MULTISIG:
+        // IsMine() wants all of the keys, any of them is enough to look closer
+        for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+            if (setIds.count(CPubKey(vSolutions[i]).GetID()))
+                return true;
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool CWalletScanFilter::MatchOutputs(const CTransaction& tx) const
+{
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        if (MatchScript(txout.scriptPubKey))
+            return true;
+    return false;
+}
+
+bool CWalletScanFilter::MatchBlockFilter(const CBlockFilter& blockfilter, size_t& nHashes) const
+{
+    boost::unique_lock<boost::mutex> lock(csFilterHashes);
+    nHashes = nFilterHashes;
+    return blockfilter.MatchAny(setFilterHashes);
+}
+
+size_t CWalletScanFilter::GetFilterHashCount() const
+{
+    boost::unique_lock<boost::mutex> lock(csFilterHashes);
+    return nFilterHashes;
+}
+
+bool CWalletScanFilter::MatchInputs(const CTransaction& tx) const
+{
+    if (setTxids.count(tx.GetHash()))
+        return true;
+    if (tx.IsCoinBase())
+        return false;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (setTxids.count(txin.prevout.hash) || setSpent.count(txin.prevout))
+            return true;
+    return false;
+}
+
+CBlockPrefetcher::CBlockPrefetcher(const std::vector<Item>& vItemsIn, const CWalletScanFilter& filterIn, const Consensus::Params& paramsIn, int nThreads) :
+    vItems(vItemsIn), filter(filterIn), params(paramsIn), nWindow(RESCAN_PREFETCH_BLOCKS * std::max(nThreads, 1)),
+    vSlots(nWindow), nNextRead(0), nNextOut(0), fStop(false), fFailed(false)
+{
+    for (int i = 0; i < std::max(nThreads, 1); i++)
+        threadGroup.create_thread(boost::bind(&CBlockPrefetcher::ThreadRead, this));
+}
+
+CBlockPrefetcher::~CBlockPrefetcher()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+    }
+    condRead.notify_all();
+    threadGroup.join_all();
+}
+
+void CBlockPrefetcher::ThreadRead()
+{
+    RenameThread("bitcoin-rescan");
+    while (true)
+    {
+        size_t nItem;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // Don't get further ahead of the committing thread than the window
+            while (!fStop && nNextRead < vItems.size() && nNextRead >= nNextOut + nWindow)
+                condRead.wait(lock);
+            if (fStop || nNextRead >= vItems.size())
+                return;
+            nItem = nNextRead++;
+        }
+
+        const Item& item = vItems[nItem];
+        CBlock block;
+        std::vector<bool> vMatch;
+        size_t nHashes = 0;
+        bool fSkipped = SkipBlock(item, nHashes);
+        bool fFailedRead = !fSkipped && !ReadBlock(item, block, vMatch);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            Slot& slot = vSlots[nItem % nWindow];
+            std::swap(slot.block, block);
+            slot.vMatch.swap(vMatch);
+            slot.fSkipped = fSkipped;
+            slot.fFailed = fFailedRead;
+            slot.nHashes = nHashes;
+            slot.fReady = true;
+        }
+        condReady.notify_all();
+    }
+}
+
+bool CBlockPrefetcher::SkipBlock(const Item& item, size_t& nHashes) const
+{
+    CBlockFilter blockfilter;
+    if (!pblockfilterindex || !pblockfilterindex->GetFilter(item.pindex, blockfilter))
+        return false;
+    return !filter.MatchBlockFilter(blockfilter, nHashes);
+}
+
+bool CBlockPrefetcher::ReadBlock(const Item& item, CBlock& block, std::vector<bool>& vMatch) const
+{
+    if (!ReadBlockFromDisk(block, item.pos, params) || block.GetHash() != item.pindex->GetBlockHash())
+        return error("%s: failed to read block %s", __func__, item.pindex->GetBlockHash().ToString());
+    vMatch.clear();
+    vMatch.reserve(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vMatch.push_back(filter.MatchOutputs(tx));
+    return true;
+}
+
+bool CBlockPrefetcher::Next(CBlockIndex*& pindex, CBlock& block, std::vector<bool>& vMatch)
+{
+    bool fRecheck;
+    size_t nItem;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fFailed || nNextOut >= vItems.size())
+            return false;
+        Slot& slot = vSlots[nNextOut % nWindow];
+        while (!slot.fReady)
+            condReady.wait(lock);
+        if (slot.fFailed) {
+            fFailed = true;
+            return false;
+        }
+        nItem = nNextOut++;
+        pindex = vItems[nItem].pindex;
+        std::swap(block, slot.block);
+        vMatch.swap(slot.vMatch);
+        // Transactions found since the block was skipped may be spent in it
+        fRecheck = slot.fSkipped && slot.nHashes != filter.GetFilterHashCount();
+        slot.fReady = false;
+    }
+    condRead.notify_all();
+
+    size_t nHashes = 0;
+    if (fRecheck && !SkipBlock(vItems[nItem], nHashes) && !ReadBlock(vItems[nItem], block, vMatch)) {
+        fFailed = true;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,156 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_RESCAN_H
+#define BITCOIN_WALLET_RESCAN_H
+
+#include "blockfilter.h"
+#include "chain.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+#include "pubkey.h"
+#include "script/script.h"
+#include "uint256.h"
+
+#include <set>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace Consensus { struct Params; }
+
+//! -rescanthreads default
+static const int DEFAULT_RESCAN_THREADS = 4;
+//! Maximum number of blocks read ahead of the one being committed, per thread
+static const unsigned int RESCAN_PREFETCH_BLOCKS = 8;
+
+/**
+ * What a wallet rescan looks for, gathered from the keystore and mapWallet
+ * up front so blocks can be matched without holding the wallet lock.
+ *
+ * An output is matched if its script is watched, or if any key, key hash or
+ * script hash it pays to belongs to the wallet; this is a superset of the
+ * outputs IsMine() accepts.  A transaction is matched by its inputs if it is
+ * in the wallet, spends an output of a wallet transaction, or spends the
+ * same outpoint as one, which are the cases AddToWalletIfInvolvingMe() acts
+ * on.  Matches are checked by AddToWalletIfInvolvingMe() before anything is
+ * added.
+ *
+ * The same is kept as block filter hashes of the scripts that pay to the
+ * wallet and the outpoints of wallet transactions, to skip blocks whose
+ * filter matches none of them without reading them.  Bare multisig outputs
+ * are found through the pay-to-pubkey scripts of the wallet keys, which
+ * block filters hold for each of their keys.
+ */
+class CWalletScanFilter
+{
+public:
+    CWalletScanFilter() : nFilterHashes(0) {}
+
+    /** Add a wallet key */
+    void AddKey(const CPubKey& pubkey);
+    /** Add a script known to the wallet, paid to by its hash */
+    void AddRedeemScript(const CScript& script);
+    /** Add a watch-only script */
+    void AddScript(const CScript& script);
+    /** Add a transaction found in the wallet or the rescan */
+    void AddTx(const CTransaction& tx);
+
+    /** Whether any output of tx may be ours; safe to call from several threads */
+    bool MatchOutputs(const CTransaction& tx) const;
+    /** Whether tx is in the wallet or conflicts with or spends from wallet transactions */
+    bool MatchInputs(const CTransaction& tx) const;
+    /**
+     * Whether a block with this filter may involve the wallet; safe to call
+     * from several threads.  nHashes is set to the number of hashes it was
+     * matched against, which grows as the rescan finds transactions.
+     */
+    bool MatchBlockFilter(const CBlockFilter& blockfilter, size_t& nHashes) const;
+    size_t GetFilterHashCount() const;
+
+private:
+    //! Key ids and script ids of the keystore, read by the prefetch threads
+    std::set<uint160> setIds;
+    //! Watch-only scripts, read by the prefetch threads
+    std::set<CScript> setScripts;
+    //! Wallet transactions and the outpoints they spend, only used by the committing thread
+    std::set<uint256> setTxids;
+    std::set<COutPoint> setSpent;
+    //! Block filter hashes of the wallet scripts and outpoints
+    mutable boost::mutex csFilterHashes;
+    std::set<uint64_t> setFilterHashes;
+    size_t nFilterHashes;
+
+    bool MatchScript(const CScript& script) const;
+    void AddFilterHash(uint64_t nHash);
+};
+
+/**
+ * Reads the blocks of a rescan on several threads, ahead of the one being
+ * committed, and matches their outputs against a CWalletScanFilter.  The
+ * blocks are handed out in order by Next().
+ */
+class CBlockPrefetcher
+{
+public:
+    /** A block to read, located while holding cs_main */
+    struct Item
+    {
+        CBlockIndex* pindex;
+        CDiskBlockPos pos;
+    };
+
+    CBlockPrefetcher(const std::vector<Item>& vItemsIn, const CWalletScanFilter& filterIn, const Consensus::Params& paramsIn, int nThreads);
+    ~CBlockPrefetcher();
+
+    /**
+     * Wait for the next block in order.  vMatch tells which of its
+     * transactions matched the filter by their outputs.  Blocks whose
+     * filter in the block filter index matches nothing the wallet has are
+     * not read, and handed out without transactions.
+     * @return false when all blocks have been handed out, or when the next
+     * one could not be read, see Failed()
+     */
+    bool Next(CBlockIndex*& pindex, CBlock& block, std::vector<bool>& vMatch);
+    /** Whether Next() stopped because a block could not be read from disk */
+    bool Failed() const { return fFailed; }
+
+private:
+    struct Slot
+    {
+        bool fReady;
+        //! Not read because of its block filter, when the filter had nHashes hashes
+        bool fSkipped;
+        bool fFailed;
+        size_t nHashes;
+        CBlock block;
+        std::vector<bool> vMatch;
+        Slot() : fReady(false), fSkipped(false), fFailed(false), nHashes(0) {}
+    };
+
+    const std::vector<Item> vItems;
+    const CWalletScanFilter& filter;
+    const Consensus::Params& params;
+    const size_t nWindow;
+
+    boost::mutex mutex;
+    boost::condition_variable condRead;
+    boost::condition_variable condReady;
+    std::vector<Slot> vSlots;
+    size_t nNextRead;
+    size_t nNextOut;
+    bool fStop;
+    //! Set by Next(), only used by the committing thread
+    bool fFailed;
+    boost::thread_group threadGroup;
+
+    void ThreadRead();
+    /** Whether the block filter index tells the block can be skipped */
+    bool SkipBlock(const Item& item, size_t& nHashes) const;
+    bool ReadBlock(const Item& item, CBlock& block, std::vector<bool>& vMatch) const;
+};
+
+#endif // BITCOIN_WALLET_RESCAN_H
@@ -74,6 +74,16 @@ std::string DecodeDumpString(const std::string &str) {
     return ret.str();
 }
 
+//! Rescan the chain from pindexStart, throwing an RPC error unless the whole of it was scanned
+static void RescanWallet(CBlockIndex* pindexStart, bool fUpdate)
+{
+    int ret = pwalletMain->ScanForWalletTransactions(pindexStart, fUpdate);
+    if (ret == -2)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan failed: a block could not be read from disk, see debug.log.");
+    if (ret < 0)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan aborted.");
+}
+
 UniValue importprivkey(const UniValue& params, bool fHelp)
 {
     if (!EnsureWalletIsAvailable(fHelp))
@@ -100,10 +110,6 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
         );
 
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
-    EnsureWalletIsUnlocked();
-
     string strSecret = params[0].get_str();
     string strLabel = "";
     if (params.size() > 1)
@@ -117,6 +123,9 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
     if (fRescan && fPruneMode)
         throw JSONRPCError(RPC_WALLET_ERROR, "Rescan is disabled in pruned mode");
 
+    if (fRescan && pwalletMain->IsScanning())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
+
     CBitcoinSecret vchSecret;
     bool fGood = vchSecret.SetString(strSecret);
 
@@ -128,7 +137,12 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
     CPubKey pubkey = key.GetPubKey();
     assert(key.VerifyPubKey(pubkey));
     CKeyID vchAddress = pubkey.GetID();
+    CBlockIndex* pindexStart = NULL;
     {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        EnsureWalletIsUnlocked();
+
         pwalletMain->MarkDirty();
         pwalletMain->SetAddressBook(vchAddress, strLabel, "receive");
 
@@ -143,12 +157,13 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
 
         // whenever a key is imported, we need to scan the whole chain
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
-
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-        }
+        pindexStart = chainActive.Genesis();
     }
 
+    // The rescan takes the locks only briefly for each block it adds
+    if (fRescan)
+        RescanWallet(pindexStart, true);
+
     return NullUniValue;
 }
 
@@ -229,23 +244,31 @@ UniValue importaddress(const UniValue& params, bool fHelp)
     if (params.size() > 3)
         fP2SH = params[3].get_bool();
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    if (fRescan && pwalletMain->IsScanning())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
 
-    CBitcoinAddress address(params[0].get_str());
-    if (address.IsValid()) {
-        if (fP2SH)
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Cannot use the p2sh flag with an address - use a script instead");
-        ImportAddress(address, strLabel);
-    } else if (IsHex(params[0].get_str())) {
-        std::vector<unsigned char> data(ParseHex(params[0].get_str()));
-        ImportScript(CScript(data.begin(), data.end()), strLabel, fP2SH);
-    } else {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address or script");
+    CBlockIndex* pindexStart = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        pindexStart = chainActive.Genesis();
+        CBitcoinAddress address(params[0].get_str());
+        if (address.IsValid()) {
+            if (fP2SH)
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Cannot use the p2sh flag with an address - use a script instead");
+            ImportAddress(address, strLabel);
+        } else if (IsHex(params[0].get_str())) {
+            std::vector<unsigned char> data(ParseHex(params[0].get_str()));
+            ImportScript(CScript(data.begin(), data.end()), strLabel, fP2SH);
+        } else {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address or script");
+        }
     }
 
     if (fRescan)
     {
-        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        RescanWallet(pindexStart, true);
+        LOCK2(cs_main, pwalletMain->cs_wallet);
         pwalletMain->ReacceptWalletTransactions();
     }
 
@@ -392,20 +415,290 @@ UniValue importpubkey(const UniValue& params, bool fHelp)
     if (!pubKey.IsFullyValid())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Pubkey is not a valid public key");
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    if (fRescan && pwalletMain->IsScanning())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
+
+    CBlockIndex* pindexStart = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    ImportAddress(CBitcoinAddress(pubKey.GetID()), strLabel);
-    ImportScript(GetScriptForRawPubKey(pubKey), strLabel, false);
+        pindexStart = chainActive.Genesis();
+        ImportAddress(CBitcoinAddress(pubKey.GetID()), strLabel);
+        ImportScript(GetScriptForRawPubKey(pubKey), strLabel, false);
+    }
 
     if (fRescan)
     {
-        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        RescanWallet(pindexStart, true);
+        LOCK2(cs_main, pwalletMain->cs_wallet);
         pwalletMain->ReacceptWalletTransactions();
     }
 
     return NullUniValue;
 }
 
+/** One entry of an importmulti call, checked before anything is written */
+struct CImportRequest
+{
+    CScript script;
+    CScript redeemScript;
+    std::vector<CKey> vKeys;
+    bool fWatchOnly;
+    bool fLabel;
+    std::string strLabel;
+    int64_t nTime;
+    //! Whether the chain is scanned for it, not for "now" as nothing can have been paid to it yet
+    bool fRescan;
+};
+
+static CImportRequest ParseImportRequest(const UniValue& data, int64_t nNow)
+{
+    if (!data.isObject())
+        throw JSONRPCError(RPC_TYPE_ERROR, "Request must be an object");
+
+    CImportRequest request;
+    const UniValue& scriptPubKey = find_value(data, "scriptPubKey");
+    if (scriptPubKey.isStr()) {
+        if (!IsHex(scriptPubKey.get_str()))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "scriptPubKey must be a hex string");
+        std::vector<unsigned char> vData(ParseHex(scriptPubKey.get_str()));
+        request.script = CScript(vData.begin(), vData.end());
+    } else if (scriptPubKey.isObject()) {
+        CBitcoinAddress address(find_value(scriptPubKey, "address").get_str());
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
+        request.script = GetScriptForDestination(address.Get());
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Missing scriptPubKey");
+    }
+
+    const UniValue& timestamp = find_value(data, "timestamp");
+    if (timestamp.isNum()) {
+        request.nTime = timestamp.get_int64();
+        request.fRescan = true;
+    } else if (timestamp.isStr() && timestamp.get_str() == "now") {
+        request.nTime = nNow;
+        request.fRescan = false;
+    } else {
+        throw JSONRPCError(RPC_TYPE_ERROR, "Missing required timestamp field, use a unix time or \"now\"");
+    }
+
+    const UniValue& redeemScript = find_value(data, "redeemscript");
+    if (!redeemScript.isNull()) {
+        if (!IsHex(redeemScript.get_str()))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "redeemscript must be a hex string");
+        std::vector<unsigned char> vData(ParseHex(redeemScript.get_str()));
+        request.redeemScript = CScript(vData.begin(), vData.end());
+        if (GetScriptForDestination(CScriptID(request.redeemScript)) != request.script)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "redeemscript does not match the P2SH scriptPubKey");
+    }
+
+    const UniValue& keys = find_value(data, "keys");
+    if (!keys.isNull()) {
+        BOOST_FOREACH(const UniValue& key, keys.get_array().getValues()) {
+            CBitcoinSecret vchSecret;
+            if (!vchSecret.SetString(key.get_str()))
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key encoding");
+            request.vKeys.push_back(vchSecret.GetKey());
+            if (!request.vKeys.back().IsValid())
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Private key outside allowed range");
+        }
+    }
+
+    const UniValue& watchOnly = find_value(data, "watchonly");
+    request.fWatchOnly = !watchOnly.isNull() && watchOnly.get_bool();
+    if (request.fWatchOnly && !request.vKeys.empty())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Keys cannot be imported as watchonly");
+    if (!request.fWatchOnly) {
+        // Everything needed to spend the script has to come with the request
+        CBasicKeyStore keystore;
+        BOOST_FOREACH(const CKey& key, request.vKeys)
+            keystore.AddKey(key);
+        if (!request.redeemScript.empty())
+            keystore.AddCScript(request.redeemScript);
+        if (::IsMine(keystore, request.script) != ISMINE_SPENDABLE)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "The keys and redeemscript given do not make scriptPubKey spendable, set watchonly to import it without them");
+    }
+
+    const UniValue& label = find_value(data, "label");
+    request.fLabel = !label.isNull();
+    if (request.fLabel)
+        request.strLabel = label.get_str();
+
+    return request;
+}
+
+/** Add a checked request to the wallet, writing through walletdb */
+static bool ImportRequest(CWalletDB& walletdb, const CImportRequest& request)
+{
+    AssertLockHeld(pwalletMain->cs_wallet);
+
+    if (!request.redeemScript.empty() && !pwalletMain->HaveCScript(CScriptID(request.redeemScript)) &&
+        !pwalletMain->AddCScriptWithDB(walletdb, request.redeemScript))
+        return false;
+
+    if (request.fWatchOnly && !pwalletMain->HaveWatchOnly(request.script) &&
+        !pwalletMain->AddWatchOnlyWithDB(walletdb, request.script))
+        return false;
+
+    BOOST_FOREACH(const CKey& key, request.vKeys) {
+        CPubKey pubkey = key.GetPubKey();
+        assert(key.VerifyPubKey(pubkey));
+        CKeyID keyid = pubkey.GetID();
+        if (pwalletMain->HaveKey(keyid))
+            continue;
+        pwalletMain->mapKeyMetadata[keyid].nCreateTime = request.nTime;
+        if (!pwalletMain->AddKeyPubKeyWithDB(walletdb, key, pubkey))
+            return false;
+        if (!pwalletMain->nTimeFirstKey || request.nTime < pwalletMain->nTimeFirstKey)
+            pwalletMain->nTimeFirstKey = std::max(request.nTime, (int64_t)1); // 0 would be considered 'no value'
+    }
+
+    // add to address book, keeping an existing label unless a new one is given
+    CTxDestination dest;
+    if (ExtractDestination(request.script, dest) && (request.fLabel || !pwalletMain->mapAddressBook.count(dest)))
+        return pwalletMain->SetAddressBookWithDB(walletdb, dest, request.strLabel, "receive");
+    return true;
+}
+
+UniValue importmulti(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "importmulti [requests] ( options )\n"
+            "\nImports keys and scripts in one go, with a single rescan from the earliest timestamp given.\n"
+            "\nArguments:\n"
+            "1. requests             (array, required) The keys and scripts to import\n"
+            "  [\n"
+            "    {\n"
+            "      \"scriptPubKey\": \"script\" | { \"address\":\"address\" }, (string or object, required) The script (in hex) or address to import\n"
+            "      \"timestamp\": timestamp | \"now\",  (integer or string, required) Creation time of the key or script in seconds since epoch,\n"
+            "                                        the rescan starts at the earliest of them. \"now\" skips the rescan for this request\n"
+            "      \"redeemscript\": \"script\",        (string, optional) The redeem script (in hex) of a P2SH scriptPubKey\n"
+            "      \"keys\": [\"privkey\",...],         (array, optional) The private keys (see dumpprivkey) that spend scriptPubKey\n"
+            "      \"watchonly\": true|false,         (boolean, optional, default=false) Watch scriptPubKey without being able to spend it\n"
+            "      \"label\": \"label\",                (string, optional, default=\"\") An optional label\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "2. options              (object, optional)\n"
+            "  {\n"
+            "    \"rescan\": true|false  (boolean, optional, default=true) Rescan the wallet for transactions\n"
+            "  }\n"
+            "\nAll requests are checked before the wallet is changed, the ones that pass are written at once.\n"
+            "A request that still fails to be written is reported as such, the others are kept.\n"
+            "\nNote: This call can take minutes to complete if rescan is true.\n"
+            "\nResult:\n"
+            "[                       (array) One entry for each request, in order\n"
+            "  {\n"
+            "    \"success\": true|false,  (boolean) Whether the request was imported\n"
+            "    \"error\": {...}          (object) The reason it was not, if success is false\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("importmulti", "'[{ \"scriptPubKey\": { \"address\": \"myaddress\" }, \"timestamp\": 1455191478, \"watchonly\": true }]'") +
+            HelpExampleCli("importmulti", "'[{ \"scriptPubKey\": \"myscript\", \"timestamp\": \"now\", \"keys\": [\"mykey\"] }]' '{ \"rescan\": false }'") +
+            "\nAs a JSON-RPC call\n"
+            + HelpExampleRpc("importmulti", "[{ \"scriptPubKey\": { \"address\": \"myaddress\" }, \"timestamp\": 1455191478, \"watchonly\": true }]")
+        );
+
+    const UniValue& requests = params[0].get_array();
+
+    // Whether to perform rescan after import
+    bool fRescan = true;
+    if (params.size() > 1) {
+        const UniValue& rescan = find_value(params[1].get_obj(), "rescan");
+        if (!rescan.isNull())
+            fRescan = rescan.get_bool();
+    }
+
+    if (fRescan && fPruneMode)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan is disabled in pruned mode");
+
+    if (fRescan && pwalletMain->IsScanning())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
+
+    int64_t nNow = GetTime();
+    std::vector<CImportRequest> vRequests(requests.size());
+    std::vector<UniValue> vErrors(requests.size());
+    bool fKeys = false;
+    for (unsigned int i = 0; i < requests.size(); i++) {
+        try {
+            vRequests[i] = ParseImportRequest(requests[i], nNow);
+            fKeys |= !vRequests[i].vKeys.empty();
+        } catch (const UniValue& objError) {
+            vErrors[i] = objError;
+        } catch (const std::exception& e) {
+            vErrors[i] = JSONRPCError(RPC_INVALID_PARAMETER, e.what());
+        }
+    }
+
+    int64_t nLowestTime = nNow;
+    bool fScan = false;
+    CBlockIndex* pindex = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        if (fKeys)
+            EnsureWalletIsUnlocked();
+
+        for (unsigned int i = 0; i < vRequests.size(); i++) {
+            if (vErrors[i].isNull() && vRequests[i].fWatchOnly && ::IsMine(*pwalletMain, vRequests[i].script) == ISMINE_SPENDABLE)
+                vErrors[i] = JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this address or script");
+        }
+
+        // Write all requests in a single database transaction.  A request
+        // that fails part way may have added some of its keys and scripts to
+        // the wallet already, and those were written through walletdb too, so
+        // the transaction is committed either way to keep the file in step
+        // with memory; the request is reported as failed.
+        CWalletDB walletdb(pwalletMain->strWalletFile);
+        if (!walletdb.TxnBegin())
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error starting wallet database transaction");
+        for (unsigned int i = 0; i < vRequests.size(); i++) {
+            if (!vErrors[i].isNull())
+                continue;
+            if (vRequests[i].fRescan) {
+                nLowestTime = std::min(nLowestTime, vRequests[i].nTime);
+                fScan = true;
+            }
+            if (!ImportRequest(walletdb, vRequests[i]))
+                vErrors[i] = JSONRPCError(RPC_WALLET_ERROR, "Error adding keys and scripts to wallet");
+        }
+        if (!walletdb.TxnCommit())
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error committing keys and scripts to wallet");
+        pwalletMain->MarkDirty();
+
+        // Block times can run ahead of the clock, so a timestamp taken from
+        // the chain is not compared to the current time
+        if (fRescan && fScan) {
+            pindex = chainActive.Tip();
+            while (pindex && pindex->pprev && pindex->GetBlockTime() > nLowestTime - 7200)
+                pindex = pindex->pprev;
+            LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
+        }
+    }
+
+    if (pindex) {
+        RescanWallet(pindex, true);
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pwalletMain->ReacceptWalletTransactions();
+    }
+
+    UniValue response(UniValue::VARR);
+    for (unsigned int i = 0; i < vErrors.size(); i++) {
+        UniValue result(UniValue::VOBJ);
+        result.push_back(Pair("success", vErrors[i].isNull()));
+        if (!vErrors[i].isNull())
+            result.push_back(Pair("error", vErrors[i]));
+        response.push_back(result);
+    }
+    return response;
+}
 
 UniValue importwallet(const UniValue& params, bool fHelp)
 {
@@ -430,82 +723,87 @@ UniValue importwallet(const UniValue& params, bool fHelp)
     if (fPruneMode)
         throw JSONRPCError(RPC_WALLET_ERROR, "Importing wallets is disabled in pruned mode");
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
-    EnsureWalletIsUnlocked();
-
-    ifstream file;
-    file.open(params[0].get_str().c_str(), std::ios::in | std::ios::ate);
-    if (!file.is_open())
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
-
-    int64_t nTimeBegin = chainActive.Tip()->GetBlockTime();
+    if (pwalletMain->IsScanning())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
 
     bool fGood = true;
-
-    int64_t nFilesize = std::max((int64_t)1, (int64_t)file.tellg());
-    file.seekg(0, file.beg);
-
-    pwalletMain->ShowProgress(_("Importing..."), 0); // show progress dialog in GUI
-    while (file.good()) {
-        pwalletMain->ShowProgress("", std::max(1, std::min(99, (int)(((double)file.tellg() / (double)nFilesize) * 100))));
-        std::string line;
-        std::getline(file, line);
-        if (line.empty() || line[0] == '#')
-            continue;
-
-        std::vector<std::string> vstr;
-        boost::split(vstr, line, boost::is_any_of(" "));
-        if (vstr.size() < 2)
-            continue;
-        CBitcoinSecret vchSecret;
-        if (!vchSecret.SetString(vstr[0]))
-            continue;
-        CKey key = vchSecret.GetKey();
-        CPubKey pubkey = key.GetPubKey();
-        assert(key.VerifyPubKey(pubkey));
-        CKeyID keyid = pubkey.GetID();
-        if (pwalletMain->HaveKey(keyid)) {
-            LogPrintf("Skipping import of %s (key already present)\n", CBitcoinAddress(keyid).ToString());
-            continue;
-        }
-        int64_t nTime = DecodeDumpTime(vstr[1]);
-        std::string strLabel;
-        bool fLabel = true;
-        for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
-            if (boost::algorithm::starts_with(vstr[nStr], "#"))
-                break;
-            if (vstr[nStr] == "change=1")
-                fLabel = false;
-            if (vstr[nStr] == "reserve=1")
-                fLabel = false;
-            if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
-                strLabel = DecodeDumpString(vstr[nStr].substr(6));
-                fLabel = true;
+    CBlockIndex *pindex;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        EnsureWalletIsUnlocked();
+
+        ifstream file;
+        file.open(params[0].get_str().c_str(), std::ios::in | std::ios::ate);
+        if (!file.is_open())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
+
+        int64_t nTimeBegin = chainActive.Tip()->GetBlockTime();
+
+        int64_t nFilesize = std::max((int64_t)1, (int64_t)file.tellg());
+        file.seekg(0, file.beg);
+
+        pwalletMain->ShowProgress(_("Importing..."), 0); // show progress dialog in GUI
+        while (file.good()) {
+            pwalletMain->ShowProgress("", std::max(1, std::min(99, (int)(((double)file.tellg() / (double)nFilesize) * 100))));
+            std::string line;
+            std::getline(file, line);
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            std::vector<std::string> vstr;
+            boost::split(vstr, line, boost::is_any_of(" "));
+            if (vstr.size() < 2)
+                continue;
+            CBitcoinSecret vchSecret;
+            if (!vchSecret.SetString(vstr[0]))
+                continue;
+            CKey key = vchSecret.GetKey();
+            CPubKey pubkey = key.GetPubKey();
+            assert(key.VerifyPubKey(pubkey));
+            CKeyID keyid = pubkey.GetID();
+            if (pwalletMain->HaveKey(keyid)) {
+                LogPrintf("Skipping import of %s (key already present)\n", CBitcoinAddress(keyid).ToString());
+                continue;
             }
+            int64_t nTime = DecodeDumpTime(vstr[1]);
+            std::string strLabel;
+            bool fLabel = true;
+            for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
+                if (boost::algorithm::starts_with(vstr[nStr], "#"))
+                    break;
+                if (vstr[nStr] == "change=1")
+                    fLabel = false;
+                if (vstr[nStr] == "reserve=1")
+                    fLabel = false;
+                if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
+                    strLabel = DecodeDumpString(vstr[nStr].substr(6));
+                    fLabel = true;
+                }
+            }
+            LogPrintf("Importing %s...\n", CBitcoinAddress(keyid).ToString());
+            if (!pwalletMain->AddKeyPubKey(key, pubkey)) {
+                fGood = false;
+                continue;
+            }
+            pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
+            if (fLabel)
+                pwalletMain->SetAddressBook(keyid, strLabel, "receive");
+            nTimeBegin = std::min(nTimeBegin, nTime);
         }
-        LogPrintf("Importing %s...\n", CBitcoinAddress(keyid).ToString());
-        if (!pwalletMain->AddKeyPubKey(key, pubkey)) {
-            fGood = false;
-            continue;
-        }
-        pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
-        if (fLabel)
-            pwalletMain->SetAddressBook(keyid, strLabel, "receive");
-        nTimeBegin = std::min(nTimeBegin, nTime);
-    }
-    file.close();
-    pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
+        file.close();
+        pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
 
-    CBlockIndex *pindex = chainActive.Tip();
-    while (pindex && pindex->pprev && pindex->GetBlockTime() > nTimeBegin - 7200)
-        pindex = pindex->pprev;
+        pindex = chainActive.Tip();
+        while (pindex && pindex->pprev && pindex->GetBlockTime() > nTimeBegin - 7200)
+            pindex = pindex->pprev;
 
-    if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
-        pwalletMain->nTimeFirstKey = nTimeBegin;
+        if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
+            pwalletMain->nTimeFirstKey = nTimeBegin;
 
-    LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
-    pwalletMain->ScanForWalletTransactions(pindex);
+        LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
+    }
+    RescanWallet(pindex, false);
     pwalletMain->MarkDirty();
 
     if (!fGood)
@@ -17,6 +17,7 @@
 #include "utilmoneystr.h"
 #include "wallet.h"
 #include "walletdb.h"
+#include "wallet/sendqueue.h"
 
 #include <stdint.h>
 
@@ -424,6 +425,127 @@ UniValue sendtoaddress(const UniValue& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+UniValue queuesend(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() < 2 || params.size() > 3)
+        throw runtime_error(
+            "queuesend \"bitcoinaddress\" amount ( subtractfeefromamount )\n"
+            "\nQueue a payment to be sent together with others in one transaction, see -sendqueueinterval.\n"
+            "Queued payments are sent while the wallet is unlocked, and are kept in memory only.\n"
+            "\nArguments:\n"
+            "1. \"bitcoinaddress\"  (string, required) The bitcoin address to send to.\n"
+            "2. \"amount\"      (numeric or string, required) The amount in " + CURRENCY_UNIT + " to send. eg 0.1\n"
+            "3. subtractfeefromamount  (boolean, optional, default=false) Take a share of the fee from the amount.\n"
+            "\nResult:\n"
+            "\"requestid\"  (string) The id to look the payment up by with getqueuedsend.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("queuesend", "\"1M72Sfpbz1BPpXFHz9m3CdqATR44Jvaydd\" 0.1")
+            + HelpExampleRpc("queuesend", "\"1M72Sfpbz1BPpXFHz9m3CdqATR44Jvaydd\", 0.1")
+        );
+
+    if (!psendqueue)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Error: The send queue is disabled, see -sendqueueinterval");
+
+    CBitcoinAddress address(params[0].get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
+
+    CAmount nAmount = AmountFromValue(params[1]);
+    if (nAmount <= 0)
+        throw JSONRPCError(RPC_TYPE_ERROR, "Invalid amount for send");
+
+    bool fSubtractFeeFromAmount = false;
+    if (params.size() > 2)
+        fSubtractFeeFromAmount = params[2].get_bool();
+
+    CScript scriptPubKey = GetScriptForDestination(address.Get());
+    if (CTxOut(nAmount, scriptPubKey).IsDust(::minRelayTxFee))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Transaction amount too small");
+
+    return psendqueue->Add(scriptPubKey, nAmount, fSubtractFeeFromAmount).GetHex();
+}
+
+UniValue getqueuedsend(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getqueuedsend \"requestid\"\n"
+            "\nGet the state of a payment queued by queuesend. Payments are forgotten a day after they are sent.\n"
+            "\nArguments:\n"
+            "1. \"requestid\"  (string, required) The id returned by queuesend\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"status\": \"queued|sent|failed\",  (string) Whether the payment is waiting, was sent or could not be sent\n"
+            "  \"txid\": \"transactionid\",         (string) The transaction that paid it, once sent\n"
+            "  \"vout\": n,                       (numeric) The output of that transaction that paid it\n"
+            "  \"error\": \"...\"                   (string) Why it could not be sent, if it failed or is still queued after an attempt\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getqueuedsend", "\"8f8c3a5b0f4c0d7d6f9c7d1b4f6e2a3c5d7e9f1a2b3c4d5e6f7a8b9c0d1e2f3a\"")
+            + HelpExampleRpc("getqueuedsend", "\"8f8c3a5b0f4c0d7d6f9c7d1b4f6e2a3c5d7e9f1a2b3c4d5e6f7a8b9c0d1e2f3a\"")
+        );
+
+    if (!psendqueue)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Error: The send queue is disabled, see -sendqueueinterval");
+
+    CQueuedSend send;
+    if (!psendqueue->Get(ParseHashV(params[0], "requestid"), send))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown request id");
+
+    UniValue ret(UniValue::VOBJ);
+    switch (send.status)
+    {
+    case CQueuedSend::QUEUED:
+        ret.push_back(Pair("status", "queued"));
+        break;
+    case CQueuedSend::SENT:
+        ret.push_back(Pair("status", "sent"));
+        break;
+    case CQueuedSend::FAILED:
+        ret.push_back(Pair("status", "failed"));
+        break;
+    }
+    if (!send.txid.IsNull())
+    {
+        ret.push_back(Pair("txid", send.txid.GetHex()));
+        ret.push_back(Pair("vout", send.nOut));
+    }
+    if (!send.strError.empty())
+        ret.push_back(Pair("error", send.strError));
+    return ret;
+}
+
+UniValue flushsendqueue(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "flushsendqueue\n"
+            "\nSend the payments queued by queuesend now, without waiting for the interval.\n"
+            + HelpRequiringPassphrase() +
+            "\nExamples:\n"
+            + HelpExampleCli("flushsendqueue", "")
+            + HelpExampleRpc("flushsendqueue", "")
+        );
+
+    if (!psendqueue)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Error: The send queue is disabled, see -sendqueueinterval");
+
+    EnsureWalletIsUnlocked();
+    if (!psendqueue->Flush())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Error: The queued payments could not be sent yet and are still queued, see getqueuedsend");
+
+    return NullUniValue;
+}
+
 UniValue listaddressgroupings(const UniValue& params, bool fHelp)
 {
     if (!EnsureWalletIsAvailable(fHelp))
@@ -1398,20 +1520,92 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Un
     }
 }
 
+/** Where a paged listtransactions or listsinceblock call left off */
+struct CListCursor
+{
+    //! nOrderPos for listtransactions, the index height for listsinceblock
+    int64_t nPos;
+    //! Transaction at that height, for listsinceblock
+    uint256 hash;
+    //! Entries at that position that were already returned or skipped
+    int nUsed;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nPos);
+        READWRITE(hash);
+        READWRITE(nUsed);
+    }
+};
+
+static string EncodeListCursor(int64_t nPos, const uint256& hash, int nUsed)
+{
+    CListCursor cursor;
+    cursor.nPos = nPos;
+    cursor.hash = hash;
+    cursor.nUsed = nUsed;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cursor;
+    return HexStr(ss.begin(), ss.end());
+}
+
+static CListCursor DecodeListCursor(const string& strCursor)
+{
+    CListCursor cursor;
+    if (!IsHex(strCursor))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    CDataStream ss(ParseHex(strCursor), SER_NETWORK, PROTOCOL_VERSION);
+    try {
+        ss >> cursor;
+    } catch (const std::exception&) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    }
+    if (!ss.empty() || cursor.nUsed < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    return cursor;
+}
+
+/**
+ * Add the entries of one transaction or accounting entry to a page, skipping
+ * the first nSkip and counting the ones used in nUsed.
+ * @return false if the page filled up before all entries were used
+ */
+static bool AddToPage(const UniValue& entries, UniValue& page, int nCount, int& nSkip, int& nUsed)
+{
+    for (unsigned int i = 0; i < entries.size(); i++)
+    {
+        if ((int)page.size() >= nCount)
+            return false;
+        nUsed++;
+        if (nSkip > 0)
+        {
+            nSkip--;
+            continue;
+        }
+        page.push_back(entries[i]);
+    }
+    return true;
+}
+
 UniValue listtransactions(const UniValue& params, bool fHelp)
 {
     if (!EnsureWalletIsAvailable(fHelp))
         return NullUniValue;
 
-    if (fHelp || params.size() > 4)
+    if (fHelp || params.size() > 5)
         throw runtime_error(
-            "listtransactions ( \"account\" count from includeWatchonly)\n"
+            "listtransactions ( \"account\" count from includeWatchonly \"cursor\")\n"
             "\nReturns up to 'count' most recent transactions skipping the first 'from' transactions for account 'account'.\n"
             "\nArguments:\n"
             "1. \"account\"    (string, optional) DEPRECATED. The account name. Should be \"*\".\n"
             "2. count          (numeric, optional, default=10) The number of transactions to return\n"
             "3. from           (numeric, optional, default=0) The number of transactions to skip\n"
             "4. includeWatchonly (bool, optional, default=false) Include transactions to watchonly addresses (see 'importaddress')\n"
+            "5. \"cursor\"     (string, optional) Page through the transactions: \"\" starts at the most recent ones, the\n"
+            "                  cursor of a result continues with those before it. The result is then an object\n"
+            "                  {\"transactions\":[...], \"cursor\":\"...\"}, without \"cursor\" on the last page.\n"
             "\nResult:\n"
             "[\n"
             "  {\n"
@@ -1458,6 +1652,9 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
             + HelpExampleCli("listtransactions", "") +
             "\nList transactions 100 to 120\n"
             + HelpExampleCli("listtransactions", "\"*\" 20 100") +
+            "\nList the most recent 100 transactions, then the 100 before them\n"
+            + HelpExampleCli("listtransactions", "\"*\" 100 0 false \"\"")
+            + HelpExampleCli("listtransactions", "\"*\" 100 0 false \"cursor\"") +
             "\nAs a json rpc call\n"
             + HelpExampleRpc("listtransactions", "\"*\", 20, 100")
         );
@@ -1483,46 +1680,71 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
+    bool fPaged = params.size() > 4;
+
     UniValue ret(UniValue::VARR);
 
     const CWallet::TxItems & txOrdered = pwalletMain->wtxOrdered;
+    CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin();
+    int nSkip = nFrom;
+    if (fPaged && !params[4].get_str().empty())
+    {
+        CListCursor cursor = DecodeListCursor(params[4].get_str());
+        it = CWallet::TxItems::const_reverse_iterator(txOrdered.upper_bound(cursor.nPos));
+        if (it != txOrdered.rend() && it->first == cursor.nPos)
+            nSkip += cursor.nUsed;
+    }
 
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    // iterate backwards until we have nCount items to return, counting the
+    // entries used at each nOrderPos so a cursor can point into it
+    int64_t nPos = it != txOrdered.rend() ? it->first : 0;
+    int nUsed = 0;
+    bool fMore = false;
+    for (; it != txOrdered.rend(); ++it)
     {
+        if (it->first != nPos)
+        {
+            if ((int)ret.size() >= nCount)
+            {
+                fMore = true;
+                break;
+            }
+            nPos = it->first;
+            nUsed = 0;
+        }
+
+        UniValue entries(UniValue::VARR);
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
+            ListTransactions(*pwtx, strAccount, 0, true, entries, filter);
         CAccountingEntry *const pacentry = (*it).second.second;
         if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
+            AcentryToJSON(*pacentry, strAccount, entries);
 
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        if (!AddToPage(entries, ret, nCount, nSkip, nUsed))
+        {
+            fMore = true;
+            break;
+        }
     }
     // ret is newest to oldest
 
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
-
     vector<UniValue> arrTmp = ret.getValues();
 
-    vector<UniValue>::iterator first = arrTmp.begin();
-    std::advance(first, nFrom);
-    vector<UniValue>::iterator last = arrTmp.begin();
-    std::advance(last, nFrom+nCount);
-
-    if (last != arrTmp.end()) arrTmp.erase(last, arrTmp.end());
-    if (first != arrTmp.begin()) arrTmp.erase(arrTmp.begin(), first);
-
     std::reverse(arrTmp.begin(), arrTmp.end()); // Return oldest to newest
 
     ret.clear();
     ret.setArray();
     ret.push_backV(arrTmp);
 
-    return ret;
+    if (!fPaged)
+        return ret;
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("transactions", ret));
+    if (fMore)
+        result.push_back(Pair("cursor", EncodeListCursor(nPos, uint256(), nUsed)));
+    return result;
 }
 
 UniValue listaccounts(const UniValue& params, bool fHelp)
@@ -1611,12 +1833,15 @@ UniValue listsinceblock(const UniValue& params, bool fHelp)
 
     if (fHelp)
         throw runtime_error(
-            "listsinceblock ( \"blockhash\" target-confirmations includeWatchonly)\n"
+            "listsinceblock ( \"blockhash\" target-confirmations includeWatchonly count \"cursor\")\n"
             "\nGet all transactions in blocks since block [blockhash], or all transactions if omitted\n"
             "\nArguments:\n"
             "1. \"blockhash\"   (string, optional) The block hash to list transactions since\n"
             "2. target-confirmations:    (numeric, optional) The confirmations required, must be 1 or more\n"
-            "3. includeWatchonly:        (bool, optional, default=false) Include transactions to watchonly addresses (see 'importaddress')"
+            "3. includeWatchonly:        (bool, optional, default=false) Include transactions to watchonly addresses (see 'importaddress')\n"
+            "4. count:                   (numeric, optional) Return at most this many transactions, with a \"cursor\" if there are more\n"
+            "5. \"cursor\":              (string, optional) Continue with the transactions after the page that returned this cursor.\n"
+            "                            Pass the same blockhash, and use the lastblock of the last page for the next call."
             "\nResult:\n"
             "{\n"
             "  \"transactions\": [\n"
@@ -1639,6 +1864,7 @@ UniValue listsinceblock(const UniValue& params, bool fHelp)
             "    \"to\": \"...\",            (string) If a comment to is associated with the transaction.\n"
              "  ],\n"
             "  \"lastblock\": \"lastblockhash\"     (string) The hash of the last block\n"
+            "  \"cursor\": \"...\"                (string) If count was given and there are more transactions, where to continue\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("listsinceblock", "")
@@ -1674,16 +1900,63 @@ UniValue listsinceblock(const UniValue& params, bool fHelp)
         if(params[2].get_bool())
             filter = filter | ISMINE_WATCH_ONLY;
 
+    int nCount = std::numeric_limits<int>::max();
+    bool fPaged = params.size() > 3;
+    if (fPaged)
+    {
+        nCount = params[3].get_int();
+        if (nCount < 1)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid count");
+    }
+
     int depth = pindex ? (1 + chainActive.Height() - pindex->nHeight) : -1;
 
     UniValue transactions(UniValue::VARR);
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    // Transactions outside the active chain come first (height -1), then
+    // those in the blocks after pindex, by height
+    typedef set<pair<int, uint256> > TxByHeight;
+    const TxByHeight& setTxByHeight = pwalletMain->GetTxHeightIndex();
+    TxByHeight::const_iterator it = setTxByHeight.begin();
+    int nSkip = 0;
+    if (params.size() > 4 && !params[4].get_str().empty())
     {
-        CWalletTx tx = (*it).second;
+        CListCursor cursor = DecodeListCursor(params[4].get_str());
+        pair<int, uint256> key(cursor.nPos, cursor.hash);
+        it = setTxByHeight.lower_bound(key);
+        if (it != setTxByHeight.end() && *it == key)
+            nSkip = cursor.nUsed;
+    }
+
+    int nUsed = 0;
+    bool fMore = false;
+    while (it != setTxByHeight.end())
+    {
+        if (pindex && it->first >= 0 && it->first <= pindex->nHeight)
+        {
+            it = setTxByHeight.lower_bound(make_pair(pindex->nHeight + 1, uint256()));
+            continue;
+        }
+        nUsed = 0;
+        if ((int)transactions.size() >= nCount)
+        {
+            fMore = true;
+            break;
+        }
 
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+        map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find(it->second);
+        if (mi != pwalletMain->mapWallet.end() && (depth == -1 || mi->second.GetDepthInMainChain() < depth))
+        {
+            UniValue entries(UniValue::VARR);
+            ListTransactions(mi->second, "*", 0, true, entries, filter);
+            if (!AddToPage(entries, transactions, nCount, nSkip, nUsed))
+            {
+                fMore = true;
+                break;
+            }
+        }
+        nSkip = 0;
+        ++it;
     }
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -1692,6 +1965,8 @@ UniValue listsinceblock(const UniValue& params, bool fHelp)
     UniValue ret(UniValue::VOBJ);
     ret.push_back(Pair("transactions", transactions));
     ret.push_back(Pair("lastblock", lastblock.GetHex()));
+    if (fMore)
+        ret.push_back(Pair("cursor", EncodeListCursor(it->first, it->second, nUsed)));
 
     return ret;
 }
@@ -1854,8 +2129,6 @@ UniValue keypoolrefill(const UniValue& params, bool fHelp)
             + HelpExampleRpc("keypoolrefill", "")
         );
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
     // 0 is interpreted by TopUpKeyPool() as the default keypool size given by -keypool
     unsigned int kpSize = 0;
     if (params.size() > 0) {
@@ -1864,9 +2137,15 @@ UniValue keypoolrefill(const UniValue& params, bool fHelp)
         kpSize = (unsigned int)params[0].get_int();
     }
 
-    EnsureWalletIsUnlocked();
+    {
+        LOCK(pwalletMain->cs_wallet);
+        EnsureWalletIsUnlocked();
+    }
+
+    // Keys are derived without holding the wallet lock, so payments can go on meanwhile
     pwalletMain->TopUpKeyPool(kpSize);
 
+    LOCK(pwalletMain->cs_wallet);
     if (pwalletMain->GetKeyPoolSize() < kpSize)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error refreshing keypool.");
 
@@ -2269,6 +2548,11 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
             "  \"unlocked_until\": ttt,        (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
             "  \"paytxfee\": x.xxxx,           (numeric) the transaction fee configuration, set in " + CURRENCY_UNIT + "/kB\n"
             "  \"hdmasterkeyid\": \"<hash160>\", (string) the Hash160 of the HD master pubkey\n"
+            "  \"scanning\":                   (json object) current scanning details, or false if no scan is in progress\n"
+            "    {\n"
+            "      \"duration\" : xxxx          (numeric) elapsed seconds since scan start\n"
+            "      \"progress\" : x.xxxx,       (numeric) scanning progress percentage [0.0, 1.0]\n"
+            "    }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getwalletinfo", "")
@@ -2291,9 +2575,45 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
     CKeyID masterKeyID = pwalletMain->GetHDChain().masterKeyID;
     if (!masterKeyID.IsNull())
          obj.push_back(Pair("hdmasterkeyid", masterKeyID.GetHex()));
+    if (pwalletMain->IsScanning()) {
+        UniValue scanning(UniValue::VOBJ);
+        scanning.push_back(Pair("duration", pwalletMain->ScanningDuration() / 1000));
+        scanning.push_back(Pair("progress", pwalletMain->ScanningProgress()));
+        obj.push_back(Pair("scanning", scanning));
+    } else {
+        obj.push_back(Pair("scanning", false));
+    }
     return obj;
 }
 
+UniValue abortrescan(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "\nStops the current wallet rescan triggered e.g. by an importprivkey call.\n"
+            "The keys imported so far stay in the wallet, a later rescan picks up their transactions.\n"
+            "\nResult\n"
+            "true|false        (boolean) Whether a rescan was in progress\n"
+            "\nExamples:\n"
+            "\nImport a private key\n"
+            + HelpExampleCli("importprivkey", "\"mykey\"") +
+            "\nAbort the running wallet rescan\n"
+            + HelpExampleCli("abortrescan", "") +
+            "\nAs a JSON-RPC call\n"
+            + HelpExampleRpc("abortrescan", "")
+        );
+
+    // Deliberately without the wallet lock, which the rescan may be waiting for
+    if (!pwalletMain->IsScanning())
+        return false;
+    pwalletMain->AbortRescan();
+    return true;
+}
+
 UniValue resendwallettransactions(const UniValue& params, bool fHelp)
 {
     if (!EnsureWalletIsAvailable(fHelp))
@@ -2561,6 +2881,7 @@ extern UniValue dumpprivkey(const UniValue& params, bool fHelp); // in rpcdump.c
 extern UniValue importprivkey(const UniValue& params, bool fHelp);
 extern UniValue importaddress(const UniValue& params, bool fHelp);
 extern UniValue importpubkey(const UniValue& params, bool fHelp);
+extern UniValue importmulti(const UniValue& params, bool fHelp);
 extern UniValue dumpwallet(const UniValue& params, bool fHelp);
 extern UniValue importwallet(const UniValue& params, bool fHelp);
 extern UniValue importprunedfunds(const UniValue& params, bool fHelp);
@@ -2572,17 +2893,20 @@ static const CRPCCommand commands[] =
     { "rawtransactions",    "fundrawtransaction",       &fundrawtransaction,       false },
     { "hidden",             "resendwallettransactions", &resendwallettransactions, true  },
     { "wallet",             "abandontransaction",       &abandontransaction,       false },
+    { "wallet",             "abortrescan",              &abortrescan,              false },
     { "wallet",             "addmultisigaddress",       &addmultisigaddress,       true  },
     { "wallet",             "addwitnessaddress",        &addwitnessaddress,        true  },
     { "wallet",             "backupwallet",             &backupwallet,             true  },
     { "wallet",             "dumpprivkey",              &dumpprivkey,              true  },
     { "wallet",             "dumpwallet",               &dumpwallet,               true  },
     { "wallet",             "encryptwallet",            &encryptwallet,            true  },
+    { "wallet",             "flushsendqueue",           &flushsendqueue,           false },
     { "wallet",             "getaccountaddress",        &getaccountaddress,        true  },
     { "wallet",             "getaccount",               &getaccount,               true  },
     { "wallet",             "getaddressesbyaccount",    &getaddressesbyaccount,    true  },
     { "wallet",             "getbalance",               &getbalance,               false },
     { "wallet",             "getnewaddress",            &getnewaddress,            true  },
+    { "wallet",             "getqueuedsend",            &getqueuedsend,            true  },
     { "wallet",             "getrawchangeaddress",      &getrawchangeaddress,      true  },
     { "wallet",             "getreceivedbyaccount",     &getreceivedbyaccount,     false },
     { "wallet",             "getreceivedbyaddress",     &getreceivedbyaddress,     false },
@@ -2592,6 +2916,7 @@ static const CRPCCommand commands[] =
     { "wallet",             "importprivkey",            &importprivkey,            true  },
     { "wallet",             "importwallet",             &importwallet,             true  },
     { "wallet",             "importaddress",            &importaddress,            true  },
+    { "wallet",             "importmulti",              &importmulti,              true  },
     { "wallet",             "importprunedfunds",        &importprunedfunds,        true  },
     { "wallet",             "importpubkey",             &importpubkey,             true  },
     { "wallet",             "keypoolrefill",            &keypoolrefill,            true  },
@@ -2605,6 +2930,7 @@ static const CRPCCommand commands[] =
     { "wallet",             "listunspent",              &listunspent,              false },
     { "wallet",             "lockunspent",              &lockunspent,              true  },
     { "wallet",             "move",                     &movecmd,                  false },
+    { "wallet",             "queuesend",                &queuesend,                false },
     { "wallet",             "sendfrom",                 &sendfrom,                 false },
     { "wallet",             "sendmany",                 &sendmany,                 false },
     { "wallet",             "sendtoaddress",            &sendtoaddress,            false },
@@ -0,0 +1,200 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/sendqueue.h"
+
+#include "main.h"
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+#include "wallet/wallet.h"
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/thread.hpp>
+
+CSendQueue* psendqueue = NULL;
+
+CSendQueue::CSendQueue(CWallet* pwalletIn, int64_t nIntervalIn, unsigned int nMaxOutputsIn) :
+    pwallet(pwalletIn), nInterval(nIntervalIn), nMaxOutputs(nMaxOutputsIn)
+{
+}
+
+uint256 CSendQueue::Add(const CScript& scriptPubKey, CAmount nAmount, bool fSubtractFeeFromAmount)
+{
+    CQueuedSend send;
+    send.scriptPubKey = scriptPubKey;
+    send.nAmount = nAmount;
+    send.fSubtractFeeFromAmount = fSubtractFeeFromAmount;
+    send.nTimeQueued = GetTime();
+
+    uint256 id = GetRandHash();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    mapSends[id] = send;
+    vQueue.push_back(id);
+    if (vQueue.size() >= nMaxOutputs)
+        condQueued.notify_one();
+    return id;
+}
+
+bool CSendQueue::Get(const uint256& id, CQueuedSend& send)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<uint256, CQueuedSend>::const_iterator it = mapSends.find(id);
+    if (it == mapSends.end())
+        return false;
+    send = it->second;
+    return true;
+}
+
+size_t CSendQueue::GetQueueSize()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return vQueue.size();
+}
+
+bool CSendQueue::Flush()
+{
+    LOCK2(cs_main, pwallet->cs_wallet);
+    std::vector<uint256> vIds;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (vQueue.empty())
+            return true;
+        if (pwallet->IsLocked())
+            return false;
+        vIds.swap(vQueue);
+    }
+    LogPrintf("%s: sending %u queued payments\n", __func__, vIds.size());
+    if (SendBatch(vIds))
+        return true;
+
+    // Ahead of any queued meanwhile, to keep the order
+    boost::unique_lock<boost::mutex> lock(mutex);
+    vQueue.insert(vQueue.begin(), vIds.begin(), vIds.end());
+    return false;
+}
+
+bool CSendQueue::SendBatch(std::vector<uint256>& vIds)
+{
+    AssertLockHeld(pwallet->cs_wallet);
+    std::vector<CRecipient> vecSend;
+    std::vector<uint256> vIdsSend;
+    std::vector<uint256> vIdsInvalid;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        BOOST_FOREACH(const uint256& id, vIds)
+        {
+            const CQueuedSend& send = mapSends[id];
+            CRecipient recipient = {send.scriptPubKey, send.nAmount, send.fSubtractFeeFromAmount};
+            if (recipient.nAmount <= 0 || CTxOut(recipient.nAmount, recipient.scriptPubKey).IsDust(::minRelayTxFee)) {
+                vIdsInvalid.push_back(id);
+                continue;
+            }
+            vecSend.push_back(recipient);
+            vIdsSend.push_back(id);
+        }
+    }
+    if (!vIdsInvalid.empty())
+    {
+        LogPrintf("%s: %u queued payments failed: amount too small\n", __func__, vIdsInvalid.size());
+        SetDone(vIdsInvalid, CQueuedSend::FAILED, uint256(), std::vector<int>(), "Transaction amount too small");
+    }
+    vIds.swap(vIdsSend);
+    if (vIds.empty())
+        return true;
+
+    CWalletTx wtx;
+    CReserveKey reservekey(pwallet);
+    CAmount nFeeRequired;
+    int nChangePos = -1;
+    std::string strError;
+    if (!pwallet->CreateTransaction(vecSend, wtx, reservekey, nFeeRequired, nChangePos, strError))
+    {
+        LogPrintf("%s: keeping %u payments queued: %s\n", __func__, vIds.size(), strError);
+        boost::unique_lock<boost::mutex> lock(mutex);
+        BOOST_FOREACH(const uint256& id, vIds)
+            mapSends[id].strError = strError;
+        return false;
+    }
+
+    // The outputs follow vecSend, with the change output inserted at nChangePos
+    std::vector<int> vOut;
+    for (int i = 0; i < (int)vIds.size(); i++)
+        vOut.push_back(nChangePos >= 0 && i >= nChangePos ? i + 1 : i);
+
+    // Once committed the transaction is in the wallet and its inputs are
+    // spent, so the payments must not be retried even if it was rejected
+    if (!pwallet->CommitTransaction(wtx, reservekey))
+    {
+        LogPrintf("%s: transaction %s for %u queued payments was rejected\n", __func__, wtx.GetHash().GetHex(), vIds.size());
+        SetDone(vIds, CQueuedSend::FAILED, wtx.GetHash(), vOut, "Transaction was rejected");
+        return true;
+    }
+    SetDone(vIds, CQueuedSend::SENT, wtx.GetHash(), vOut, "");
+    return true;
+}
+
+void CSendQueue::SetDone(const std::vector<uint256>& vIds, CQueuedSend::Status status, const uint256& txid, const std::vector<int>& vOut, const std::string& strError)
+{
+    int64_t nNow = GetTime();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (unsigned int i = 0; i < vIds.size(); i++)
+    {
+        CQueuedSend& send = mapSends[vIds[i]];
+        send.status = status;
+        send.txid = txid;
+        send.nOut = i < vOut.size() ? vOut[i] : -1;
+        send.strError = strError;
+        dequeDone.push_back(std::make_pair(nNow, vIds[i]));
+    }
+
+    while (!dequeDone.empty() && dequeDone.front().first < nNow - SEND_QUEUE_RESULT_EXPIRY)
+    {
+        mapSends.erase(dequeDone.front().second);
+        dequeDone.pop_front();
+    }
+}
+
+void CSendQueue::ThreadSendQueue()
+{
+    RenameThread("bitcoin-sendqueue");
+    // After a flush left the payments queued, wait out the interval even if
+    // the queue is full, rather than retry at once
+    bool fWaitInterval = false;
+    try {
+        while (true)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(nInterval);
+                while (fWaitInterval || vQueue.size() < nMaxOutputs)
+                    if (!condQueued.timed_wait(lock, deadline))
+                        break;
+            }
+            fWaitInterval = !Flush();
+        }
+    } catch (const boost::thread_interrupted&) {
+        // Send what is still queued before the node shuts down
+        if (!Flush())
+            LogPrintf("%s: %u queued payments could not be sent before shutting down\n", __func__, GetQueueSize());
+        throw;
+    }
+}
+
+void StartSendQueue(boost::thread_group& threadGroup, CWallet* pwallet)
+{
+    int64_t nInterval = GetArg("-sendqueueinterval", DEFAULT_SEND_QUEUE_INTERVAL);
+    if (nInterval <= 0)
+        return;
+    unsigned int nMaxOutputs = std::max((int64_t)1, GetArg("-sendqueuemaxoutputs", DEFAULT_SEND_QUEUE_MAX_OUTPUTS));
+    psendqueue = new CSendQueue(pwallet, nInterval, nMaxOutputs);
+    threadGroup.create_thread(boost::bind(&CSendQueue::ThreadSendQueue, psendqueue));
+}
+
+void StopSendQueue()
+{
+    delete psendqueue;
+    psendqueue = NULL;
+}
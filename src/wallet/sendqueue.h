@@ -0,0 +1,122 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_SENDQUEUE_H
+#define BITCOIN_WALLET_SENDQUEUE_H
+
+#include "amount.h"
+#include "script/script.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CWallet;
+
+namespace boost {
+class thread_group;
+} // namespace boost
+
+//! -sendqueueinterval default, 0 disables the send queue
+static const int64_t DEFAULT_SEND_QUEUE_INTERVAL = 0;
+//! -sendqueuemaxoutputs default
+static const unsigned int DEFAULT_SEND_QUEUE_MAX_OUTPUTS = 100;
+//! How long the outcome of a queued payment can be looked up after it was sent, in seconds
+static const int64_t SEND_QUEUE_RESULT_EXPIRY = 24 * 60 * 60;
+
+/** A payment in the send queue, and what became of it */
+struct CQueuedSend
+{
+    enum Status
+    {
+        QUEUED,
+        SENT,
+        FAILED,
+    };
+
+    CScript scriptPubKey;
+    CAmount nAmount;
+    bool fSubtractFeeFromAmount;
+    int64_t nTimeQueued;
+
+    Status status;
+    //! Transaction that paid it, and the output, once sent
+    uint256 txid;
+    int nOut;
+    //! Why it could not be sent, if it failed or the last attempt to send it did
+    std::string strError;
+
+    CQueuedSend() : nAmount(0), fSubtractFeeFromAmount(false), nTimeQueued(0), status(QUEUED), nOut(-1) {}
+};
+
+/**
+ * Payments accepted by queuesend, sent together in one transaction every
+ * -sendqueueinterval seconds, or as soon as -sendqueuemaxoutputs of them
+ * are waiting.  Batching them saves the fees, signing and change outputs of
+ * one transaction per payment.
+ *
+ * A payment that can never be made, such as one to dust, fails on its own
+ * before the batch is built.  If the batch still cannot be created, because
+ * of insufficient funds for instance, its payments stay queued for the next
+ * attempt, as they do while the wallet is locked.  The queue is kept in
+ * memory only: payments still waiting when the node
+ * shuts down are sent before it stops, and are lost if it crashes.
+ */
+class CSendQueue
+{
+public:
+    CSendQueue(CWallet* pwalletIn, int64_t nIntervalIn, unsigned int nMaxOutputsIn);
+
+    /** Queue a payment, returning the id to look it up by */
+    uint256 Add(const CScript& scriptPubKey, CAmount nAmount, bool fSubtractFeeFromAmount);
+    bool Get(const uint256& id, CQueuedSend& send);
+    size_t GetQueueSize();
+
+    /**
+     * Send all queued payments now.
+     * @return false if they were kept queued because the wallet is locked
+     * or the transaction could not be created
+     */
+    bool Flush();
+
+    /** Sends the queued payments as they become due, until interrupted */
+    void ThreadSendQueue();
+
+private:
+    CWallet* pwallet;
+    const int64_t nInterval;
+    const unsigned int nMaxOutputs;
+
+    boost::mutex mutex;
+    boost::condition_variable condQueued;
+    std::map<uint256, CQueuedSend> mapSends;
+    //! Payments waiting to be sent, in the order they were queued
+    std::vector<uint256> vQueue;
+    //! Sent and failed payments by the time they were done, to expire them
+    std::deque<std::pair<int64_t, uint256> > dequeDone;
+
+    /**
+     * Send the payments vIds in one transaction.  Those that can never be
+     * sent are marked failed and removed from vIds first.
+     * @return false if the transaction could not be created, leaving the
+     * payments left in vIds to be queued again
+     */
+    bool SendBatch(std::vector<uint256>& vIds);
+    void SetDone(const std::vector<uint256>& vIds, CQueuedSend::Status status, const uint256& txid, const std::vector<int>& vOut, const std::string& strError);
+};
+
+extern CSendQueue* psendqueue;
+
+/** Start the send queue if -sendqueueinterval is set */
+void StartSendQueue(boost::thread_group& threadGroup, CWallet* pwallet);
+/** Free the send queue, after its thread has been interrupted and joined */
+void StopSendQueue();
+
+#endif // BITCOIN_WALLET_SENDQUEUE_H
@@ -227,4 +227,48 @@ BOOST_AUTO_TEST_CASE(decrypt) {
     }
 }
 
+class TestCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    using CCryptoKeyStore::EncryptKeys;
+    using CCryptoKeyStore::Unlock;
+};
+
+BOOST_AUTO_TEST_CASE(keystore_unlock) {
+    TestCryptoKeyStore keystore;
+    std::vector<CKey> vKeys(100);
+    for (unsigned int i = 0; i < vKeys.size(); i++) {
+        vKeys[i].MakeNewKey(true);
+        BOOST_CHECK(keystore.AddKeyPubKey(vKeys[i], vKeys[i].GetPubKey()));
+    }
+
+    CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE);
+    GetRandBytes(&vMasterKey[0], WALLET_CRYPTO_KEY_SIZE);
+    CKeyingMaterial vWrongKey(WALLET_CRYPTO_KEY_SIZE);
+    GetRandBytes(&vWrongKey[0], WALLET_CRYPTO_KEY_SIZE);
+    BOOST_CHECK(keystore.EncryptKeys(vMasterKey));
+    BOOST_CHECK(keystore.Lock());
+
+    CKey key;
+    BOOST_CHECK(!keystore.GetKey(vKeys[0].GetPubKey().GetID(), key));
+    BOOST_CHECK(!keystore.Unlock(vWrongKey));
+    BOOST_CHECK(keystore.Unlock(vMasterKey));
+    // Keys are decrypted on first use and then served from the cache
+    for (int n = 0; n < 2; n++) {
+        for (unsigned int i = 0; i < vKeys.size(); i++) {
+            BOOST_CHECK(keystore.GetKey(vKeys[i].GetPubKey().GetID(), key));
+            BOOST_CHECK(key == vKeys[i]);
+        }
+    }
+    BOOST_CHECK(keystore.Lock());
+    BOOST_CHECK(!keystore.GetKey(vKeys[0].GetPubKey().GetID(), key));
+
+    // A key that doesn't decrypt is only found when it is used
+    CPubKey pubkey = vKeys.back().GetPubKey();
+    BOOST_CHECK(keystore.AddCryptedKey(pubkey, std::vector<unsigned char>(48, 0x55)));
+    BOOST_CHECK(keystore.Unlock(vMasterKey));
+    BOOST_CHECK(keystore.GetKey(vKeys[0].GetPubKey().GetID(), key));
+    BOOST_CHECK(!keystore.GetKey(pubkey.GetID(), key));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
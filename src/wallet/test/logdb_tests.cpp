@@ -0,0 +1,102 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/logdb.h"
+#include "test/test_bitcoin.h"
+
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+static CSerializeData Data(const std::string& str)
+{
+    return CSerializeData(str.begin(), str.end());
+}
+
+BOOST_FIXTURE_TEST_SUITE(logdb_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(logdb_commit_reopen)
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CSerializeData value, key;
+    {
+        CLogDB logdb;
+        BOOST_CHECK(!logdb.Open(path, false));
+        BOOST_CHECK(logdb.Open(path, true));
+
+        CLogDBBatch batch;
+        batch.Write(Data("a"), Data("1"));
+        batch.Write(Data("b"), Data("2"));
+        batch.Erase(Data("a"));
+        batch.Write(Data("\xff"), Data("3"));
+        bool fErased;
+        BOOST_CHECK(batch.Find(Data("a"), value, fErased) && fErased);
+        BOOST_CHECK(!batch.Find(Data("c"), value, fErased));
+        BOOST_CHECK(logdb.Commit(batch));
+
+        BOOST_CHECK(!logdb.Exists(Data("a")));
+        BOOST_CHECK(logdb.Read(Data("b"), value) && value == Data("2"));
+
+        // Keys are ordered as unsigned bytes
+        BOOST_CHECK(logdb.ReadNext(Data(""), true, key, value) && key == Data("b"));
+        BOOST_CHECK(logdb.ReadNext(key, false, key, value) && key == Data("\xff"));
+        BOOST_CHECK(!logdb.ReadNext(key, false, key, value));
+    }
+    BOOST_CHECK(CLogDB::IsLogFile(path));
+
+    // A commit cut short at the end of the file is dropped
+    uint64_t nSize = boost::filesystem::file_size(path);
+    FILE* file = fopen(path.string().c_str(), "ab");
+    fwrite("\x40\x00\x00\x00\x01\x02\x03\x04xyz", 1, 11, file);
+    fclose(file);
+    {
+        CLogDB logdb;
+        BOOST_CHECK(logdb.Open(path, false));
+        BOOST_CHECK(logdb.Read(Data("\xff"), value) && value == Data("3"));
+        BOOST_CHECK(!logdb.Exists(Data("a")));
+        BOOST_CHECK_EQUAL(logdb.GetFileSize(), nSize);
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSize);
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(logdb_compact)
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CSerializeData value;
+    {
+        CLogDB logdb;
+        BOOST_CHECK(logdb.Open(path, true));
+        for (int i = 0; i < 100; i++) {
+            CLogDBBatch batch;
+            batch.Write(Data("\x04poolkey"), Data(strprintf("%d", i)));
+            batch.Write(Data("name"), Data(strprintf("%d", i)));
+            BOOST_CHECK(logdb.Commit(batch));
+        }
+        uint64_t nSize = logdb.GetFileSize();
+        BOOST_CHECK(nSize > 2 * logdb.GetLiveSize());
+
+        BOOST_CHECK(logdb.Compact("\x04pool"));
+        BOOST_CHECK(logdb.GetFileSize() < nSize / 10);
+        BOOST_CHECK(!logdb.Exists(Data("\x04poolkey")));
+        BOOST_CHECK(logdb.Read(Data("name"), value) && value == Data("99"));
+
+        // The compacted file is appended to as before
+        CLogDBBatch batch;
+        batch.Write(Data("name"), Data("100"));
+        BOOST_CHECK(logdb.Commit(batch));
+    }
+    {
+        CLogDB logdb;
+        BOOST_CHECK(logdb.Open(path, false));
+        BOOST_CHECK(!logdb.Exists(Data("\x04poolkey")));
+        BOOST_CHECK(logdb.Read(Data("name"), value) && value == Data("100"));
+    }
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,13 @@
 
 #include "wallet/wallet.h"
 
+#include "key.h"
+#include "main.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "wallet/rescan.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -351,4 +358,360 @@ BOOST_AUTO_TEST_CASE(ApproximateBestSubset)
     BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
 }
 
+BOOST_AUTO_TEST_CASE(BranchAndBound)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    empty_wallet();
+
+    // 5 cents and 3 cents and a bit overshoot 8 cents by less than a change
+    // output would be worth, so they are taken instead of the next bigger coin
+    add_coin(5 * CENT);
+    add_coin(3 * CENT + 300);
+    add_coin(20 * CENT);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(8 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 8 * CENT + 300);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    // an exact match deep in a large set is found
+    empty_wallet();
+    for (int i = 0; i < 1000; i++)
+        add_coin(1000 * COIN);
+    add_coin(7 * COIN);
+    add_coin(5 * COIN);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(2012 * COIN, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 2012 * COIN);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 4U);
+
+    // without a match the search gives up and the coins are still selected
+    empty_wallet();
+    for (int i = 0; i < 500; i++)
+        add_coin(CENT + 997 * i);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(50 * CENT + 1, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK(nValueRet >= 50 * CENT + 1);
+
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(unspent_index)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    fCheckWalletBalances = true;
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+
+    vector<COutput> vAvailable;
+    pwalletMain->AvailableCoins(vAvailable);
+    BOOST_CHECK(vAvailable.empty());
+
+    // Two outputs of ours confirmed in the tip
+    CMutableTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFund.vout.push_back(CTxOut(1 * COIN, scriptMine));
+    txFund.vout.push_back(CTxOut(2 * COIN, scriptMine));
+    txFund.vout.push_back(CTxOut(3 * COIN, scriptOther));
+    CWalletTx wtxFund(pwalletMain, txFund);
+    wtxFund.hashBlock = chainActive.Tip()->GetBlockHash();
+    wtxFund.nIndex = 0;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxFund));
+    pwalletMain->AvailableCoins(vAvailable);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 2U);
+    BOOST_CHECK(pwalletMain->CheckUnspentIndex());
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 3 * COIN);
+
+    // Spending one of them removes it
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(wtxFund.GetHash(), 1);
+    txSpend.vout.push_back(CTxOut(2 * COIN, scriptOther));
+    CWalletTx wtxSpend(pwalletMain, txSpend);
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxSpend));
+    pwalletMain->AvailableCoins(vAvailable);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 1U);
+    BOOST_CHECK_EQUAL(vAvailable[0].i, 0);
+    BOOST_CHECK(pwalletMain->CheckUnspentIndex());
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 1 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), 0);
+
+    // and abandoning the spend brings it back
+    BOOST_CHECK(pwalletMain->AbandonTransaction(wtxSpend.GetHash()));
+    pwalletMain->AvailableCoins(vAvailable);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 2U);
+    BOOST_CHECK(pwalletMain->CheckUnspentIndex());
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 3 * COIN);
+
+    // Watching another address adds its outputs, unspendable
+    BOOST_CHECK(pwalletMain->AddWatchOnly(scriptOther));
+    pwalletMain->AvailableCoins(vAvailable);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 3U);
+    BOOST_CHECK(pwalletMain->CheckUnspentIndex());
+    int nSpendable = 0;
+    BOOST_FOREACH(const COutput& out, vAvailable)
+        nSpendable += out.fSpendable;
+    BOOST_CHECK_EQUAL(nSpendable, 2);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 3 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetWatchOnlyBalance(), 3 * COIN);
+
+    // Importing the key of an output already in the wallet makes it ours
+    CKey keyImport;
+    keyImport.MakeNewKey(true);
+    CMutableTransaction txImport;
+    txImport.vin.resize(1);
+    txImport.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txImport.vout.push_back(CTxOut(4 * COIN, GetScriptForDestination(keyImport.GetPubKey().GetID())));
+    CWalletTx wtxImport(pwalletMain, txImport);
+    wtxImport.hashBlock = chainActive.Tip()->GetBlockHash();
+    wtxImport.nIndex = 0;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxImport));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 3 * COIN);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(keyImport, keyImport.GetPubKey()));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 7 * COIN);
+    BOOST_CHECK(pwalletMain->CheckUnspentIndex());
+
+    // A coinbase in the tip is counted as immature
+    CMutableTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vout.push_back(CTxOut(50 * COIN, scriptMine));
+    CWalletTx wtxCoinBase(pwalletMain, txCoinBase);
+    wtxCoinBase.hashBlock = chainActive.Tip()->GetBlockHash();
+    wtxCoinBase.nIndex = 0;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxCoinBase));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 7 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetImmatureBalance(), 50 * COIN);
+    BOOST_CHECK(pwalletMain->CheckBalances());
+
+    fCheckWalletBalances = false;
+}
+
+BOOST_AUTO_TEST_CASE(unspent_index_snapshot)
+{
+    CUnspentIndexSnapshot snapshot;
+    snapshot.hashTip = GetRandHash();
+    snapshot.nTxCount = 3;
+    snapshot.nKeyCount = 101;
+    uint256 hash = GetRandHash();
+    snapshot.setUnspent.insert(COutPoint(hash, 0));
+    snapshot.setUnspent.insert(COutPoint(hash, 7));
+    snapshot.setUnspent.insert(COutPoint(GetRandHash(), 1));
+    snapshot.setUnsettled.insert(hash);
+    snapshot.nSettledCredit = 5 * COIN;
+    snapshot.nSettledWatchCredit = COIN;
+    snapshot.nSettledHeight = 1000;
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << snapshot;
+    CUnspentIndexSnapshot snapshotRead;
+    ss >> snapshotRead;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(snapshotRead.hashTip == snapshot.hashTip);
+    BOOST_CHECK_EQUAL(snapshotRead.nTxCount, snapshot.nTxCount);
+    BOOST_CHECK_EQUAL(snapshotRead.nKeyCount, snapshot.nKeyCount);
+    BOOST_CHECK(snapshotRead.setUnspent == snapshot.setUnspent);
+    BOOST_CHECK(snapshotRead.setUnsettled == snapshot.setUnsettled);
+    BOOST_CHECK_EQUAL(snapshotRead.nSettledCredit, snapshot.nSettledCredit);
+    BOOST_CHECK_EQUAL(snapshotRead.nSettledWatchCredit, snapshot.nSettledWatchCredit);
+    BOOST_CHECK_EQUAL(snapshotRead.nSettledHeight, snapshot.nSettledHeight);
+    BOOST_CHECK(snapshotRead.hashTxs == snapshot.hashTxs);
+    BOOST_CHECK(snapshotRead.hashKeys == snapshot.hashKeys);
+}
+
+static CWalletTx AddConfirmedTx(const CScript& scriptPubKey, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.push_back(CTxOut(nValue, scriptPubKey));
+    CWalletTx wtx(pwalletMain, tx);
+    wtx.hashBlock = chainActive.Tip()->GetBlockHash();
+    wtx.nIndex = 0;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtx));
+    return wtx;
+}
+
+BOOST_AUTO_TEST_CASE(unspent_index_snapshot_stale)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CKey key, keyWatch, keyWatchOther;
+    key.MakeNewKey(true);
+    keyWatch.MakeNewKey(true);
+    keyWatchOther.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptWatch = GetScriptForDestination(keyWatch.GetPubKey().GetID());
+    BOOST_CHECK(pwalletMain->AddWatchOnly(scriptWatch));
+    CWalletTx wtx = AddConfirmedTx(scriptMine, 1 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 1 * COIN);
+
+    // A snapshot is taken back while nothing changed
+    CUnspentIndexSnapshot snapshot;
+    BOOST_CHECK(pwalletMain->GetUnspentIndexSnapshot(snapshot));
+    CUnspentIndexSnapshot snapshotCopy(snapshot);
+    BOOST_CHECK(pwalletMain->LoadUnspentIndex(snapshotCopy));
+
+    // but not with another transaction in place of the one it saw
+    std::vector<uint256> vHashIn(1, wtx.GetHash()), vHashOut;
+    BOOST_CHECK(pwalletMain->ZapSelectTx(vHashIn, vHashOut) == DB_LOAD_OK);
+    AddConfirmedTx(scriptMine, 2 * COIN);
+    snapshotCopy = snapshot;
+    BOOST_CHECK_EQUAL(snapshotCopy.nTxCount, pwalletMain->mapWallet.size());
+    BOOST_CHECK(!pwalletMain->LoadUnspentIndex(snapshotCopy));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 2 * COIN);
+
+    // nor with another watch-only script in place of the one it saw
+    BOOST_CHECK(pwalletMain->GetUnspentIndexSnapshot(snapshot));
+    BOOST_CHECK(pwalletMain->RemoveWatchOnly(scriptWatch));
+    BOOST_CHECK(pwalletMain->AddWatchOnly(GetScriptForDestination(keyWatchOther.GetPubKey().GetID())));
+    snapshotCopy = snapshot;
+    BOOST_CHECK(!pwalletMain->LoadUnspentIndex(snapshotCopy));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 2 * COIN);
+    CUnspentIndexSnapshot snapshotNew;
+    BOOST_CHECK(pwalletMain->GetUnspentIndexSnapshot(snapshotNew));
+    BOOST_CHECK_EQUAL(snapshotNew.nKeyCount, snapshot.nKeyCount);
+}
+
+BOOST_AUTO_TEST_CASE(keypool_batch)
+{
+    LOCK(pwalletMain->cs_wallet);
+    CPubKey masterPubKey = pwalletMain->GenerateNewHDMasterKey();
+    BOOST_CHECK(pwalletMain->SetHDMasterKey(masterPubKey));
+
+    // More than one batch, written to the pool in derivation order
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(KEYPOOL_BATCH_SIZE + 10));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), KEYPOOL_BATCH_SIZE + 11);
+    for (int i = 0; i < 3; i++) {
+        int64_t nIndex;
+        CKeyPool keypool;
+        pwalletMain->ReserveKeyFromKeyPool(nIndex, keypool);
+        pwalletMain->KeepKey(nIndex);
+        BOOST_CHECK(pwalletMain->HaveKey(keypool.vchPubKey.GetID()));
+        const CKeyMetadata& metadata = pwalletMain->mapKeyMetadata[keypool.vchPubKey.GetID()];
+        BOOST_CHECK_EQUAL(metadata.hdKeypath, strprintf("m/0'/0'/%d'", i));
+        BOOST_CHECK(metadata.hdMasterKeyID == masterPubKey.GetID());
+    }
+
+    // Keys derived one at a time continue after the batches
+    CPubKey pubkey = pwalletMain->GenerateNewKey();
+    BOOST_CHECK_EQUAL(pwalletMain->mapKeyMetadata[pubkey.GetID()].hdKeypath, strprintf("m/0'/0'/%d'", KEYPOOL_BATCH_SIZE + 11));
+}
+
+BOOST_AUTO_TEST_CASE(rescan_filter)
+{
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CScript scriptRedeem = GetScriptForMultisig(1, std::vector<CPubKey>(1, keyOther.GetPubKey()));
+    CScript scriptWatch = GetScriptForDestination(keyOther.GetPubKey().GetID());
+
+    CWalletScanFilter filter;
+    filter.AddKey(pubkey);
+    filter.AddRedeemScript(scriptRedeem);
+    filter.AddScript(scriptWatch);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = GetScriptForDestination(keyOther.GetPubKey().GetID()) << OP_NOP;
+    BOOST_CHECK(!filter.MatchOutputs(tx));
+    BOOST_CHECK(!filter.MatchInputs(tx));
+
+    // Every way of paying to a wallet key or script matches
+    std::vector<CScript> vScripts;
+    vScripts.push_back(GetScriptForRawPubKey(pubkey));
+    vScripts.push_back(GetScriptForDestination(pubkey.GetID()));
+    vScripts.push_back(GetScriptForDestination(CScriptID(scriptRedeem)));
+    vScripts.push_back(GetScriptForMultisig(1, std::vector<CPubKey>(2, pubkey)));
+    vScripts.push_back(CScript() << OP_0 << ToByteVector(pubkey.GetID()));
+    vScripts.push_back(scriptWatch);
+    BOOST_FOREACH(const CScript& script, vScripts) {
+        CMutableTransaction txPay(tx);
+        txPay.vout.push_back(CTxOut(COIN, script));
+        BOOST_CHECK(filter.MatchOutputs(txPay));
+    }
+
+    // Spending from or conflicting with a wallet transaction matches by the inputs
+    CTransaction txWallet(tx);
+    filter.AddTx(txWallet);
+    BOOST_CHECK(filter.MatchInputs(txWallet));
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(txWallet.GetHash(), 0);
+    BOOST_CHECK(filter.MatchInputs(txSpend));
+    CMutableTransaction txConflict;
+    txConflict.vin.resize(1);
+    txConflict.vin[0].prevout = tx.vin[0].prevout;
+    txConflict.nLockTime = 1;
+    BOOST_CHECK(filter.MatchInputs(txConflict));
+
+    // Block filters match the same
+    size_t nHashes;
+    BOOST_CHECK(!filter.MatchBlockFilter(CBlockFilter(std::vector<uint64_t>(1, GetBlockFilterHash(tx.vout[0].scriptPubKey))), nHashes));
+    for (unsigned int i = 0; i < vScripts.size(); i++) {
+        CMutableTransaction txPay;
+        txPay.vout.push_back(CTxOut(COIN, vScripts[i]));
+        CBlock block;
+        block.vtx.push_back(txPay);
+        BOOST_CHECK(filter.MatchBlockFilter(CBlockFilter(block), nHashes));
+    }
+    BOOST_CHECK(filter.MatchBlockFilter(CBlockFilter(std::vector<uint64_t>(1, GetBlockFilterHash(txSpend.vin[0].prevout))), nHashes));
+    BOOST_CHECK_EQUAL(nHashes, filter.GetFilterHashCount());
+}
+
+BOOST_FIXTURE_TEST_CASE(rescan_filter_spend_in_block, TestChain100Setup)
+{
+    // A pays to the wallet and B, later in the same block, spends all of it elsewhere
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(coinbaseKey);
+    keystore.AddKey(key);
+
+    CMutableTransaction txA;
+    txA.vin.resize(1);
+    txA.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    txA.vout.push_back(CTxOut(coinbaseTxns[0].vout[0].nValue - 10000, GetScriptForDestination(key.GetPubKey().GetID())));
+    BOOST_CHECK(SignSignature(keystore, coinbaseTxns[0], txA, 0, SIGHASH_ALL));
+    CMutableTransaction txB;
+    txB.vin.resize(1);
+    txB.vin[0].prevout = COutPoint(txA.GetHash(), 0);
+    txB.vout.push_back(CTxOut(txA.vout[0].nValue - 10000, GetScriptForDestination(keyOther.GetPubKey().GetID())));
+    BOOST_CHECK(SignSignature(keystore, CTransaction(txA), txB, 0, SIGHASH_ALL));
+
+    std::vector<CMutableTransaction> vTx;
+    vTx.push_back(txA);
+    vTx.push_back(txB);
+    CBlock block = CreateAndProcessBlock(vTx, GetScriptForRawPubKey(keyOther.GetPubKey()));
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    // The scan only counts the transactions the wallet could write
+    bitdb.MakeMock();
+    {
+        CWallet wallet("wallet_test.dat");
+        {
+            LOCK(wallet.cs_wallet);
+            BOOST_CHECK(wallet.AddKeyPubKey(key, key.GetPubKey()));
+        }
+        BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Genesis(), true), 2);
+        LOCK2(cs_main, wallet.cs_wallet);
+        BOOST_CHECK(wallet.mapWallet.count(txA.GetHash()));
+        BOOST_CHECK(wallet.mapWallet.count(txB.GetHash()));
+        BOOST_CHECK(wallet.IsSpent(txA.GetHash(), 0));
+        BOOST_CHECK_EQUAL(wallet.GetBalance(), 0);
+    }
+    bitdb.Flush(true);
+    bitdb.Reset();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
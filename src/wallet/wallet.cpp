@@ -6,6 +6,7 @@
 #include "wallet/wallet.h"
 
 #include "base58.h"
+#include "chainparams.h"
 #include "checkpoints.h"
 #include "chain.h"
 #include "coincontrol.h"
@@ -25,6 +26,8 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "utilmoneystr.h"
+#include "wallet/rescan.h"
+#include "wallet/sendqueue.h"
 
 #include <assert.h>
 
@@ -40,6 +43,7 @@ CFeeRate payTxFee(DEFAULT_TRANSACTION_FEE);
 unsigned int nTxConfirmTarget = DEFAULT_TX_CONFIRM_TARGET;
 bool bSpendZeroConfChange = DEFAULT_SPEND_ZEROCONF_CHANGE;
 bool fSendFreeTransactions = DEFAULT_SEND_FREE_TRANSACTIONS;
+bool fCheckWalletBalances = false;
 
 const char * DEFAULT_WALLET_DAT = "wallet.dat";
 const uint32_t BIP32_HARDENED_KEY_LIMIT = 0x80000000;
@@ -134,7 +138,7 @@ CPubKey CWallet::GenerateNewKey()
         secret = childKey.key;
 
         // update the chain model in the database
-        if (!CWalletDB(strWalletFile).WriteHDChain(hdChain))
+        if (fFileBacked && !CWalletDB(strWalletFile).WriteHDChain(hdChain))
             throw std::runtime_error(std::string(__func__) + ": Writing HD chain model failed");
     } else {
         secret.MakeNewKey(fCompressed);
@@ -157,26 +161,44 @@ CPubKey CWallet::GenerateNewKey()
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
+{
+    CWalletDB walletdb(strWalletFile);
+    return CWallet::AddKeyPubKeyWithDB(walletdb, secret, pubkey);
+}
+
+bool CWallet::AddKeyPubKeyWithDB(CWalletDB& walletdb, const CKey& secret, const CPubKey &pubkey)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
-    if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
+
+    // Encrypted keys are written to walletdb here rather than through
+    // AddCryptedKey(); encryption can't start meanwhile, it needs cs_wallet
+    if (IsCrypted()) {
+        std::vector<unsigned char> vchCryptedSecret;
+        if (!EncryptKey(secret, pubkey, vchCryptedSecret))
+            return false;
+        if (!AddCryptedKeyWithDB(walletdb, pubkey, vchCryptedSecret))
+            return false;
+    } else if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey)) {
         return false;
+    }
+    // Outputs to the key may already be in mapWallet
+    fUnspentIndexed = false;
 
     // check if we need to remove from watch-only
     CScript script;
     script = GetScriptForDestination(pubkey.GetID());
     if (HaveWatchOnly(script))
-        RemoveWatchOnly(script);
+        RemoveWatchOnlyWithDB(walletdb, script);
     script = GetScriptForRawPubKey(pubkey);
     if (HaveWatchOnly(script))
-        RemoveWatchOnly(script);
+        RemoveWatchOnlyWithDB(walletdb, script);
 
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
-        return CWalletDB(strWalletFile).WriteKey(pubkey,
-                                                 secret.GetPrivKey(),
-                                                 mapKeyMetadata[pubkey.GetID()]);
+        return walletdb.WriteKey(pubkey,
+                                 secret.GetPrivKey(),
+                                 mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
 }
@@ -186,10 +208,11 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
-    if (!fFileBacked)
-        return true;
     {
         LOCK(cs_wallet);
+        fUnspentIndexed = false;
+        if (!fFileBacked)
+            return true;
         if (pwalletdbEncryption)
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey,
                                                         vchCryptedSecret,
@@ -202,6 +225,20 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
     return false;
 }
 
+bool CWallet::AddCryptedKeyWithDB(CWalletDB& walletdb, const CPubKey &vchPubKey,
+                                  const vector<unsigned char> &vchCryptedSecret)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    fUnspentIndexed = false;
+    if (!fFileBacked)
+        return true;
+    return walletdb.WriteCryptedKey(vchPubKey,
+                                    vchCryptedSecret,
+                                    mapKeyMetadata[vchPubKey.GetID()]);
+}
+
 bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
@@ -218,12 +255,22 @@ bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigne
 }
 
 bool CWallet::AddCScript(const CScript& redeemScript)
+{
+    CWalletDB walletdb(strWalletFile);
+    return AddCScriptWithDB(walletdb, redeemScript);
+}
+
+bool CWallet::AddCScriptWithDB(CWalletDB& walletdb, const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_wallet);
+        fUnspentIndexed = false;
+    }
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
+    return walletdb.WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
 bool CWallet::LoadCScript(const CScript& redeemScript)
@@ -243,25 +290,42 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
 }
 
 bool CWallet::AddWatchOnly(const CScript &dest)
+{
+    CWalletDB walletdb(strWalletFile);
+    return AddWatchOnlyWithDB(walletdb, dest);
+}
+
+bool CWallet::AddWatchOnlyWithDB(CWalletDB& walletdb, const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    {
+        LOCK(cs_wallet);
+        fUnspentIndexed = false;
+    }
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteWatchOnly(dest);
+    return walletdb.WriteWatchOnly(dest);
 }
 
 bool CWallet::RemoveWatchOnly(const CScript &dest)
+{
+    CWalletDB walletdb(strWalletFile);
+    return RemoveWatchOnlyWithDB(walletdb, dest);
+}
+
+bool CWallet::RemoveWatchOnlyWithDB(CWalletDB& walletdb, const CScript &dest)
 {
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    fUnspentIndexed = false;
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
-        if (!CWalletDB(strWalletFile).EraseWatchOnly(dest))
+        if (!walletdb.EraseWatchOnly(dest))
             return false;
 
     return true;
@@ -408,6 +472,8 @@ set<uint256> CWallet::GetConflicts(const uint256& txid) const
 
 void CWallet::Flush(bool shutdown)
 {
+    if (shutdown)
+        WriteUnspentIndex();
     bitdb.Flush(shutdown);
 }
 
@@ -423,6 +489,10 @@ bool CWallet::Verify()
     if (walletFile != boost::filesystem::basename(walletFile) + boost::filesystem::extension(walletFile))
         return InitError(strprintf(_("Wallet %s resides outside data directory %s"), walletFile, GetDataDir().string()));
 
+    std::string strBackend = GetArg("-walletbackend", DEFAULT_WALLET_BACKEND);
+    if (strBackend != "bdb" && strBackend != "log")
+        return InitError(strprintf(_("Unknown wallet backend requested: %s"), strBackend));
+
     if (!bitdb.Open(GetDataDir()))
     {
         // try moving the database env out of the way
@@ -442,14 +512,19 @@ bool CWallet::Verify()
         }
     }
     
+    // A log checks its commits itself when it is opened
+    bool fLogDb = bitdb.IsLogDb(walletFile);
+
     if (GetBoolArg("-salvagewallet", false))
     {
+        if (fLogDb)
+            return InitError(strprintf(_("%s is an append-only log wallet, -salvagewallet only works with BerkeleyDB wallets"), walletFile));
         // Recover readable keypairs:
         if (!CWalletDB::Recover(bitdb, walletFile, true))
             return false;
     }
     
-    if (boost::filesystem::exists(GetDataDir() / walletFile))
+    if (!fLogDb && boost::filesystem::exists(GetDataDir() / walletFile))
     {
         CDBEnv::VerifyResult r = bitdb.Verify(walletFile, CWalletDB::Recover);
         if (r == CDBEnv::RECOVER_OK)
@@ -462,6 +537,13 @@ bool CWallet::Verify()
         }
         if (r == CDBEnv::RECOVER_FAIL)
             return InitError(strprintf(_("%s corrupt, salvage failed"), walletFile));
+
+        if (strBackend == "log")
+        {
+            uiInterface.InitMessage(_("Converting wallet..."));
+            if (!CDB::ConvertToLog(walletFile))
+                return InitError(strprintf(_("Error converting %s to an append-only log"), walletFile));
+        }
     }
     
     return true;
@@ -527,6 +609,343 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
     return false;
 }
 
+void CWallet::BuildUnspentIndex() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    setUnspent.clear();
+    setUnsettled.clear();
+    nSettledCredit = 0;
+    nSettledWatchCredit = 0;
+    nSettledHeight = chainActive.Height();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = it->second;
+        bool fSettled = IsSettled(wtx);
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        {
+            if (IsMine(wtx.vout[i]) == ISMINE_NO || IsSpent(it->first, i))
+                continue;
+            setUnspent.insert(setUnspent.end(), COutPoint(it->first, i));
+            if (fSettled)
+                AddSettledCredit(wtx.vout[i], 1);
+            else
+                setUnsettled.insert(it->first);
+        }
+    }
+    fUnspentIndexed = true;
+}
+
+uint64_t CWallet::GetKeyStoreCount() const
+{
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    LOCK(cs_KeyStore);
+    return setKeys.size() + mapScripts.size() + setWatchOnly.size();
+}
+
+uint256 CWallet::GetKeyStoreHash() const
+{
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    CHashWriter ss(SER_GETHASH, 0);
+    BOOST_FOREACH(const CKeyID& keyid, setKeys)
+        ss << keyid;
+    LOCK(cs_KeyStore);
+    for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+        ss << it->first;
+    BOOST_FOREACH(const CScript& script, setWatchOnly)
+        ss << *(const CScriptBase*)(&script);
+    return ss.GetHash();
+}
+
+uint256 CWallet::GetTxSetHash() const
+{
+    AssertLockHeld(cs_wallet);
+    CHashWriter ss(SER_GETHASH, 0);
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        ss << it->first;
+    return ss.GetHash();
+}
+
+bool CWallet::LoadUnspentIndex(CUnspentIndexSnapshot& snapshot)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (!chainActive.Tip() || snapshot.hashTip != chainActive.Tip()->GetBlockHash() ||
+        snapshot.nSettledHeight != chainActive.Height() || snapshot.nTxCount != mapWallet.size() ||
+        snapshot.nKeyCount != GetKeyStoreCount())
+        return false;
+    // The same counts with other transactions or keys, e.g. after -zapwallettxes
+    if (snapshot.hashTxs != GetTxSetHash() || snapshot.hashKeys != GetKeyStoreHash())
+        return false;
+
+    // Don't take anything on trust that AvailableCoins() or the balances would dereference
+    for (set<COutPoint>::const_iterator it = snapshot.setUnspent.begin(); it != snapshot.setUnspent.end(); ++it)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(it->hash);
+        if (mi == mapWallet.end() || it->n >= mi->second.vout.size())
+            return false;
+    }
+    for (set<uint256>::const_iterator it = snapshot.setUnsettled.begin(); it != snapshot.setUnsettled.end(); ++it)
+        if (!mapWallet.count(*it))
+            return false;
+
+    setUnspent.swap(snapshot.setUnspent);
+    setUnsettled.swap(snapshot.setUnsettled);
+    nSettledCredit = snapshot.nSettledCredit;
+    nSettledWatchCredit = snapshot.nSettledWatchCredit;
+    nSettledHeight = snapshot.nSettledHeight;
+    fUnspentIndexed = true;
+    if (fCheckWalletBalances)
+        assert(CheckBalances());
+    return true;
+}
+
+void CWallet::WriteUnspentIndex()
+{
+    if (!fFileBacked)
+        return;
+    LOCK2(cs_main, cs_wallet);
+    CWalletDB walletdb(strWalletFile);
+    CUnspentIndexSnapshot snapshot;
+    if (!GetUnspentIndexSnapshot(snapshot))
+    {
+        walletdb.EraseUnspentIndex();
+        return;
+    }
+    if (!walletdb.WriteUnspentIndex(snapshot))
+        LogPrintf("%s: failed to save the unspent index\n", __func__);
+}
+
+bool CWallet::GetUnspentIndexSnapshot(CUnspentIndexSnapshot& snapshot) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (!fUnspentIndexed || !chainActive.Tip())
+        return false;
+
+    UpdateSettledCredit();
+    snapshot.hashTip = chainActive.Tip()->GetBlockHash();
+    snapshot.nTxCount = mapWallet.size();
+    snapshot.nKeyCount = GetKeyStoreCount();
+    snapshot.hashTxs = GetTxSetHash();
+    snapshot.hashKeys = GetKeyStoreHash();
+    snapshot.setUnspent = setUnspent;
+    snapshot.setUnsettled = setUnsettled;
+    snapshot.nSettledCredit = nSettledCredit;
+    snapshot.nSettledWatchCredit = nSettledWatchCredit;
+    snapshot.nSettledHeight = nSettledHeight;
+    return true;
+}
+
+bool CWallet::HasUnspentIndexed(const uint256& hash) const
+{
+    set<COutPoint>::const_iterator it = setUnspent.lower_bound(COutPoint(hash, 0));
+    return it != setUnspent.end() && it->hash == hash;
+}
+
+bool CWallet::IsSettled(const CWalletTx& wtx) const
+{
+    return wtx.GetDepthInMainChain() > 0 && wtx.GetBlocksToMaturity() == 0;
+}
+
+void CWallet::AddSettledCredit(const CTxOut& txout, int nSign) const
+{
+    nSettledCredit += nSign * GetCredit(txout, ISMINE_SPENDABLE);
+    nSettledWatchCredit += nSign * GetCredit(txout, ISMINE_WATCH_ONLY);
+}
+
+void CWallet::UpdateSettled(const CWalletTx& wtx) const
+{
+    AssertLockHeld(cs_main); // IsSettled
+    AssertLockHeld(cs_wallet);
+    const uint256& hash = wtx.GetHash();
+    if (!fUnspentIndexed || !HasUnspentIndexed(hash))
+        return;
+
+    bool fUnsettled = setUnsettled.count(hash);
+    if (IsSettled(wtx) != fUnsettled)
+        return;
+
+    // Move the credit of the indexed outputs in or out of the running total
+    for (set<COutPoint>::const_iterator it = setUnspent.lower_bound(COutPoint(hash, 0)); it != setUnspent.end() && it->hash == hash; ++it)
+        AddSettledCredit(wtx.vout[it->n], fUnsettled ? 1 : -1);
+    if (fUnsettled)
+        setUnsettled.erase(hash);
+    else
+        setUnsettled.insert(hash);
+}
+
+void CWallet::UpdateSettledCredit() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (!fUnspentIndexed || chainActive.Height() < nSettledHeight)
+        BuildUnspentIndex();
+    nSettledHeight = chainActive.Height();
+
+    // Settle the transactions that got confirmed or matured since
+    for (set<uint256>::const_iterator it = setUnsettled.begin(); it != setUnsettled.end(); )
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(*it++);
+        assert(mi != mapWallet.end());
+        UpdateSettled(mi->second);
+    }
+
+    if (fCheckWalletBalances)
+        assert(CheckBalances());
+}
+
+void CWallet::IndexUnspent(const COutPoint& outpoint)
+{
+    AssertLockHeld(cs_main); // IsSpent and IsSettled look at the depth in the chain
+    AssertLockHeld(cs_wallet);
+    if (!fUnspentIndexed)
+        return;
+
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash);
+    bool fUnspent = it != mapWallet.end() && outpoint.n < it->second.vout.size() &&
+        IsMine(it->second.vout[outpoint.n]) != ISMINE_NO && !IsSpent(outpoint.hash, outpoint.n);
+    if (fUnspent == (setUnspent.count(outpoint) > 0))
+        return;
+
+    assert(it != mapWallet.end());
+    const CWalletTx& wtx = it->second;
+    if (fUnspent)
+    {
+        // The first indexed output of a transaction decides where it is counted
+        if (!HasUnspentIndexed(outpoint.hash) && !IsSettled(wtx))
+            setUnsettled.insert(outpoint.hash);
+        setUnspent.insert(outpoint);
+        if (!setUnsettled.count(outpoint.hash))
+            AddSettledCredit(wtx.vout[outpoint.n], 1);
+    }
+    else
+    {
+        setUnspent.erase(outpoint);
+        if (!setUnsettled.count(outpoint.hash))
+            AddSettledCredit(wtx.vout[outpoint.n], -1);
+        else if (!HasUnspentIndexed(outpoint.hash))
+            setUnsettled.erase(outpoint.hash);
+    }
+}
+
+void CWallet::IndexUnspent(const CWalletTx& wtx)
+{
+    UpdateSettled(wtx);
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        IndexUnspent(COutPoint(hash, i));
+    if (!wtx.IsCoinBase()) {
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            IndexUnspent(txin.prevout);
+    }
+}
+
+bool CWallet::CheckUnspentIndex() const
+{
+    LOCK2(cs_main, cs_wallet);
+    if (!fUnspentIndexed)
+        return true;
+
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = it->second;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            if (IsMine(wtx.vout[i]) != ISMINE_NO && !IsSpent(it->first, i) && !setUnspent.count(COutPoint(it->first, i)))
+                return false;
+    }
+    return true;
+}
+
+bool CWallet::CheckBalances() const
+{
+    LOCK2(cs_main, cs_wallet);
+    if (!fUnspentIndexed)
+        return true;
+    if (!CheckUnspentIndex())
+        return false;
+
+    CAmount nCredit = 0;
+    CAmount nWatchCredit = 0;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = it->second;
+        if (setUnsettled.count(it->first))
+        {
+            if (!HasUnspentIndexed(it->first))
+                return false;
+            continue;
+        }
+        if (!HasUnspentIndexed(it->first))
+            continue;
+        if (!IsSettled(wtx))
+            return false;
+        nCredit += wtx.GetAvailableCredit(false);
+        nWatchCredit += wtx.GetAvailableWatchOnlyCredit(false);
+    }
+    if (nCredit != nSettledCredit || nWatchCredit != nSettledWatchCredit)
+    {
+        LogPrintf("%s: settled balance %s (watch-only %s) differs from %s (watch-only %s)\n", __func__,
+                  FormatMoney(nSettledCredit), FormatMoney(nSettledWatchCredit), FormatMoney(nCredit), FormatMoney(nWatchCredit));
+        return false;
+    }
+    return true;
+}
+
+int CWallet::GetIndexHeight(const CWalletTx& wtx) const
+{
+    AssertLockHeld(cs_main);
+    // Conflicted transactions carry the conflicting block with nIndex -1
+    if (wtx.hashUnset() || wtx.nIndex == -1)
+        return -1;
+    BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+        return -1;
+    return mi->second->nHeight;
+}
+
+void CWallet::IndexHeight(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    if (!fHeightIndexed)
+        return;
+
+    const uint256& hash = wtx.GetHash();
+    int nHeight = GetIndexHeight(wtx);
+    map<uint256, int>::iterator it = mapTxHeight.find(hash);
+    if (it != mapTxHeight.end())
+    {
+        if (it->second == nHeight)
+            return;
+        setTxByHeight.erase(make_pair(it->second, hash));
+        it->second = nHeight;
+    }
+    else
+        mapTxHeight.insert(make_pair(hash, nHeight));
+    setTxByHeight.insert(make_pair(nHeight, hash));
+}
+
+const set<pair<int, uint256> >& CWallet::GetTxHeightIndex() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (!fHeightIndexed)
+    {
+        setTxByHeight.clear();
+        mapTxHeight.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            int nHeight = GetIndexHeight(it->second);
+            mapTxHeight.insert(mapTxHeight.end(), make_pair(it->first, nHeight));
+            setTxByHeight.insert(make_pair(nHeight, it->first));
+        }
+        fHeightIndexed = true;
+    }
+    return setTxByHeight;
+}
+
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
@@ -534,6 +953,7 @@ void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
     SyncMetaData(range);
+    IndexUnspent(outpoint);
 }
 
 
@@ -738,12 +1158,14 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fUnspentIndexed = false;
+        fHeightIndexed = false;
     }
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose)
 {
-    LOCK(cs_wallet);
+    LOCK2(cs_main, cs_wallet);
 
     CWalletDB walletdb(strWalletFile, "r+", fFlushOnClose);
 
@@ -844,6 +1266,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose)
 
     // Break debit/credit balance caches:
     wtx.MarkDirty();
+    IndexUnspent(wtx);
+    IndexHeight(wtx);
 
     // Notify UI of new or updated transaction
     NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -865,10 +1289,16 @@ bool CWallet::LoadToWallet(const CWalletTx& wtxIn)
     uint256 hash = wtxIn.GetHash();
 
     mapWallet[hash] = wtxIn;
+    return LoadToWallet(hash);
+}
+
+bool CWallet::LoadToWallet(const uint256& hash)
+{
     CWalletTx& wtx = mapWallet[hash];
     wtx.BindWallet(this);
     wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
     AddToSpends(hash);
+    IndexHeight(wtx);
     BOOST_FOREACH(const CTxIn& txin, wtx.vin) {
         if (mapWallet.count(txin.prevout.hash)) {
             CWalletTx& prevtx = mapWallet[txin.prevout.hash];
@@ -955,6 +1385,8 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.setAbandoned();
             wtx.MarkDirty();
+            IndexUnspent(wtx);
+            IndexHeight(wtx);
             walletdb.WriteTx(wtx);
             NotifyTransactionChanged(this, wtx.GetHash(), CT_UPDATED);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them abandoned too
@@ -1017,6 +1449,8 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.hashBlock = hashBlock;
             wtx.MarkDirty();
+            IndexUnspent(wtx);
+            IndexHeight(wtx);
             walletdb.WriteTx(wtx);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them conflicted too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(now, 0));
@@ -1049,8 +1483,10 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex,
     // recomputed, also:
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        if (mapWallet.count(txin.prevout.hash))
+        if (mapWallet.count(txin.prevout.hash)) {
             mapWallet[txin.prevout.hash].MarkDirty();
+            IndexUnspent(txin.prevout);
+        }
     }
 }
 
@@ -1226,7 +1662,7 @@ bool CWallet::SetHDMasterKey(const CPubKey& pubkey)
 bool CWallet::SetHDChain(const CHDChain& chain, bool memonly)
 {
     LOCK(cs_wallet);
-    if (!memonly && !CWalletDB(strWalletFile).WriteHDChain(chain))
+    if (!memonly && fFileBacked && !CWalletDB(strWalletFile).WriteHDChain(chain))
         throw runtime_error(std::string(__func__) + ": writing chain failed");
 
     hdChain = chain;
@@ -1374,6 +1810,28 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
     }
 }
 
+void CWallet::GetScanFilter(CWalletScanFilter& filter) const
+{
+    AssertLockHeld(cs_wallet);
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    BOOST_FOREACH(const CKeyID& keyid, setKeys)
+    {
+        CPubKey pubkey;
+        if (GetPubKey(keyid, pubkey))
+            filter.AddKey(pubkey);
+    }
+    {
+        LOCK(cs_KeyStore);
+        for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+            filter.AddRedeemScript(it->second);
+        BOOST_FOREACH(const CScript& script, setWatchOnly)
+            filter.AddScript(script);
+    }
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        filter.AddTx(it->second);
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
@@ -1381,44 +1839,101 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
+    bool fExpected = false;
+    if (!fScanningWallet.compare_exchange_strong(fExpected, true))
+        return -1;
+    fAbortRescan = false;
+    nScanningStartTime = GetTimeMillis();
+    dScanningProgress = 0;
+
     int ret = 0;
+    bool fFailed = false;
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
+    int nThreads = std::max(1, (int)GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS));
+    double dProgressStart = -1;
+    double dProgressTip = 0;
 
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
     CBlockIndex* pindex = pindexStart;
+    while (pindex && !fAbortRescan && !fFailed)
     {
-        LOCK2(cs_main, cs_wallet);
-
-        // no need to read and scan block, if block was created before
-        // our wallet birthday (as adjusted for block time variability)
-        while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
-            pindex = chainActive.Next(pindex);
+        // Locate the blocks up to the tip, they are read without cs_main
+        std::vector<CBlockPrefetcher::Item> vItems;
+        CWalletScanFilter filter;
+        {
+            LOCK2(cs_main, cs_wallet);
+
+            // no need to read and scan block, if block was created before
+            // our wallet birthday (as adjusted for block time variability)
+            while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
+                pindex = chainActive.Next(pindex);
+            if (!pindex)
+                break;
+
+            if (dProgressStart < 0)
+                dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
+            dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
+            for (CBlockIndex* pindexItem = pindex; pindexItem; pindexItem = chainActive.Next(pindexItem))
+            {
+                CBlockPrefetcher::Item item = { pindexItem, pindexItem->GetBlockPos() };
+                vItems.push_back(item);
+            }
+            GetScanFilter(filter);
+        }
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
+        CBlockPrefetcher prefetcher(vItems, filter, chainParams.GetConsensus(), nThreads);
+        CBlockIndex* pindexBlock;
+        CBlock block;
+        std::vector<bool> vMatch;
+        pindex = NULL;
+        while (!fAbortRescan && prefetcher.Next(pindexBlock, block, vMatch))
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            if (dProgressTip - dProgressStart > 0.0)
+            {
+                double dProgress = (Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindexBlock, false) - dProgressStart) / (dProgressTip - dProgressStart);
+                dScanningProgress = std::max(0.0, std::min(1.0, dProgress));
+                if (pindexBlock->nHeight % 100 == 0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)(dScanningProgress * 100))));
+            }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            int posInBlock;
-            for (posInBlock = 0; posInBlock < (int)block.vtx.size(); posInBlock++)
+            LOCK2(cs_main, cs_wallet);
+            if (!chainActive.Contains(pindexBlock))
+            {
+                // Reorganized while scanning, go on from the fork
+                pindex = chainActive.Next(chainActive.FindFork(pindexBlock));
+                break;
+            }
+            // Outputs were matched by the prefetch threads, inputs depend on what was
+            // found before, including earlier transactions of the same block
+            for (unsigned int posInBlock = 0; posInBlock < block.vtx.size(); posInBlock++)
             {
-                if (AddToWalletIfInvolvingMe(block.vtx[posInBlock], pindex, posInBlock, fUpdate))
+                const CTransaction& tx = block.vtx[posInBlock];
+                if ((vMatch[posInBlock] || filter.MatchInputs(tx)) && AddToWalletIfInvolvingMe(tx, pindexBlock, posInBlock, fUpdate))
+                {
+                    filter.AddTx(tx);
                     ret++;
+                }
             }
-            pindex = chainActive.Next(pindex);
+            // Blocks connected since the scan started are picked up by the next round
+            pindex = chainActive.Next(pindexBlock);
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindexBlock->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindexBlock));
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+        // The blocks after one that could not be read are not scanned
+        fFailed = prefetcher.Failed();
     }
-    return ret;
+
+    bool fAborted = fAbortRescan;
+    if (fFailed)
+        LogPrintf("Rescan failed, a block could not be read. Progress=%f\n", (double)dScanningProgress);
+    else if (fAborted)
+        LogPrintf("Rescan aborted. Progress=%f\n", (double)dScanningProgress);
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    fScanningWallet = false;
+    return fFailed ? -2 : fAborted ? -1 : ret;
 }
 
 void CWallet::ReacceptWalletTransactions()
@@ -1751,9 +2266,11 @@ CAmount CWallet::GetBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateSettledCredit();
+        nTotal = nSettledCredit;
+        BOOST_FOREACH(const uint256& hash, setUnsettled)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1767,9 +2284,10 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateSettledCredit();
+        BOOST_FOREACH(const uint256& hash, setUnsettled)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1782,9 +2300,10 @@ CAmount CWallet::GetImmatureBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateSettledCredit();
+        BOOST_FOREACH(const uint256& hash, setUnsettled)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             nTotal += pcoin->GetImmatureCredit();
         }
     }
@@ -1796,9 +2315,11 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateSettledCredit();
+        nTotal = nSettledWatchCredit;
+        BOOST_FOREACH(const uint256& hash, setUnsettled)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1812,9 +2333,10 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateSettledCredit();
+        BOOST_FOREACH(const uint256& hash, setUnsettled)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1827,54 +2349,72 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateSettledCredit();
+        BOOST_FOREACH(const uint256& hash, setUnsettled)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
         }
     }
     return nTotal;
 }
 
+int CWallet::GetAvailableDepth(const CWalletTx& wtx, bool fOnlyConfirmed) const
+{
+    if (!CheckFinalTx(wtx))
+        return -1;
+
+    if (fOnlyConfirmed && !wtx.IsTrusted())
+        return -1;
+
+    if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0)
+        return -1;
+
+    int nDepth = wtx.GetDepthInMainChain();
+    if (nDepth < 0)
+        return -1;
+
+    // We should not consider coins which aren't at least in our mempool
+    // It's possible for these to be conflicted via ancestors which we may never be able to detect
+    if (nDepth == 0 && !wtx.InMempool())
+        return -1;
+
+    return nDepth;
+}
+
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue) const
 {
     vCoins.clear();
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+        if (!fUnspentIndexed)
+            BuildUnspentIndex();
 
-            if (!CheckFinalTx(*pcoin))
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
-
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            int nDepth = pcoin->GetDepthInMainChain();
+        // Outputs of the same transaction are adjacent in the index
+        const CWalletTx* pcoin = NULL;
+        int nDepth = -1;
+        for (set<COutPoint>::const_iterator it = setUnspent.begin(); it != setUnspent.end(); ++it)
+        {
+            const uint256& wtxid = it->hash;
+            if (pcoin == NULL || pcoin->GetHash() != wtxid) {
+                map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(wtxid);
+                assert(mi != mapWallet.end());
+                pcoin = &(*mi).second;
+                nDepth = GetAvailableDepth(*pcoin, fOnlyConfirmed);
+            }
             if (nDepth < 0)
                 continue;
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
-                continue;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(COutPoint((*it).first, i))))
-                        vCoins.push_back(COutput(pcoin, i, nDepth,
-                                                 ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
-                                                  (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO),
-                                                 (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO));
-            }
+            unsigned int i = it->n;
+            isminetype mine = IsMine(pcoin->vout[i]);
+            if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
+                !IsLockedCoin(wtxid, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(*it)))
+                    vCoins.push_back(COutput(pcoin, i, nDepth,
+                                             ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
+                                              (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO),
+                                             (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO));
         }
     }
 }
@@ -1925,6 +2465,69 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
+/**
+ * Depth-first search over vValue, sorted by descending value, for the subset
+ * closest to nTargetValue that overshoots it by at most nMatchWindow, so that
+ * spending it doesn't need a change output.  Subsets that can no longer reach
+ * the target or already overshoot it are not explored further, and neither
+ * are those differing only in which of several equal coins is left out.
+ * Gives up after MAX_BNB_TRIES subsets.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTargetValue,
+                           const CAmount& nMatchWindow, vector<char>& vfBest, CAmount& nBest)
+{
+    // Total value of the coins from each position on
+    vector<CAmount> vRemaining(vValue.size() + 1, 0);
+    for (unsigned int i = vValue.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<char> vfIncluded(vValue.size(), false);
+    CAmount nTotal = 0;
+    bool fFound = false;
+    unsigned int i = 0;
+
+    for (unsigned int nTries = 0; nTries < MAX_BNB_TRIES; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nTotal + vRemaining[i] < nTargetValue || nTotal > nTargetValue + nMatchWindow)
+            fBacktrack = true;
+        else if (nTotal >= nTargetValue)
+        {
+            if (!fFound || nTotal < nBest)
+            {
+                fFound = true;
+                nBest = nTotal;
+                vfBest = vfIncluded;
+                if (nBest == nTargetValue)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Leave out the last coin taken and go on with the ones after it
+            while (i > 0 && !vfIncluded[i - 1])
+                i--;
+            if (i == 0)
+                break;
+            vfIncluded[i - 1] = false;
+            nTotal -= vValue[i - 1].first;
+            continue;
+        }
+
+        // Taking this coin instead of an equal one just left out gives the same totals
+        if (i == 0 || vfIncluded[i - 1] || vValue[i].first != vValue[i - 1].first)
+        {
+            vfIncluded[i] = true;
+            nTotal += vValue[i].first;
+        }
+        i++;
+    }
+
+    return fFound;
+}
+
 bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
@@ -1991,19 +2594,27 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
     std::sort(vValue.begin(), vValue.end(), CompareValueOnly());
     std::reverse(vValue.begin(), vValue.end());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + MIN_CHANGE)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest);
+    // First look for a subset whose excess is too small to be worth a change
+    // output and would be added to the fee instead
+    CAmount nMatchWindow = CTxOut(0, GetScriptForDestination(CKeyID())).GetDustThreshold(::minRelayTxFee);
+    bool fNoChange = SelectCoinsBnB(vValue, nTargetValue, nMatchWindow, vfBest, nBest);
+
+    // Otherwise solve subset sum by stochastic approximation
+    if (!fNoChange)
+    {
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + MIN_CHANGE)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
+    if (!fNoChange && coinLowestLarger.second.first &&
         ((nBest != nTargetValue && nBest < nTargetValue + MIN_CHANGE) || coinLowestLarger.first <= nBest))
     {
         setCoinsRet.insert(coinLowestLarger.second);
@@ -2136,6 +2747,42 @@ bool CWallet::FundTransaction(CMutableTransaction& tx, CAmount& nFeeRet, bool ov
     return true;
 }
 
+/** The inputs of a transaction made by CreateTransaction, signed on several threads */
+struct CSigningBatch
+{
+    const CKeyStore* keystore;
+    const CTransaction* txTo;
+    const PrecomputedTransactionData* txdata;
+    std::vector<CTxOut> vPrevOut;
+    std::vector<SignatureData> vSigData;
+    //! Not a vector<bool>, whose elements can't be written from different threads
+    std::vector<char> vSigned;
+};
+
+static void SignBatchInputs(CSigningBatch& batch, std::atomic<size_t>& nNext)
+{
+    size_t i;
+    while ((i = nNext++) < batch.vPrevOut.size())
+    {
+        const CTxOut& prevout = batch.vPrevOut[i];
+        batch.vSigned[i] = ProduceSignature(TransactionSignatureCreator(batch.keystore, batch.txTo, i, prevout.nValue, SIGHASH_ALL, batch.txdata),
+                                            prevout.scriptPubKey, batch.vSigData[i]);
+    }
+}
+
+static void SignBatch(CSigningBatch& batch)
+{
+    batch.vSigData.assign(batch.vPrevOut.size(), SignatureData());
+    batch.vSigned.assign(batch.vPrevOut.size(), 0);
+    std::atomic<size_t> nNext(0);
+    int nThreads = std::min(std::min(GetNumCores(), MAX_SIGNING_THREADS), (int)(batch.vPrevOut.size() / 16) + 1);
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&SignBatchInputs, boost::ref(batch), boost::ref(nNext)));
+    SignBatchInputs(batch, nNext);
+    threadGroup.join_all();
+}
+
 bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet,
                                 int& nChangePosInOut, std::string& strFailReason, const CCoinControl* coinControl, bool sign)
 {
@@ -2202,6 +2849,7 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
             std::vector<COutput> vAvailableCoins;
             AvailableCoins(vAvailableCoins, true, coinControl);
 
+            set<pair<const CWalletTx*,unsigned int> > setCoins;
             nFeeRet = 0;
             // Start with no fee and loop until there is enough fee
             while (true)
@@ -2249,7 +2897,7 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
                 }
 
                 // Choose coins to use
-                set<pair<const CWalletTx*,unsigned int> > setCoins;
+                setCoins.clear();
                 CAmount nValueIn = 0;
                 if (!SelectCoins(vAvailableCoins, nValueToSelect, setCoins, nValueIn, coinControl))
                 {
@@ -2361,42 +3009,25 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
                     txNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second,CScript(),
                                               std::numeric_limits<unsigned int>::max()-1));
 
-                // Sign
+                // Size the transaction with dummy signatures, which are at
+                // least as large as real ones, so finding the fee doesn't
+                // sign every input on each pass; it is signed once below.
                 int nIn = 0;
-                CTransaction txNewConst(txNew);
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
                 {
-                    bool signSuccess;
                     const CScript& scriptPubKey = coin.first->vout[coin.second].scriptPubKey;
                     SignatureData sigdata;
-                    if (sign)
-                        signSuccess = ProduceSignature(TransactionSignatureCreator(this, &txNewConst, nIn, coin.first->vout[coin.second].nValue, SIGHASH_ALL), scriptPubKey, sigdata);
-                    else
-                        signSuccess = ProduceSignature(DummySignatureCreator(this), scriptPubKey, sigdata);
-
-                    if (!signSuccess)
+                    if (!ProduceSignature(DummySignatureCreator(this), scriptPubKey, sigdata))
                     {
                         strFailReason = _("Signing transaction failed");
                         return false;
-                    } else {
-                        UpdateTransaction(txNew, nIn, sigdata);
                     }
-
+                    UpdateTransaction(txNew, nIn, sigdata);
                     nIn++;
                 }
 
                 unsigned int nBytes = GetVirtualTransactionSize(txNew);
 
-                // Remove scriptSigs if we used dummy signatures for fee calculation
-                if (!sign) {
-                    BOOST_FOREACH (CTxIn& vin, txNew.vin)
-                        vin.scriptSig = CScript();
-                    txNew.wit.SetNull();
-                }
-
-                // Embed the constructed transaction data in wtxNew.
-                *static_cast<CTransaction*>(&wtxNew) = CTransaction(txNew);
-
                 // Limit size
                 if (GetTransactionWeight(txNew) >= MAX_STANDARD_TX_WEIGHT)
                 {
@@ -2404,6 +3035,14 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
                     return false;
                 }
 
+                // Remove the dummy signatures
+                BOOST_FOREACH (CTxIn& vin, txNew.vin)
+                    vin.scriptSig = CScript();
+                txNew.wit.SetNull();
+
+                // Embed the constructed transaction data in wtxNew.
+                *static_cast<CTransaction*>(&wtxNew) = CTransaction(txNew);
+
                 dPriority = wtxNew.ComputePriority(dPriority, nBytes);
 
                 // Can we complete this as a free transaction?
@@ -2438,6 +3077,30 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
                 nFeeRet = nFeeNeeded;
                 continue;
             }
+
+            if (sign)
+            {
+                CSigningBatch batch;
+                batch.keystore = this;
+                CTransaction txNewConst(txNew);
+                PrecomputedTransactionData txdata(txNewConst);
+                batch.txTo = &txNewConst;
+                batch.txdata = &txdata;
+                BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
+                    batch.vPrevOut.push_back(coin.first->vout[coin.second]);
+                SignBatch(batch);
+
+                for (unsigned int i = 0; i < batch.vPrevOut.size(); i++)
+                {
+                    if (!batch.vSigned[i])
+                    {
+                        strFailReason = _("Signing transaction failed");
+                        return false;
+                    }
+                    UpdateTransaction(txNew, i, batch.vSigData[i]);
+                }
+                *static_cast<CTransaction*>(&wtxNew) = CTransaction(txNew);
+            }
         }
     }
 
@@ -2532,7 +3195,25 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
     if (!fFileBacked)
         return DB_LOAD_OK;
     fFirstRunRet = false;
-    DBErrors nLoadWalletRet = CWalletDB(strWalletFile,"cr+").LoadWallet(this);
+    DBErrors nLoadWalletRet;
+    {
+        // Loading indexes the transactions, which needs their depth in the chain
+        LOCK2(cs_main, cs_wallet);
+        nLoadWalletRet = CWalletDB(strWalletFile,"cr+").LoadWallet(this);
+    }
+    if (nLoadWalletRet == DB_LOAD_OK || nLoadWalletRet == DB_NONCRITICAL_ERROR)
+    {
+        // The saved unspent index won't follow the changes made from now on
+        LOCK2(cs_main, cs_wallet);
+        CWalletDB walletdb(strWalletFile);
+        CUnspentIndexSnapshot snapshot;
+        if (walletdb.ReadUnspentIndex(snapshot))
+        {
+            walletdb.EraseUnspentIndex();
+            if (nLoadWalletRet == DB_LOAD_OK && !LoadUnspentIndex(snapshot))
+                LogPrintf("Saved unspent index is out of date, it will be rebuilt\n");
+        }
+    }
     if (nLoadWalletRet == DB_NEED_REWRITE)
     {
         if (CDB::Rewrite(strWalletFile, "\x04pool"))
@@ -2605,6 +3286,12 @@ DBErrors CWallet::ZapWalletTx(std::vector<CWalletTx>& vWtx)
 
 
 bool CWallet::SetAddressBook(const CTxDestination& address, const string& strName, const string& strPurpose)
+{
+    CWalletDB walletdb(strWalletFile);
+    return SetAddressBookWithDB(walletdb, address, strName, strPurpose);
+}
+
+bool CWallet::SetAddressBookWithDB(CWalletDB& walletdb, const CTxDestination& address, const string& strName, const string& strPurpose)
 {
     bool fUpdated = false;
     {
@@ -2619,9 +3306,9 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
                              strPurpose, (fUpdated ? CT_UPDATED : CT_NEW) );
     if (!fFileBacked)
         return false;
-    if (!strPurpose.empty() && !CWalletDB(strWalletFile).WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
+    if (!strPurpose.empty() && !walletdb.WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
         return false;
-    return CWalletDB(strWalletFile).WriteName(CBitcoinAddress(address).ToString(), strName);
+    return walletdb.WriteName(CBitcoinAddress(address).ToString(), strName);
 }
 
 bool CWallet::DelAddressBook(const CTxDestination& address)
@@ -2677,12 +3364,8 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64_t nKeys = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        if (!FillKeyPool(nKeys))
+            return false;
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
     return true;
@@ -2690,35 +3373,166 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
+    // Top up key pool
+    unsigned int nTargetSize;
+    if (kpSize > 0)
+        nTargetSize = kpSize;
+    else
+        nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
+
+    return FillKeyPool(nTargetSize + 1);
+}
+
+/** Keys for the keypool, derived without holding cs_wallet */
+struct CKeyPoolBatch
+{
+    bool fHD;
+    bool fCompressed;
+    int64_t nCreationTime;
+    CKeyID masterKeyID;
+    //! Key at m/0'/0', the batch holds its hardened children from nChildIndex on
+    CExtKey chainKey;
+    uint32_t nChildIndex;
+    std::vector<CKey> vKeys;
+    std::vector<CPubKey> vPubKeys;
+    std::vector<CKeyMetadata> vMetadata;
+};
+
+static void DeriveKeyPoolKeys(CKeyPoolBatch& batch, std::atomic<size_t>& nNext)
+{
+    size_t i;
+    while ((i = nNext++) < batch.vKeys.size())
     {
-        LOCK(cs_wallet);
+        CKey& secret = batch.vKeys[i];
+        CKeyMetadata& metadata = batch.vMetadata[i];
+        metadata.nCreateTime = batch.nCreationTime;
+        if (batch.fHD) {
+            // always derive hardened keys, like GenerateNewKey()
+            uint32_t nChildIndex = batch.nChildIndex + i;
+            CExtKey childKey;
+            batch.chainKey.Derive(childKey, nChildIndex | BIP32_HARDENED_KEY_LIMIT);
+            secret = childKey.key;
+            metadata.hdKeypath     = "m/0'/0'/"+std::to_string(nChildIndex)+"'";
+            metadata.hdMasterKeyID = batch.masterKeyID;
+        } else {
+            secret.MakeNewKey(batch.fCompressed);
+        }
+        batch.vPubKeys[i] = secret.GetPubKey();
+        assert(secret.VerifyPubKey(batch.vPubKeys[i]));
+    }
+}
 
-        if (IsLocked())
-            return false;
+static void DeriveKeyPoolBatch(CKeyPoolBatch& batch)
+{
+    std::atomic<size_t> nNext(0);
+    int nThreads = std::min(std::min(GetNumCores(), MAX_KEYPOOL_THREADS), (int)(batch.vKeys.size() / 64) + 1);
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&DeriveKeyPoolKeys, boost::ref(batch), boost::ref(nNext)));
+    DeriveKeyPoolKeys(batch, nNext);
+    threadGroup.join_all();
+}
 
-        CWalletDB walletdb(strWalletFile);
+void CWallet::PrepareKeyPoolBatch(CKeyPoolBatch& batch, unsigned int nKeys)
+{
+    AssertLockHeld(cs_wallet);
+    batch.fHD = IsHDEnabled();
+    batch.fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    batch.nCreationTime = GetTime();
+    if (batch.fHD) {
+        // Derive m/0'/0' once for the whole batch, see GenerateNewKey() for the keypath scheme
+        CKey key;
+        CExtKey masterKey;
+        CExtKey accountKey;
+        if (!GetKey(hdChain.masterKeyID, key))
+            throw std::runtime_error(std::string(__func__) + ": Master key not found");
+        masterKey.SetMaster(key.begin(), key.size());
+        masterKey.Derive(accountKey, BIP32_HARDENED_KEY_LIMIT);
+        accountKey.Derive(batch.chainKey, BIP32_HARDENED_KEY_LIMIT);
+        batch.masterKeyID = hdChain.masterKeyID;
+        batch.nChildIndex = hdChain.nExternalChainCounter;
+    }
+    batch.vKeys.resize(nKeys);
+    batch.vPubKeys.resize(nKeys);
+    batch.vMetadata.resize(nKeys);
+}
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (kpSize > 0)
-            nTargetSize = kpSize;
-        else
-            nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
+bool CWallet::AddKeyPoolBatch(const CKeyPoolBatch& batch)
+{
+    AssertLockHeld(cs_wallet);
+    // The wallet may have been locked or got another HD master key meanwhile
+    if (IsLocked() || batch.fHD != IsHDEnabled() || (batch.fHD && batch.masterKeyID != hdChain.masterKeyID))
+        return false;
 
-        while (setKeyPool.size() < (nTargetSize + 1))
-        {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error(std::string(__func__) + ": writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+    CWalletDB walletdb(strWalletFile);
+    if (fFileBacked && !walletdb.TxnBegin())
+        throw runtime_error(std::string(__func__) + ": starting database transaction failed");
+
+    std::vector<int64_t> vIndex;
+    int64_t nEnd = 1;
+    if (!setKeyPool.empty())
+        nEnd = *(--setKeyPool.end()) + 1;
+    for (unsigned int i = 0; i < batch.vKeys.size(); i++)
+    {
+        const CPubKey& pubkey = batch.vPubKeys[i];
+        // GenerateNewKey() may have used some of the HD children meanwhile
+        if (HaveKey(pubkey.GetID()))
+            continue;
+        mapKeyMetadata[pubkey.GetID()] = batch.vMetadata[i];
+        if (!AddKeyPubKeyWithDB(walletdb, batch.vKeys[i], pubkey) ||
+            (fFileBacked && !walletdb.WritePool(nEnd, CKeyPool(pubkey)))) {
+            if (fFileBacked)
+                walletdb.TxnAbort();
+            throw runtime_error(std::string(__func__) + ": writing generated key failed");
+        }
+        vIndex.push_back(nEnd++);
+    }
+    if (!vIndex.empty() && (!nTimeFirstKey || batch.nCreationTime < nTimeFirstKey))
+        nTimeFirstKey = batch.nCreationTime;
+
+    if (batch.fHD && hdChain.nExternalChainCounter < batch.nChildIndex + batch.vKeys.size()) {
+        hdChain.nExternalChainCounter = batch.nChildIndex + batch.vKeys.size();
+        if (fFileBacked && !walletdb.WriteHDChain(hdChain)) {
+            walletdb.TxnAbort();
+            throw std::runtime_error(std::string(__func__) + ": Writing HD chain model failed");
         }
     }
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (batch.fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY, &walletdb);
+
+    if (fFileBacked && !walletdb.TxnCommit())
+        throw runtime_error(std::string(__func__) + ": committing generated keys failed");
+
+    // Only now the keys become available to ReserveKeyFromKeyPool()
+    setKeyPool.insert(vIndex.begin(), vIndex.end());
     return true;
 }
 
+bool CWallet::FillKeyPool(unsigned int nSize)
+{
+    while (true)
+    {
+        CKeyPoolBatch batch;
+        {
+            LOCK(cs_wallet);
+            if (IsLocked())
+                return false;
+            if (setKeyPool.size() >= nSize)
+                return true;
+            PrepareKeyPoolBatch(batch, std::min(nSize - (unsigned int)setKeyPool.size(), KEYPOOL_BATCH_SIZE));
+        }
+
+        DeriveKeyPoolBatch(batch);
+
+        LOCK(cs_wallet);
+        if (!AddKeyPoolBatch(batch) && IsLocked())
+            return false;
+        LogPrintf("keypool added %u keys, size=%u\n", batch.vKeys.size(), setKeyPool.size());
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -3233,7 +4047,10 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     strUsage += HelpMessageOpt("-paytxfee=<amt>", strprintf(_("Fee (in %s/kB) to add to transactions you send (default: %s)"),
                                                             CURRENCY_UNIT, FormatMoney(payTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-rescan", _("Rescan the block chain for missing wallet transactions on startup"));
+    strUsage += HelpMessageOpt("-rescanthreads=<n>", strprintf(_("Number of threads reading blocks during a wallet rescan (default: %u)"), DEFAULT_RESCAN_THREADS));
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet on startup"));
+    strUsage += HelpMessageOpt("-sendqueueinterval=<n>", strprintf(_("Send the payments queued by queuesend together every <n> seconds, 0 to disable queuesend (default: %u)"), DEFAULT_SEND_QUEUE_INTERVAL));
+    strUsage += HelpMessageOpt("-sendqueuemaxoutputs=<n>", strprintf(_("Send the queued payments as soon as <n> are waiting (default: %u)"), DEFAULT_SEND_QUEUE_MAX_OUTPUTS));
     if (showDebug)
         strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), DEFAULT_SEND_FREE_TRANSACTIONS));
     strUsage += HelpMessageOpt("-spendzeroconfchange", strprintf(_("Spend unconfirmed change when sending transactions (default: %u)"), DEFAULT_SPEND_ZEROCONF_CHANGE));
@@ -3241,6 +4058,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     strUsage += HelpMessageOpt("-usehd", _("Use hierarchical deterministic key generation (HD) after BIP32. Only has effect during wallet creation/first start") + " " + strprintf(_("(default: %u)"), DEFAULT_USE_HD_WALLET));
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format on startup"));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), DEFAULT_WALLET_DAT));
+    strUsage += HelpMessageOpt("-walletbackend=<type>", _("Store the wallet in BerkeleyDB (bdb) or in an append-only log (log). Takes effect when the wallet is created; an existing BerkeleyDB wallet is converted to log on startup") + " " + strprintf(_("(default: %s)"), DEFAULT_WALLET_BACKEND));
     strUsage += HelpMessageOpt("-walletbroadcast", _("Make the wallet broadcast transactions") + " " + strprintf(_("(default: %u)"), DEFAULT_WALLETBROADCAST));
     strUsage += HelpMessageOpt("-walletnotify=<cmd>", _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)"));
     strUsage += HelpMessageOpt("-zapwallettxes=<mode>", _("Delete all wallet transactions and only recover those parts of the blockchain through -rescan on startup") +
@@ -3250,6 +4068,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     {
         strUsage += HelpMessageGroup(_("Wallet debugging/testing options:"));
 
+        strUsage += HelpMessageOpt("-checkwalletbalances", strprintf("Check the cached wallet balances against a full recomputation on every query (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf("Flush wallet database activity from memory to disk log every <n> megabytes (default: %u)", DEFAULT_WALLET_DBLOGSIZE));
         strUsage += HelpMessageOpt("-flushwallet", strprintf("Run a thread to flush wallet periodically (default: %u)", DEFAULT_FLUSHWALLET));
         strUsage += HelpMessageOpt("-privdb", strprintf("Sets the DB_PRIVATE flag in the wallet db environment (default: %u)", DEFAULT_WALLET_PRIVDB));
@@ -3383,7 +4202,8 @@ bool CWallet::InitLoadWallet()
         uiInterface.InitMessage(_("Rescanning..."));
         LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
         nStart = GetTimeMillis();
-        walletInstance->ScanForWalletTransactions(pindexRescan, true);
+        if (walletInstance->ScanForWalletTransactions(pindexRescan, true) == -2)
+            return InitError(_("Rescanning failed: a block could not be read from disk"));
         LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
         walletInstance->SetBestChain(chainActive.GetLocator());
         nWalletDBUpdated++;
@@ -3479,6 +4299,7 @@ bool CWallet::ParameterInteraction()
     nTxConfirmTarget = GetArg("-txconfirmtarget", DEFAULT_TX_CONFIRM_TARGET);
     bSpendZeroConfChange = GetBoolArg("-spendzeroconfchange", DEFAULT_SPEND_ZEROCONF_CHANGE);
     fSendFreeTransactions = GetBoolArg("-sendfreetransactions", DEFAULT_SEND_FREE_TRANSACTIONS);
+    fCheckWalletBalances = GetBoolArg("-checkwalletbalances", Params().DefaultConsistencyChecks());
 
     return true;
 }
@@ -11,6 +11,7 @@
 #include "tinyformat.h"
 #include "ui_interface.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 #include "validationinterface.h"
 #include "script/ismine.h"
 #include "wallet/crypter.h"
@@ -18,6 +19,7 @@
 #include "wallet/rpcwallet.h"
 
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -37,8 +39,15 @@ extern CFeeRate payTxFee;
 extern unsigned int nTxConfirmTarget;
 extern bool bSpendZeroConfChange;
 extern bool fSendFreeTransactions;
+extern bool fCheckWalletBalances;
 
 static const unsigned int DEFAULT_KEYPOOL_SIZE = 100;
+//! Number of keypool keys derived together and written in one database transaction
+static const unsigned int KEYPOOL_BATCH_SIZE = 1000;
+//! Maximum number of threads deriving keypool keys
+static const int MAX_KEYPOOL_THREADS = 8;
+//! Maximum number of threads signing the inputs of a new transaction
+static const int MAX_SIGNING_THREADS = 8;
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
 //! -fallbackfee default
@@ -47,6 +56,8 @@ static const CAmount DEFAULT_FALLBACK_FEE = 20000;
 static const CAmount DEFAULT_TRANSACTION_MINFEE = 1000;
 //! minimum change amount
 static const CAmount MIN_CHANGE = CENT;
+//! Maximum number of subsets the branch and bound coin selector visits
+static const unsigned int MAX_BNB_TRIES = 100000;
 //! Default for -spendzeroconfchange
 static const bool DEFAULT_SPEND_ZEROCONF_CHANGE = true;
 //! Default for -sendfreetransactions
@@ -64,10 +75,12 @@ extern const char * DEFAULT_WALLET_DAT;
 
 class CBlockIndex;
 class CCoinControl;
+struct CKeyPoolBatch;
 class COutput;
 class CReserveKey;
 class CScript;
 class CTxMemPool;
+class CWalletScanFilter;
 class CWalletTx;
 
 /** (client) version numbers for particular wallet features */
@@ -578,6 +591,84 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Outputs of ours that no wallet transaction spends, so coin selection
+     * doesn't have to walk every transaction in mapWallet.  The index is
+     * built on first use and updated wherever the spent state of an output
+     * can change; it may briefly contain outputs spent again by a reorg,
+     * which AvailableCoins still filters out.  Adding keys, scripts or
+     * watch-only addresses, or MarkDirty(), drop it to be rebuilt.  Keeping
+     * it up to date needs cs_main as well as cs_wallet.
+     */
+    mutable std::set<COutPoint> setUnspent;
+    mutable bool fUnspentIndexed;
+    void BuildUnspentIndex() const;
+    void IndexUnspent(const COutPoint& outpoint);
+    void IndexUnspent(const CWalletTx& wtx);
+    bool HasUnspentIndexed(const uint256& hash) const;
+
+    /**
+     * Balance of the indexed outputs of settled transactions, i.e. those
+     * confirmed and mature, kept up to date as outputs enter and leave the
+     * index.  Transactions with indexed outputs that aren't settled are
+     * kept in setUnsettled, and their credit, which depends on the tip and
+     * the mempool, is added up on every query.  As coinbases can become
+     * immature again when the tip moves back, the index is rebuilt then.
+     */
+    mutable CAmount nSettledCredit;
+    mutable CAmount nSettledWatchCredit;
+    mutable std::set<uint256> setUnsettled;
+    mutable int nSettledHeight;
+    bool IsSettled(const CWalletTx& wtx) const;
+    void AddSettledCredit(const CTxOut& txout, int nSign) const;
+    void UpdateSettled(const CWalletTx& wtx) const;
+    void UpdateSettledCredit() const;
+
+    /**
+     * Wallet transactions by the height of the block that confirms them in
+     * the active chain, or -1 for those that aren't (unconfirmed, conflicted,
+     * abandoned, or in a block that was disconnected), so listsinceblock
+     * only visits transactions after the block it is given.  Like the
+     * unspent index it is built on first use and updated wherever a
+     * transaction can enter or leave the active chain; MarkDirty() drops it.
+     * mapTxHeight holds the key each transaction is filed under.
+     */
+    mutable std::set<std::pair<int, uint256> > setTxByHeight;
+    mutable std::map<uint256, int> mapTxHeight;
+    mutable bool fHeightIndexed;
+    int GetIndexHeight(const CWalletTx& wtx) const;
+    void IndexHeight(const CWalletTx& wtx);
+
+    /** Number of keys, scripts and watch-only scripts, to tell whether IsMine() may have changed */
+    uint64_t GetKeyStoreCount() const;
+    /** Hash of the ids of the keys, scripts and watch-only scripts, for the same */
+    uint256 GetKeyStoreHash() const;
+    /** Hash of the txids in mapWallet */
+    uint256 GetTxSetHash() const;
+    /** Save the unspent index for the next startup, or erase the saved one if there is none */
+    void WriteUnspentIndex();
+
+    /** Depth of a transaction whose outputs may be selected, or -1 if they can't be */
+    int GetAvailableDepth(const CWalletTx& wtx, bool fOnlyConfirmed) const;
+
+    std::atomic<bool> fAbortRescan;
+    std::atomic<bool> fScanningWallet;
+    std::atomic<int64_t> nScanningStartTime;
+    std::atomic<double> dScanningProgress;
+    /** Take a snapshot of the keys, scripts and transactions a rescan looks for */
+    void GetScanFilter(CWalletScanFilter& filter) const;
+
+    /**
+     * Add keys to the keypool until it holds nSize of them.  The keys are
+     * derived in batches on several threads without holding cs_wallet, unless
+     * the caller holds it, and each batch is added to the pool at once.
+     */
+    bool FillKeyPool(unsigned int nSize);
+    /** Set up the derivation of nKeys new keys */
+    void PrepareKeyPoolBatch(CKeyPoolBatch& batch, unsigned int nKeys);
+    /** Write a derived batch in one database transaction and add it to the keypool, false if it is out of date */
+    bool AddKeyPoolBatch(const CKeyPoolBatch& batch);
+
     /* the HD chain data model (external chain counters) */
     CHDChain hdChain;
 
@@ -645,6 +736,15 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        fUnspentIndexed = false;
+        fHeightIndexed = false;
+        nSettledCredit = 0;
+        nSettledWatchCredit = 0;
+        nSettledHeight = 0;
+        fAbortRescan = false;
+        fScanningWallet = false;
+        nScanningStartTime = 0;
+        dScanningProgress = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -677,14 +777,30 @@ public:
 
     /**
      * Shuffle and select coins until nTargetValue is reached while avoiding
-     * small change; This method is stochastic for some inputs and upon
-     * completion the coin set and corresponding actual target value is
-     * assembled
+     * small change; A subset that needs no change output is looked for first
+     * by a bounded branch and bound search. This method is stochastic for
+     * some inputs and upon completion the coin set and corresponding actual
+     * target value is assembled
      */
     bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
+    /** Check that the unspent output index covers every unspent output of ours */
+    bool CheckUnspentIndex() const;
+    /** The unspent index as saved on shutdown; false if there is none */
+    bool GetUnspentIndexSnapshot(CUnspentIndexSnapshot& snapshot) const;
+    /** Take over an unspent index saved on the last shutdown if it is still valid */
+    bool LoadUnspentIndex(CUnspentIndexSnapshot& snapshot);
+    /** Check the settled balance against a full recomputation */
+    bool CheckBalances() const;
+
+    /**
+     * Transactions by confirming height, see setTxByHeight, building the
+     * index if needed.  Requires cs_main and cs_wallet.
+     */
+    const std::set<std::pair<int, uint256> >& GetTxHeightIndex() const;
+
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(const COutPoint& output);
     void UnlockCoin(const COutPoint& output);
@@ -698,6 +814,8 @@ public:
     CPubKey GenerateNewKey();
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
+    //! Adds a key to the store, and saves it through walletdb, e.g. in an open database transaction.
+    bool AddKeyPubKeyWithDB(CWalletDB& walletdb, const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
     bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
     //! Load metadata (used by LoadWallet)
@@ -707,9 +825,11 @@ public:
 
     //! Adds an encrypted key to the store, and saves it to disk.
     bool AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
+    bool AddCryptedKeyWithDB(CWalletDB& walletdb, const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     //! Adds an encrypted key to the store, without saving it to disk (used by LoadWallet)
     bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddCScript(const CScript& redeemScript);
+    bool AddCScriptWithDB(CWalletDB& walletdb, const CScript& redeemScript);
     bool LoadCScript(const CScript& redeemScript);
 
     //! Adds a destination data tuple to the store, and saves it to disk
@@ -723,7 +843,9 @@ public:
 
     //! Adds a watch-only address to the store, and saves it to disk.
     bool AddWatchOnly(const CScript &dest);
+    bool AddWatchOnlyWithDB(CWalletDB& walletdb, const CScript &dest);
     bool RemoveWatchOnly(const CScript &dest);
+    bool RemoveWatchOnlyWithDB(CWalletDB& walletdb, const CScript &dest);
     //! Adds a watch-only address to the store, without saving it to disk (used by LoadWallet)
     bool LoadWatchOnly(const CScript &dest);
 
@@ -744,9 +866,23 @@ public:
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose=true);
     bool LoadToWallet(const CWalletTx& wtxIn);
+    //! Index a transaction the loader decoded into mapWallet itself
+    bool LoadToWallet(const uint256& hash);
     void SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, int posInBlock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlockIndex* pIndex, int posInBlock, bool fUpdate);
+    /**
+     * Scan the active chain from pindexStart for transactions of ours.  The
+     * blocks are read and matched on -rescanthreads threads while the locks
+     * are only taken to add what was found.
+     * @return the number of transactions added or updated, -1 if the
+     * rescan was aborted or another one is in progress, or -2 if it stopped
+     * because a block could not be read
+     */
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    void AbortRescan() { fAbortRescan = true; }
+    bool IsScanning() const { return fScanningWallet; }
+    int64_t ScanningDuration() const { return fScanningWallet ? GetTimeMillis() - nScanningStartTime : 0; }
+    double ScanningProgress() const { return fScanningWallet ? (double)dScanningProgress : 0; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime);
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime);
@@ -822,6 +958,7 @@ public:
     DBErrors ZapSelectTx(std::vector<uint256>& vHashIn, std::vector<uint256>& vHashOut);
 
     bool SetAddressBook(const CTxDestination& address, const std::string& strName, const std::string& purpose);
+    bool SetAddressBookWithDB(CWalletDB& walletdb, const CTxDestination& address, const std::string& strName, const std::string& purpose);
 
     bool DelAddressBook(const CTxDestination& address);
 
@@ -20,8 +20,15 @@
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
+#include <atomic>
+
 using namespace std;
 
+//! Number of transaction records decoded together while loading the wallet
+static const unsigned int WALLET_LOAD_BATCH = 1000;
+//! Maximum number of threads decoding transaction records
+static const int MAX_WALLET_LOAD_THREADS = 8;
+
 static uint64_t nAccountingEntryNumber = 0;
 
 //
@@ -141,6 +148,23 @@ bool CWalletDB::ReadBestBlock(CBlockLocator& locator)
     return Read(std::string("bestblock_nomerkle"), locator);
 }
 
+bool CWalletDB::WriteUnspentIndex(const CUnspentIndexSnapshot& snapshot)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("unspentindex"), snapshot);
+}
+
+bool CWalletDB::ReadUnspentIndex(CUnspentIndexSnapshot& snapshot)
+{
+    return Read(std::string("unspentindex"), snapshot);
+}
+
+bool CWalletDB::EraseUnspentIndex()
+{
+    nWalletDBUpdated++;
+    return Erase(std::string("unspentindex"));
+}
+
 bool CWalletDB::WriteOrderPosNext(int64_t nOrderPosNext)
 {
     nWalletDBUpdated++;
@@ -212,7 +236,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error(std::string(__func__) + ": cannot create DB cursor");
     bool setRange = true;
@@ -229,7 +253,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            delete pcursor;
             throw runtime_error(std::string(__func__) + ": error scanning DB");
         }
 
@@ -248,7 +272,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    delete pcursor;
 }
 
 DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
@@ -345,6 +369,36 @@ public:
     }
 };
 
+/** Decode the value of a "tx" record, fUpgraded is set if it must be rewritten */
+static bool ReadTxValue(const uint256& hash, CDataStream& ssValue, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -371,30 +425,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             uint256 hash;
             ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded = false;
+            if (!ReadTxValue(hash, ssValue, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
+            if (fUpgraded)
                 wss.vWalletUpgrade.push_back(hash);
-            }
 
             if (wtx.nOrderPos == -1)
                 wss.fAnyUnordered = true;
@@ -615,6 +650,89 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+/** A "tx" record read from the database, decoded later with the rest of its batch */
+struct CWalletTxRecord
+{
+    uint256 hash;
+    CDataStream ssValue;
+    //! Entry of mapWallet the transaction is decoded into
+    CWalletTx* pwtx;
+    bool fOk;
+    bool fUpgraded;
+    string strErr;
+
+    CWalletTxRecord(const uint256& hashIn, CDataStream& ssValueIn, CWalletTx* pwtxIn) :
+        hash(hashIn), ssValue(std::move(ssValueIn)), pwtx(pwtxIn), fOk(false), fUpgraded(false) {}
+};
+
+static bool IsTxRecord(const CDataStream& ssKey, uint256& hash)
+{
+    try {
+        CDataStream ssType(ssKey);
+        string strType;
+        ssType >> strType;
+        if (strType != "tx")
+            return false;
+        ssType >> hash;
+        return true;
+    } catch (const std::exception&) {
+        // Let ReadKeyValue() report it
+        return false;
+    }
+}
+
+static void DecodeTxRecords(vector<CWalletTxRecord>& vRecords, std::atomic<size_t>& nNext)
+{
+    size_t i;
+    while ((i = nNext++) < vRecords.size())
+    {
+        CWalletTxRecord& record = vRecords[i];
+        try {
+            record.fOk = ReadTxValue(record.hash, record.ssValue, *record.pwtx, record.fUpgraded, record.strErr);
+        } catch (...) {
+            record.fOk = false;
+        }
+        record.ssValue = CDataStream(SER_DISK, CLIENT_VERSION);
+    }
+}
+
+/**
+ * Decode a batch of transaction records straight into mapWallet, spreading
+ * the deserialization and the checks over several threads, then index them
+ * in the order they were read.
+ */
+static void LoadTxRecords(CWallet* pwallet, vector<CWalletTxRecord>& vRecords, CWalletScanState& wss, bool& fNoncriticalErrors)
+{
+    AssertLockHeld(pwallet->cs_wallet);
+    std::atomic<size_t> nNext(0);
+    int nThreads = std::min(std::min(GetNumCores(), MAX_WALLET_LOAD_THREADS), (int)(vRecords.size() / 100) + 1);
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&DecodeTxRecords, boost::ref(vRecords), boost::ref(nNext)));
+    DecodeTxRecords(vRecords, nNext);
+    threadGroup.join_all();
+
+    BOOST_FOREACH(CWalletTxRecord& record, vRecords)
+    {
+        if (!record.strErr.empty())
+            LogPrintf("%s\n", record.strErr);
+        if (!record.fOk)
+        {
+            pwallet->mapWallet.erase(record.hash);
+            // Rescan if there is a bad transaction record:
+            fNoncriticalErrors = true;
+            SoftSetBoolArg("-rescan", true);
+            continue;
+        }
+        if (record.fUpgraded)
+            wss.vWalletUpgrade.push_back(record.hash);
+        if (record.pwtx->nOrderPos == -1)
+            wss.fAnyUnordered = true;
+        pwallet->LoadToWallet(record.hash);
+    }
+    vRecords.clear();
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -633,13 +751,15 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
         }
 
+        vector<CWalletTxRecord> vTxRecords;
+        vTxRecords.reserve(WALLET_LOAD_BATCH);
         while (true)
         {
             // Read next record
@@ -654,6 +774,16 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
+            // Transactions are only decoded once a batch of them has been read
+            uint256 hash;
+            if (IsTxRecord(ssKey, hash))
+            {
+                vTxRecords.push_back(CWalletTxRecord(hash, ssValue, &pwallet->mapWallet[hash]));
+                if (vTxRecords.size() >= WALLET_LOAD_BATCH)
+                    LoadTxRecords(pwallet, vTxRecords, wss, fNoncriticalErrors);
+                continue;
+            }
+
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
             if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
@@ -674,7 +804,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             if (!strErr.empty())
                 LogPrintf("%s\n", strErr);
         }
-        pcursor->close();
+        LoadTxRecords(pwallet, vTxRecords, wss, fNoncriticalErrors);
+        delete pcursor;
     }
     catch (const boost::thread_interrupted&) {
         throw;
@@ -739,7 +870,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -773,7 +904,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
                 vWtx.push_back(wtx);
             }
         }
-        pcursor->close();
+        delete pcursor;
     }
     catch (const boost::thread_interrupted&) {
         throw;
@@ -855,6 +986,9 @@ void ThreadFlushWalletDB(const string& strFile)
     fOneThread = true;
     if (!GetBoolArg("-flushwallet", DEFAULT_FLUSHWALLET))
         return;
+    // Commits to a log are synced as they are made, there is nothing to flush
+    if (bitdb.IsLogDb(strFile))
+        return;
 
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
@@ -12,6 +12,8 @@
 #include "key.h"
 
 #include <list>
+#include <map>
+#include <set>
 #include <stdint.h>
 #include <string>
 #include <utility>
@@ -114,6 +116,61 @@ public:
     }
 };
 
+/**
+ * The index of unspent wallet outputs and the settled balances, saved on
+ * shutdown so the next startup doesn't check every output of every wallet
+ * transaction against the keystore.  It is only used with the chain tip,
+ * transactions and keys it was saved with, and erased once read.
+ */
+class CUnspentIndexSnapshot
+{
+public:
+    uint256 hashTip;
+    uint64_t nTxCount;
+    //! Keys, scripts and watch-only scripts in the keystore
+    uint64_t nKeyCount;
+    //! What the counts don't tell apart: see CWallet::GetTxSetHash and GetKeyStoreHash
+    uint256 hashTxs;
+    uint256 hashKeys;
+    std::set<COutPoint> setUnspent;
+    std::set<uint256> setUnsettled;
+    CAmount nSettledCredit;
+    CAmount nSettledWatchCredit;
+    int nSettledHeight;
+
+    CUnspentIndexSnapshot() : nTxCount(0), nKeyCount(0), nSettledCredit(0), nSettledWatchCredit(0), nSettledHeight(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashTip);
+        READWRITE(nTxCount);
+        READWRITE(nKeyCount);
+        // Store the output numbers of each transaction together, rather than
+        // repeating the txid in every outpoint
+        std::map<uint256, std::vector<uint32_t> > mapOutputs;
+        if (!ser_action.ForRead()) {
+            for (std::set<COutPoint>::const_iterator it = setUnspent.begin(); it != setUnspent.end(); ++it)
+                mapOutputs[it->hash].push_back(it->n);
+        }
+        READWRITE(mapOutputs);
+        if (ser_action.ForRead()) {
+            setUnspent.clear();
+            for (std::map<uint256, std::vector<uint32_t> >::const_iterator it = mapOutputs.begin(); it != mapOutputs.end(); ++it)
+                for (std::vector<uint32_t>::const_iterator itn = it->second.begin(); itn != it->second.end(); ++itn)
+                    setUnspent.insert(setUnspent.end(), COutPoint(it->first, *itn));
+        }
+        READWRITE(setUnsettled);
+        READWRITE(nSettledCredit);
+        READWRITE(nSettledWatchCredit);
+        READWRITE(nSettledHeight);
+        // Last, so that snapshots written without them fail to load
+        READWRITE(hashTxs);
+        READWRITE(hashKeys);
+    }
+};
+
 /** Access to the wallet database */
 class CWalletDB : public CDB
 {
@@ -143,6 +200,10 @@ public:
     bool WriteBestBlock(const CBlockLocator& locator);
     bool ReadBestBlock(CBlockLocator& locator);
 
+    bool WriteUnspentIndex(const CUnspentIndexSnapshot& snapshot);
+    bool ReadUnspentIndex(CUnspentIndexSnapshot& snapshot);
+    bool EraseUnspentIndex();
+
     bool WriteOrderPosNext(int64_t nOrderPosNext);
 
     bool WriteDefaultKey(const CPubKey& vchPubKey);